@@ -91,4 +91,9 @@ typedef unsigned long mem_ptr_t;
 
 #define LWIP_RAND() ((u32_t)rand())
 
+/* Internet checksum with SSE2/AVX2 variants, picked at run time
+   (lwip_chksum.c) */
+#define LWIP_CHKSUM lwip_chksum
+u16_t lwip_chksum(void *dataptr, int len);
+
 #endif /* LWIP_ARCH_CC_H */
@@ -37,37 +37,222 @@
 #include "lwip/def.h"
 #include "lwip/inet.h"
 
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LWIP_CHKSUM_X86 1
+#include <immintrin.h>
+#else
+#define LWIP_CHKSUM_X86 0
+#endif
+
+/* Each variant sums the buffer as 16 bit words in memory order, starting
+ * at dataptr whatever its alignment, and returns the sum folded to 16 bits
+ * (not inverted). As in lwip_standard_chksum(), this is the Internet
+ * checksum in network order, read as a host order u16_t.
+ */
+
+static inline u16_t
+chksum_fold(uint64_t acc)
+{
+  acc = (acc >> 32) + (acc & 0xffffffffUL);
+  acc = (acc >> 32) + (acc & 0xffffffffUL);
+  acc = (acc >> 16) + (acc & 0xffffUL);
+  acc = (acc >> 16) + (acc & 0xffffUL);
+  acc = (acc >> 16) + (acc & 0xffffUL);
+  return (u16_t)acc;
+}
+
+static inline uint64_t
+chksum_add64(uint64_t acc, uint64_t v)
+{
+  /* ones' complement addition: the carry goes back in at the bottom */
+  acc += v;
+  return acc + (acc < v);
+}
 
 /*-----------------------------------------------------------------------------------*/
-/* lwip_chksum:
+/* chksum_acc64:
  *
- * Sums up all 16 bit words in a memory portion. Also includes any odd byte.
- * This function is used by the other checksum functions.
+ * Adds len bytes to a 64 bit ones' complement accumulator, 8 bytes at a
+ * time, including a trailing odd byte. The caller folds the result.
  *
  */
 /*-----------------------------------------------------------------------------------*/
-#if 0
-u16_t
-lwip_chksum(void *dataptr, int len)
+static uint64_t
+chksum_acc64(const u8_t *p, int len, uint64_t acc)
 {
-  u32_t acc;
-    
-  for(acc = 0; len > 1; len -= 2) {
-    acc += *((u16_t *)dataptr)++;
-  }
+  uint64_t a0 = 0, a1 = 0, v0, v1;
+  u32_t w;
+  u16_t t;
 
-  /* add up any odd byte */
-  if (len == 1) {
-    acc += htons((u16_t)((*(u8_t *)dataptr) & 0xff) << 8);
-    LWIP_DEBUGF(INET_DEBUG, ("inet: chksum: odd byte %d\n", *(u8_t *)dataptr));
+  while (len >= 32) {
+    memcpy(&v0, p, 8);
+    memcpy(&v1, p + 8, 8);
+    a0 = chksum_add64(a0, v0);
+    a1 = chksum_add64(a1, v1);
+    memcpy(&v0, p + 16, 8);
+    memcpy(&v1, p + 24, 8);
+    a0 = chksum_add64(a0, v0);
+    a1 = chksum_add64(a1, v1);
+    p += 32;
+    len -= 32;
   }
-  acc = (acc >> 16) + (acc & 0xffffUL);
+  while (len >= 8) {
+    memcpy(&v0, p, 8);
+    a0 = chksum_add64(a0, v0);
+    p += 8;
+    len -= 8;
+  }
+  acc = chksum_add64(acc, chksum_add64(a0, a1));
+  if (len >= 4) {
+    memcpy(&w, p, 4);
+    acc = chksum_add64(acc, w);
+    p += 4;
+    len -= 4;
+  }
+  if (len >= 2) {
+    memcpy(&t, p, 2);
+    acc = chksum_add64(acc, t);
+    p += 2;
+    len -= 2;
+  }
+  if (len > 0) {
+    /* the odd byte is the first half of a zero padded word */
+    t = 0;
+    ((u8_t *)&t)[0] = *p;
+    acc = chksum_add64(acc, t);
+  }
+  return acc;
+}
 
-  if (acc & 0xffff0000 != 0) {
-    acc = (acc >> 16) + (acc & 0xffffUL);
+static u16_t
+lwip_chksum_scalar(void *dataptr, int len)
+{
+  return chksum_fold(chksum_acc64((const u8_t *)dataptr, len, 0));
+}
+
+#if LWIP_CHKSUM_X86
+/* The vector variants widen the 16 bit words to 32 bit lanes, which can
+ * take 0x10000 additions before they overflow. Blocks of at most
+ * CHKSUM_VEC_BLOCK bytes are summed that way and then added up in 64 bits.
+ */
+#define CHKSUM_VEC_BLOCK 0x10000
+
+__attribute__((target("sse2")))
+static u16_t
+lwip_chksum_sse2(void *dataptr, int len)
+{
+  const u8_t *p = (const u8_t *)dataptr;
+  const __m128i zero = _mm_setzero_si128();
+  uint64_t acc = 0;
+  u32_t lanes[4];
+  int n, i;
+
+  while (len >= 64) {
+    __m128i s0 = zero, s1 = zero, v;
+
+    n = LWIP_MIN(len, CHKSUM_VEC_BLOCK) & ~63;
+    for (i = 0; i < n; i += 64) {
+      v = _mm_loadu_si128((const __m128i *)(p + i));
+      s0 = _mm_add_epi32(s0, _mm_unpacklo_epi16(v, zero));
+      s1 = _mm_add_epi32(s1, _mm_unpackhi_epi16(v, zero));
+      v = _mm_loadu_si128((const __m128i *)(p + i + 16));
+      s0 = _mm_add_epi32(s0, _mm_unpacklo_epi16(v, zero));
+      s1 = _mm_add_epi32(s1, _mm_unpackhi_epi16(v, zero));
+      v = _mm_loadu_si128((const __m128i *)(p + i + 32));
+      s0 = _mm_add_epi32(s0, _mm_unpacklo_epi16(v, zero));
+      s1 = _mm_add_epi32(s1, _mm_unpackhi_epi16(v, zero));
+      v = _mm_loadu_si128((const __m128i *)(p + i + 48));
+      s0 = _mm_add_epi32(s0, _mm_unpacklo_epi16(v, zero));
+      s1 = _mm_add_epi32(s1, _mm_unpackhi_epi16(v, zero));
+    }
+    /* 32 bit lanes to 64 bit ones, so that their sum can't overflow */
+    s0 = _mm_add_epi64(_mm_unpacklo_epi32(s0, zero),
+                       _mm_unpackhi_epi32(s0, zero));
+    s1 = _mm_add_epi64(_mm_unpacklo_epi32(s1, zero),
+                       _mm_unpackhi_epi32(s1, zero));
+    _mm_storeu_si128((__m128i *)lanes, _mm_add_epi64(s0, s1));
+    acc += ((uint64_t)lanes[1] << 32 | lanes[0]) +
+           ((uint64_t)lanes[3] << 32 | lanes[2]);
+    p += n;
+    len -= n;
   }
+  return chksum_fold(chksum_acc64(p, len, acc));
+}
 
-  return (u16_t)acc;
+__attribute__((target("avx2")))
+static u16_t
+lwip_chksum_avx2(void *dataptr, int len)
+{
+  const u8_t *p = (const u8_t *)dataptr;
+  const __m256i zero = _mm256_setzero_si256();
+  uint64_t acc = 0;
+  uint64_t lanes[4];
+  int n, i;
+
+  while (len >= 128) {
+    __m256i s0 = zero, s1 = zero, v;
+
+    n = LWIP_MIN(len, CHKSUM_VEC_BLOCK) & ~127;
+    for (i = 0; i < n; i += 128) {
+      v = _mm256_loadu_si256((const __m256i *)(p + i));
+      s0 = _mm256_add_epi32(s0, _mm256_unpacklo_epi16(v, zero));
+      s1 = _mm256_add_epi32(s1, _mm256_unpackhi_epi16(v, zero));
+      v = _mm256_loadu_si256((const __m256i *)(p + i + 32));
+      s0 = _mm256_add_epi32(s0, _mm256_unpacklo_epi16(v, zero));
+      s1 = _mm256_add_epi32(s1, _mm256_unpackhi_epi16(v, zero));
+      v = _mm256_loadu_si256((const __m256i *)(p + i + 64));
+      s0 = _mm256_add_epi32(s0, _mm256_unpacklo_epi16(v, zero));
+      s1 = _mm256_add_epi32(s1, _mm256_unpackhi_epi16(v, zero));
+      v = _mm256_loadu_si256((const __m256i *)(p + i + 96));
+      s0 = _mm256_add_epi32(s0, _mm256_unpacklo_epi16(v, zero));
+      s1 = _mm256_add_epi32(s1, _mm256_unpackhi_epi16(v, zero));
+    }
+    s0 = _mm256_add_epi64(_mm256_unpacklo_epi32(s0, zero),
+                          _mm256_unpackhi_epi32(s0, zero));
+    s1 = _mm256_add_epi64(_mm256_unpacklo_epi32(s1, zero),
+                          _mm256_unpackhi_epi32(s1, zero));
+    _mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi64(s0, s1));
+    acc += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    p += n;
+    len -= n;
+  }
+  return chksum_fold(chksum_acc64(p, len, acc));
 }
+#endif /* LWIP_CHKSUM_X86 */
+
 /*-----------------------------------------------------------------------------------*/
-#endif
+/* lwip_chksum:
+ *
+ * Sums up all 16 bit words in a memory portion. Also includes any odd byte.
+ * This function is used by the other checksum functions (see LWIP_CHKSUM in
+ * cc.h). The first call picks the fastest variant the CPU supports.
+ *
+ */
+/*-----------------------------------------------------------------------------------*/
+static u16_t lwip_chksum_select(void *dataptr, int len);
+
+static u16_t (*lwip_chksum_fn)(void *dataptr, int len) = lwip_chksum_select;
+
+static u16_t
+lwip_chksum_select(void *dataptr, int len)
+{
+  lwip_chksum_fn = lwip_chksum_scalar;
+#if LWIP_CHKSUM_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    lwip_chksum_fn = lwip_chksum_avx2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    lwip_chksum_fn = lwip_chksum_sse2;
+  }
+#endif /* LWIP_CHKSUM_X86 */
+  return lwip_chksum_fn(dataptr, len);
+}
+
+u16_t
+lwip_chksum(void *dataptr, int len)
+{
+  return lwip_chksum_fn(dataptr, len);
+}
@@ -480,12 +480,14 @@ u32_t
 sys_now(void)
 {
   struct timeval tv;
-  u32_t sec, usec, msec;
+  u32_t sec, msec;
+  long usec;
   gettimeofday(&tv, NULL);
 
   sec = (u32_t)(tv.tv_sec - starttime.tv_sec);
-  usec = (u32_t)(tv.tv_usec - starttime.tv_usec);
-  msec = sec * 1000 + usec / 1000;
+  /* negative if the current second started at a lower usec value */
+  usec = (long)(tv.tv_usec - starttime.tv_usec);
+  msec = sec * 1000 + (u32_t)(usec / 1000);
 
   return msec;
 }
@@ -45,6 +45,8 @@
  * map it to a numerical IP address. It maintains a list of resolved
  * hostnames that can be queried with the dns_lookup() function.
  * New hostnames can be resolved using the dns_query() function.
+ * The table is indexed by a hash of the name, and also remembers names
+ * that failed to resolve for DNS_NEG_TTL seconds.
  *
  * The lwIP version of the resolver also adds a non-blocking version of
  * gethostbyname() that will work with a raw API application. This function
@@ -80,6 +82,7 @@
 #include "lwip/mem.h"
 #include "lwip/memp.h"
 #include "lwip/dns.h"
+#include "lwip/sys.h"
 
 #include <string.h>
 
@@ -115,6 +118,56 @@
 #define DNS_FLAG2_ERR_MASK        0x0f
 #define DNS_FLAG2_ERR_NONE        0x00
 #define DNS_FLAG2_ERR_NAME        0x03
+/* not a DNS RCODE: stored in dns_table_entry.err when all retries time out */
+#define DNS_ERR_TIMEOUT           0x10
+
+/** Number of hash chains indexing dns_table by name */
+#ifndef DNS_HASH_SIZE
+#define DNS_HASH_SIZE             DNS_TABLE_SIZE
+#endif
+#define DNS_HASH_NONE             0xFFFF
+/** Number of hash chains indexing dns_requests by callback argument */
+#ifndef DNS_REQ_HASH_SIZE
+#define DNS_REQ_HASH_SIZE         DNS_MAX_REQUESTS
+#endif
+/* end of a dns_requests list */
+#define DNS_REQ_NONE              0xFFFF
+
+#if DNS_HEDGE
+/** Number of recent response times kept per server, for the 95th percentile */
+#ifndef DNS_RTT_SAMPLES
+#define DNS_RTT_SAMPLES           32
+#endif
+
+/** Until a server has this many samples, hedge after DNS_HEDGE_INITIAL ms */
+#ifndef DNS_HEDGE_MIN_SAMPLES
+#define DNS_HEDGE_MIN_SAMPLES     8
+#endif
+
+#ifndef DNS_HEDGE_INITIAL
+#define DNS_HEDGE_INITIAL         500
+#endif
+
+/** Never hedge sooner than this many ms after the first query */
+#ifndef DNS_HEDGE_MIN
+#define DNS_HEDGE_MIN             10
+#endif
+
+/** A server that timed out this many times in a row... */
+#ifndef DNS_SERVER_MAX_FAILS
+#define DNS_SERVER_MAX_FAILS      3
+#endif
+
+/** ...is only asked as a last resort for this many seconds */
+#ifndef DNS_SERVER_DOWN_TIME
+#define DNS_SERVER_DOWN_TIME      30
+#endif
+
+/* dns_table_entry.hedge values other than a server index */
+#define DNS_HEDGE_WAIT            0xFE
+#endif /* DNS_HEDGE */
+/* not one of dns_servers */
+#define DNS_SERVER_NONE           0xFF
 
 /* DNS protocol states */
 #define DNS_STATE_UNUSED          0
@@ -170,14 +223,63 @@ struct dns_table_entry {
   u8_t  numdns;
   u8_t  tmr;
   u8_t  retries;
-  u8_t  seqno;
   u8_t  err;
+  /** next entry on the same hash chain, or DNS_HASH_NONE */
+  u16_t hnext;
+  u32_t hash;
+  /** neighbours on dns_lru (DNS_STATE_DONE) or the free list (lnext only,
+      DNS_STATE_UNUSED), or DNS_HASH_NONE */
+  u16_t lprev;
+  u16_t lnext;
   u32_t ttl;
   char name[DNS_MAX_NAME_LENGTH];
-  ip_addr_t ipaddr;
+  /** the name's addresses, in the order the server gave them */
+  ip_addr_t ipaddr[DNS_MAX_ADDRS];
+  u8_t naddrs;
+  /** first dns_requests entry waiting for this query, or DNS_REQ_NONE */
+  u16_t reqs;
+#if DNS_HEDGE
+  /** servers asked, and those asked more than once (no RTT sample) */
+  u8_t  sent_mask;
+  u8_t  retx_mask;
+  /** server the hedge went to, DNS_HEDGE_WAIT until hedge_due, or DNS_SERVER_NONE */
+  u8_t  hedge;
+  u32_t hedge_due;
+  /** sys_now() of the first query to each server */
+  u32_t sent[DNS_MAX_SERVERS];
+#endif /* DNS_HEDGE */
+};
+
+#if DNS_HEDGE
+/** What we know about one DNS server */
+struct dns_server_state {
+  struct dns_server_stats stats;
+  /** smoothed response time, ms << 3 */
+  u32_t srtt8;
+  /** recent response times (ms), a ring */
+  u16_t rtt[DNS_RTT_SAMPLES];
+  u8_t  nrtt;
+  u8_t  rtt_next;
+  /** timeouts in a row, and sys_now() of the last one */
+  u8_t  fails;
+  u32_t fail_time;
+};
+#endif /* DNS_HEDGE */
+
+/** A caller waiting for a dns_table entry to be resolved */
+struct dns_req_entry {
   /* pointer to callback on DNS query done */
   dns_found_callback found;
   void *arg;
+  /** the dns_table entry waited for */
+  u16_t entry;
+  /** neighbours on the entry's requests (next also links the free list),
+      or DNS_REQ_NONE */
+  u16_t next;
+  u16_t prev;
+  /** neighbours on the dns_req_hash chain of arg, or DNS_REQ_NONE */
+  u16_t anext;
+  u16_t aprev;
 };
 
 #if DNS_LOCAL_HOSTLIST
@@ -217,9 +319,30 @@ static void dns_check_entries(void);
 
 /* DNS variables */
 static struct udp_pcb        *dns_pcb;
-static u8_t                   dns_seqno;
 static struct dns_table_entry dns_table[DNS_TABLE_SIZE];
+/** Heads of the hash chains of (unused and used) dns_table entries */
+static u16_t                  dns_hash[DNS_HASH_SIZE];
+/** Unused dns_table entries */
+static u16_t                  dns_free;
+/** Completed dns_table entries, most recently used first */
+static u16_t                  dns_lru_head = DNS_HASH_NONE;
+static u16_t                  dns_lru_tail = DNS_HASH_NONE;
+/** Callbacks of pending queries; all callers asking for the same name
+    share one dns_table entry and one query */
+static struct dns_req_entry   dns_requests[DNS_MAX_REQUESTS];
+static u16_t                  dns_req_free;
+/** Heads of the chains of dns_requests by callback argument, for dns_cancel() */
+static u16_t                  dns_req_hash[DNS_REQ_HASH_SIZE];
+/** Entry whose callbacks are running; it must not be evicted meanwhile */
+static u16_t                  dns_calling = DNS_HASH_NONE;
+static struct dns_cache_stats dns_stats;
 static ip_addr_t              dns_servers[DNS_MAX_SERVERS];
+#if DNS_HEDGE
+static struct dns_server_state dns_server_state[DNS_MAX_SERVERS];
+/** Whether any entry waits to be hedged, and the earliest hedge_due */
+static u8_t                   dns_hedge_pending;
+static u32_t                  dns_hedge_next;
+#endif /* DNS_HEDGE */
 /** Contiguous buffer for processing responses */
 static u8_t                   dns_payload_buffer[LWIP_MEM_ALIGN_BUFFER(DNS_MSG_SIZE)];
 static u8_t*                  dns_payload;
@@ -245,10 +368,35 @@ dns_init()
     dns_pcb = udp_new();
 
     if (dns_pcb != NULL) {
+      u16_t i;
+
       /* initialize DNS table not needed (initialized to zero since it is a
        * global variable) */
       LWIP_ASSERT("For implicit initialization to work, DNS_STATE_UNUSED needs to be 0",
         DNS_STATE_UNUSED == 0);
+      LWIP_ASSERT("DNS_TABLE_SIZE too large for 16-bit transaction IDs",
+        DNS_TABLE_SIZE < DNS_HASH_NONE);
+      LWIP_ASSERT("DNS_MAX_REQUESTS too large", DNS_MAX_REQUESTS < DNS_REQ_NONE);
+#if DNS_HEDGE
+      LWIP_ASSERT("DNS_MAX_SERVERS too large for u8_t masks", DNS_MAX_SERVERS <= 8);
+#endif /* DNS_HEDGE */
+      for (i = 0; i < DNS_HASH_SIZE; ++i) {
+        dns_hash[i] = DNS_HASH_NONE;
+      }
+      for (i = 0; i < DNS_TABLE_SIZE; ++i) {
+        dns_table[i].reqs = DNS_REQ_NONE;
+        dns_table[i].lnext = i + 1;
+      }
+      dns_table[DNS_TABLE_SIZE - 1].lnext = DNS_HASH_NONE;
+      dns_free = 0;
+      for (i = 0; i < DNS_MAX_REQUESTS; ++i) {
+        dns_requests[i].next = i + 1;
+      }
+      dns_requests[DNS_MAX_REQUESTS - 1].next = DNS_REQ_NONE;
+      dns_req_free = 0;
+      for (i = 0; i < DNS_REQ_HASH_SIZE; ++i) {
+        dns_req_hash[i] = DNS_REQ_NONE;
+      }
 
       /* initialize DNS client */
       udp_bind(dns_pcb, IP_ADDR_ANY, 0);
@@ -275,6 +423,9 @@ dns_setserver(u8_t numdns, ip_addr_t *dnsserver)
   if ((numdns < DNS_MAX_SERVERS) && (dns_pcb != NULL) &&
       (dnsserver != NULL) && !ip_addr_isany(dnsserver)) {
     dns_servers[numdns] = (*dnsserver);
+#if DNS_HEDGE
+    memset(&dns_server_state[numdns], 0, sizeof(dns_server_state[numdns]));
+#endif /* DNS_HEDGE */
   }
 }
 
@@ -295,6 +446,221 @@ dns_getserver(u8_t numdns)
   }
 }
 
+/**
+ * Hash a hostname (FNV-1a) to find its chain in dns_hash.
+ */
+static u32_t
+dns_hash_name(const char *name)
+{
+  u32_t h = 2166136261UL;
+
+  while (*name) {
+    h = (h ^ (u8_t)*name++) * 16777619UL;
+  }
+  return h;
+}
+
+/**
+ * Put dns_table[i] (with its name filled in) on its hash chain.
+ */
+static void
+dns_hash_add(u16_t i)
+{
+  struct dns_table_entry *pEntry = &dns_table[i];
+  u16_t *head;
+
+  pEntry->hash = dns_hash_name(pEntry->name);
+  head = &dns_hash[pEntry->hash % DNS_HASH_SIZE];
+  pEntry->hnext = *head;
+  *head = i;
+}
+
+/**
+ * Put completed dns_table[i] at the head of dns_lru.
+ */
+static void
+dns_lru_push(u16_t i)
+{
+  struct dns_table_entry *pEntry = &dns_table[i];
+
+  pEntry->lprev = DNS_HASH_NONE;
+  pEntry->lnext = dns_lru_head;
+  if (dns_lru_head != DNS_HASH_NONE) {
+    dns_table[dns_lru_head].lprev = i;
+  } else {
+    dns_lru_tail = i;
+  }
+  dns_lru_head = i;
+}
+
+/**
+ * Take dns_table[i] off dns_lru.
+ */
+static void
+dns_lru_unlink(u16_t i)
+{
+  struct dns_table_entry *pEntry = &dns_table[i];
+
+  if (pEntry->lprev != DNS_HASH_NONE) {
+    dns_table[pEntry->lprev].lnext = pEntry->lnext;
+  } else {
+    dns_lru_head = pEntry->lnext;
+  }
+  if (pEntry->lnext != DNS_HASH_NONE) {
+    dns_table[pEntry->lnext].lprev = pEntry->lprev;
+  } else {
+    dns_lru_tail = pEntry->lprev;
+  }
+}
+
+/**
+ * Remove dns_table[i] from the table and its hash chain.
+ */
+static void
+dns_flush(u16_t i)
+{
+  struct dns_table_entry *pEntry = &dns_table[i];
+  u16_t *pp;
+
+  for (pp = &dns_hash[pEntry->hash % DNS_HASH_SIZE]; *pp != i;
+       pp = &dns_table[*pp].hnext) {
+    LWIP_ASSERT("dns_flush: entry not hashed", *pp != DNS_HASH_NONE);
+  }
+  *pp = pEntry->hnext;
+  LWIP_ASSERT("dns_flush: requests still waiting", pEntry->reqs == DNS_REQ_NONE);
+  if (pEntry->state == DNS_STATE_DONE) {
+    dns_lru_unlink(i);
+  }
+  pEntry->state = DNS_STATE_UNUSED;
+  pEntry->lnext = dns_free;
+  dns_free = i;
+}
+
+/**
+ * Hash a callback argument to find its chain in dns_req_hash.
+ */
+static u16_t
+dns_hash_arg(void *arg)
+{
+  return (u16_t)((((mem_ptr_t)arg >> 3) * 2654435761UL) % DNS_REQ_HASH_SIZE);
+}
+
+/**
+ * Make a caller wait for dns_table[i] to be resolved.
+ *
+ * @return ERR_OK, or ERR_MEM if all DNS_MAX_REQUESTS are in use
+ */
+static err_t
+dns_add_request(u16_t i, dns_found_callback found, void *callback_arg)
+{
+  struct dns_table_entry *pEntry = &dns_table[i];
+  struct dns_req_entry *req;
+  u16_t r, *head;
+
+  if (found == NULL) {
+    /* nothing to call back */
+    return ERR_OK;
+  }
+  r = dns_req_free;
+  if (r == DNS_REQ_NONE) {
+    LWIP_DEBUGF(DNS_DEBUG, ("dns_add_request: \"%s\": too many requests\n", pEntry->name));
+    return ERR_MEM;
+  }
+  req = &dns_requests[r];
+  dns_req_free = req->next;
+  req->found = found;
+  req->arg   = callback_arg;
+  req->entry = i;
+  req->prev  = DNS_REQ_NONE;
+  req->next  = pEntry->reqs;
+  if (req->next != DNS_REQ_NONE) {
+    dns_requests[req->next].prev = r;
+  }
+  pEntry->reqs = r;
+  head = &dns_req_hash[dns_hash_arg(callback_arg)];
+  req->aprev = DNS_REQ_NONE;
+  req->anext = *head;
+  if (req->anext != DNS_REQ_NONE) {
+    dns_requests[req->anext].aprev = r;
+  }
+  *head = r;
+  return ERR_OK;
+}
+
+/**
+ * Stop a caller waiting: take dns_requests[r] off its lists and free it.
+ */
+static void
+dns_del_request(u16_t r)
+{
+  struct dns_req_entry *req = &dns_requests[r];
+
+  if (req->prev != DNS_REQ_NONE) {
+    dns_requests[req->prev].next = req->next;
+  } else {
+    dns_table[req->entry].reqs = req->next;
+  }
+  if (req->next != DNS_REQ_NONE) {
+    dns_requests[req->next].prev = req->prev;
+  }
+  if (req->aprev != DNS_REQ_NONE) {
+    dns_requests[req->aprev].anext = req->anext;
+  } else {
+    dns_req_hash[dns_hash_arg(req->arg)] = req->anext;
+  }
+  if (req->anext != DNS_REQ_NONE) {
+    dns_requests[req->anext].aprev = req->aprev;
+  }
+  req->next = dns_req_free;
+  dns_req_free = r;
+}
+
+/**
+ * Call back everyone waiting for dns_table[i], with ipaddr NULL on failure.
+ * A callback may look the same name up again; while the entry is still
+ * pending that adds a request, which is called back here as well.
+ */
+static void
+dns_call_found(u16_t i, ip_addr_t *ipaddr)
+{
+  struct dns_table_entry *pEntry = &dns_table[i];
+  dns_found_callback found;
+  void *arg;
+  u16_t r, calling;
+
+  calling = dns_calling;
+  dns_calling = i;
+  while ((r = pEntry->reqs) != DNS_REQ_NONE) {
+    found = dns_requests[r].found;
+    arg   = dns_requests[r].arg;
+    dns_del_request(r);
+    (*found)(pEntry->name, ipaddr, arg);
+  }
+  dns_calling = calling;
+}
+
+/**
+ * Remember that the name in dns_table[i] does not resolve (err says why),
+ * so that lookups fail right away for the next DNS_NEG_TTL seconds.
+ */
+static void
+dns_set_negative(u16_t i, u8_t err)
+{
+  struct dns_table_entry *pEntry = &dns_table[i];
+
+  if (DNS_NEG_TTL == 0) {
+    dns_flush(i);
+    return;
+  }
+  LWIP_DEBUGF(DNS_DEBUG, ("dns: \"%s\": negative, err %"U16_F"\n", pEntry->name, (u16_t)err));
+  if (pEntry->state != DNS_STATE_DONE) {
+    pEntry->state = DNS_STATE_DONE;
+    dns_lru_push(i);
+  }
+  pEntry->err   = err;
+  pEntry->ttl   = DNS_NEG_TTL;
+}
+
 /**
  * The DNS resolver client timer - handle retries and timeouts and should
  * be called every DNS_TMR_INTERVAL milliseconds (every second by default).
@@ -308,6 +674,47 @@ dns_tmr(void)
   }
 }
 
+/**
+ * Check whether any lookups are waiting for an answer. dns_tmr() only
+ * needs to run while this is true; cached entries can be aged later with
+ * dns_tmr_skip().
+ */
+u8_t
+dns_tmr_needed(void)
+{
+  u16_t i;
+
+  for (i = 0; i < DNS_TABLE_SIZE; ++i) {
+    if ((dns_table[i].state == DNS_STATE_NEW) ||
+        (dns_table[i].state == DNS_STATE_ASKING)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Age the cached entries by 'secs' DNS_TMR_INTERVAL periods during which
+ * dns_tmr() was not called because dns_tmr_needed() was false.
+ */
+void
+dns_tmr_skip(u32_t secs)
+{
+  u16_t i;
+
+  for (i = 0; i < DNS_TABLE_SIZE; ++i) {
+    struct dns_table_entry *pEntry = &dns_table[i];
+    if (pEntry->state == DNS_STATE_DONE) {
+      if (pEntry->ttl <= secs) {
+        LWIP_DEBUGF(DNS_DEBUG, ("dns_tmr_skip: \"%s\": flush\n", pEntry->name));
+        dns_flush(i);
+      } else {
+        pEntry->ttl -= secs;
+      }
+    }
+  }
+}
+
 #if DNS_LOCAL_HOSTLIST
 static void
 dns_init_local()
@@ -442,40 +849,54 @@ dns_local_addhost(const char *hostname, const ip_addr_t *addr)
  * for a hostname.
  *
  * @param name the hostname to look up
- * @return the hostname's IP address, as u32_t (instead of ip_addr_t to
- *         better check for failure: != IPADDR_NONE) or IPADDR_NONE if the hostname
- *         was not found in the cached dns_table.
+ * @param addr the hostname's IP address is stored here if found
+ * @return ERR_OK if found, ERR_VAL if the hostname is cached as not
+ *         resolving, or ERR_ARG if it was not found in the cached dns_table.
  */
-static u32_t
-dns_lookup(const char *name)
+static err_t
+dns_lookup(const char *name, ip_addr_t *addr)
 {
-  u8_t i;
+  u16_t i;
+  u32_t hash;
 #if DNS_LOCAL_HOSTLIST || defined(DNS_LOOKUP_LOCAL_EXTERN)
-  u32_t addr;
+  u32_t local;
 #endif /* DNS_LOCAL_HOSTLIST || defined(DNS_LOOKUP_LOCAL_EXTERN) */
 #if DNS_LOCAL_HOSTLIST
-  if ((addr = dns_lookup_local(name)) != IPADDR_NONE) {
-    return addr;
+  if ((local = dns_lookup_local(name)) != IPADDR_NONE) {
+    ip4_addr_set_u32(addr, local);
+    return ERR_OK;
   }
 #endif /* DNS_LOCAL_HOSTLIST */
 #ifdef DNS_LOOKUP_LOCAL_EXTERN
-  if((addr = DNS_LOOKUP_LOCAL_EXTERN(name)) != IPADDR_NONE) {
-    return addr;
+  if((local = DNS_LOOKUP_LOCAL_EXTERN(name)) != IPADDR_NONE) {
+    ip4_addr_set_u32(addr, local);
+    return ERR_OK;
   }
 #endif /* DNS_LOOKUP_LOCAL_EXTERN */
 
-  /* Walk through name list, return entry if found. If not, return NULL. */
-  for (i = 0; i < DNS_TABLE_SIZE; ++i) {
-    if ((dns_table[i].state == DNS_STATE_DONE) &&
-        (strcmp(name, dns_table[i].name) == 0)) {
+  /* Walk the name's hash chain */
+  hash = dns_hash_name(name);
+  for (i = dns_hash[hash % DNS_HASH_SIZE]; i != DNS_HASH_NONE; i = dns_table[i].hnext) {
+    struct dns_table_entry *pEntry = &dns_table[i];
+    if ((pEntry->state == DNS_STATE_DONE) && (pEntry->hash == hash) &&
+        (strcmp(name, pEntry->name) == 0)) {
+      if (i != dns_lru_head) {
+        dns_lru_unlink(i);
+        dns_lru_push(i);
+      }
+      if (pEntry->err != 0) {
+        LWIP_DEBUGF(DNS_DEBUG, ("dns_lookup: \"%s\": negative\n", name));
+        return ERR_VAL;
+      }
       LWIP_DEBUGF(DNS_DEBUG, ("dns_lookup: \"%s\": found = ", name));
-      ip_addr_debug_print(DNS_DEBUG, &(dns_table[i].ipaddr));
+      ip_addr_debug_print(DNS_DEBUG, &(pEntry->ipaddr[0]));
       LWIP_DEBUGF(DNS_DEBUG, ("\n"));
-      return ip4_addr_get_u32(&dns_table[i].ipaddr);
+      ip_addr_copy(*addr, pEntry->ipaddr[0]);
+      return ERR_OK;
     }
   }
 
-  return IPADDR_NONE;
+  return ERR_ARG;
 }
 
 #if DNS_DOES_NAME_CHECK
@@ -522,14 +943,18 @@ dns_compare_name(unsigned char *query, unsigned char *response)
  * Walk through a compact encoded DNS name and return the end of the name.
  *
  * @param query encoded DNS name in the DNS server response
- * @return end of the name
+ * @param end end of the response
+ * @return end of the name, or NULL if it runs past end
  */
 static unsigned char *
-dns_parse_name(unsigned char *query)
+dns_parse_name(unsigned char *query, unsigned char *end)
 {
   unsigned char n;
 
   do {
+    if (query >= end) {
+      return NULL;
+    }
     n = *query++;
     /** @see RFC 1035 - 4.1.4. Message compression */
     if ((n & 0xc0) == 0xc0) {
@@ -537,13 +962,17 @@ dns_parse_name(unsigned char *query)
       break;
     } else {
       /* Not compressed name */
-      while (n > 0) {
-        ++query;
-        --n;
-      };
+      if (n >= end - query) {
+        return NULL;
+      }
+      query += n;
     }
   } while (*query != 0);
 
+  /* skip the terminating 0, or the second byte of the pointer */
+  if (query >= end) {
+    return NULL;
+  }
   return query + 1;
 }
 
@@ -557,7 +986,7 @@ dns_parse_name(unsigned char *query)
  * @return ERR_OK if packet is sent; an err_t indicating the problem otherwise
  */
 static err_t
-dns_send(u8_t numdns, const char* name, u8_t id)
+dns_send(u8_t numdns, const char* name, u16_t id)
 {
   err_t err;
   struct dns_hdr *hdr;
@@ -612,8 +1041,6 @@ dns_send(u8_t numdns, const char* name, u8_t id)
     LWIP_ASSERT("p->tot_len >= realloc_size", p->tot_len >= realloc_size);
     pbuf_realloc(p, realloc_size);
 
-    /* connect to the server for faster receiving */
-    udp_connect(dns_pcb, &dns_servers[numdns], DNS_SERVER_PORT);
     /* send dns packet */
     err = udp_sendto(dns_pcb, p, &dns_servers[numdns], DNS_SERVER_PORT);
 
@@ -626,6 +1053,230 @@ dns_send(u8_t numdns, const char* name, u8_t id)
   return err;
 }
 
+/**
+ * Which configured server an answer came from, or DNS_SERVER_NONE.
+ */
+static u8_t
+dns_server_index(ip_addr_t *addr)
+{
+  u8_t k;
+
+  for (k = 0; k < DNS_MAX_SERVERS; ++k) {
+    if (!ip_addr_isany(&dns_servers[k]) && ip_addr_cmp(addr, &dns_servers[k])) {
+      return k;
+    }
+  }
+  return DNS_SERVER_NONE;
+}
+
+#if DNS_HEDGE
+/**
+ * Add a response time sample (ms) for server k. If it is only a lower bound
+ * (the server hadn't answered yet when another one did), it only moves the
+ * average: the hedging delay follows the server's own answers.
+ */
+static void
+dns_server_rtt(u8_t k, u32_t ms, u8_t lower_bound)
+{
+  struct dns_server_state *srv = &dns_server_state[k];
+  u16_t tmp[DNS_RTT_SAMPLES], t;
+  u8_t n, skip, j, x, m;
+
+  ms = LWIP_MIN(ms, 0xFFFF);
+  if (srv->srtt8 == 0) {
+    srv->srtt8 = ms << 3;
+  } else {
+    srv->srtt8 = srv->srtt8 - (srv->srtt8 >> 3) + ms;
+  }
+  srv->stats.srtt = srv->srtt8 >> 3;
+  if (lower_bound) {
+    return;
+  }
+
+  srv->rtt[srv->rtt_next] = (u16_t)ms;
+  srv->rtt_next = (srv->rtt_next + 1) % DNS_RTT_SAMPLES;
+  if (srv->nrtt < DNS_RTT_SAMPLES) {
+    srv->nrtt++;
+  }
+
+  /* the 95th percentile: skip the slowest 5% of the samples */
+  n = srv->nrtt;
+  skip = n / 20;
+  MEMCPY(tmp, srv->rtt, n * sizeof(tmp[0]));
+  for (j = 0; j <= skip; ++j) {
+    m = j;
+    for (x = j + 1; x < n; ++x) {
+      if (tmp[x] > tmp[m]) {
+        m = x;
+      }
+    }
+    t = tmp[j];
+    tmp[j] = tmp[m];
+    tmp[m] = t;
+  }
+  srv->stats.p95 = tmp[skip];
+}
+
+/**
+ * Is server k answering, or has it been a while since it timed out repeatedly?
+ */
+static u8_t
+dns_server_up(u8_t k, u32_t now)
+{
+  struct dns_server_state *srv = &dns_server_state[k];
+
+  return (srv->fails < DNS_SERVER_MAX_FAILS) ||
+         ((u32_t)(now - srv->fail_time) >= DNS_SERVER_DOWN_TIME * 1000UL);
+}
+
+/**
+ * Choose the configured server (not in exclude) to ask: the fastest one that
+ * is up, or if they are all down, the one that went down first.
+ */
+static u8_t
+dns_pick_server(u8_t exclude, u32_t now)
+{
+  u8_t k, best = DNS_SERVER_NONE, down = DNS_SERVER_NONE;
+
+  for (k = 0; k < DNS_MAX_SERVERS; ++k) {
+    if ((exclude & (1 << k)) || ip_addr_isany(&dns_servers[k])) {
+      continue;
+    }
+    if (dns_server_up(k, now)) {
+      /* servers that haven't answered yet (srtt 0) get tried first */
+      if ((best == DNS_SERVER_NONE) ||
+          (dns_server_state[k].srtt8 < dns_server_state[best].srtt8)) {
+        best = k;
+      }
+    } else if ((down == DNS_SERVER_NONE) ||
+               ((s32_t)(dns_server_state[k].fail_time - dns_server_state[down].fail_time) < 0)) {
+      down = k;
+    }
+  }
+  return (best != DNS_SERVER_NONE) ? best : down;
+}
+
+/**
+ * Make dns_hedge_tmr() look at dns_table again by time due.
+ */
+static void
+dns_hedge_schedule(u32_t due)
+{
+  if (!dns_hedge_pending || ((s32_t)(due - dns_hedge_next) < 0)) {
+    dns_hedge_next = due;
+  }
+  dns_hedge_pending = 1;
+}
+
+/**
+ * Plan to ask a second server if dns_table[i]'s server is slower than usual.
+ */
+static void
+dns_hedge_arm(u16_t i, u32_t now)
+{
+  struct dns_table_entry *pEntry = &dns_table[i];
+  struct dns_server_state *srv = &dns_server_state[pEntry->numdns];
+  u32_t wait;
+
+  if (dns_pick_server(pEntry->sent_mask, now) == DNS_SERVER_NONE) {
+    pEntry->hedge = DNS_SERVER_NONE;
+    return;
+  }
+  wait = (srv->nrtt >= DNS_HEDGE_MIN_SAMPLES) ? srv->stats.p95 : DNS_HEDGE_INITIAL;
+  pEntry->hedge = DNS_HEDGE_WAIT;
+  pEntry->hedge_due = now + LWIP_MAX(wait, DNS_HEDGE_MIN);
+  dns_hedge_schedule(pEntry->hedge_due);
+}
+
+/**
+ * Learn from dns_table[i] being answered by server k.
+ */
+static void
+dns_answered(u16_t i, u8_t k, u32_t now)
+{
+  struct dns_table_entry *pEntry = &dns_table[i];
+  struct dns_server_state *srv;
+  u32_t ms;
+  u8_t j;
+
+  for (j = 0; j < DNS_MAX_SERVERS; ++j) {
+    if (!(pEntry->sent_mask & (1 << j))) {
+      continue;
+    }
+    srv = &dns_server_state[j];
+    ms = now - pEntry->sent[j];
+    if (j == k) {
+      srv->stats.answers++;
+      srv->fails = 0;
+      if (!(pEntry->retx_mask & (1 << j))) {
+        dns_server_rtt(j, ms, 0);
+      }
+      if (pEntry->hedge == j) {
+        srv->stats.hedges_won++;
+      }
+    } else if (!(pEntry->retx_mask & (1 << j)) && ((ms << 3) > srv->srtt8)) {
+      /* still waiting for it, so it takes at least this long */
+      dns_server_rtt(j, ms, 1);
+    }
+  }
+  pEntry->hedge = DNS_SERVER_NONE;
+}
+
+/**
+ * Count a timeout for dns_table[i]'s server, and choose one to ask instead:
+ * one that hasn't been asked, or the one the query was hedged to.
+ *
+ * @return the server, or DNS_SERVER_NONE to give up
+ */
+static u8_t
+dns_failover(u16_t i)
+{
+  struct dns_table_entry *pEntry = &dns_table[i];
+  struct dns_server_state *srv = &dns_server_state[pEntry->numdns];
+  u32_t now = sys_now();
+  u8_t tried, next;
+
+  srv->stats.timeouts++;
+  srv->fails++;
+  srv->fail_time = now;
+
+  tried = pEntry->sent_mask;
+  if (pEntry->hedge < DNS_MAX_SERVERS) {
+    tried &= ~(1 << pEntry->hedge);
+  }
+  next = dns_pick_server(tried, now);
+  if ((next == DNS_SERVER_NONE) && (pEntry->hedge < DNS_MAX_SERVERS) &&
+      (pEntry->hedge != pEntry->numdns)) {
+    /* the hedge went unanswered as well */
+    srv = &dns_server_state[pEntry->hedge];
+    srv->stats.timeouts++;
+    srv->fails++;
+    srv->fail_time = now;
+  }
+  return next;
+}
+#endif /* DNS_HEDGE */
+
+/**
+ * Send dns_table[i]'s query to server numdns.
+ */
+static err_t
+dns_ask(u16_t i, u8_t numdns)
+{
+  struct dns_table_entry *pEntry = &dns_table[i];
+
+#if DNS_HEDGE
+  if (pEntry->sent_mask & (1 << numdns)) {
+    pEntry->retx_mask |= 1 << numdns;
+  } else {
+    pEntry->sent_mask |= 1 << numdns;
+    pEntry->sent[numdns] = sys_now();
+  }
+  dns_server_state[numdns].stats.queries++;
+#endif /* DNS_HEDGE */
+  return dns_send(numdns, pEntry->name, i);
+}
+
 /**
  * dns_check_entry() - see if pEntry has not yet been queried and, if so, sends out a query.
  * Check an entry in the dns_table:
@@ -636,7 +1287,7 @@ dns_send(u8_t numdns, const char* name, u8_t id)
  * @param i index of the dns_table entry to check
  */
 static void
-dns_check_entry(u8_t i)
+dns_check_entry(u16_t i)
 {
   err_t err;
   struct dns_table_entry *pEntry = &dns_table[i];
@@ -648,36 +1299,55 @@ dns_check_entry(u8_t i)
     case DNS_STATE_NEW: {
       /* initialize new entry */
       pEntry->state   = DNS_STATE_ASKING;
+#if DNS_HEDGE
+      pEntry->sent_mask = 0;
+      pEntry->retx_mask = 0;
+      pEntry->numdns  = dns_pick_server(0, sys_now());
+      if (pEntry->numdns == DNS_SERVER_NONE) {
+        pEntry->numdns = 0;
+      }
+#else /* DNS_HEDGE */
       pEntry->numdns  = 0;
+#endif /* DNS_HEDGE */
       pEntry->tmr     = 1;
       pEntry->retries = 0;
       
       /* send DNS packet for this entry */
-      err = dns_send(pEntry->numdns, pEntry->name, i);
+      err = dns_ask(i, pEntry->numdns);
       if (err != ERR_OK) {
         LWIP_DEBUGF(DNS_DEBUG | LWIP_DBG_LEVEL_WARNING,
                     ("dns_send returned error: %s\n", lwip_strerr(err)));
       }
+#if DNS_HEDGE
+      dns_hedge_arm(i, pEntry->sent[pEntry->numdns]);
+#endif /* DNS_HEDGE */
       break;
     }
 
     case DNS_STATE_ASKING: {
       if (--pEntry->tmr == 0) {
         if (++pEntry->retries == DNS_MAX_RETRIES) {
-          if ((pEntry->numdns+1<DNS_MAX_SERVERS) && !ip_addr_isany(&dns_servers[pEntry->numdns+1])) {
+#if DNS_HEDGE
+          u8_t next = dns_failover(i);
+          if (next != DNS_SERVER_NONE) {
+#else /* DNS_HEDGE */
+          u8_t next = pEntry->numdns + 1;
+          if ((next < DNS_MAX_SERVERS) && !ip_addr_isany(&dns_servers[next])) {
+#endif /* DNS_HEDGE */
             /* change of server */
-            pEntry->numdns++;
+            pEntry->numdns  = next;
             pEntry->tmr     = 1;
             pEntry->retries = 0;
             break;
           } else {
             LWIP_DEBUGF(DNS_DEBUG, ("dns_check_entry: \"%s\": timeout\n", pEntry->name));
-            /* call specified callback function if provided */
-            if (pEntry->found)
-              (*pEntry->found)(pEntry->name, NULL, pEntry->arg);
-            /* flush this entry */
-            pEntry->state   = DNS_STATE_UNUSED;
-            pEntry->found   = NULL;
+#if DNS_HEDGE
+            pEntry->hedge = DNS_SERVER_NONE;
+#endif /* DNS_HEDGE */
+            /* call the callback functions of all waiting callers */
+            dns_call_found(i, NULL);
+            /* don't ask again for a while */
+            dns_set_negative(i, DNS_ERR_TIMEOUT);
             break;
           }
         }
@@ -686,7 +1356,7 @@ dns_check_entry(u8_t i)
         pEntry->tmr = pEntry->retries;
 
         /* send DNS packet for this entry */
-        err = dns_send(pEntry->numdns, pEntry->name, i);
+        err = dns_ask(i, pEntry->numdns);
         if (err != ERR_OK) {
           LWIP_DEBUGF(DNS_DEBUG | LWIP_DBG_LEVEL_WARNING,
                       ("dns_send returned error: %s\n", lwip_strerr(err)));
@@ -700,8 +1370,7 @@ dns_check_entry(u8_t i)
       if ((pEntry->ttl == 0) || (--pEntry->ttl == 0)) {
         LWIP_DEBUGF(DNS_DEBUG, ("dns_check_entry: \"%s\": flush\n", pEntry->name));
         /* flush this entry */
-        pEntry->state = DNS_STATE_UNUSED;
-        pEntry->found = NULL;
+        dns_flush(i);
       }
       break;
     }
@@ -720,7 +1389,7 @@ dns_check_entry(u8_t i)
 static void
 dns_check_entries(void)
 {
-  u8_t i;
+  u16_t i;
 
   for (i = 0; i < DNS_TABLE_SIZE; ++i) {
     dns_check_entry(i);
@@ -736,16 +1405,23 @@ static void
 dns_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p, ip_addr_t *addr, u16_t port)
 {
   u16_t i;
-  char *pHostname;
+  char *pHostname = NULL;
+  u8_t *end;
   struct dns_hdr *hdr;
   struct dns_answer ans;
   struct dns_table_entry *pEntry;
   u16_t nquestions, nanswers;
+  u8_t k, negative = 0;
 
   LWIP_UNUSED_ARG(arg);
   LWIP_UNUSED_ARG(pcb);
-  LWIP_UNUSED_ARG(addr);
-  LWIP_UNUSED_ARG(port);
+
+  /* the pcb isn't connected: only take answers from the servers we ask */
+  k = dns_server_index(addr);
+  if ((k == DNS_SERVER_NONE) || (port != DNS_SERVER_PORT)) {
+    LWIP_DEBUGF(DNS_DEBUG, ("dns_recv: not from a DNS server\n"));
+    goto memerr;
+  }
 
   /* is the dns message too big ? */
   if (p->tot_len > DNS_MSG_SIZE) {
@@ -765,75 +1441,114 @@ dns_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p, ip_addr_t *addr, u16_t
   if (pbuf_copy_partial(p, dns_payload, p->tot_len, 0) == p->tot_len) {
     /* The ID in the DNS header should be our entry into the name table. */
     hdr = (struct dns_hdr*)dns_payload;
+    end = dns_payload + p->tot_len;
     i = htons(hdr->id);
     if (i < DNS_TABLE_SIZE) {
       pEntry = &dns_table[i];
-      if(pEntry->state == DNS_STATE_ASKING) {
-        /* This entry is now completed. */
-        pEntry->state = DNS_STATE_DONE;
-        pEntry->err   = hdr->flags2 & DNS_FLAG2_ERR_MASK;
-
+#if DNS_HEDGE
+      /* ... and only from one asked for this entry */
+      if ((pEntry->state == DNS_STATE_ASKING) && (pEntry->sent_mask & (1 << k))) {
+#else /* DNS_HEDGE */
+      if (pEntry->state == DNS_STATE_ASKING) {
+#endif /* DNS_HEDGE */
         /* We only care about the question(s) and the answers. The authrr
            and the extrarr are simply discarded. */
         nquestions = htons(hdr->numquestions);
         nanswers   = htons(hdr->numanswers);
 
-        /* Check for error. If so, call callback to inform. */
-        if (((hdr->flags1 & DNS_FLAG1_RESPONSE) == 0) || (pEntry->err != 0) || (nquestions != 1)) {
-          LWIP_DEBUGF(DNS_DEBUG, ("dns_recv: \"%s\": error in flags\n", pEntry->name));
-          /* call callback to indicate error, clean up memory and return */
-          goto responseerr;
+        /* Skip the name in the "question" part, making sure it is all there */
+        if (nquestions == 1) {
+          pHostname = (char *) dns_parse_name((unsigned char *)dns_payload + SIZEOF_DNS_HDR, end);
+          if ((pHostname == NULL) || ((u8_t *)pHostname + SIZEOF_DNS_QUERY > end)) {
+            LWIP_DEBUGF(DNS_DEBUG, ("dns_recv: \"%s\": malformed question\n", pEntry->name));
+            goto memerr;
+          }
+          pHostname += SIZEOF_DNS_QUERY;
         }
 
 #if DNS_DOES_NAME_CHECK
-        /* Check if the name in the "question" part match with the name in the entry. */
-        if (dns_compare_name((unsigned char *)(pEntry->name), (unsigned char *)dns_payload + SIZEOF_DNS_HDR) != 0) {
+        /* Check if the name in the "question" part match with the name in the entry.
+           If not, this is a late answer meant for an earlier user of the entry
+           (e.g. from a server that was slower than its hedge): ignore it. */
+        if ((nquestions == 1) &&
+            (dns_compare_name((unsigned char *)(pEntry->name), (unsigned char *)dns_payload + SIZEOF_DNS_HDR) != 0)) {
           LWIP_DEBUGF(DNS_DEBUG, ("dns_recv: \"%s\": response not match to query\n", pEntry->name));
-          /* call callback to indicate error, clean up memory and return */
-          goto responseerr;
+          goto memerr;
         }
 #endif /* DNS_DOES_NAME_CHECK */
 
-        /* Skip the name in the "question" part */
-        pHostname = (char *) dns_parse_name((unsigned char *)dns_payload + SIZEOF_DNS_HDR) + SIZEOF_DNS_QUERY;
+        /* This entry is now completed. */
+        pEntry->state = DNS_STATE_DONE;
+        pEntry->err   = hdr->flags2 & DNS_FLAG2_ERR_MASK;
+        dns_lru_push(i);
+#if DNS_HEDGE
+        /* SERVFAIL, REFUSED etc. say nothing about how fast the server answers */
+        if ((hdr->flags1 & DNS_FLAG1_RESPONSE) &&
+            ((pEntry->err == DNS_FLAG2_ERR_NONE) || (pEntry->err == DNS_FLAG2_ERR_NAME))) {
+          dns_answered(i, k, sys_now());
+        }
+#endif /* DNS_HEDGE */
+
+        /* Check for error. If so, call callback to inform. */
+        if (((hdr->flags1 & DNS_FLAG1_RESPONSE) == 0) || (pEntry->err != 0) || (nquestions != 1)) {
+          LWIP_DEBUGF(DNS_DEBUG, ("dns_recv: \"%s\": error in flags\n", pEntry->name));
+          /* NXDOMAIN is worth remembering; SERVFAIL etc. may be transient */
+          negative = (hdr->flags1 & DNS_FLAG1_RESPONSE) && (pEntry->err == DNS_FLAG2_ERR_NAME);
+          /* call callback to indicate error, clean up memory and return */
+          goto responseerr;
+        }
 
+        pEntry->naddrs = 0;
         while (nanswers > 0) {
           /* skip answer resource record's host name */
-          pHostname = (char *) dns_parse_name((unsigned char *)pHostname);
+          pHostname = (char *) dns_parse_name((unsigned char *)pHostname, end);
+          if ((pHostname == NULL) || ((u8_t *)pHostname + SIZEOF_DNS_ANSWER > end)) {
+            break;
+          }
 
           /* Check for IP address type and Internet class. Others are discarded. */
           SMEMCPY(&ans, pHostname, SIZEOF_DNS_ANSWER);
+          /* the record's data has to be there as well, to be read or skipped */
+          if (htons(ans.len) > end - ((u8_t *)pHostname + SIZEOF_DNS_ANSWER)) {
+            break;
+          }
           if((ans.type == PP_HTONS(DNS_RRTYPE_A)) && (ans.cls == PP_HTONS(DNS_RRCLASS_IN)) &&
              (ans.len == PP_HTONS(sizeof(ip_addr_t))) ) {
-            /* read the answer resource record's TTL, and maximize it if needed */
-            pEntry->ttl = ntohl(ans.ttl);
-            if (pEntry->ttl > DNS_MAX_TTL) {
-              pEntry->ttl = DNS_MAX_TTL;
+            /* read the answer resource record's TTL, and maximize it if needed;
+               the addresses are kept as long as the shortest lived one */
+            u32_t ttl = LWIP_MIN(ntohl(ans.ttl), DNS_MAX_TTL);
+            if ((pEntry->naddrs == 0) || (ttl < pEntry->ttl)) {
+              pEntry->ttl = ttl;
             }
             /* read the IP address after answer resource record's header */
-            SMEMCPY(&(pEntry->ipaddr), (pHostname+SIZEOF_DNS_ANSWER), sizeof(ip_addr_t));
+            SMEMCPY(&(pEntry->ipaddr[pEntry->naddrs]), (pHostname+SIZEOF_DNS_ANSWER), sizeof(ip_addr_t));
             LWIP_DEBUGF(DNS_DEBUG, ("dns_recv: \"%s\": response = ", pEntry->name));
-            ip_addr_debug_print(DNS_DEBUG, (&(pEntry->ipaddr)));
+            ip_addr_debug_print(DNS_DEBUG, (&(pEntry->ipaddr[pEntry->naddrs])));
             LWIP_DEBUGF(DNS_DEBUG, ("\n"));
-            /* call specified callback function if provided */
-            if (pEntry->found) {
-              (*pEntry->found)(pEntry->name, &pEntry->ipaddr, pEntry->arg);
-            }
-            if (pEntry->ttl == 0) {
-              /* RFC 883, page 29: "Zero values are
-                 interpreted to mean that the RR can only be used for the
-                 transaction in progress, and should not be cached."
-                 -> flush this entry now */
-              goto flushentry;
+            if (++pEntry->naddrs == DNS_MAX_ADDRS) {
+              break;
             }
-            /* deallocate memory and return */
-            goto memerr;
-          } else {
-            pHostname = pHostname + SIZEOF_DNS_ANSWER + htons(ans.len);
           }
+          pHostname = pHostname + SIZEOF_DNS_ANSWER + htons(ans.len);
           --nanswers;
         }
+        if (pEntry->naddrs > 0) {
+          /* call the callback functions of all waiting callers */
+          dns_call_found(i, &pEntry->ipaddr[0]);
+          if (pEntry->ttl == 0) {
+            /* RFC 883, page 29: "Zero values are
+               interpreted to mean that the RR can only be used for the
+               transaction in progress, and should not be cached."
+               -> flush this entry now */
+            goto flushentry;
+          }
+          /* deallocate memory and return */
+          goto memerr;
+        }
         LWIP_DEBUGF(DNS_DEBUG, ("dns_recv: \"%s\": error in response\n", pEntry->name));
+        /* the name exists, but has no A record (NODATA) */
+        negative = 1;
+        pEntry->err = DNS_FLAG2_ERR_NAME;
         /* call callback to indicate error, clean up memory and return */
         goto responseerr;
       }
@@ -844,14 +1559,15 @@ dns_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p, ip_addr_t *addr, u16_t
   goto memerr;
 
 responseerr:
-  /* ERROR: call specified callback function with NULL as name to indicate an error */
-  if (pEntry->found) {
-    (*pEntry->found)(pEntry->name, NULL, pEntry->arg);
+  /* ERROR: call the callback functions with NULL as address to indicate an error */
+  dns_call_found(i, NULL);
+  if (negative) {
+    dns_set_negative(i, pEntry->err);
+    goto memerr;
   }
 flushentry:
   /* flush this entry */
-  pEntry->state = DNS_STATE_UNUSED;
-  pEntry->found = NULL;
+  dns_flush(i);
 
 memerr:
   /* free pbuf */
@@ -860,7 +1576,8 @@ memerr:
 }
 
 /**
- * Queues a new hostname to resolve and sends out a DNS query for that hostname
+ * Queues a new hostname to resolve and sends out a DNS query for that hostname,
+ * or waits for the query already sent for it
  *
  * @param name the hostname that is to be queried
  * @param hostnamelen length of the hostname
@@ -872,52 +1589,62 @@ static err_t
 dns_enqueue(const char *name, size_t hostnamelen, dns_found_callback found,
             void *callback_arg)
 {
-  u8_t i;
-  u8_t lseq, lseqi;
+  u16_t i;
+  u32_t hash;
   struct dns_table_entry *pEntry = NULL;
   size_t namelen;
 
-  /* search an unused entry, or the oldest one */
-  lseq = lseqi = 0;
-  for (i = 0; i < DNS_TABLE_SIZE; ++i) {
+  /* is this name being asked for already? */
+  hash = dns_hash_name(name);
+  for (i = dns_hash[hash % DNS_HASH_SIZE]; i != DNS_HASH_NONE; i = dns_table[i].hnext) {
     pEntry = &dns_table[i];
-    /* is it an unused entry ? */
-    if (pEntry->state == DNS_STATE_UNUSED)
-      break;
-
-    /* check if this is the oldest completed entry */
-    if (pEntry->state == DNS_STATE_DONE) {
-      if ((u8_t)(dns_seqno - pEntry->seqno) > lseq) {
-        lseq = dns_seqno - pEntry->seqno;
-        lseqi = i;
+    if (((pEntry->state == DNS_STATE_NEW) || (pEntry->state == DNS_STATE_ASKING)) &&
+        (pEntry->hash == hash) && (strcmp(name, pEntry->name) == 0)) {
+      if (dns_add_request(i, found, callback_arg) != ERR_OK) {
+        return ERR_MEM;
       }
+      LWIP_DEBUGF(DNS_DEBUG, ("dns_enqueue: \"%s\": wait for DNS entry %"U16_F"\n", name, i));
+      dns_stats.coalesced++;
+      return ERR_INPROGRESS;
     }
   }
 
-  /* if we don't have found an unused entry, use the oldest completed one */
-  if (i == DNS_TABLE_SIZE) {
-    if ((lseqi >= DNS_TABLE_SIZE) || (dns_table[lseqi].state != DNS_STATE_DONE)) {
+  if ((found != NULL) && (dns_req_free == DNS_REQ_NONE)) {
+    LWIP_DEBUGF(DNS_DEBUG, ("dns_enqueue: \"%s\": too many requests\n", name));
+    return ERR_MEM;
+  }
+
+  /* if there is no unused entry, evict the least recently used completed one */
+  if (dns_free == DNS_HASH_NONE) {
+    i = dns_lru_tail;
+    if ((i != DNS_HASH_NONE) && (i == dns_calling)) {
+      i = dns_table[i].lprev;
+    }
+    if (i == DNS_HASH_NONE) {
       /* no entry can't be used now, table is full */
       LWIP_DEBUGF(DNS_DEBUG, ("dns_enqueue: \"%s\": DNS entries table is full\n", name));
       return ERR_MEM;
-    } else {
-      /* use the oldest completed one */
-      i = lseqi;
-      pEntry = &dns_table[i];
     }
+    dns_flush(i);
+    dns_stats.evictions++;
   }
+  i = dns_free;
+  pEntry = &dns_table[i];
+  dns_free = pEntry->lnext;
 
   /* use this entry */
   LWIP_DEBUGF(DNS_DEBUG, ("dns_enqueue: \"%s\": use DNS entry %"U16_F"\n", name, (u16_t)(i)));
 
   /* fill the entry */
   pEntry->state = DNS_STATE_NEW;
-  pEntry->seqno = dns_seqno++;
-  pEntry->found = found;
-  pEntry->arg   = callback_arg;
+  pEntry->err   = 0;
+  dns_add_request(i, found, callback_arg);
   namelen = LWIP_MIN(hostnamelen, DNS_MAX_NAME_LENGTH-1);
   MEMCPY(pEntry->name, name, namelen);
   pEntry->name[namelen] = 0;
+  dns_hash_add(i);
+
+  dns_stats.misses++;
 
   /* force to send query without waiting timer */
   dns_check_entry(i);
@@ -935,13 +1662,14 @@ dns_enqueue(const char *name, size_t hostnamelen, dns_found_callback found,
  *   name is already in the local names table.
  * - ERR_INPROGRESS enqueue a request to be sent to the DNS server
  *   for resolution if no errors are present.
+ * - ERR_VAL: the hostname recently failed to resolve (see DNS_NEG_TTL)
  * - ERR_ARG: dns client not initialized or invalid hostname
  *
  * @param hostname the hostname that is to be queried
  * @param addr pointer to a ip_addr_t where to store the address if it is already
  *             cached in the dns_table (only valid if ERR_OK is returned!)
  * @param found a callback function to be called on success, failure or timeout (only if
- *              ERR_INPROGRESS is returned!)
+ *              ERR_INPROGRESS is returned!); may be NULL to only fill the cache
  * @param callback_arg argument to pass to the callback function
  * @return a err_t return code.
  */
@@ -951,6 +1679,7 @@ dns_gethostbyname(const char *hostname, ip_addr_t *addr, dns_found_callback foun
 {
   u32_t ipaddr;
   size_t hostnamelen;
+  err_t err;
   /* not initialized or no valid server yet, or invalid addr pointer
    * or invalid hostname or invalid hostname length */
   if ((dns_pcb == NULL) || (addr == NULL) ||
@@ -972,17 +1701,155 @@ dns_gethostbyname(const char *hostname, ip_addr_t *addr, dns_found_callback foun
 
   /* host name already in octet notation? set ip addr and return ERR_OK */
   ipaddr = ipaddr_addr(hostname);
-  if (ipaddr == IPADDR_NONE) {
-    /* already have this address cached? */
-    ipaddr = dns_lookup(hostname);
-  }
   if (ipaddr != IPADDR_NONE) {
     ip4_addr_set_u32(addr, ipaddr);
     return ERR_OK;
   }
 
+  /* already have this address cached? */
+  err = dns_lookup(hostname, addr);
+  if (err == ERR_OK) {
+    dns_stats.hits++;
+    return ERR_OK;
+  } else if (err == ERR_VAL) {
+    dns_stats.neg_hits++;
+    return ERR_VAL;
+  }
+
   /* queue query with specified callback */
   return dns_enqueue(hostname, hostnamelen, found, callback_arg);
 }
 
+/**
+ * Get all the cached addresses of a name (see DNS_MAX_ADDRS), e.g. from
+ * the callback passed to dns_gethostbyname().
+ *
+ * @param hostname the name that was looked up
+ * @param addrs where to store the addresses
+ * @param max size of addrs
+ * @return the number of addresses stored; 0 if none are cached
+ */
+u8_t
+dns_getaddrs(const char *hostname, ip_addr_t *addrs, u8_t max)
+{
+  u32_t hash = dns_hash_name(hostname);
+  u16_t i;
+  u8_t n;
+
+  for (i = dns_hash[hash % DNS_HASH_SIZE]; i != DNS_HASH_NONE; i = dns_table[i].hnext) {
+    struct dns_table_entry *pEntry = &dns_table[i];
+    if ((pEntry->state == DNS_STATE_DONE) && (pEntry->err == 0) &&
+        (pEntry->hash == hash) && (strcmp(hostname, pEntry->name) == 0)) {
+      n = LWIP_MIN(pEntry->naddrs, max);
+      MEMCPY(addrs, pEntry->ipaddr, n * sizeof(ip_addr_t));
+      return n;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Stop calling back a caller of dns_gethostbyname() that is no longer
+ * interested in the answer. The query itself goes on, so the answer
+ * still ends up in the cache.
+ *
+ * @param found the callback function passed to dns_gethostbyname()
+ * @param callback_arg the argument passed along with it
+ */
+void
+dns_cancel(dns_found_callback found, void *callback_arg)
+{
+  u16_t r, next;
+
+  for (r = dns_req_hash[dns_hash_arg(callback_arg)]; r != DNS_REQ_NONE; r = next) {
+    struct dns_req_entry *req = &dns_requests[r];
+    next = req->anext;
+    if ((req->found == found) && (req->arg == callback_arg)) {
+      dns_del_request(r);
+    }
+  }
+}
+
+#if DNS_HEDGE
+/**
+ * @return milliseconds until dns_hedge_tmr() has to be called, or
+ *         DNS_HEDGE_IDLE if no query is waiting to be hedged
+ */
+u32_t
+dns_hedge_delay(void)
+{
+  u32_t now = sys_now();
+
+  if (!dns_hedge_pending) {
+    return DNS_HEDGE_IDLE;
+  }
+  return ((s32_t)(dns_hedge_next - now) > 0) ? dns_hedge_next - now : 0;
+}
+
+/**
+ * Ask a second server for the queries whose first server is being slow.
+ */
+void
+dns_hedge_tmr(void)
+{
+  struct dns_table_entry *pEntry;
+  u32_t now = sys_now();
+  u16_t i;
+  u8_t k;
+
+  if (!dns_hedge_pending || ((s32_t)(now - dns_hedge_next) < 0)) {
+    return;
+  }
+  dns_hedge_pending = 0;
+  for (i = 0; i < DNS_TABLE_SIZE; ++i) {
+    pEntry = &dns_table[i];
+    if ((pEntry->state != DNS_STATE_ASKING) || (pEntry->hedge != DNS_HEDGE_WAIT)) {
+      continue;
+    }
+    if ((s32_t)(now - pEntry->hedge_due) < 0) {
+      dns_hedge_schedule(pEntry->hedge_due);
+      continue;
+    }
+    k = dns_pick_server(pEntry->sent_mask, now);
+    pEntry->hedge = k;
+    if (k != DNS_SERVER_NONE) {
+      LWIP_DEBUGF(DNS_DEBUG, ("dns_hedge_tmr: \"%s\": hedge to server %"U16_F"\n", pEntry->name, (u16_t)k));
+      dns_server_state[k].stats.hedges++;
+      dns_ask(i, k);
+    }
+  }
+}
+
+/**
+ * Get the response time and timeout counters of server numdns, or NULL if
+ * it isn't configured.
+ */
+const struct dns_server_stats *
+dns_get_server_stats(u8_t numdns)
+{
+  if ((numdns >= DNS_MAX_SERVERS) || ip_addr_isany(&dns_servers[numdns])) {
+    return NULL;
+  }
+  dns_server_state[numdns].stats.down = !dns_server_up(numdns, sys_now());
+  return &dns_server_state[numdns].stats;
+}
+#endif /* DNS_HEDGE */
+
+/**
+ * Get the resolver cache counters.
+ */
+const struct dns_cache_stats *
+dns_get_stats(void)
+{
+  u16_t i;
+
+  dns_stats.used = 0;
+  for (i = 0; i < DNS_TABLE_SIZE; ++i) {
+    if (dns_table[i].state != DNS_STATE_UNUSED) {
+      dns_stats.used++;
+    }
+  }
+  return &dns_stats;
+}
+
 #endif /* LWIP_DNS */
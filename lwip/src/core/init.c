@@ -131,6 +131,18 @@
   #error "If you want to use TCP, TCP_WND must fit in an u16_t, so, you have to reduce it in your lwipopts.h (or enable window scaling)"
 #endif
 #endif /* LWIP_WND_SCALE */
+#if (LWIP_TCP && LWIP_TCP_RTT_MS && ((TCP_RTO_MIN < 1) || (TCP_RTO_MIN > TCP_RTO_MAX) || (TCP_RTO_MAX > 0x7fffff)))
+  #error "TCP_RTO_MIN and TCP_RTO_MAX must be ordered and between 1 ms and 0x7fffff ms"
+#endif
+#if (LWIP_TCP && LWIP_TCP_RACK && (!LWIP_TCP_SACK || !LWIP_TCP_RTT_MS))
+  #error "LWIP_TCP_RACK needs LWIP_TCP_SACK and LWIP_TCP_RTT_MS"
+#endif
+#if (LWIP_TCP && LWIP_TCP_SACK && !TCP_QUEUE_OOSEQ)
+  #error "LWIP_TCP_SACK needs TCP_QUEUE_OOSEQ to report out-of-sequence data"
+#endif
+#if (LWIP_TCP && LWIP_TCP_SACK && ((LWIP_TCP_MAX_SACK_NUM < 1) || (LWIP_TCP_MAX_SACK_NUM > 4)))
+  #error "LWIP_TCP_MAX_SACK_NUM must be between 1 and 4"
+#endif
 #if (LWIP_TCP && (TCP_SND_QUEUELEN > 0xffff))
   #error "If you want to use TCP, TCP_SND_QUEUELEN must fit in an u16_t, so, you have to reduce it in your lwipopts.h"
 #endif
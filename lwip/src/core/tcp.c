@@ -52,6 +52,7 @@
 #include "lwip/tcp_impl.h"
 #include "lwip/debug.h"
 #include "lwip/stats.h"
+#include "lwip/sys.h"
 #include "lwip/ip6.h"
 #include "lwip/ip6_addr.h"
 #include "lwip/nd6.h"
@@ -175,7 +176,7 @@ tcp_close_shutdown(struct tcp_pcb *pcb, u8_t rst_on_unacked_data)
   err_t err;
 
   if (rst_on_unacked_data && ((pcb->state == ESTABLISHED) || (pcb->state == CLOSE_WAIT))) {
-    if ((pcb->refused_data != NULL) || (pcb->rcv_wnd != TCP_WND)) {
+    if ((pcb->refused_data != NULL) || (pcb->rcv_wnd != TCP_WND_MAX(pcb))) {
       /* Not all data received by application, send RST to tell the remote
          side about this. */
       LWIP_ASSERT("pcb->flags & TF_RXCLOSED", pcb->flags & TF_RXCLOSED);
@@ -295,6 +296,7 @@ tcp_close(struct tcp_pcb *pcb)
   if (pcb->state != LISTEN) {
     /* Set a flag not to receive any more data... */
     pcb->flags |= TF_RXCLOSED;
+    TCP_TIMER_KICK(pcb);
   }
   /* ... and close */
   return tcp_close_shutdown(pcb, 1);
@@ -321,6 +323,7 @@ tcp_shutdown(struct tcp_pcb *pcb, int shut_rx, int shut_tx)
   if (shut_rx) {
     /* shut down the receive side: set a flag not to receive any more data... */
     pcb->flags |= TF_RXCLOSED;
+    TCP_TIMER_KICK(pcb);
     if (shut_tx) {
       /* shutting down the tx AND rx side is the same as closing for the raw API */
       return tcp_close_shutdown(pcb, 1);
@@ -557,6 +560,9 @@ tcp_listen_with_backlog(struct tcp_pcb *pcb, u8_t backlog)
   lpcb->local_port = pcb->local_port;
   lpcb->state = LISTEN;
   lpcb->prio = pcb->prio;
+#if LWIP_TCP_CC
+  lpcb->cc = pcb->cc;
+#endif /* LWIP_TCP_CC */
   lpcb->so_options = pcb->so_options;
   ip_set_option(lpcb, SOF_ACCEPTCONN);
   lpcb->ttl = pcb->ttl;
@@ -652,15 +658,15 @@ tcp_recved(struct tcp_pcb *pcb, u16_t len)
     pcb->state != LISTEN);
 
   pcb->rcv_wnd += len;
-  if (pcb->rcv_wnd > TCP_WND) {
-    pcb->rcv_wnd = TCP_WND;
+  if (pcb->rcv_wnd > TCP_WND_MAX(pcb)) {
+    pcb->rcv_wnd = TCP_WND_MAX(pcb);
   } else if(pcb->rcv_wnd == 0) {
     /* rcv_wnd overflowed */
     if ((pcb->state == CLOSE_WAIT) || (pcb->state == LAST_ACK)) {
       /* In passive close, we allow this, since the FIN bit is added to rcv_wnd
          by the stack itself, since it is not mandatory for an application
          to call tcp_recved() for the FIN bit, but e.g. the netconn API does so. */
-      pcb->rcv_wnd = TCP_WND;
+      pcb->rcv_wnd = TCP_WND_MAX(pcb);
     } else {
       LWIP_ASSERT("tcp_recved: len wrapped rcv_wnd\n", 0);
     }
@@ -678,7 +684,7 @@ tcp_recved(struct tcp_pcb *pcb, u16_t len)
   }
 
   LWIP_DEBUGF(TCP_DEBUG, ("tcp_recved: received %"U16_F" bytes, wnd %"U16_F" (%"U16_F").\n",
-         len, pcb->rcv_wnd, TCP_WND - pcb->rcv_wnd));
+         len, pcb->rcv_wnd, TCP_WND_MAX(pcb) - pcb->rcv_wnd));
 }
 
 /**
@@ -790,8 +796,8 @@ tcp_connect(struct tcp_pcb *pcb, ip_addr_t *ipaddr, u16_t port,
   pcb->snd_nxt = iss;
   pcb->lastack = iss - 1;
   pcb->snd_lbb = iss - 1;
-  pcb->rcv_wnd = TCP_WND;
-  pcb->rcv_ann_wnd = TCP_WND;
+  pcb->rcv_wnd = TCPWND16(TCP_WND);
+  pcb->rcv_ann_wnd = TCPWND16(TCP_WND);
   pcb->rcv_ann_right_edge = pcb->rcv_nxt;
   pcb->snd_wnd = TCP_WND;
   /* As initial send MSS, we use TCP_MSS but limit it to 536.
@@ -824,6 +830,712 @@ tcp_connect(struct tcp_pcb *pcb, ip_addr_t *ipaddr, u16_t port,
   return ret;
 }
 
+/**
+ * The retransmission timer of a PCB expired: back off, let congestion
+ * control react and retransmit the first unacknowledged segment.
+ *
+ * @param pcb the tcp_pcb whose retransmission timer expired
+ */
+static void
+tcp_rto_expired(struct tcp_pcb *pcb)
+{
+#if !LWIP_TCP_CC
+  tcpwnd_size_t eff_wnd;
+#endif /* !LWIP_TCP_CC */
+
+  /* Double retransmission time-out unless we are trying to
+   * connect to somebody (i.e., we are in SYN_SENT). */
+  if (pcb->state != SYN_SENT) {
+#if LWIP_TCP_RTT_MS
+    pcb->rto = LWIP_MIN(TCP_RTO_CALC(pcb) << tcp_backoff[pcb->nrtx], TCP_RTO_MAX);
+#else /* LWIP_TCP_RTT_MS */
+    pcb->rto = TCP_RTO_CALC(pcb) << tcp_backoff[pcb->nrtx];
+#endif /* LWIP_TCP_RTT_MS */
+  }
+
+#if LWIP_TCP_RACK
+  /* a timeout ends the tail loss probe episode, and the timer is only
+     restarted as an RTO */
+  pcb->rack_flags &= ~TCP_RACK_TLP_OUT;
+  pcb->rto_mode = TCP_RTO_MODE_RTO;
+  tcp_rto_arm(pcb, pcb->rto);
+#else /* LWIP_TCP_RACK */
+  /* Reset the retransmission timer. */
+  TCP_RTO_START(pcb);
+#endif /* LWIP_TCP_RACK */
+
+  /* Reduce congestion window and ssthresh. */
+#if LWIP_TCP_CC
+  pcb->cc->on_rto(pcb);
+#else /* LWIP_TCP_CC */
+  eff_wnd = LWIP_MIN(pcb->cwnd, pcb->snd_wnd);
+  pcb->ssthresh = eff_wnd >> 1;
+  if (pcb->ssthresh < (tcpwnd_size_t)(pcb->mss << 1)) {
+    pcb->ssthresh = (pcb->mss << 1);
+  }
+  pcb->cwnd = pcb->mss;
+#endif /* LWIP_TCP_CC */
+  LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_rto_expired: cwnd %"TCPWNDSIZE_F
+                               " ssthresh %"TCPWNDSIZE_F"\n",
+                               pcb->cwnd, pcb->ssthresh));
+
+  /* The following needs to be called AFTER cwnd is set to one
+     mss - STJ */
+  tcp_rexmit_rto(pcb);
+}
+
+/**
+ * Slow timer processing for one active PCB: retransmission and persist
+ * timers, keepalives, and the timeouts of the closing states.
+ *
+ * @param pcb the tcp_pcb to process
+ * @param pcb_reset set to 1 if a RST should be sent when removing the pcb
+ * @return 1 if the pcb should be removed, 0 otherwise
+ */
+static u8_t
+tcp_slowtmr_pcb(struct tcp_pcb *pcb, u8_t *pcb_reset)
+{
+  u8_t pcb_remove = 0;
+
+  *pcb_reset = 0;
+
+  if (pcb->state == SYN_SENT && pcb->nrtx == TCP_SYNMAXRTX) {
+    pcb_remove = 1;
+    LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: max SYN retries reached\n"));
+  }
+  else if (pcb->nrtx == TCP_MAXRTX) {
+    pcb_remove = 1;
+    LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: max DATA retries reached\n"));
+  } else {
+    if (pcb->persist_backoff > 0) {
+      /* If snd_wnd is zero, use persist timer to send 1 byte probes
+       * instead of using the standard retransmission mechanism. */
+      pcb->persist_cnt++;
+      if (pcb->persist_cnt >= tcp_persist_backoff[pcb->persist_backoff-1]) {
+        pcb->persist_cnt = 0;
+        if (pcb->persist_backoff < sizeof(tcp_persist_backoff)) {
+          pcb->persist_backoff++;
+        }
+        tcp_zero_window_probe(pcb);
+      }
+    }
+#if !LWIP_TCP_RTT_MS
+    else {
+      /* Increase the retransmission timer if it is running */
+      if(pcb->rtime >= 0) {
+        ++pcb->rtime;
+      }
+
+      if (pcb->unacked != NULL && pcb->rtime >= pcb->rto) {
+        /* Time for a retransmission. */
+        LWIP_DEBUGF(TCP_RTO_DEBUG, ("tcp_slowtmr: rtime %"S16_F
+                                    " pcb->rto %"TCPRTT_F"\n",
+                                    pcb->rtime, pcb->rto));
+        tcp_rto_expired(pcb);
+      }
+    }
+#endif /* !LWIP_TCP_RTT_MS */
+  }
+  /* Check if this PCB has stayed too long in FIN-WAIT-2 */
+  if (pcb->state == FIN_WAIT_2) {
+    /* If this PCB is in FIN_WAIT_2 because of SHUT_WR don't let it time out. */
+    if (pcb->flags & TF_RXCLOSED) {
+      /* PCB was fully closed (either through close() or SHUT_RDWR):
+         normal FIN-WAIT timeout handling. */
+      if ((u32_t)(tcp_ticks - pcb->tmr) >
+          TCP_FIN_WAIT_TIMEOUT / TCP_SLOW_INTERVAL) {
+        pcb_remove = 1;
+        LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: removing pcb stuck in FIN-WAIT-2\n"));
+      }
+    }
+  }
+
+  /* Check if KEEPALIVE should be sent */
+  if(ip_get_option(pcb, SOF_KEEPALIVE) &&
+     ((pcb->state == ESTABLISHED) ||
+      (pcb->state == CLOSE_WAIT))) {
+    if((u32_t)(tcp_ticks - pcb->tmr) >
+       (pcb->keep_idle + TCP_KEEP_DUR(pcb)) / TCP_SLOW_INTERVAL)
+    {
+      LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: KEEPALIVE timeout. Aborting connection to "));
+      ipX_addr_debug_print(PCB_ISIPV6(pcb), TCP_DEBUG, &pcb->remote_ip);
+      LWIP_DEBUGF(TCP_DEBUG, ("\n"));
+      
+      pcb_remove = 1;
+      *pcb_reset = 1;
+    }
+    else if((u32_t)(tcp_ticks - pcb->tmr) > 
+            (pcb->keep_idle + pcb->keep_cnt_sent * TCP_KEEP_INTVL(pcb))
+            / TCP_SLOW_INTERVAL)
+    {
+      tcp_keepalive(pcb);
+      pcb->keep_cnt_sent++;
+    }
+  }
+
+  /* If this PCB has queued out of sequence data, but has been
+     inactive for too long, will drop the data (it will eventually
+     be retransmitted). */
+#if TCP_QUEUE_OOSEQ
+  if (pcb->ooseq != NULL &&
+#if LWIP_TCP_RTT_MS
+      (u32_t)tcp_ticks - pcb->tmr >= (u32_t)pcb->rto * TCP_OOSEQ_TIMEOUT / TCP_SLOW_INTERVAL) {
+#else /* LWIP_TCP_RTT_MS */
+      (u32_t)tcp_ticks - pcb->tmr >= pcb->rto * TCP_OOSEQ_TIMEOUT) {
+#endif /* LWIP_TCP_RTT_MS */
+    tcp_segs_free(pcb->ooseq);
+    pcb->ooseq = NULL;
+    LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_slowtmr: dropping OOSEQ queued data\n"));
+  }
+#endif /* TCP_QUEUE_OOSEQ */
+
+  /* Check if this PCB has stayed too long in SYN-RCVD */
+  if (pcb->state == SYN_RCVD) {
+    if ((u32_t)(tcp_ticks - pcb->tmr) >
+        TCP_SYN_RCVD_TIMEOUT / TCP_SLOW_INTERVAL) {
+      pcb_remove = 1;
+      LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: removing pcb stuck in SYN-RCVD\n"));
+    }
+  }
+
+  /* Check if this PCB has stayed too long in LAST-ACK */
+  if (pcb->state == LAST_ACK) {
+    if ((u32_t)(tcp_ticks - pcb->tmr) > 2 * TCP_MSL / TCP_SLOW_INTERVAL) {
+      pcb_remove = 1;
+      LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: removing pcb stuck in LAST-ACK\n"));
+    }
+  }
+
+  return pcb_remove;
+}
+
+#if LWIP_TCP_RTT_MS
+/** Running retransmission timers, hashed by the millisecond they expire */
+static struct tcp_pcb *tcp_rto_wheel[TCP_RTO_WHEEL_SIZE];
+/** Number of PCBs on the wheel */
+static u32_t tcp_rto_armed;
+/** The slots up to this sys_now() value have been visited */
+static u32_t tcp_rto_done;
+/** No retransmission timer expires before this */
+static u32_t tcp_rto_next;
+
+static void
+tcp_rto_link(struct tcp_pcb **list, struct tcp_pcb *pcb)
+{
+  pcb->rto_next = *list;
+  if (*list != NULL) {
+    (*list)->rto_pprev = &pcb->rto_next;
+  }
+  *list = pcb;
+  pcb->rto_pprev = list;
+}
+
+/**
+ * Take a PCB off the retransmission timer wheel. Called from TCP_RMV.
+ */
+void
+tcp_rto_cancel(struct tcp_pcb *pcb)
+{
+  if (pcb->rto_pprev != NULL) {
+    tcp_rto_armed--;
+    *pcb->rto_pprev = pcb->rto_next;
+    if (pcb->rto_next != NULL) {
+      pcb->rto_next->rto_pprev = pcb->rto_pprev;
+    }
+    pcb->rto_next = NULL;
+    pcb->rto_pprev = NULL;
+  }
+}
+
+/**
+ * (Re)start the retransmission timer of a PCB.
+ *
+ * @param pcb the tcp_pcb to time
+ * @param delay milliseconds until the timer expires
+ */
+void
+tcp_rto_arm(struct tcp_pcb *pcb, u32_t delay)
+{
+  u32_t now = sys_now();
+
+  tcp_rto_cancel(pcb);
+  if (tcp_rto_armed == 0) {
+    tcp_rto_done = now;
+  }
+  pcb->rtime = 0;
+  pcb->rto_due = now + delay;
+  if (TIME_LEQ(pcb->rto_due, tcp_rto_done)) {
+    /* that slot has been visited already */
+    pcb->rto_due = tcp_rto_done + 1;
+  }
+  if (tcp_rto_armed++ == 0 || TIME_LT(pcb->rto_due, tcp_rto_next)) {
+    tcp_rto_next = pcb->rto_due;
+  }
+  tcp_rto_link(&tcp_rto_wheel[pcb->rto_due & (TCP_RTO_WHEEL_SIZE - 1)], pcb);
+}
+
+/**
+ * (Re)start the retransmission timer of a PCB, to expire in pcb->rto ms.
+ * With RACK-TLP, a tail loss probe is scheduled instead where possible.
+ *
+ * @param pcb the tcp_pcb to time
+ */
+void
+tcp_rto_start(struct tcp_pcb *pcb)
+{
+#if LWIP_TCP_RACK
+  u32_t pto;
+
+  /* RFC 8985, section 7.2: no probe during recovery, after a timeout or
+     while another one is outstanding, and not before the RTT is known */
+  if ((pcb->flags & (TF_SACK | TF_INFR)) == TF_SACK && pcb->nrtx == 0 &&
+      !(pcb->rack_flags & TCP_RACK_TLP_OUT) && pcb->sa != 0) {
+    pto = 2 * (u32_t)(pcb->sa >> 3);
+    if (pcb->unacked == NULL || pcb->unacked->next == NULL) {
+      /* a single segment may be waiting for a delayed ACK */
+      pto += TCP_TLP_MAX_ACK_DELAY;
+    }
+    pto = LWIP_MAX(pto, TCP_TLP_PTO_MIN);
+    if (pto < (u32_t)pcb->rto) {
+      pcb->rto_mode = TCP_RTO_MODE_TLP;
+      tcp_rto_arm(pcb, pto);
+      return;
+    }
+  }
+  pcb->rto_mode = TCP_RTO_MODE_RTO;
+#endif /* LWIP_TCP_RACK */
+  tcp_rto_arm(pcb, (u32_t)pcb->rto);
+}
+
+/**
+ * @return milliseconds until tcp_rto_tmr() has to be called, or
+ *         TCP_RTO_IDLE if no retransmission timer is running
+ */
+u32_t
+tcp_rto_delay(void)
+{
+  struct tcp_pcb *pcb;
+  u32_t now = sys_now();
+  u32_t t;
+
+  if (tcp_rto_armed == 0) {
+    return TCP_RTO_IDLE;
+  }
+  if (TIME_LEQ(tcp_rto_next, tcp_rto_done)) {
+    /* the earliest timer has been handled or restarted: look for the
+       next one, one round ahead at most */
+    tcp_rto_next = tcp_rto_done + TCP_RTO_WHEEL_SIZE;
+    for (t = tcp_rto_done + 1; t != tcp_rto_done + TCP_RTO_WHEEL_SIZE; t++) {
+      for (pcb = tcp_rto_wheel[t & (TCP_RTO_WHEEL_SIZE - 1)];
+           pcb != NULL; pcb = pcb->rto_next) {
+        if (TIME_LEQ(pcb->rto_due, t)) {
+          tcp_rto_next = t;
+          break;
+        }
+      }
+      if (pcb != NULL) {
+        break;
+      }
+    }
+  }
+  return TIME_GT(tcp_rto_next, now) ? tcp_rto_next - now : 0;
+}
+
+/**
+ * Retransmit on the PCBs whose retransmission timer expired. Only the
+ * wheel slots of the milliseconds since the last call are visited.
+ */
+void
+tcp_rto_tmr(void)
+{
+  struct tcp_pcb *pcb, *next, *todo = NULL;
+  u32_t now = sys_now();
+  u32_t t, n;
+
+  /* Collect the expired timers first: handling them restarts timers, and
+     callbacks may close any PCB, which takes it off 'todo'. */
+  n = LWIP_MIN(now - tcp_rto_done, TCP_RTO_WHEEL_SIZE);
+  for (t = now - n + 1; t != now + 1; t++) {
+    for (pcb = tcp_rto_wheel[t & (TCP_RTO_WHEEL_SIZE - 1)];
+         pcb != NULL; pcb = next) {
+      next = pcb->rto_next;
+      if (TIME_LEQ(pcb->rto_due, now)) {
+        tcp_rto_cancel(pcb);
+        tcp_rto_link(&todo, pcb);
+        /* still counted as armed while it is on 'todo' */
+        tcp_rto_armed++;
+      }
+    }
+  }
+  tcp_rto_done = now;
+
+  while ((pcb = todo) != NULL) {
+    tcp_rto_cancel(pcb);
+    if (pcb->rtime < 0) {
+      continue;
+    }
+    if (pcb->unacked == NULL || pcb->persist_backoff > 0 ||
+        pcb->nrtx == ((pcb->state == SYN_SENT) ? TCP_SYNMAXRTX : TCP_MAXRTX)) {
+      /* Nothing to retransmit, the persist timer is in charge or
+         tcp_slowtmr() is about to give up. The next transmission
+         starts the timer again. */
+      pcb->rtime = -1;
+    } else {
+#if LWIP_TCP_RACK
+      if (pcb->rto_mode == TCP_RTO_MODE_TLP) {
+        tcp_tlp_probe(pcb);
+      } else if (pcb->rto_mode == TCP_RTO_MODE_REO) {
+        /* back to the deadline the reordering timer took over, unless
+           more segments have to wait */
+        tcp_rack_reo_done(pcb, now);
+        tcp_rack_detect_loss(pcb);
+        tcp_output(pcb);
+      } else
+#endif /* LWIP_TCP_RACK */
+      {
+        LWIP_DEBUGF(TCP_RTO_DEBUG, ("tcp_rto_tmr: pcb->rto %"TCPRTT_F" ms expired\n",
+                                    pcb->rto));
+        tcp_rto_expired(pcb);
+      }
+    }
+  }
+}
+#endif /* LWIP_TCP_RTT_MS */
+
+#if LWIP_TCP_TIMER_WHEEL
+/** PCBs that need to be visited on every timer tick */
+static struct tcp_pcb *tcp_tmr_hot;
+/** Idle PCBs, hashed by the slow tick of their next deadline */
+static struct tcp_pcb *tcp_tmr_wheel[TCP_TIMER_WHEEL_SIZE];
+/** Number of PCBs on the wheel */
+static u32_t tcp_tmr_parked;
+/** No PCB on the wheel is due before this tick */
+static u32_t tcp_tmr_next_due;
+
+static void
+tcp_tmr_link(struct tcp_pcb **list, struct tcp_pcb *pcb)
+{
+  pcb->tmr_next = *list;
+  if (*list != NULL) {
+    (*list)->tmr_pprev = &pcb->tmr_next;
+  }
+  *list = pcb;
+  pcb->tmr_pprev = list;
+}
+
+/**
+ * Take a PCB off the timer lists. Called from TCP_RMV.
+ */
+void
+tcp_timer_unlink(struct tcp_pcb *pcb)
+{
+  if (pcb->tmr_pprev != NULL) {
+    if (!pcb->tmr_hot) {
+      tcp_tmr_parked--;
+    }
+    *pcb->tmr_pprev = pcb->tmr_next;
+    if (pcb->tmr_next != NULL) {
+      pcb->tmr_next->tmr_pprev = pcb->tmr_pprev;
+    }
+    pcb->tmr_next = NULL;
+    pcb->tmr_pprev = NULL;
+  }
+}
+
+/**
+ * Make sure a PCB is visited on every timer tick until its timer state has
+ * been re-evaluated. Called whenever a PCB might have acquired new timer
+ * work: on registration, on input, and when data or flags are queued.
+ */
+void
+tcp_timer_kick(struct tcp_pcb *pcb)
+{
+  if ((pcb->state == CLOSED) || (pcb->state == LISTEN)) {
+    /* not on the active or TIME-WAIT lists */
+    return;
+  }
+  if (pcb->tmr_hot && pcb->tmr_pprev != NULL) {
+    return;
+  }
+  tcp_timer_unlink(pcb);
+  pcb->tmr_hot = 1;
+  tcp_tmr_link(&tcp_tmr_hot, pcb);
+}
+
+/** Detach the per-tick list so it can be walked while PCBs are rescheduled */
+static void
+tcp_tmr_take_hot(struct tcp_pcb **list)
+{
+  *list = tcp_tmr_hot;
+  tcp_tmr_hot = NULL;
+  if (*list != NULL) {
+    (*list)->tmr_pprev = list;
+  }
+}
+
+/**
+ * Does this PCB have state that is driven by every timer tick?
+ */
+static u8_t
+tcp_tmr_needs_tick(struct tcp_pcb *pcb)
+{
+#if LWIP_EVENT_API
+  /* the application is polled on every slow tick */
+  LWIP_UNUSED_ARG(pcb);
+  return 1;
+#else /* LWIP_EVENT_API */
+  return pcb->rtime >= 0 || pcb->unacked != NULL || pcb->unsent != NULL ||
+         pcb->persist_backoff > 0 || pcb->refused_data != NULL ||
+#if TCP_QUEUE_OOSEQ
+         pcb->ooseq != NULL ||
+#endif /* TCP_QUEUE_OOSEQ */
+         pcb->poll != NULL ||
+         (pcb->flags & (TF_ACK_DELAY | TF_ACK_NOW | TF_NAGLEMEMERR)) != 0;
+#endif /* LWIP_EVENT_API */
+}
+
+/**
+ * Find the first slow tick at which tcp_slowtmr_pcb() would act on an idle
+ * PCB, mirroring the timeout checks there.
+ *
+ * @return 1 if *due was set, 0 if the PCB has no deadline at all
+ */
+static u8_t
+tcp_tmr_deadline(struct tcp_pcb *pcb, u32_t *due)
+{
+  u32_t t;
+  u8_t found = 0;
+
+#define TCP_TMR_DUE(ticks) do {                             \
+    t = pcb->tmr + (ticks) + 1;                             \
+    if (!found || (s32_t)(t - *due) < 0) {                  \
+      *due = t;                                             \
+      found = 1;                                            \
+    }                                                       \
+  } while (0)
+
+  if (pcb->state == TIME_WAIT || pcb->state == LAST_ACK) {
+    TCP_TMR_DUE(2 * TCP_MSL / TCP_SLOW_INTERVAL);
+  }
+  if (pcb->state == FIN_WAIT_2 && (pcb->flags & TF_RXCLOSED)) {
+    TCP_TMR_DUE(TCP_FIN_WAIT_TIMEOUT / TCP_SLOW_INTERVAL);
+  }
+  if (pcb->state == SYN_RCVD) {
+    TCP_TMR_DUE(TCP_SYN_RCVD_TIMEOUT / TCP_SLOW_INTERVAL);
+  }
+  /* the next probe is always due no later than the abort */
+  if (ip_get_option(pcb, SOF_KEEPALIVE) &&
+      ((pcb->state == ESTABLISHED) || (pcb->state == CLOSE_WAIT))) {
+    TCP_TMR_DUE((pcb->keep_idle + pcb->keep_cnt_sent * TCP_KEEP_INTVL(pcb))
+                / TCP_SLOW_INTERVAL);
+  }
+#undef TCP_TMR_DUE
+
+  return found;
+}
+
+/**
+ * Put a PCB back on the per-tick list if it still has timer work, park it
+ * on the wheel if it is only waiting for a timeout, or leave it off the
+ * timer lists altogether.
+ */
+static void
+tcp_tmr_reschedule(struct tcp_pcb *pcb)
+{
+  u32_t due;
+
+  tcp_timer_unlink(pcb);
+  if (pcb->state != TIME_WAIT && tcp_tmr_needs_tick(pcb)) {
+    pcb->tmr_hot = 1;
+    tcp_tmr_link(&tcp_tmr_hot, pcb);
+  } else if (tcp_tmr_deadline(pcb, &due)) {
+    if ((s32_t)(due - tcp_ticks) <= 0) {
+      due = tcp_ticks + 1;
+    }
+    if (tcp_tmr_parked++ == 0 || (s32_t)(due - tcp_tmr_next_due) < 0) {
+      tcp_tmr_next_due = due;
+    }
+    pcb->tmr_hot = 0;
+    pcb->tmr_due = due;
+    tcp_tmr_link(&tcp_tmr_wheel[due & (TCP_TIMER_WHEEL_SIZE - 1)], pcb);
+  } else {
+    pcb->tmr_hot = 0;
+  }
+}
+
+/**
+ * How long can the TCP timers be left idle?
+ *
+ * @return 0 if a PCB needs every tick, TCP_TIMER_IDLE_FOREVER if no PCB
+ *         needs the timers at all, or else the number of slow ticks until
+ *         the next deadline (at most TCP_TIMER_WHEEL_SIZE)
+ */
+u32_t
+tcp_timer_idle_ticks(void)
+{
+  struct tcp_pcb *pcb;
+  u32_t t;
+
+  if (tcp_tmr_hot != NULL) {
+    return 0;
+  }
+  if (tcp_tmr_parked == 0) {
+    return TCP_TIMER_IDLE_FOREVER;
+  }
+  if ((s32_t)(tcp_tmr_next_due - tcp_ticks) <= 0) {
+    /* the earliest deadline has passed or its PCB has left the wheel:
+       look for the next one, one round ahead at most */
+    tcp_tmr_next_due = tcp_ticks + TCP_TIMER_WHEEL_SIZE;
+    for (t = tcp_ticks + 1; t != tcp_ticks + TCP_TIMER_WHEEL_SIZE; t++) {
+      for (pcb = tcp_tmr_wheel[t & (TCP_TIMER_WHEEL_SIZE - 1)];
+           pcb != NULL; pcb = pcb->tmr_next) {
+        if ((s32_t)(pcb->tmr_due - t) <= 0) {
+          tcp_tmr_next_due = t;
+          return t - tcp_ticks;
+        }
+      }
+    }
+  }
+  return tcp_tmr_next_due - tcp_ticks;
+}
+
+/**
+ * Account for slow ticks during which the timers were not run. 'ticks'
+ * must be less than tcp_timer_idle_ticks(), so that no deadline is missed.
+ */
+void
+tcp_timer_skip(u32_t ticks)
+{
+  LWIP_ASSERT("tcp_timer_skip: deadline missed",
+              ticks < tcp_timer_idle_ticks());
+  tcp_ticks += ticks;
+}
+
+/**
+ * Called every 500 ms and implements the retransmission timer and the timer that
+ * removes PCBs that have been in TIME-WAIT for enough time. Only PCBs on the
+ * per-tick list and those whose wheel deadline has arrived are visited.
+ *
+ * Automatically called from tcp_tmr().
+ */
+void
+tcp_slowtmr(void)
+{
+  struct tcp_pcb *pcb, *next, *todo;
+  u8_t pcb_reset;
+  err_t err;
+
+  err = ERR_OK;
+
+  ++tcp_ticks;
+  ++tcp_timer_ctr;
+
+  /* Move PCBs whose deadline is this tick from the wheel to the per-tick
+     list. Others in the same slot are due in a later round. */
+  for (pcb = tcp_tmr_wheel[tcp_ticks & (TCP_TIMER_WHEEL_SIZE - 1)];
+       pcb != NULL; pcb = next) {
+    next = pcb->tmr_next;
+    if ((s32_t)(pcb->tmr_due - tcp_ticks) <= 0) {
+      tcp_timer_kick(pcb);
+    }
+  }
+
+  /* Callbacks may close or kick any PCB; both unlink it from 'todo'. */
+  tcp_tmr_take_hot(&todo);
+  while ((pcb = todo) != NULL) {
+    tcp_timer_unlink(pcb);
+
+    if (pcb->state == TIME_WAIT) {
+      /* Check if this PCB has stayed long enough in TIME-WAIT */
+      if ((u32_t)(tcp_ticks - pcb->tmr) > 2 * TCP_MSL / TCP_SLOW_INTERVAL) {
+        tcp_pcb_purge(pcb);
+        TCP_RMV(&tcp_tw_pcbs, pcb);
+        memp_free(MEMP_TCP_PCB, pcb);
+      } else {
+        tcp_tmr_reschedule(pcb);
+      }
+      continue;
+    }
+
+    LWIP_ASSERT("tcp_slowtmr: active pcb->state != CLOSED\n", pcb->state != CLOSED);
+    LWIP_ASSERT("tcp_slowtmr: active pcb->state != LISTEN\n", pcb->state != LISTEN);
+
+    if (tcp_slowtmr_pcb(pcb, &pcb_reset)) {
+      tcp_err_fn err_fn;
+      void *err_arg;
+      tcp_pcb_purge(pcb);
+      TCP_RMV_ACTIVE(pcb);
+
+      if (pcb_reset) {
+        tcp_rst(pcb->snd_nxt, pcb->rcv_nxt, &pcb->local_ip, &pcb->remote_ip,
+                 pcb->local_port, pcb->remote_port, PCB_ISIPV6(pcb));
+      }
+
+      err_fn = pcb->errf;
+      err_arg = pcb->callback_arg;
+      memp_free(MEMP_TCP_PCB, pcb);
+      TCP_EVENT_ERR(err_fn, err_arg, ERR_ABRT);
+      continue;
+    }
+
+    /* We check if we should poll the connection. */
+    ++pcb->polltmr;
+    if (pcb->polltmr >= pcb->pollinterval) {
+      pcb->polltmr = 0;
+      LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: polling application\n"));
+      TCP_EVENT_POLL(pcb, err);
+      /* if err == ERR_ABRT, 'pcb' is already deallocated */
+      if (err == ERR_ABRT) {
+        continue;
+      }
+      if (err == ERR_OK) {
+        tcp_output(pcb);
+      }
+    }
+    tcp_tmr_reschedule(pcb);
+  }
+}
+
+/**
+ * Is called every TCP_FAST_INTERVAL (250 ms) and process data previously
+ * "refused" by upper layer (application) and sends delayed ACKs. Only PCBs
+ * on the per-tick list can have either.
+ *
+ * Automatically called from tcp_tmr().
+ */
+void
+tcp_fasttmr(void)
+{
+  struct tcp_pcb *pcb, *todo;
+
+  ++tcp_timer_ctr;
+
+  tcp_tmr_take_hot(&todo);
+  while ((pcb = todo) != NULL) {
+    /* back onto the per-tick list before anything can free it */
+    tcp_timer_unlink(pcb);
+    tcp_tmr_link(&tcp_tmr_hot, pcb);
+    if (pcb->state == TIME_WAIT) {
+      continue;
+    }
+
+    /* send delayed ACKs */
+    if (pcb->flags & TF_ACK_DELAY) {
+      LWIP_DEBUGF(TCP_DEBUG, ("tcp_fasttmr: delayed ACK\n"));
+      tcp_ack_now(pcb);
+      tcp_output(pcb);
+      pcb->flags &= ~(TF_ACK_DELAY | TF_ACK_NOW);
+    }
+
+    /* If there is data which was previously "refused" by upper layer */
+    if (pcb->refused_data != NULL) {
+      tcp_process_refused_data(pcb);
+    }
+  }
+}
+
+#else /* LWIP_TCP_TIMER_WHEEL */
+
 /**
  * Called every 500 ms and implements the retransmission timer and the timer that
  * removes PCBs that have been in TIME-WAIT for enough time. It also increments
@@ -835,7 +1547,6 @@ void
 tcp_slowtmr(void)
 {
   struct tcp_pcb *pcb, *prev;
-  tcpwnd_size_t eff_wnd;
   u8_t pcb_remove;      /* flag if a PCB should be removed */
   u8_t pcb_reset;       /* flag if a RST should be sent when removing */
   err_t err;
@@ -864,131 +1575,7 @@ tcp_slowtmr_start:
     }
     pcb->last_timer = tcp_timer_ctr;
 
-    pcb_remove = 0;
-    pcb_reset = 0;
-
-    if (pcb->state == SYN_SENT && pcb->nrtx == TCP_SYNMAXRTX) {
-      ++pcb_remove;
-      LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: max SYN retries reached\n"));
-    }
-    else if (pcb->nrtx == TCP_MAXRTX) {
-      ++pcb_remove;
-      LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: max DATA retries reached\n"));
-    } else {
-      if (pcb->persist_backoff > 0) {
-        /* If snd_wnd is zero, use persist timer to send 1 byte probes
-         * instead of using the standard retransmission mechanism. */
-        pcb->persist_cnt++;
-        if (pcb->persist_cnt >= tcp_persist_backoff[pcb->persist_backoff-1]) {
-          pcb->persist_cnt = 0;
-          if (pcb->persist_backoff < sizeof(tcp_persist_backoff)) {
-            pcb->persist_backoff++;
-          }
-          tcp_zero_window_probe(pcb);
-        }
-      } else {
-        /* Increase the retransmission timer if it is running */
-        if(pcb->rtime >= 0) {
-          ++pcb->rtime;
-        }
-
-        if (pcb->unacked != NULL && pcb->rtime >= pcb->rto) {
-          /* Time for a retransmission. */
-          LWIP_DEBUGF(TCP_RTO_DEBUG, ("tcp_slowtmr: rtime %"S16_F
-                                      " pcb->rto %"S16_F"\n",
-                                      pcb->rtime, pcb->rto));
-
-          /* Double retransmission time-out unless we are trying to
-           * connect to somebody (i.e., we are in SYN_SENT). */
-          if (pcb->state != SYN_SENT) {
-            pcb->rto = ((pcb->sa >> 3) + pcb->sv) << tcp_backoff[pcb->nrtx];
-          }
-
-          /* Reset the retransmission timer. */
-          pcb->rtime = 0;
-
-          /* Reduce congestion window and ssthresh. */
-          eff_wnd = LWIP_MIN(pcb->cwnd, pcb->snd_wnd);
-          pcb->ssthresh = eff_wnd >> 1;
-          if (pcb->ssthresh < (tcpwnd_size_t)(pcb->mss << 1)) {
-            pcb->ssthresh = (pcb->mss << 1);
-          }
-          pcb->cwnd = pcb->mss;
-          LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_slowtmr: cwnd %"TCPWNDSIZE_F
-                                       " ssthresh %"TCPWNDSIZE_F"\n",
-                                       pcb->cwnd, pcb->ssthresh));
-
-          /* The following needs to be called AFTER cwnd is set to one
-             mss - STJ */
-          tcp_rexmit_rto(pcb);
-        }
-      }
-    }
-    /* Check if this PCB has stayed too long in FIN-WAIT-2 */
-    if (pcb->state == FIN_WAIT_2) {
-      /* If this PCB is in FIN_WAIT_2 because of SHUT_WR don't let it time out. */
-      if (pcb->flags & TF_RXCLOSED) {
-        /* PCB was fully closed (either through close() or SHUT_RDWR):
-           normal FIN-WAIT timeout handling. */
-        if ((u32_t)(tcp_ticks - pcb->tmr) >
-            TCP_FIN_WAIT_TIMEOUT / TCP_SLOW_INTERVAL) {
-          ++pcb_remove;
-          LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: removing pcb stuck in FIN-WAIT-2\n"));
-        }
-      }
-    }
-
-    /* Check if KEEPALIVE should be sent */
-    if(ip_get_option(pcb, SOF_KEEPALIVE) &&
-       ((pcb->state == ESTABLISHED) ||
-        (pcb->state == CLOSE_WAIT))) {
-      if((u32_t)(tcp_ticks - pcb->tmr) >
-         (pcb->keep_idle + TCP_KEEP_DUR(pcb)) / TCP_SLOW_INTERVAL)
-      {
-        LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: KEEPALIVE timeout. Aborting connection to "));
-        ipX_addr_debug_print(PCB_ISIPV6(pcb), TCP_DEBUG, &pcb->remote_ip);
-        LWIP_DEBUGF(TCP_DEBUG, ("\n"));
-        
-        ++pcb_remove;
-        ++pcb_reset;
-      }
-      else if((u32_t)(tcp_ticks - pcb->tmr) > 
-              (pcb->keep_idle + pcb->keep_cnt_sent * TCP_KEEP_INTVL(pcb))
-              / TCP_SLOW_INTERVAL)
-      {
-        tcp_keepalive(pcb);
-        pcb->keep_cnt_sent++;
-      }
-    }
-
-    /* If this PCB has queued out of sequence data, but has been
-       inactive for too long, will drop the data (it will eventually
-       be retransmitted). */
-#if TCP_QUEUE_OOSEQ
-    if (pcb->ooseq != NULL &&
-        (u32_t)tcp_ticks - pcb->tmr >= pcb->rto * TCP_OOSEQ_TIMEOUT) {
-      tcp_segs_free(pcb->ooseq);
-      pcb->ooseq = NULL;
-      LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_slowtmr: dropping OOSEQ queued data\n"));
-    }
-#endif /* TCP_QUEUE_OOSEQ */
-
-    /* Check if this PCB has stayed too long in SYN-RCVD */
-    if (pcb->state == SYN_RCVD) {
-      if ((u32_t)(tcp_ticks - pcb->tmr) >
-          TCP_SYN_RCVD_TIMEOUT / TCP_SLOW_INTERVAL) {
-        ++pcb_remove;
-        LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: removing pcb stuck in SYN-RCVD\n"));
-      }
-    }
-
-    /* Check if this PCB has stayed too long in LAST-ACK */
-    if (pcb->state == LAST_ACK) {
-      if ((u32_t)(tcp_ticks - pcb->tmr) > 2 * TCP_MSL / TCP_SLOW_INTERVAL) {
-        ++pcb_remove;
-        LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: removing pcb stuck in LAST-ACK\n"));
-      }
-    }
+    pcb_remove = tcp_slowtmr_pcb(pcb, &pcb_reset);
 
     /* If the PCB should be removed, do it. */
     if (pcb_remove) {
@@ -997,6 +1584,11 @@ tcp_slowtmr_start:
       void *err_arg;
       tcp_pcb_purge(pcb);
       /* Remove PCB from tcp_active_pcbs list. */
+#if LWIP_TCP_PCB_HASH
+      tcp_pcb_hash_del(pcb);
+#endif /* LWIP_TCP_PCB_HASH */
+      TCP_PACE_DEL(pcb);
+      TCP_RTO_DEL(pcb);
       if (prev != NULL) {
         LWIP_ASSERT("tcp_slowtmr: middle tcp != tcp_active_pcbs", pcb != tcp_active_pcbs);
         prev->next = pcb->next;
@@ -1065,6 +1657,10 @@ tcp_slowtmr_start:
       struct tcp_pcb *pcb2;
       tcp_pcb_purge(pcb);
       /* Remove PCB from tcp_tw_pcbs list. */
+#if LWIP_TCP_PCB_HASH
+      tcp_pcb_hash_del(pcb);
+#endif /* LWIP_TCP_PCB_HASH */
+      TCP_RTO_DEL(pcb);
       if (prev != NULL) {
         LWIP_ASSERT("tcp_slowtmr: middle tcp != tcp_tw_pcbs", pcb != tcp_tw_pcbs);
         prev->next = pcb->next;
@@ -1128,6 +1724,7 @@ tcp_fasttmr_start:
     }
   }
 }
+#endif /* LWIP_TCP_TIMER_WHEEL */
 
 /** Pass pcb->refused_data to the recv callback */
 err_t
@@ -1161,7 +1758,7 @@ tcp_process_refused_data(struct tcp_pcb *pcb)
          ) {
         /* correct rcv_wnd as the application won't call tcp_recved()
            for the FIN's seqno */
-        if (pcb->rcv_wnd != TCP_WND) {
+        if (pcb->rcv_wnd != TCP_WND_MAX(pcb)) {
           pcb->rcv_wnd++;
         }
         TCP_EVENT_CLOSED(pcb, err);
@@ -1378,8 +1975,10 @@ tcp_alloc(u8_t prio)
     pcb->prio = prio;
     pcb->snd_buf = TCP_SND_BUF;
     pcb->snd_queuelen = 0;
-    pcb->rcv_wnd = TCP_WND;
-    pcb->rcv_ann_wnd = TCP_WND;
+    /* Start with a window that does not need scaling; it is enlarged
+       once both sides agree on window scaling. */
+    pcb->rcv_wnd = TCPWND16(TCP_WND);
+    pcb->rcv_ann_wnd = TCPWND16(TCP_WND);
 #if LWIP_WND_SCALE
     /* snd_scale and rcv_scale are zero unless both sides agree to use scaling */
     pcb->snd_scale = 0;
@@ -1390,11 +1989,14 @@ tcp_alloc(u8_t prio)
     /* As initial send MSS, we use TCP_MSS but limit it to 536.
        The send MSS is updated when an MSS option is received. */
     pcb->mss = (TCP_MSS > 536) ? 536 : TCP_MSS;
-    pcb->rto = 3000 / TCP_SLOW_INTERVAL;
+    pcb->rto = TCP_RTO_INITIAL;
     pcb->sa = 0;
-    pcb->sv = 3000 / TCP_SLOW_INTERVAL;
+    pcb->sv = TCP_RTO_INITIAL;
     pcb->rtime = -1;
     pcb->cwnd = 1;
+#if LWIP_TCP_CC
+    pcb->cc = tcp_cc_default;
+#endif /* LWIP_TCP_CC */
     iss = tcp_next_iss();
     pcb->snd_wl2 = iss;
     pcb->snd_nxt = iss;
@@ -1551,6 +2153,7 @@ tcp_poll(struct tcp_pcb *pcb, tcp_poll_fn poll, u8_t interval)
   LWIP_UNUSED_ARG(poll);
 #endif /* LWIP_CALLBACK_API */  
   pcb->pollinterval = interval;
+  TCP_TIMER_KICK(pcb);
 }
 
 /**
@@ -1616,12 +2219,119 @@ tcp_pcb_purge(struct tcp_pcb *pcb)
     tcp_segs_free(pcb->unsent);
     tcp_segs_free(pcb->unacked);
     pcb->unacked = pcb->unsent = NULL;
+#if LWIP_TCP_RACK
+    pcb->rack_xmit = NULL;
+#endif /* LWIP_TCP_RACK */
 #if TCP_OVERSIZE
     pcb->unsent_oversize = 0;
 #endif /* TCP_OVERSIZE */
   }
 }
 
+#if LWIP_TCP_PCB_HASH
+/** Active and TIME-WAIT PCBs, chained through hash_next */
+static struct tcp_pcb *tcp_pcb_hash[TCP_PCB_HASH_SIZE];
+/** The PCB returned by the last successful lookup */
+static struct tcp_pcb *tcp_pcb_hash_last;
+
+static u32_t
+tcp_pcb_hashfn(ipX_addr_t *local_ip, u16_t local_port,
+               ipX_addr_t *remote_ip, u16_t remote_port)
+{
+  /* for IPv6, this only hashes the first 32 bits of each address */
+  u32_t h = ipX_2_ip(local_ip)->addr ^ ipX_2_ip(remote_ip)->addr ^
+            (((u32_t)remote_port << 16) | local_port);
+
+  h ^= h >> 16;
+  h *= 0x45d9f3bU;
+  h ^= h >> 16;
+  return h & (TCP_PCB_HASH_SIZE - 1);
+}
+
+/**
+ * Add a PCB to the 4-tuple hash table. Called from TCP_REG when a PCB
+ * enters tcp_active_pcbs or tcp_tw_pcbs.
+ *
+ * @param pcb tcp_pcb with its addresses and ports already set
+ */
+void
+tcp_pcb_hash_add(struct tcp_pcb *pcb)
+{
+  struct tcp_pcb **bucket = &tcp_pcb_hash[tcp_pcb_hashfn(&pcb->local_ip,
+    pcb->local_port, &pcb->remote_ip, pcb->remote_port)];
+
+  pcb->hash_next = *bucket;
+  *bucket = pcb;
+}
+
+/**
+ * Remove a PCB from the 4-tuple hash table. Called from TCP_RMV and from
+ * anywhere else that unlinks a PCB from tcp_active_pcbs or tcp_tw_pcbs.
+ *
+ * @param pcb tcp_pcb to remove
+ */
+void
+tcp_pcb_hash_del(struct tcp_pcb *pcb)
+{
+  struct tcp_pcb **pp = &tcp_pcb_hash[tcp_pcb_hashfn(&pcb->local_ip,
+    pcb->local_port, &pcb->remote_ip, pcb->remote_port)];
+
+  if (tcp_pcb_hash_last == pcb) {
+    tcp_pcb_hash_last = NULL;
+  }
+  for (; *pp != NULL; pp = &(*pp)->hash_next) {
+    if (*pp == pcb) {
+      *pp = pcb->hash_next;
+      break;
+    }
+  }
+  pcb->hash_next = NULL;
+}
+
+/**
+ * Find the active or TIME-WAIT PCB for an incoming segment. Must be called
+ * from tcp_input(), since the IP version of the current packet is used.
+ *
+ * @return matching tcp_pcb, or NULL if there is none
+ */
+struct tcp_pcb *
+tcp_pcb_hash_lookup(ipX_addr_t *local_ip, u16_t local_port,
+                    ipX_addr_t *remote_ip, u16_t remote_port)
+{
+  struct tcp_pcb **bucket, **pp, *pcb;
+
+#define TCP_PCB_HASH_MATCH(pcb) \
+  ((pcb)->remote_port == remote_port && \
+   (pcb)->local_port == local_port && \
+   IP_PCB_IPVER_INPUT_MATCH(pcb) && \
+   ipX_addr_cmp(ip_current_is_v6(), &(pcb)->remote_ip, remote_ip) && \
+   ipX_addr_cmp(ip_current_is_v6(), &(pcb)->local_ip, local_ip))
+
+  /* segments tend to arrive in trains for the same connection */
+  pcb = tcp_pcb_hash_last;
+  if (pcb != NULL && TCP_PCB_HASH_MATCH(pcb)) {
+    return pcb;
+  }
+
+  bucket = &tcp_pcb_hash[tcp_pcb_hashfn(local_ip, local_port,
+                                        remote_ip, remote_port)];
+  for (pp = bucket; (pcb = *pp) != NULL; pp = &pcb->hash_next) {
+    if (TCP_PCB_HASH_MATCH(pcb)) {
+      /* move to the front of the bucket */
+      if (pp != bucket) {
+        *pp = pcb->hash_next;
+        pcb->hash_next = *bucket;
+        *bucket = pcb;
+      }
+      tcp_pcb_hash_last = pcb;
+      return pcb;
+    }
+  }
+  return NULL;
+#undef TCP_PCB_HASH_MATCH
+}
+#endif /* LWIP_TCP_PCB_HASH */
+
 /**
  * Purges the PCB and removes it from a PCB list. Any delayed ACKs are sent first.
  *
@@ -1631,8 +2341,6 @@ tcp_pcb_purge(struct tcp_pcb *pcb)
 void
 tcp_pcb_remove(struct tcp_pcb **pcblist, struct tcp_pcb *pcb)
 {
-  TCP_RMV(pcblist, pcb);
-
   tcp_pcb_purge(pcb);
   
   /* if there is an outstanding delayed ACKs, send it */
@@ -1643,6 +2351,9 @@ tcp_pcb_remove(struct tcp_pcb **pcblist, struct tcp_pcb *pcb)
     tcp_output(pcb);
   }
 
+  /* only now, as tcp_output() puts the PCB back on the timer lists */
+  TCP_RMV(pcblist, pcb);
+
   if (pcb->state != LISTEN) {
     LWIP_ASSERT("unsent segments leaking", pcb->unsent == NULL);
     LWIP_ASSERT("unacked segments leaking", pcb->unacked == NULL);
@@ -0,0 +1,640 @@
+/**
+ * @file
+ * TCP congestion control modules and pacing
+ *
+ * Each tcp_pcb points to a struct tcp_cc_ops which decides how cwnd and
+ * ssthresh evolve outside of fast recovery. Reno reproduces the classic
+ * lwIP behaviour, CUBIC follows RFC 8312 and the "bbr" module is a
+ * simplified BBR: it models the path from its bottleneck bandwidth and
+ * minimum RTT, keeps about two BDPs in flight and paces at a multiple of
+ * the measured bandwidth, so random loss doesn't shrink the window.
+ *
+ */
+
+/*
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ *
+ * This file is part of the lwIP TCP/IP stack.
+ *
+ */
+
+#include "lwip/opt.h"
+
+#if LWIP_TCP && LWIP_TCP_CC /* don't build if not configured for use in lwipopts.h */
+
+#include "lwip/def.h"
+#include "lwip/sys.h"
+#include "lwip/tcp.h"
+#include "lwip/tcp_impl.h"
+#include "lwip/debug.h"
+
+#include <string.h>
+
+/* CUBIC and the bandwidth estimate need more than 32 bits of precision */
+typedef unsigned long long cc_u64_t;
+
+const struct tcp_cc_ops *tcp_cc_default = &TCP_CC_DEFAULT;
+
+/* PCBs waiting for pacing credit, and the earliest pace_due among them */
+static struct tcp_pcb *tcp_pace_list;
+static u32_t tcp_pace_next;
+
+#define CC_PRIV(pcb, type) ((struct type *)(void *)(pcb)->cc_priv)
+/* fail to compile if a module's state doesn't fit into cc_priv */
+#define CC_PRIV_CHECK(type) \
+  typedef char type##_fits[(sizeof(struct type) <= \
+    sizeof(((struct tcp_pcb *)0)->cc_priv)) ? 1 : -1]
+
+static tcpwnd_size_t
+cc_wnd(cc_u64_t wnd)
+{
+  return (tcpwnd_size_t)(wnd > TCPWND_MAX ? TCPWND_MAX : wnd);
+}
+
+/*
+ * One sample per round trip: a round starts with snd_nxt as it is now and
+ * ends once the first byte sent after that has been acknowledged. The time
+ * that took is an RTT sample (inflated if the sender was idle), and the
+ * data acknowledged meanwhile gives the delivery rate. Rounds last at least
+ * CC_ROUND_MIN ms, so that sys_now()'s resolution doesn't skew the rate on
+ * short paths.
+ */
+struct cc_round {
+  u32_t seq;      /* round ends when this is acked */
+  u32_t stamp;    /* sys_now() at the start of the round */
+  u32_t lastack;  /* pcb->lastack at the start of the round */
+  u32_t min_rtt;  /* ms, 0 if unknown */
+  u32_t min_stamp;
+};
+
+#define CC_ROUND_MIN   10
+/* Minimum RTT estimates older than this are replaced by the next sample */
+#define CC_MIN_RTT_WIN 10000
+
+static void
+cc_round_start(struct tcp_pcb *pcb, struct cc_round *r, u32_t now)
+{
+  r->seq = pcb->snd_nxt;
+  r->stamp = now;
+  r->lastack = pcb->lastack;
+}
+
+/* Returns the length of the round in ms if one ended, 0 otherwise */
+static u32_t
+cc_round_end(struct tcp_pcb *pcb, struct cc_round *r, u32_t now)
+{
+  u32_t rtt;
+
+  rtt = now - r->stamp;
+  if (!TCP_SEQ_GT(pcb->lastack, r->seq) || rtt < CC_ROUND_MIN) {
+    return 0;
+  }
+  if (r->min_rtt == 0 || rtt <= r->min_rtt ||
+      (u32_t)(now - r->min_stamp) > CC_MIN_RTT_WIN) {
+    r->min_rtt = rtt;
+    r->min_stamp = now;
+  }
+  return rtt;
+}
+
+/*
+ * Reno (RFC 5681), as lwIP always did it
+ */
+
+static void
+reno_init(struct tcp_pcb *pcb)
+{
+  LWIP_UNUSED_ARG(pcb);
+}
+
+static void
+reno_on_ack(struct tcp_pcb *pcb, tcpwnd_size_t acked)
+{
+  LWIP_UNUSED_ARG(acked);
+  if (pcb->cwnd < pcb->ssthresh) {
+    if ((tcpwnd_size_t)(pcb->cwnd + pcb->mss) > pcb->cwnd) {
+      pcb->cwnd += pcb->mss;
+    }
+  } else {
+    tcpwnd_size_t new_cwnd = (pcb->cwnd + pcb->mss * pcb->mss / pcb->cwnd);
+    if (new_cwnd > pcb->cwnd) {
+      pcb->cwnd = new_cwnd;
+    }
+  }
+}
+
+static void
+reno_on_loss(struct tcp_pcb *pcb)
+{
+  /* Set ssthresh to half of the minimum of the current
+   * cwnd and the advertised window, but at least 2 MSS */
+  pcb->ssthresh = LWIP_MIN(pcb->cwnd, pcb->snd_wnd) / 2;
+  if (pcb->ssthresh < (tcpwnd_size_t)(2U * pcb->mss)) {
+    pcb->ssthresh = 2U * pcb->mss;
+  }
+}
+
+static void
+reno_on_rto(struct tcp_pcb *pcb)
+{
+  reno_on_loss(pcb);
+  pcb->cwnd = pcb->mss;
+}
+
+const struct tcp_cc_ops tcp_cc_reno = {
+  "reno", reno_init, reno_on_ack, reno_on_loss, reno_on_rto, NULL
+};
+
+/*
+ * CUBIC (RFC 8312): after a reduction, the window follows a cubic function
+ * of the time since the loss that plateaus around the window where the
+ * loss happened, independently of the RTT. Windows are in bytes, times
+ * in ms.
+ */
+
+/* beta_cubic = 7/10; C = 0.4 segments/s^3 = 2/5 */
+#define CUBIC_BETA_NUM 7
+#define CUBIC_BETA_DEN 10
+/* C in segments/ms^3, inverted: 1 / (0.4e-9) */
+#define CUBIC_INV_C    2500000000ULL
+/* (t - K)^3 is only computed up to this many ms */
+#define CUBIC_T_MAX    100000
+
+struct cubic {
+  struct cc_round r;
+  u32_t w_max;       /* window before the last reduction */
+  u32_t w_last_max;  /* w_max before that, for fast convergence */
+  u32_t epoch;       /* sys_now() when the current epoch began */
+  u32_t k;           /* ms from epoch until the window reaches origin */
+  u32_t origin;      /* plateau of the cubic function */
+  u32_t w_est;       /* window Reno would have (TCP-friendly region) */
+  u32_t cnt;         /* fractional bytes of cwnd increase */
+  u32_t est_cnt;     /* fractional bytes of w_est increase */
+  u8_t in_epoch;
+};
+CC_PRIV_CHECK(cubic);
+
+static u32_t
+cubic_root(cc_u64_t a)
+{
+  u32_t lo = 0, hi = 1U << 21, mid;
+
+  while (lo < hi) {
+    mid = (lo + hi + 1) / 2;
+    if ((cc_u64_t)mid * mid * mid <= a) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return lo;
+}
+
+static void
+cubic_init(struct tcp_pcb *pcb)
+{
+  struct cubic *c = CC_PRIV(pcb, cubic);
+
+  memset(c, 0, sizeof(*c));
+  cc_round_start(pcb, &c->r, sys_now());
+}
+
+static void
+cubic_on_ack(struct tcp_pcb *pcb, tcpwnd_size_t acked)
+{
+  struct cubic *c = CC_PRIV(pcb, cubic);
+  u32_t now = sys_now(), t, target;
+  cc_u64_t offs, inc;
+
+  if (cc_round_end(pcb, &c->r, now)) {
+    cc_round_start(pcb, &c->r, now);
+  }
+
+  if (pcb->cwnd < pcb->ssthresh) {
+    /* slow start with appropriate byte counting (RFC 3465, L = 2) */
+    pcb->cwnd = cc_wnd((cc_u64_t)pcb->cwnd + LWIP_MIN(acked, 2U * pcb->mss));
+    return;
+  }
+
+  if (!c->in_epoch) {
+    c->in_epoch = 1;
+    c->epoch = now;
+    c->cnt = c->est_cnt = 0;
+    c->w_est = pcb->cwnd;
+    if (pcb->cwnd < c->w_max) {
+      /* K = cbrt((W_max - cwnd) / C), in segments and ms */
+      c->k = cubic_root((cc_u64_t)(c->w_max - pcb->cwnd) * CUBIC_INV_C / pcb->mss);
+      c->origin = c->w_max;
+    } else {
+      c->k = 0;
+      c->origin = pcb->cwnd;
+    }
+  }
+
+  /* W_cubic(t + RTT) */
+  t = now - c->epoch + c->r.min_rtt;
+  if (t < c->k) {
+    t = LWIP_MIN(c->k - t, CUBIC_T_MAX);
+    offs = (cc_u64_t)t * t * t * pcb->mss / CUBIC_INV_C;
+    target = offs < c->origin ? (u32_t)(c->origin - offs) : 0;
+  } else {
+    t = LWIP_MIN(t - c->k, CUBIC_T_MAX);
+    offs = (cc_u64_t)t * t * t * pcb->mss / CUBIC_INV_C;
+    target = cc_wnd(c->origin + offs);
+  }
+  /* don't grow by more than half the window per RTT */
+  target = LWIP_MIN(target, pcb->cwnd + pcb->cwnd / 2);
+
+  /* Reno would grow by 3 * (1 - beta) / (1 + beta) ~= 9/17 MSS per RTT */
+  inc = (cc_u64_t)9 * pcb->mss * acked + c->est_cnt;
+  c->w_est = cc_wnd(c->w_est + inc / (17 * (cc_u64_t)pcb->cwnd));
+  c->est_cnt = (u32_t)(inc % (17 * (cc_u64_t)pcb->cwnd));
+  target = LWIP_MAX(target, c->w_est);
+
+  if (target > pcb->cwnd) {
+    /* cwnd += (target - cwnd) / cwnd per byte acknowledged */
+    inc = (cc_u64_t)(target - pcb->cwnd) * acked + c->cnt;
+    pcb->cwnd = cc_wnd(pcb->cwnd + inc / pcb->cwnd);
+    c->cnt = (u32_t)(inc % pcb->cwnd);
+  }
+}
+
+static void
+cubic_on_loss(struct tcp_pcb *pcb)
+{
+  struct cubic *c = CC_PRIV(pcb, cubic);
+  u32_t wnd = LWIP_MIN(pcb->cwnd, pcb->snd_wnd);
+
+  /* fast convergence: release bandwidth if the plateau keeps shrinking */
+  if (wnd < c->w_last_max) {
+    c->w_last_max = wnd;
+    c->w_max = (u32_t)((cc_u64_t)wnd * (CUBIC_BETA_DEN + CUBIC_BETA_NUM) /
+                       (2 * CUBIC_BETA_DEN));
+  } else {
+    c->w_last_max = c->w_max = wnd;
+  }
+  c->in_epoch = 0;
+  pcb->ssthresh = (tcpwnd_size_t)((cc_u64_t)wnd * CUBIC_BETA_NUM / CUBIC_BETA_DEN);
+  if (pcb->ssthresh < (tcpwnd_size_t)(2U * pcb->mss)) {
+    pcb->ssthresh = 2U * pcb->mss;
+  }
+}
+
+static void
+cubic_on_rto(struct tcp_pcb *pcb)
+{
+  cubic_on_loss(pcb);
+  pcb->cwnd = pcb->mss;
+}
+
+const struct tcp_cc_ops tcp_cc_cubic = {
+  "cubic", cubic_init, cubic_on_ack, cubic_on_loss, cubic_on_rto, NULL
+};
+
+/*
+ * BBR-like: estimate the bottleneck bandwidth (max delivery rate over the
+ * last 5-10 rounds) and the minimum RTT, pace at gain * bandwidth and cap
+ * the data in flight at two bandwidth-delay products. STARTUP doubles the
+ * rate every round until the bandwidth stops growing, DRAIN empties the
+ * queue this built, PROBE_BW cycles the pacing gain to probe for more
+ * bandwidth and PROBE_RTT briefly shrinks the window when the minimum RTT
+ * hasn't been confirmed for CC_MIN_RTT_WIN ms. Loss is not a signal.
+ */
+
+enum bbr_mode {
+  BBR_STARTUP,
+  BBR_DRAIN,
+  BBR_PROBE_BW,
+  BBR_PROBE_RTT
+};
+
+/* gains are in 1/1000 */
+#define BBR_HIGH_GAIN   2885  /* 2/ln(2) */
+#define BBR_DRAIN_GAIN  347   /* 1/BBR_HIGH_GAIN */
+#define BBR_CWND_GAIN   2000
+#define BBR_CYCLE_LEN   8
+static const u16_t bbr_cycle_gain[BBR_CYCLE_LEN] = {
+  1250, 750, 1000, 1000, 1000, 1000, 1000, 1000
+};
+/* rounds without 25% bandwidth growth before STARTUP ends */
+#define BBR_FULL_BW_ROUNDS 3
+/* rounds covered by each half of the bandwidth max filter */
+#define BBR_BW_ROUNDS   5
+#define BBR_PROBE_RTT_MS 200
+#define BBR_MIN_CWND(pcb) (4U * (pcb)->mss)
+
+struct bbr {
+  struct cc_round r;
+  u32_t bw[2];       /* max delivery rate, bytes/s, this and the last window */
+  u32_t rounds;
+  u32_t full_bw;
+  u32_t probe_rtt_done; /* sys_now() when PROBE_RTT may end */
+  u32_t prior_cwnd;  /* cwnd to restore after PROBE_RTT */
+  u8_t mode;
+  u8_t cycle;
+  u8_t full_bw_cnt;
+};
+CC_PRIV_CHECK(bbr);
+
+static u32_t
+bbr_max_bw(struct bbr *b)
+{
+  return LWIP_MAX(b->bw[0], b->bw[1]);
+}
+
+static u32_t
+bbr_gain(struct bbr *b)
+{
+  switch (b->mode) {
+  case BBR_STARTUP:
+    return BBR_HIGH_GAIN;
+  case BBR_DRAIN:
+    return BBR_DRAIN_GAIN;
+  case BBR_PROBE_BW:
+    return bbr_cycle_gain[b->cycle];
+  default:
+    return 1000;
+  }
+}
+
+/* bandwidth-delay product times gain, in bytes */
+static cc_u64_t
+bbr_bdp(struct bbr *b, u32_t gain)
+{
+  return (cc_u64_t)bbr_max_bw(b) * b->r.min_rtt * gain / 1000000;
+}
+
+static void
+bbr_init(struct tcp_pcb *pcb)
+{
+  struct bbr *b = CC_PRIV(pcb, bbr);
+
+  memset(b, 0, sizeof(*b));
+  b->mode = BBR_STARTUP;
+  cc_round_start(pcb, &b->r, sys_now());
+}
+
+/* A round of 'rtt' ms ended; 'expired' if it replaced a stale min_rtt */
+static void
+bbr_round(struct tcp_pcb *pcb, struct bbr *b, u32_t rtt, u8_t expired, u32_t now)
+{
+  u32_t bw, inflight;
+
+  bw = (u32_t)LWIP_MIN((cc_u64_t)(pcb->lastack - b->r.lastack) * 1000 / rtt,
+                       0xFFFFFFFFU);
+  b->bw[0] = LWIP_MAX(b->bw[0], bw);
+  if (++b->rounds % BBR_BW_ROUNDS == 0) {
+    b->bw[1] = b->bw[0];
+    b->bw[0] = 0;
+  }
+
+  inflight = pcb->snd_nxt - pcb->lastack;
+  switch (b->mode) {
+  case BBR_STARTUP:
+    /* only count rounds where the application kept the pipe full */
+    if (bbr_max_bw(b) >= (cc_u64_t)b->full_bw * 5 / 4) {
+      b->full_bw = bbr_max_bw(b);
+      b->full_bw_cnt = 0;
+    } else if (pcb->unsent != NULL && ++b->full_bw_cnt >= BBR_FULL_BW_ROUNDS) {
+      b->mode = BBR_DRAIN;
+    }
+    break;
+  case BBR_DRAIN:
+    if (inflight <= bbr_bdp(b, 1000)) {
+      b->mode = BBR_PROBE_BW;
+      b->cycle = 0;
+    }
+    break;
+  case BBR_PROBE_BW:
+    b->cycle = (b->cycle + 1) % BBR_CYCLE_LEN;
+    break;
+  case BBR_PROBE_RTT:
+    if ((s32_t)(now - b->probe_rtt_done) >= 0) {
+      b->r.min_stamp = now;
+      b->mode = BBR_PROBE_BW;
+      b->cycle = 0;
+      pcb->cwnd = LWIP_MAX(pcb->cwnd, b->prior_cwnd);
+    }
+    break;
+  }
+
+  if (b->mode == BBR_PROBE_BW && expired) {
+    b->mode = BBR_PROBE_RTT;
+    b->prior_cwnd = pcb->cwnd;
+    b->probe_rtt_done = now + LWIP_MAX(BBR_PROBE_RTT_MS, rtt);
+  }
+}
+
+static void
+bbr_on_ack(struct tcp_pcb *pcb, tcpwnd_size_t acked)
+{
+  struct bbr *b = CC_PRIV(pcb, bbr);
+  u32_t now = sys_now(), rtt;
+  u32_t min_rtt = b->r.min_rtt, min_stamp = b->r.min_stamp;
+  cc_u64_t target;
+
+  rtt = cc_round_end(pcb, &b->r, now);
+  if (rtt) {
+    bbr_round(pcb, b, rtt,
+              (u32_t)(now - min_stamp) > CC_MIN_RTT_WIN && rtt > min_rtt, now);
+    cc_round_start(pcb, &b->r, now);
+  }
+
+  if (b->mode == BBR_PROBE_RTT) {
+    pcb->cwnd = LWIP_MIN(pcb->cwnd, BBR_MIN_CWND(pcb));
+    return;
+  }
+  /* grow towards the target like slow start, but never beyond it once
+     the pipe has been filled */
+  target = LWIP_MAX(bbr_bdp(b, BBR_CWND_GAIN), BBR_MIN_CWND(pcb));
+  if (b->mode == BBR_STARTUP || bbr_max_bw(b) == 0 || pcb->cwnd < target) {
+    pcb->cwnd = cc_wnd((cc_u64_t)pcb->cwnd + acked);
+  }
+  if (b->mode != BBR_STARTUP && bbr_max_bw(b) != 0) {
+    pcb->cwnd = cc_wnd(LWIP_MIN(pcb->cwnd, target));
+  }
+  /* keep the core in congestion avoidance, it doesn't matter for BBR */
+  pcb->ssthresh = pcb->cwnd;
+}
+
+static void
+bbr_on_loss(struct tcp_pcb *pcb)
+{
+  /* keep the window: fast recovery inflates it by 3 MSS and falls back
+     to it when recovery ends */
+  pcb->ssthresh = LWIP_MAX(pcb->cwnd, 2U * pcb->mss);
+}
+
+static void
+bbr_on_rto(struct tcp_pcb *pcb)
+{
+  bbr_on_loss(pcb);
+  pcb->cwnd = pcb->mss;
+}
+
+static u32_t
+bbr_pacing_rate(struct tcp_pcb *pcb)
+{
+  struct bbr *b = CC_PRIV(pcb, bbr);
+
+  /* not paced until there is a bandwidth estimate */
+  return (u32_t)LWIP_MIN((cc_u64_t)bbr_max_bw(b) * bbr_gain(b) / 1000,
+                         0xFFFFFFFFU);
+}
+
+const struct tcp_cc_ops tcp_cc_bbr = {
+  "bbr", bbr_init, bbr_on_ack, bbr_on_loss, bbr_on_rto, bbr_pacing_rate
+};
+
+static const struct tcp_cc_ops * const tcp_cc_modules[] = {
+  &tcp_cc_reno, &tcp_cc_cubic, &tcp_cc_bbr
+};
+
+/**
+ * Look up a congestion control module by name.
+ *
+ * @param name "reno", "cubic" or "bbr"
+ * @return the module, or NULL if there is none by that name
+ */
+const struct tcp_cc_ops *
+tcp_cc_find(const char *name)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof(tcp_cc_modules) / sizeof(tcp_cc_modules[0]); i++) {
+    if (strcmp(tcp_cc_modules[i]->name, name) == 0) {
+      return tcp_cc_modules[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Set the congestion control module for PCBs created from now on.
+ */
+void
+tcp_cc_set_default(const struct tcp_cc_ops *cc)
+{
+  tcp_cc_default = cc;
+}
+
+/**
+ * Set the congestion control module of a PCB. On a listening PCB, this
+ * selects the module of the connections it accepts.
+ *
+ * @param pcb the tcp_pcb to change
+ * @param cc the new module
+ */
+void
+tcp_set_cc(struct tcp_pcb *pcb, const struct tcp_cc_ops *cc)
+{
+  pcb->cc = cc;
+  if (pcb->state >= ESTABLISHED) {
+    cc->init(pcb);
+  }
+}
+
+/**
+ * Called by tcp_output() when a paced PCB ran out of credit.
+ *
+ * @param pcb the tcp_pcb that has to wait
+ * @param due sys_now() value when it may send again
+ */
+void
+tcp_pace_wait(struct tcp_pcb *pcb, u32_t due)
+{
+  if (tcp_pace_list == NULL || TIME_LT(due, tcp_pace_next)) {
+    tcp_pace_next = due;
+  }
+  pcb->pace_due = due;
+  if (pcb->pace_pprev == NULL) {
+    pcb->pace_next = tcp_pace_list;
+    if (tcp_pace_list != NULL) {
+      tcp_pace_list->pace_pprev = &pcb->pace_next;
+    }
+    tcp_pace_list = pcb;
+    pcb->pace_pprev = &tcp_pace_list;
+  }
+}
+
+/**
+ * Stop waiting for pacing credit. Called from TCP_RMV.
+ *
+ * @param pcb the tcp_pcb to take off the pacing list
+ */
+void
+tcp_pace_cancel(struct tcp_pcb *pcb)
+{
+  if (pcb->pace_pprev != NULL) {
+    *pcb->pace_pprev = pcb->pace_next;
+    if (pcb->pace_next != NULL) {
+      pcb->pace_next->pace_pprev = pcb->pace_pprev;
+    }
+    pcb->pace_next = NULL;
+    pcb->pace_pprev = NULL;
+  }
+}
+
+/**
+ * @return milliseconds until tcp_pace_tmr() has to be called, or
+ *         TCP_PACE_IDLE if no PCB is waiting for pacing credit
+ */
+u32_t
+tcp_pace_delay(void)
+{
+  u32_t now = sys_now();
+
+  if (tcp_pace_list == NULL) {
+    return TCP_PACE_IDLE;
+  }
+  return TIME_GT(tcp_pace_next, now) ? tcp_pace_next - now : 0;
+}
+
+/**
+ * Resume output on the paced PCBs whose wait is over. Only PCBs that are
+ * waiting for pacing credit are visited.
+ */
+void
+tcp_pace_tmr(void)
+{
+  struct tcp_pcb *pcb, *todo;
+  u32_t now = sys_now();
+
+  /* Detach the list: tcp_output() may put a PCB back on it. */
+  todo = tcp_pace_list;
+  tcp_pace_list = NULL;
+  if (todo != NULL) {
+    todo->pace_pprev = &todo;
+  }
+  while ((pcb = todo) != NULL) {
+    tcp_pace_cancel(pcb);
+    if (TIME_GEQ(now, pcb->pace_due)) {
+      /* may call tcp_pace_wait() again */
+      tcp_output(pcb);
+    } else {
+      tcp_pace_wait(pcb, pcb->pace_due);
+    }
+  }
+}
+
+#endif /* LWIP_TCP && LWIP_TCP_CC */
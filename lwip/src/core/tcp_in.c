@@ -54,6 +54,9 @@
 #include "lwip/inet_chksum.h"
 #include "lwip/stats.h"
 #include "lwip/snmp.h"
+#if LWIP_TCP_RTT_MS
+#include "lwip/sys.h"
+#endif /* LWIP_TCP_RTT_MS */
 #include "arch/perf.h"
 #include "lwip/ip6.h"
 #include "lwip/ip6_addr.h"
@@ -73,6 +76,15 @@ static u16_t tcp_optidx;
 static u32_t seqno, ackno;
 static u8_t flags;
 static u16_t tcplen;
+#if LWIP_TCP_SACK
+/* SACK blocks (left and right edge, host byte order) of the current segment */
+static u32_t tcp_sack_blocks[2 * LWIP_TCP_MAX_SACK_NUM];
+static u8_t tcp_sack_num;
+#endif /* LWIP_TCP_SACK */
+#if LWIP_TCP_TIMESTAMPS
+/* TSecr of the current segment (host byte order), 0 if it had no timestamp */
+static u32_t tcp_ts_ecr;
+#endif /* LWIP_TCP_TIMESTAMPS */
 
 static u8_t recv_flags;
 static struct pbuf *recv_data;
@@ -83,6 +95,15 @@ struct tcp_pcb *tcp_input_pcb;
 static err_t tcp_process(struct tcp_pcb *pcb);
 static void tcp_receive(struct tcp_pcb *pcb);
 static void tcp_parseopt(struct tcp_pcb *pcb);
+#if LWIP_TCP_SACK
+static u8_t tcp_sack_update(struct tcp_pcb *pcb);
+#endif /* LWIP_TCP_SACK */
+#if LWIP_TCP_RTT_MS
+static void tcp_rtt_update(struct tcp_pcb *pcb, u8_t acked_new);
+#endif /* LWIP_TCP_RTT_MS */
+#if LWIP_TCP_RACK
+static void tcp_rack_update(struct tcp_pcb *pcb, struct tcp_seg *seg);
+#endif /* LWIP_TCP_RACK */
 
 static err_t tcp_listen_input(struct tcp_pcb_listen *pcb);
 static err_t tcp_timewait_input(struct tcp_pcb *pcb);
@@ -138,15 +159,17 @@ tcp_input(struct pbuf *p, struct netif *inp)
   }
 
 #if CHECKSUM_CHECK_TCP
-  /* Verify TCP checksum. */
-  chksum = ipX_chksum_pseudo(ip_current_is_v6(), p, IP_PROTO_TCP, p->tot_len,
-                             ipX_current_src_addr(), ipX_current_dest_addr());
-  if (chksum != 0) {
-      LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_input: packet discarded due to failing checksum 0x%04"X16_F"\n",
-        chksum));
-    tcp_debug_print(tcphdr);
-    TCP_STATS_INC(tcp.chkerr);
-    goto dropped;
+  IF__NETIF_CHECKSUM_ENABLED(inp, NETIF_CHECKSUM_CHECK_TCP) {
+    /* Verify TCP checksum. */
+    chksum = ipX_chksum_pseudo(ip_current_is_v6(), p, IP_PROTO_TCP, p->tot_len,
+                               ipX_current_src_addr(), ipX_current_dest_addr());
+    if (chksum != 0) {
+        LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_input: packet discarded due to failing checksum 0x%04"X16_F"\n",
+          chksum));
+      tcp_debug_print(tcphdr);
+      TCP_STATS_INC(tcp.chkerr);
+      goto dropped;
+    }
   }
 #endif /* CHECKSUM_CHECK_TCP */
 
@@ -202,7 +225,16 @@ tcp_input(struct pbuf *p, struct netif *inp)
      for an active connection. */
   prev = NULL;
 
-  
+#if LWIP_TCP_PCB_HASH
+  pcb = tcp_pcb_hash_lookup(ipX_current_dest_addr(), tcphdr->dest,
+                            ipX_current_src_addr(), tcphdr->src);
+  if (pcb != NULL && pcb->state == TIME_WAIT) {
+    LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_input: packed for TIME_WAITing connection.\n"));
+    tcp_timewait_input(pcb);
+    pbuf_free(p);
+    return;
+  }
+#else /* LWIP_TCP_PCB_HASH */
   for(pcb = tcp_active_pcbs; pcb != NULL; pcb = pcb->next) {
     LWIP_ASSERT("tcp_input: active pcb->state != CLOSED", pcb->state != CLOSED);
     LWIP_ASSERT("tcp_input: active pcb->state != TIME-WAIT", pcb->state != TIME_WAIT);
@@ -218,6 +250,13 @@ tcp_input(struct pbuf *p, struct netif *inp)
       LWIP_ASSERT("tcp_input: pcb->next != pcb (before cache)", pcb->next != pcb);
       if (prev != NULL) {
         prev->next = pcb->next;
+#if LWIP_TCP_TIMER_WHEEL
+        if (pcb->next != NULL) {
+          pcb->next->pprev = &prev->next;
+        }
+        tcp_active_pcbs->pprev = &pcb->next;
+        pcb->pprev = &tcp_active_pcbs;
+#endif /* LWIP_TCP_TIMER_WHEEL */
         pcb->next = tcp_active_pcbs;
         tcp_active_pcbs = pcb;
       }
@@ -226,8 +265,10 @@ tcp_input(struct pbuf *p, struct netif *inp)
     }
     prev = pcb;
   }
+#endif /* LWIP_TCP_PCB_HASH */
 
   if (pcb == NULL) {
+#if !LWIP_TCP_PCB_HASH
     /* If it did not go to an active connection, we check the connections
        in the TIME-WAIT state. */
     for(pcb = tcp_tw_pcbs; pcb != NULL; pcb = pcb->next) {
@@ -246,6 +287,7 @@ tcp_input(struct pbuf *p, struct netif *inp)
         return;
       }
     }
+#endif /* !LWIP_TCP_PCB_HASH */
 
     /* Finally, if we still did not get a match, we check all PCBs that
        are LISTENing for incoming connections. */
@@ -335,6 +377,10 @@ tcp_input(struct pbuf *p, struct netif *inp)
       p->flags |= PBUF_FLAG_PUSH;
     }
 
+    /* the segment may leave delayed ACKs, refused or out-of-sequence data
+       behind for the timers */
+    TCP_TIMER_KICK(pcb);
+
     /* If there is data which was previously "refused" by upper layer */
     if (pcb->refused_data != NULL) {
       if ((tcp_process_refused_data(pcb) == ERR_ABRT) ||
@@ -455,7 +501,7 @@ tcp_input(struct pbuf *p, struct netif *inp)
           } else {
             /* correct rcv_wnd as the application won't call tcp_recved()
                for the FIN's seqno */
-            if (pcb->rcv_wnd != TCP_WND) {
+            if (pcb->rcv_wnd != TCP_WND_MAX(pcb)) {
               pcb->rcv_wnd++;
             }
             TCP_EVENT_CLOSED(pcb, err);
@@ -577,6 +623,9 @@ tcp_listen_input(struct tcp_pcb_listen *pcb)
 #if LWIP_CALLBACK_API
     npcb->accept = pcb->accept;
 #endif /* LWIP_CALLBACK_API */
+#if LWIP_TCP_CC
+    npcb->cc = pcb->cc;
+#endif /* LWIP_TCP_CC */
     /* inherit socket options */
     npcb->so_options = pcb->so_options & SOF_INHERITED;
     /* Register the new PCB so that we can begin receiving segments
@@ -585,9 +634,10 @@ tcp_listen_input(struct tcp_pcb_listen *pcb)
 
     /* Parse any options in the SYN. */
     tcp_parseopt(npcb);
-    npcb->snd_wnd = SND_WND_SCALE(npcb, tcphdr->wnd);
+    /* the window field of a SYN is never scaled */
+    npcb->snd_wnd = tcphdr->wnd;
     npcb->snd_wnd_max = npcb->snd_wnd;
-    npcb->ssthresh = npcb->snd_wnd;
+    npcb->ssthresh = SND_WND_SCALE(npcb, 0xFFFFU);
 
 #if TCP_CALCULATE_EFF_SEND_MSS
     npcb->mss = tcp_eff_send_mss(npcb->mss, &npcb->local_ip,
@@ -726,7 +776,8 @@ tcp_process(struct tcp_pcb *pcb)
       pcb->rcv_nxt = seqno + 1;
       pcb->rcv_ann_right_edge = pcb->rcv_nxt;
       pcb->lastack = ackno;
-      pcb->snd_wnd = SND_WND_SCALE(pcb, tcphdr->wnd);
+      /* the window field of a SYN is never scaled */
+      pcb->snd_wnd = tcphdr->wnd;
       pcb->snd_wnd_max = pcb->snd_wnd;
       pcb->snd_wl1 = seqno - 1; /* initialise to seqno - 1 to force window update */
       pcb->state = ESTABLISHED;
@@ -737,15 +788,26 @@ tcp_process(struct tcp_pcb *pcb)
 #endif /* TCP_CALCULATE_EFF_SEND_MSS */
 
       /* Set ssthresh again after changing pcb->mss (already set in tcp_connect
-       * but for the default value of pcb->mss) */
-      pcb->ssthresh = pcb->mss * 10;
+       * but for the default value of pcb->mss).  Per RFC 5681, start out
+       * with the largest window the peer could advertise. */
+      pcb->ssthresh = SND_WND_SCALE(pcb, 0xFFFFU);
 
       pcb->cwnd = ((pcb->cwnd == 1) ? (pcb->mss * 2) : pcb->mss);
+#if LWIP_TCP_CC
+      pcb->cc->init(pcb);
+#endif /* LWIP_TCP_CC */
+#if LWIP_TCP_RTT_MS
+      /* the SYN has been acknowledged */
+      tcp_rtt_update(pcb, 1);
+#endif /* LWIP_TCP_RTT_MS */
       LWIP_ASSERT("pcb->snd_queuelen > 0", (pcb->snd_queuelen > 0));
       --pcb->snd_queuelen;
       LWIP_DEBUGF(TCP_QLEN_DEBUG, ("tcp_process: SYN-SENT --queuelen %"TCPWNDSIZE_F"\n", (tcpwnd_size_t)pcb->snd_queuelen));
       rseg = pcb->unacked;
       pcb->unacked = rseg->next;
+#if LWIP_TCP_RACK
+      tcp_rack_unlink(pcb, rseg);
+#endif /* LWIP_TCP_RACK */
       tcp_seg_free(rseg);
 
       /* If there's nothing left to acknowledge, stop the retransmit
@@ -753,7 +815,7 @@ tcp_process(struct tcp_pcb *pcb)
       if(pcb->unacked == NULL)
         pcb->rtime = -1;
       else {
-        pcb->rtime = 0;
+        TCP_RTO_START(pcb);
         pcb->nrtx = 0;
       }
 
@@ -804,6 +866,9 @@ tcp_process(struct tcp_pcb *pcb)
         }
 
         pcb->cwnd = ((old_cwnd == 1) ? (pcb->mss * 2) : pcb->mss);
+#if LWIP_TCP_CC
+        pcb->cc->init(pcb);
+#endif /* LWIP_TCP_CC */
 
         if (recv_flags & TF_GOT_FIN) {
           tcp_ack_now(pcb);
@@ -944,10 +1009,16 @@ tcp_receive(struct tcp_pcb *pcb)
 #endif /* TCP_QUEUE_OOSEQ */
   struct pbuf *p;
   s32_t off;
+#if !LWIP_TCP_RTT_MS
   s16_t m;
+#endif /* !LWIP_TCP_RTT_MS */
   u32_t right_wnd_edge;
   u16_t new_tot_len;
   int found_dupack = 0;
+#if LWIP_TCP_SACK
+  u8_t sack_partial = 0;
+  u8_t sack_new = 0;
+#endif /* LWIP_TCP_SACK */
 #if TCP_OOSEQ_MAX_BYTES || TCP_OOSEQ_MAX_PBUFS
   u32_t ooseq_blen;
   u16_t ooseq_qlen;
@@ -992,6 +1063,24 @@ tcp_receive(struct tcp_pcb *pcb)
 #endif /* TCP_WND_DEBUG */
     }
 
+#if LWIP_TCP_SACK
+    if (tcp_sack_num > 0) {
+      sack_new = tcp_sack_update(pcb);
+    }
+#endif /* LWIP_TCP_SACK */
+#if LWIP_TCP_RACK
+    if (pcb->rack_flags & TCP_RACK_TLP_OUT) {
+      /* A D-SACK (a first block below the cumulative ACK) means the probe
+         was a duplicate. Otherwise, once it is acknowledged, it repaired
+         a loss. */
+      if (tcp_sack_num > 0 && TCP_SEQ_LEQ(tcp_sack_blocks[1], ackno)) {
+        tcp_tlp_done(pcb, 0);
+      } else if (TCP_SEQ_GEQ(ackno, pcb->tlp_end_seq)) {
+        tcp_tlp_done(pcb, 1);
+      }
+    }
+#endif /* LWIP_TCP_RACK */
+
     /* (From Stevens TCP/IP Illustrated Vol II, p970.) Its only a
      * duplicate ack if:
      * 1) It doesn't ACK new data 
@@ -1010,15 +1099,26 @@ tcp_receive(struct tcp_pcb *pcb)
      *
      * If it only passes 1, should reset dupack counter
      *
+     * With SACK, an ACK that SACKs new data passes 2 and 3 whatever its
+     * length and window (RFC 6675): receivers that keep growing their
+     * window would otherwise never send a dupack.
      */
 
     /* Clause 1 */
     if (TCP_SEQ_LEQ(ackno, pcb->lastack)) {
       pcb->acked = 0;
       /* Clause 2 */
-      if (tcplen == 0) {
+      if (tcplen == 0
+#if LWIP_TCP_SACK
+          || sack_new
+#endif /* LWIP_TCP_SACK */
+         ) {
         /* Clause 3 */
-        if (pcb->snd_wl2 + pcb->snd_wnd == right_wnd_edge){
+        if (pcb->snd_wl2 + pcb->snd_wnd == right_wnd_edge
+#if LWIP_TCP_SACK
+            || sack_new
+#endif /* LWIP_TCP_SACK */
+           ) {
           /* Clause 4 */
           if (pcb->rtime >= 0) {
             /* Clause 5 */
@@ -1027,12 +1127,23 @@ tcp_receive(struct tcp_pcb *pcb)
               if ((u8_t)(pcb->dupacks + 1) > pcb->dupacks) {
                 ++pcb->dupacks;
               }
-              if (pcb->dupacks > 3) {
+              if (pcb->dupacks > 3
+#if LWIP_TCP_SACK
+                  /* after a partial ACK, recovery goes on from the first dupack */
+                  || (pcb->flags & (TF_SACK | TF_INFR)) == (TF_SACK | TF_INFR)
+#endif /* LWIP_TCP_SACK */
+                 ) {
                 /* Inflate the congestion window, but not if it means that
                    the value overflows. */
                 if ((tcpwnd_size_t)(pcb->cwnd + pcb->mss) > pcb->cwnd) {
                   pcb->cwnd += pcb->mss;
                 }
+#if LWIP_TCP_SACK
+                if (pcb->flags & TF_SACK) {
+                  /* Fill the next hole the SACK blocks have uncovered */
+                  tcp_rexmit_sack(pcb, 0);
+                }
+#endif /* LWIP_TCP_SACK */
               } else if (pcb->dupacks == 3) {
                 /* Do fast retransmit */
                 tcp_rexmit_fast(pcb);
@@ -1043,7 +1154,13 @@ tcp_receive(struct tcp_pcb *pcb)
       }
       /* If Clause (1) or more is true, but not a duplicate ack, reset
        * count of consecutive duplicate acks */
-      if (!found_dupack) {
+      if (!found_dupack
+#if LWIP_TCP_SACK
+          /* With SACK, dupacks count the ACKs reporting new SACKed data;
+             the data segments of a busy reverse path must not reset that. */
+          && !(pcb->flags & TF_SACK)
+#endif /* LWIP_TCP_SACK */
+         ) {
         pcb->dupacks = 0;
       }
     } else if (TCP_SEQ_BETWEEN(ackno, pcb->lastack+1, pcb->snd_nxt)){
@@ -1053,15 +1170,24 @@ tcp_receive(struct tcp_pcb *pcb)
          in fast retransmit. Also reset the congestion window to the
          slow start threshold. */
       if (pcb->flags & TF_INFR) {
-        pcb->flags &= ~TF_INFR;
-        pcb->cwnd = pcb->ssthresh;
+#if LWIP_TCP_SACK
+        if ((pcb->flags & TF_SACK) && TCP_SEQ_LT(ackno, pcb->recover)) {
+          /* Partial ACK: more of the data outstanding when recovery
+             started was lost, so stay in fast recovery (RFC 6675). */
+          sack_partial = 1;
+        } else
+#endif /* LWIP_TCP_SACK */
+        {
+          pcb->flags &= ~TF_INFR;
+          pcb->cwnd = pcb->ssthresh;
+        }
       }
 
       /* Reset the number of retransmissions. */
       pcb->nrtx = 0;
 
       /* Reset the retransmission time-out. */
-      pcb->rto = (pcb->sa >> 3) + pcb->sv;
+      pcb->rto = TCP_RTO_CALC(pcb);
 
       /* Update the send buffer space. Diff between the two can never exceed 64K
          unless window scaling is used. */
@@ -1076,6 +1202,19 @@ tcp_receive(struct tcp_pcb *pcb)
       /* Update the congestion control variables (cwnd and
          ssthresh). */
       if (pcb->state >= ESTABLISHED) {
+#if LWIP_TCP_SACK
+        if (sack_partial) {
+          /* Deflate the window by the amount of new data acknowledged,
+             then add back one segment (RFC 6582) */
+          pcb->cwnd = (pcb->cwnd > pcb->acked ? pcb->cwnd - pcb->acked : 0) + pcb->mss;
+        } else
+#endif /* LWIP_TCP_SACK */
+#if LWIP_TCP_CC
+        {
+          pcb->cc->on_ack(pcb, pcb->acked);
+          LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_receive: %s cwnd %"TCPWNDSIZE_F"\n", pcb->cc->name, pcb->cwnd));
+        }
+#else /* LWIP_TCP_CC */
         if (pcb->cwnd < pcb->ssthresh) {
           if ((tcpwnd_size_t)(pcb->cwnd + pcb->mss) > pcb->cwnd) {
             pcb->cwnd += pcb->mss;
@@ -1088,6 +1227,7 @@ tcp_receive(struct tcp_pcb *pcb)
           }
           LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_receive: congestion avoidance cwnd %"TCPWNDSIZE_F"\n", pcb->cwnd));
         }
+#endif /* LWIP_TCP_CC */
       }
       LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_receive: ACK for %"U32_F", unacked->seqno %"U32_F":%"U32_F"\n",
                                     ackno,
@@ -1116,6 +1256,12 @@ tcp_receive(struct tcp_pcb *pcb)
           pcb->acked--;
         }
 
+#if LWIP_TCP_RACK
+        if (!(next->flags & TF_SEG_SACKED)) {
+          tcp_rack_update(pcb, next);
+        }
+        tcp_rack_unlink(pcb, next);
+#endif /* LWIP_TCP_RACK */
         pcb->snd_queuelen -= pbuf_clen(next->p);
         tcp_seg_free(next);
 
@@ -1126,12 +1272,19 @@ tcp_receive(struct tcp_pcb *pcb)
         }
       }
 
+#if LWIP_TCP_SACK
+      if (sack_partial) {
+        /* The first unacked segment is the next hole */
+        tcp_rexmit_sack(pcb, 1);
+      }
+#endif /* LWIP_TCP_SACK */
+
       /* If there's nothing left to acknowledge, stop the retransmit
          timer, otherwise reset it to start again */
       if (pcb->unacked == NULL) {
         pcb->rtime = -1;
       } else {
-        pcb->rtime = 0;
+        TCP_RTO_START(pcb);
       }
 
       pcb->polltmr = 0;
@@ -1148,6 +1301,27 @@ tcp_receive(struct tcp_pcb *pcb)
       tcp_send_empty_ack(pcb);
     }
 
+#if LWIP_TCP_SACK
+    if (sack_new && !(pcb->flags & TF_INFR)) {
+      /* However few dupacks got through, the first unacked segment is
+         lost once three segments above it have been SACKed (RFC 6675) */
+      u8_t sacked = 0;
+      for (next = pcb->unacked; next != NULL && sacked < 3; next = next->next) {
+        if (next->flags & TF_SEG_SACKED) {
+          sacked++;
+        }
+      }
+      if (sacked == 3) {
+        tcp_rexmit_fast(pcb);
+      }
+    }
+#endif /* LWIP_TCP_SACK */
+#if LWIP_TCP_RACK
+    if ((pcb->flags & TF_SACK) && pcb->unacked != NULL) {
+      tcp_rack_detect_loss(pcb);
+    }
+#endif /* LWIP_TCP_RACK */
+
     /* We go through the ->unsent list to see if any of the segments
        on the list are acknowledged by the ACK. This may seem
        strange since an "unsent" segment shouldn't be acked. The
@@ -1184,6 +1358,9 @@ tcp_receive(struct tcp_pcb *pcb)
     }
     /* End of ACK for new data processing. */
 
+#if LWIP_TCP_RTT_MS
+    tcp_rtt_update(pcb, pcb->acked > 0);
+#else /* LWIP_TCP_RTT_MS */
     LWIP_DEBUGF(TCP_RTO_DEBUG, ("tcp_receive: pcb->rttest %"U32_F" rtseq %"U32_F" ackno %"U32_F"\n",
                                 pcb->rttest, pcb->rtseq, ackno));
 
@@ -1213,6 +1390,7 @@ tcp_receive(struct tcp_pcb *pcb)
 
       pcb->rttest = 0;
     }
+#endif /* LWIP_TCP_RTT_MS */
   }
 
   /* If the incoming segment contains data, we must process it
@@ -1468,6 +1646,13 @@ tcp_receive(struct tcp_pcb *pcb)
 
         /* Acknowledge the segment(s). */
         tcp_ack(pcb);
+#if LWIP_TCP_SACK
+        if (pcb->ooseq != NULL) {
+          /* Part of a hole was filled: report what is still missing
+             right away */
+          tcp_ack_now(pcb);
+        }
+#endif /* LWIP_TCP_SACK */
 
 #if LWIP_IPV6 && LWIP_ND6_TCP_REACHABILITY_HINTS
         if (PCB_ISIPV6(pcb)) {
@@ -1478,7 +1663,9 @@ tcp_receive(struct tcp_pcb *pcb)
 
       } else {
         /* We get here if the incoming segment is out-of-sequence. */
+#if !LWIP_TCP_SACK
         tcp_send_empty_ack(pcb);
+#endif /* !LWIP_TCP_SACK */
 #if TCP_QUEUE_OOSEQ
         /* We queue the segment on the ->ooseq queue. */
         if (pcb->ooseq == NULL) {
@@ -1626,6 +1813,12 @@ tcp_receive(struct tcp_pcb *pcb)
         }
 #endif /* TCP_OOSEQ_MAX_BYTES || TCP_OOSEQ_MAX_PBUFS */
 #endif /* TCP_QUEUE_OOSEQ */
+#if LWIP_TCP_SACK
+        /* Send the dupack once the segment is queued, so that its SACK
+           blocks (led by this segment) cover it. */
+        pcb->rcv_sack_last = seqno;
+        tcp_send_empty_ack(pcb);
+#endif /* LWIP_TCP_SACK */
       }
     } else {
       /* The incoming segment is not withing the window. */
@@ -1642,6 +1835,58 @@ tcp_receive(struct tcp_pcb *pcb)
   }
 }
 
+#if LWIP_TCP_SACK
+/**
+ * Mark the unacked segments covered by the SACK blocks of the incoming
+ * segment. Blocks are only trusted for whole segments: a segment is marked
+ * once a single block covers all of it.
+ *
+ * @param pcb the tcp_pcb for which a segment arrived
+ * @return 1 if any segment was newly SACKed, 0 otherwise
+ */
+static u8_t
+tcp_sack_update(struct tcp_pcb *pcb)
+{
+  struct tcp_seg *seg;
+  u32_t left, right, highest;
+  u8_t i;
+  u8_t marked = 0;
+
+  highest = tcp_sack_blocks[1];
+  for (i = 1; i < tcp_sack_num; i++) {
+    if (TCP_SEQ_GT(tcp_sack_blocks[2 * i + 1], highest)) {
+      highest = tcp_sack_blocks[2 * i + 1];
+    }
+  }
+
+  /* unacked is sorted, so stop at the first segment above all blocks */
+  for (seg = pcb->unacked; seg != NULL; seg = seg->next) {
+    left = ntohl(seg->tcphdr->seqno);
+    if (TCP_SEQ_GEQ(left, highest)) {
+      break;
+    }
+    if ((seg->flags & TF_SEG_SACKED) || TCP_SEQ_LT(left, ackno)) {
+      /* already marked, or (D-SACK for) data this segment acknowledges */
+      continue;
+    }
+    right = left + TCP_TCPLEN(seg);
+    for (i = 0; i < tcp_sack_num; i++) {
+      if (TCP_SEQ_LEQ(tcp_sack_blocks[2 * i], left) &&
+          TCP_SEQ_LEQ(right, tcp_sack_blocks[2 * i + 1])) {
+        seg->flags |= TF_SEG_SACKED;
+#if LWIP_TCP_RACK
+        tcp_rack_update(pcb, seg);
+        tcp_rack_unlink(pcb, seg);
+#endif /* LWIP_TCP_RACK */
+        marked = 1;
+        break;
+      }
+    }
+  }
+  return marked;
+}
+#endif /* LWIP_TCP_SACK */
+
 static u8_t tcp_getoptbyte(void)
 {
   if ((tcphdr_opt2 == NULL) || (tcp_optidx < tcphdr_opt1len)) {
@@ -1653,6 +1898,118 @@ static u8_t tcp_getoptbyte(void)
   }
 }
 
+#if LWIP_TCP_RTT_MS
+/**
+ * Takes a round-trip time sample in milliseconds from the current ACK and
+ * updates the RTO (RFC 6298). With timestamps, each ACK for new data echoes
+ * when the segment that triggered it was sent. Otherwise, one segment per
+ * round trip is timed, and retransmitted segments are not (Karn).
+ *
+ * @param pcb the tcp_pcb the ACK is for
+ * @param acked_new 1 if the ACK acknowledges new data
+ */
+static void
+tcp_rtt_update(struct tcp_pcb *pcb, u8_t acked_new)
+{
+  s32_t m;
+
+#if LWIP_TCP_TIMESTAMPS
+  if (pcb->flags & TF_TIMESTAMP) {
+    if (!acked_new || tcp_ts_ecr == 0) {
+      return;
+    }
+    m = (s32_t)(sys_now() - tcp_ts_ecr);
+  } else
+#endif /* LWIP_TCP_TIMESTAMPS */
+  {
+    LWIP_UNUSED_ARG(acked_new);
+    if (pcb->rttest == 0 || !TCP_SEQ_LT(pcb->rtseq, ackno)) {
+      return;
+    }
+    m = (s32_t)(sys_now() - pcb->rttest);
+    pcb->rttest = 0;
+  }
+  if (m < 0 || m > TCP_RTO_MAX) {
+    /* not an echo of one of our timestamps */
+    return;
+  }
+
+  LWIP_DEBUGF(TCP_RTO_DEBUG, ("tcp_rtt_update: experienced rtt %"S32_F" msec\n", m));
+
+  if (pcb->sa == 0) {
+    /* first measurement: SRTT = R, RTTVAR = R/2 */
+    pcb->sa = m << 3;
+    pcb->sv = m << 1;
+  } else {
+    /* This is taken directly from VJs original code in his paper */
+    m = m - (pcb->sa >> 3);
+    pcb->sa += m;
+    if (m < 0) {
+      m = -m;
+    }
+    m = m - (pcb->sv >> 2);
+    pcb->sv += m;
+  }
+  pcb->rto = TCP_RTO_CALC(pcb);
+
+  LWIP_DEBUGF(TCP_RTO_DEBUG, ("tcp_rtt_update: RTO %"TCPRTT_F" milliseconds\n",
+                              pcb->rto));
+}
+#endif /* LWIP_TCP_RTT_MS */
+
+#if LWIP_TCP_RACK
+/**
+ * Updates the RACK state with a segment that the current ACK reports as
+ * delivered, cumulatively or by SACK (RFC 8985, section 6.2).
+ *
+ * @param pcb the tcp_pcb the ACK is for
+ * @param seg the newly delivered segment
+ */
+static void
+tcp_rack_update(struct tcp_pcb *pcb, struct tcp_seg *seg)
+{
+  u32_t rtt, end;
+
+  if (seg->xmit_time == 0) {
+    return;
+  }
+  rtt = sys_now() - seg->xmit_time;
+  end = ntohl(seg->tcphdr->seqno) + TCP_TCPLEN(seg);
+  if (seg->flags & TF_SEG_REXMITTED) {
+    /* Was it the retransmission that got through? If the echoed timestamp
+       is older, or the RTT too short, it was an earlier transmission. */
+#if LWIP_TCP_TIMESTAMPS
+    if (tcp_ts_ecr != 0 && TIME_LT(tcp_ts_ecr, seg->xmit_time)) {
+      return;
+    }
+#endif /* LWIP_TCP_TIMESTAMPS */
+    if (rtt < pcb->rack_min_rtt) {
+      return;
+    }
+  } else if (TCP_SEQ_LT(end, pcb->rack_fack) &&
+             (pcb->rack_flags & TCP_RACK_VALID)) {
+    /* delivered after data that was sent later */
+    pcb->rack_flags |= TCP_RACK_REORD;
+  }
+
+  if (pcb->rack_min_rtt == 0 || rtt < pcb->rack_min_rtt) {
+    pcb->rack_min_rtt = rtt;
+  }
+  if (!(pcb->rack_flags & TCP_RACK_VALID) ||
+      TIME_GT(seg->xmit_time, pcb->rack_xmit_ts) ||
+      (seg->xmit_time == pcb->rack_xmit_ts &&
+       TCP_SEQ_GT(end, pcb->rack_end_seq))) {
+    pcb->rack_xmit_ts = seg->xmit_time;
+    pcb->rack_end_seq = end;
+    pcb->rack_rtt = rtt;
+  }
+  if (!(pcb->rack_flags & TCP_RACK_VALID) || TCP_SEQ_GT(end, pcb->rack_fack)) {
+    pcb->rack_fack = end;
+  }
+  pcb->rack_flags |= TCP_RACK_VALID;
+}
+#endif /* LWIP_TCP_RACK */
+
 /**
  * Parses the options contained in the incoming segment.
  *
@@ -1669,6 +2026,15 @@ tcp_parseopt(struct tcp_pcb *pcb)
 #if LWIP_TCP_TIMESTAMPS
   u32_t tsval;
 #endif
+#if LWIP_TCP_SACK
+  u32_t edge;
+  u8_t i;
+
+  tcp_sack_num = 0;
+#endif
+#if LWIP_TCP_TIMESTAMPS
+  tcp_ts_ecr = 0;
+#endif
 
   /* Parse the TCP MSS option, if present. */
   if (TCPH_HDRLEN(tcphdr) > 0x5) {
@@ -1708,7 +2074,7 @@ tcp_parseopt(struct tcp_pcb *pcb)
         /* If syn was received with wnd scale option,
            activate wnd scale opt */
         data = tcp_getoptbyte();
-        if (flags & TCP_SYN) {
+        if ((flags & TCP_SYN) && !(pcb->flags & TF_WND_SCALE)) {
           /* An WND_SCALE option with the right option length. */
           pcb->snd_scale = data;
           if (pcb->snd_scale > 14U) {
@@ -1716,6 +2082,10 @@ tcp_parseopt(struct tcp_pcb *pcb)
           }
           pcb->rcv_scale = TCP_RCV_SCALE;
           pcb->flags |= TF_WND_SCALE;
+          /* window scaling is enabled, we can use the full receive window */
+          LWIP_ASSERT("window not at default value", pcb->rcv_wnd == TCPWND16(TCP_WND));
+          LWIP_ASSERT("window not at default value", pcb->rcv_ann_wnd == TCPWND16(TCP_WND));
+          pcb->rcv_wnd = pcb->rcv_ann_wnd = TCP_WND;
         }
         break;
 #endif
@@ -1740,8 +2110,53 @@ tcp_parseopt(struct tcp_pcb *pcb)
         } else if (TCP_SEQ_BETWEEN(pcb->ts_lastacksent, seqno, seqno+tcplen)) {
           pcb->ts_recent = ntohl(tsval);
         }
-        /* Advance to next option (6 bytes already read) */
-        tcp_optidx += LWIP_TCP_OPT_LEN_TS - 6;
+        /* The echoed timestamp is only meaningful on an ACK */
+        tsval = tcp_getoptbyte();
+        tsval |= (tcp_getoptbyte() << 8);
+        tsval |= (tcp_getoptbyte() << 16);
+        tsval |= (tcp_getoptbyte() << 24);
+        if (flags & TCP_ACK) {
+          tcp_ts_ecr = ntohl(tsval);
+        }
+        break;
+#endif
+#if LWIP_TCP_SACK
+      case LWIP_TCP_OPT_SACK_PERM:
+        LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_parseopt: SACK_PERM\n"));
+        if (tcp_getoptbyte() != LWIP_TCP_OPT_LEN_SACK_PERM || (tcp_optidx - 2 + LWIP_TCP_OPT_LEN_SACK_PERM) > max_c) {
+          /* Bad length */
+          LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_parseopt: bad length\n"));
+          return;
+        }
+        if (flags & TCP_SYN) {
+          /* The remote host can receive SACK blocks and will send them */
+          pcb->flags |= TF_SACK;
+        }
+        break;
+      case LWIP_TCP_OPT_SACK:
+        LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_parseopt: SACK\n"));
+        data = tcp_getoptbyte();
+        if (data < 10 || ((data - 2) & 7) != 0 || (tcp_optidx - 2 + data) > max_c) {
+          /* Bad length */
+          LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_parseopt: bad length\n"));
+          return;
+        }
+        for (data = (data - 2) / 8; data > 0; data--) {
+          if (!(pcb->flags & TF_SACK) || tcp_sack_num == LWIP_TCP_MAX_SACK_NUM) {
+            /* Skip the blocks we have no use or no room for */
+            tcp_optidx += 8;
+            continue;
+          }
+          /* left and right edge, in network byte order */
+          for (i = 0; i < 2; i++) {
+            edge = (u32_t)tcp_getoptbyte() << 24;
+            edge |= (u32_t)tcp_getoptbyte() << 16;
+            edge |= (u32_t)tcp_getoptbyte() << 8;
+            edge |= tcp_getoptbyte();
+            tcp_sack_blocks[2 * tcp_sack_num + i] = edge;
+          }
+          tcp_sack_num++;
+        }
         break;
 #endif
       default:
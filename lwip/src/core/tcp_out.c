@@ -54,7 +54,7 @@
 #include "lwip/ip6.h"
 #include "lwip/ip6_addr.h"
 #include "lwip/inet_chksum.h"
-#if LWIP_TCP_TIMESTAMPS
+#if LWIP_TCP_TIMESTAMPS || LWIP_TCP_CC || LWIP_TCP_RTT_MS
 #include "lwip/sys.h"
 #endif
 
@@ -82,6 +82,26 @@
 
 /* Forward declarations.*/
 static void tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb);
+static void tcp_rexmit_requeue(struct tcp_pcb *pcb, struct tcp_seg **pseg);
+#if LWIP_TCP_RACK
+static void tcp_rack_link(struct tcp_pcb *pcb, struct tcp_seg *seg);
+#endif /* LWIP_TCP_RACK */
+
+/* Only the segment holding the latest data may be extended: the last one
+   on the unsent queue can also be a retransmission, with later data already
+   in flight on the unacked queue. */
+#define TCP_SEG_ENDS_QUEUE(pcb, seg) \
+  (ntohl((seg)->tcphdr->seqno) + (seg)->len == (pcb)->snd_lbb)
+
+#define TCP_SEG_WND_END(pcb, seg) (ntohl((seg)->tcphdr->seqno) - (pcb)->lastack + (seg)->len)
+#if LWIP_TCP_SACK
+/* A hole retransmitted during SACK recovery is clocked out by the ACK that
+   reported it: only the peer's window limits it, not the cwnd. */
+#define TCP_SEG_IN_WND(pcb, seg, wnd) (TCP_SEG_WND_END(pcb, seg) <= \
+  (((seg)->flags & TF_SEG_SACK_REXMIT) ? (pcb)->snd_wnd : (wnd)))
+#else /* LWIP_TCP_SACK */
+#define TCP_SEG_IN_WND(pcb, seg, wnd) (TCP_SEG_WND_END(pcb, seg) <= (wnd))
+#endif /* LWIP_TCP_SACK */
 
 /** Allocate a pbuf and create a tcphdr at p->payload, used for output
  * functions other than the default tcp_output -> tcp_output_segment
@@ -133,7 +153,8 @@ tcp_send_fin(struct tcp_pcb *pcb)
     for (last_unsent = pcb->unsent; last_unsent->next != NULL;
          last_unsent = last_unsent->next);
 
-    if ((TCPH_FLAGS(last_unsent->tcphdr) & (TCP_SYN | TCP_FIN | TCP_RST)) == 0) {
+    if ((TCPH_FLAGS(last_unsent->tcphdr) & (TCP_SYN | TCP_FIN | TCP_RST)) == 0 &&
+        TCP_SEG_ENDS_QUEUE(pcb, last_unsent)) {
       /* no SYN/FIN/RST flag in the header, we can add the FIN flag */
       TCPH_SET_FLAG(last_unsent->tcphdr, TCP_FIN);
       pcb->flags |= TF_FIN;
@@ -172,6 +193,11 @@ tcp_create_segment(struct tcp_pcb *pcb, struct pbuf *p, u8_t flags, u32_t seqno,
   seg->flags = optflags;
   seg->next = NULL;
   seg->p = p;
+#if LWIP_TCP_RACK
+  seg->xmit_time = 0;
+  seg->rack_next = NULL;
+  seg->rack_pprev = NULL;
+#endif /* LWIP_TCP_RACK */
   LWIP_ASSERT("p->tot_len >= optlen", p->tot_len >= optlen);
   seg->len = p->tot_len - optlen;
 #if TCP_OVERSIZE_DBGCHECK
@@ -387,6 +413,9 @@ tcp_write(struct tcp_pcb *pcb, const void *arg, u16_t len, u8_t apiflags)
   LWIP_ERROR("tcp_write: arg == NULL (programmer violates API)", 
              arg != NULL, return ERR_ARG;);
 
+  /* queued data and TF_NAGLEMEMERR both need the timer */
+  TCP_TIMER_KICK(pcb);
+
   err = tcp_write_checks(pcb, len);
   if (err != ERR_OK) {
     return err;
@@ -439,7 +468,11 @@ tcp_write(struct tcp_pcb *pcb, const void *arg, u16_t len, u8_t apiflags)
     /* Usable space at the end of the last unsent segment */
     unsent_optlen = LWIP_TCP_OPT_LENGTH(last_unsent->flags);
     LWIP_ASSERT("mss_local is too small", mss_local >= last_unsent->len + unsent_optlen);
-    space = mss_local - (last_unsent->len + unsent_optlen);
+    if (TCP_SEG_ENDS_QUEUE(pcb, last_unsent)) {
+      space = mss_local - (last_unsent->len + unsent_optlen);
+    } else {
+      space = 0;
+    }
 
     /*
      * Phase 1: Copy data directly into an oversized pbuf.
@@ -566,6 +599,11 @@ tcp_write(struct tcp_pcb *pcb, const void *arg, u16_t len, u8_t apiflags)
 #if TCP_CHECKSUM_ON_COPY
       /* calculate the checksum of nocopy-data */
       chksum = ~inet_chksum((u8_t*)arg + pos, seglen);
+      if (seglen & 1) {
+        /* data chained after an odd length starts at an odd offset */
+        chksum_swapped = 1;
+        chksum = SWAP_BYTES_IN_WORD(chksum);
+      }
 #endif /* TCP_CHECKSUM_ON_COPY */
       /* reference the non-volatile payload data */
       p2->payload = (u8_t*)arg + pos;
@@ -745,6 +783,8 @@ tcp_enqueue_flags(struct tcp_pcb *pcb, u8_t flags)
   LWIP_ASSERT("tcp_enqueue_flags: need either TCP_SYN or TCP_FIN in flags (programmer violates API)",
               (flags & (TCP_SYN | TCP_FIN)) != 0);
 
+  TCP_TIMER_KICK(pcb);
+
   /* check for configured max queuelen and possible overflow */
   if ((pcb->snd_queuelen >= TCP_SND_QUEUELEN) || (pcb->snd_queuelen > TCP_SNDQUEUELEN_OVERFLOW)) {
     LWIP_DEBUGF(TCP_OUTPUT_DEBUG | 3, ("tcp_enqueue_flags: too long queue %"U16_F" (max %"U16_F")\n",
@@ -763,6 +803,19 @@ tcp_enqueue_flags(struct tcp_pcb *pcb, u8_t flags)
       optflags |= TF_SEG_OPTS_WND_SCALE;
     }
 #endif /* LWIP_WND_SCALE */
+#if LWIP_TCP_SACK
+    if ((pcb->state != SYN_RCVD) || (pcb->flags & TF_SACK)) {
+      /* Likewise, only answer SACK-permitted with SACK-permitted. */
+      optflags |= TF_SEG_OPTS_SACK_PERM;
+    }
+#endif /* LWIP_TCP_SACK */
+#if LWIP_TCP_TIMESTAMPS
+    if (pcb->state != SYN_RCVD) {
+      /* Offer timestamps on an active open; a <SYN,ACK> only carries them
+         if the remote host offered them (see below). */
+      optflags |= TF_SEG_OPTS_TS;
+    }
+#endif /* LWIP_TCP_TIMESTAMPS */
   }
 #if LWIP_TCP_TIMESTAMPS
   if ((pcb->flags & TF_TIMESTAMP)) {
@@ -870,6 +923,74 @@ tcp_build_wnd_scale_option(u32_t *opts)
 }
 #endif
 
+#if LWIP_TCP_SACK
+/** Collect the SACK blocks describing the ooseq queue: runs of contiguous
+ * segments are merged into one block, and the block holding the most
+ * recently received segment is reported first (RFC 2018, section 4).
+ *
+ * @param pcb tcp_pcb with a non-empty ooseq queue
+ * @param blocks left and right edge of each block (host byte order)
+ * @param max maximum number of blocks to return
+ * @return number of blocks stored
+ */
+static u8_t
+tcp_sack_blocks(struct tcp_pcb *pcb, u32_t *blocks, u8_t max)
+{
+  struct tcp_seg *seg = pcb->ooseq;
+  u32_t left, right;
+  u8_t num = 1;
+  u8_t found = 0;
+
+  while (seg != NULL) {
+    left = seg->tcphdr->seqno;
+    right = left + TCP_TCPLEN(seg);
+    for (seg = seg->next; seg != NULL && seg->tcphdr->seqno == right; seg = seg->next) {
+      right += TCP_TCPLEN(seg);
+    }
+    if (!found && TCP_SEQ_BETWEEN(pcb->rcv_sack_last, left, right - 1)) {
+      blocks[0] = left;
+      blocks[1] = right;
+      found = 1;
+    } else if (num < max) {
+      blocks[2 * num] = left;
+      blocks[2 * num + 1] = right;
+      num++;
+    }
+    if (found && num == max) {
+      break;
+    }
+  }
+  if (!found) {
+    /* the latest arrival was trimmed off the queue: just report the
+       lowest blocks */
+    for (found = 1; found < num; found++) {
+      blocks[2 * found - 2] = blocks[2 * found];
+      blocks[2 * found - 1] = blocks[2 * found + 1];
+    }
+    num--;
+  }
+  return num;
+}
+
+/** Build a SACK option with the given blocks at the specified options pointer
+ *
+ * @param opts option pointer where to store the SACK option
+ * @param blocks left and right edge of each block (host byte order)
+ * @param num number of blocks
+ */
+static void
+tcp_build_sack_option(u32_t *opts, const u32_t *blocks, u8_t num)
+{
+  u8_t i;
+
+  /* Pad with two NOP options to make everything nicely aligned */
+  opts[0] = htonl(0x01010500 | (2 + 8 * num));
+  for (i = 0; i < 2 * num; i++) {
+    opts[1 + i] = htonl(blocks[i]);
+  }
+}
+#endif /* LWIP_TCP_SACK */
+
 /** Send an ACK without data.
  *
  * @param pcb Protocol control block for the TCP connection to send the ACK
@@ -879,24 +1000,38 @@ tcp_send_empty_ack(struct tcp_pcb *pcb)
 {
   struct pbuf *p;
   u8_t optlen = 0;
-#if LWIP_TCP_TIMESTAMPS || CHECKSUM_GEN_TCP
+#if LWIP_TCP_TIMESTAMPS || CHECKSUM_GEN_TCP || LWIP_TCP_SACK
   struct tcp_hdr *tcphdr;
-#endif /* LWIP_TCP_TIMESTAMPS || CHECKSUM_GEN_TCP */
+#endif /* LWIP_TCP_TIMESTAMPS || CHECKSUM_GEN_TCP || LWIP_TCP_SACK */
+#if LWIP_TCP_SACK
+  u32_t sack_blocks[2 * LWIP_TCP_MAX_SACK_NUM];
+  u8_t sack_num = 0;
+#endif /* LWIP_TCP_SACK */
 
 #if LWIP_TCP_TIMESTAMPS
   if (pcb->flags & TF_TIMESTAMP) {
     optlen = LWIP_TCP_OPT_LENGTH(TF_SEG_OPTS_TS);
   }
 #endif
+#if LWIP_TCP_SACK
+  if ((pcb->flags & TF_SACK) && pcb->ooseq != NULL) {
+    /* 40 bytes of option space: 4 blocks, or 3 next to a timestamp */
+    sack_num = tcp_sack_blocks(pcb, sack_blocks,
+      LWIP_MIN(LWIP_TCP_MAX_SACK_NUM, (optlen ? 3 : 4)));
+    if (sack_num > 0) {
+      optlen += LWIP_TCP_OPT_LEN_SACK_OUT(sack_num);
+    }
+  }
+#endif /* LWIP_TCP_SACK */
 
   p = tcp_output_alloc_header(pcb, optlen, 0, htonl(pcb->snd_nxt));
   if (p == NULL) {
     LWIP_DEBUGF(TCP_OUTPUT_DEBUG, ("tcp_output: (ACK) could not allocate pbuf\n"));
     return ERR_BUF;
   }
-#if LWIP_TCP_TIMESTAMPS || CHECKSUM_GEN_TCP
+#if LWIP_TCP_TIMESTAMPS || CHECKSUM_GEN_TCP || LWIP_TCP_SACK
   tcphdr = (struct tcp_hdr *)p->payload;
-#endif /* LWIP_TCP_TIMESTAMPS || CHECKSUM_GEN_TCP */
+#endif /* LWIP_TCP_TIMESTAMPS || CHECKSUM_GEN_TCP || LWIP_TCP_SACK */
   LWIP_DEBUGF(TCP_OUTPUT_DEBUG, 
               ("tcp_output: sending ACK for %"U32_F"\n", pcb->rcv_nxt));
   /* remove ACK flags from the PCB, as we send an empty ACK now */
@@ -910,6 +1045,12 @@ tcp_send_empty_ack(struct tcp_pcb *pcb)
     tcp_build_timestamp_option(pcb, (u32_t *)(tcphdr + 1));
   }
 #endif 
+#if LWIP_TCP_SACK
+  if (sack_num > 0) {
+    tcp_build_sack_option((u32_t *)(tcphdr + 1) + (optlen - LWIP_TCP_OPT_LEN_SACK_OUT(sack_num)) / 4,
+      sack_blocks, sack_num);
+  }
+#endif /* LWIP_TCP_SACK */
 
 #if CHECKSUM_GEN_TCP
   tcphdr->chksum = ipX_chksum_pseudo(PCB_ISIPV6(pcb), p, IP_PROTO_TCP, p->tot_len,
@@ -927,6 +1068,32 @@ tcp_send_empty_ack(struct tcp_pcb *pcb)
   return ERR_OK;
 }
 
+#if LWIP_TCP_CC
+/**
+ * Add the pacing credit that accrued since the last call, allowing bursts
+ * of 2 ms worth of data (but at least two segments).
+ *
+ * @param pcb the paced tcp_pcb
+ * @param rate pacing rate in bytes per second
+ */
+static void
+tcp_pace_refill(struct tcp_pcb *pcb, u32_t rate)
+{
+  u32_t now = sys_now();
+  u32_t burst = LWIP_MAX(rate / 500, 2U * pcb->mss);
+  u32_t elapsed = LWIP_MIN(now - pcb->pace_stamp, 1000);
+  u32_t add = (rate / 1000) * elapsed;
+
+  pcb->pace_stamp = now;
+  pcb->pace_credit = LWIP_MIN(pcb->pace_credit, burst);
+  if (add >= burst - pcb->pace_credit) {
+    pcb->pace_credit = burst;
+  } else {
+    pcb->pace_credit += add;
+  }
+}
+#endif /* LWIP_TCP_CC */
+
 /**
  * Find out what we can send and send it
  *
@@ -939,6 +1106,9 @@ tcp_output(struct tcp_pcb *pcb)
 {
   struct tcp_seg *seg, *useg;
   u32_t wnd, snd_nxt;
+#if LWIP_TCP_CC
+  u32_t pace_rate = 0;
+#endif /* LWIP_TCP_CC */
 #if TCP_CWND_DEBUG
   s16_t i = 0;
 #endif /* TCP_CWND_DEBUG */
@@ -955,6 +1125,8 @@ tcp_output(struct tcp_pcb *pcb)
     return ERR_OK;
   }
 
+  TCP_TIMER_KICK(pcb);
+
   wnd = LWIP_MIN(pcb->snd_wnd, pcb->cwnd);
 
   seg = pcb->unsent;
@@ -966,10 +1138,17 @@ tcp_output(struct tcp_pcb *pcb)
    * If data is to be sent, we will just piggyback the ACK (see below).
    */
   if (pcb->flags & TF_ACK_NOW &&
-     (seg == NULL ||
-      ntohl(seg->tcphdr->seqno) - pcb->lastack + seg->len > wnd)) {
+     (seg == NULL || !TCP_SEG_IN_WND(pcb, seg, wnd))) {
      return tcp_send_empty_ack(pcb);
   }
+#if LWIP_TCP_SACK
+  /* Data segments carry no SACK blocks, so while there is a hole in the
+     received data, report it on an ACK of its own before the data. */
+  if ((pcb->flags & (TF_ACK_NOW | TF_SACK)) == (TF_ACK_NOW | TF_SACK) &&
+      pcb->ooseq != NULL) {
+    tcp_send_empty_ack(pcb);
+  }
+#endif /* LWIP_TCP_SACK */
 
   /* useg should point to last segment on unacked queue */
   useg = pcb->unacked;
@@ -998,9 +1177,16 @@ tcp_output(struct tcp_pcb *pcb)
                  ntohl(seg->tcphdr->seqno), pcb->lastack));
   }
 #endif /* TCP_CWND_DEBUG */
+#if LWIP_TCP_CC
+  if (seg != NULL && pcb->cc->pacing_rate != NULL) {
+    pace_rate = pcb->cc->pacing_rate(pcb);
+    if (pace_rate != 0) {
+      tcp_pace_refill(pcb, pace_rate);
+    }
+  }
+#endif /* LWIP_TCP_CC */
   /* data available and window allows it to be sent? */
-  while (seg != NULL &&
-         ntohl(seg->tcphdr->seqno) - pcb->lastack + seg->len <= wnd) {
+  while (seg != NULL && TCP_SEG_IN_WND(pcb, seg, wnd)) {
     LWIP_ASSERT("RST not expected here!", 
                 (TCPH_FLAGS(seg->tcphdr) & TCP_RST) == 0);
     /* Stop sending if the nagle algorithm would prevent it
@@ -1014,6 +1200,18 @@ tcp_output(struct tcp_pcb *pcb)
       ((pcb->flags & (TF_NAGLEMEMERR | TF_FIN)) == 0)){
       break;
     }
+#if LWIP_TCP_CC
+    if (pace_rate != 0 && pcb->pace_credit < seg->len) {
+      /* Out of pacing credit: tcp_pace_tmr() resumes once enough has
+         accrued. Don't hold back an ACK that was due now. */
+      tcp_pace_wait(pcb, sys_now() +
+        LWIP_MAX(((seg->len - pcb->pace_credit) * 1000 + pace_rate - 1) / pace_rate, 1));
+      if (pcb->flags & TF_ACK_NOW) {
+        tcp_send_empty_ack(pcb);
+      }
+      break;
+    }
+#endif /* LWIP_TCP_CC */
 #if TCP_CWND_DEBUG
     LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_output: snd_wnd %"TCPWNDSIZE_F", cwnd %"TCPWNDSIZE_F", wnd %"U32_F", effwnd %"U32_F", seq %"U32_F", ack %"U32_F", i %"S16_F"\n",
                             pcb->snd_wnd, pcb->cwnd, wnd,
@@ -1034,6 +1232,11 @@ tcp_output(struct tcp_pcb *pcb)
     seg->oversize_left = 0;
 #endif /* TCP_OVERSIZE_DBGCHECK */
     tcp_output_segment(seg, pcb);
+#if LWIP_TCP_CC
+    if (pace_rate != 0) {
+      pcb->pace_credit -= seg->len;
+    }
+#endif /* LWIP_TCP_CC */
     snd_nxt = ntohl(seg->tcphdr->seqno) + TCP_TCPLEN(seg);
     if (TCP_SEQ_LT(pcb->snd_nxt, snd_nxt)) {
       pcb->snd_nxt = snd_nxt;
@@ -1065,6 +1268,9 @@ tcp_output(struct tcp_pcb *pcb)
           useg = useg->next;
         }
       }
+#if LWIP_TCP_RACK
+      tcp_rack_link(pcb, seg);
+#endif /* LWIP_TCP_RACK */
     /* do not queue empty segments on the unacked list */
     } else {
       tcp_seg_free(seg);
@@ -1094,6 +1300,15 @@ tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb)
   u16_t len;
   u32_t *opts;
 
+#ifdef LWIP_HOOK_TCP_SEG_BUSY
+  if (seg->p->ref != 1) {
+    /* The netif still holds the last transmission of this segment (e.g.
+       queued for a batched send): let it go out before the header changes
+       underneath it. */
+    LWIP_HOOK_TCP_SEG_BUSY(pcb, seg);
+  }
+#endif /* LWIP_HOOK_TCP_SEG_BUSY */
+
   /** @bug Exclude retransmitted segments from this count. */
   snmp_inc_tcpoutsegs();
 
@@ -1106,7 +1321,7 @@ tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb)
   if (seg->flags & TF_SEG_OPTS_WND_SCALE) {
     /* The Window field in a SYN segment itself (the only type where we send
        the window scale option) is never scaled. */
-    seg->tcphdr->wnd = htons(pcb->rcv_ann_wnd);
+    seg->tcphdr->wnd = htons(TCPWND16(pcb->rcv_ann_wnd));
   } else
 #endif /* LWIP_WND_SCALE */
   {
@@ -1142,11 +1357,18 @@ tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb)
     opts += 1;
   }
 #endif
+#if LWIP_TCP_SACK
+  if (seg->flags & TF_SEG_OPTS_SACK_PERM) {
+    /* Pad with two NOP options to make everything nicely aligned */
+    *opts = PP_HTONL(0x01010402);
+    opts += 1;
+  }
+#endif
   
   /* Set retransmission timer running if it is not currently enabled 
      This must be set before checking the route. */
   if (pcb->rtime == -1) {
-    pcb->rtime = 0;
+    TCP_RTO_START(pcb);
   }
 
   /* If we don't have a local IP address, we get one by
@@ -1162,11 +1384,29 @@ tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb)
   }
 
   if (pcb->rttest == 0) {
+#if LWIP_TCP_RTT_MS
+    pcb->rttest = sys_now();
+    if (pcb->rttest == 0) {
+      /* 0 means no segment is being timed */
+      pcb->rttest = 1;
+    }
+#else /* LWIP_TCP_RTT_MS */
     pcb->rttest = tcp_ticks;
+#endif /* LWIP_TCP_RTT_MS */
     pcb->rtseq = ntohl(seg->tcphdr->seqno);
 
     LWIP_DEBUGF(TCP_RTO_DEBUG, ("tcp_output_segment: rtseq %"U32_F"\n", pcb->rtseq));
   }
+#if LWIP_TCP_RACK
+  if (seg->xmit_time != 0) {
+    seg->flags |= TF_SEG_REXMITTED;
+  }
+  seg->xmit_time = sys_now();
+  if (seg->xmit_time == 0) {
+    /* 0 means never sent */
+    seg->xmit_time = 1;
+  }
+#endif /* LWIP_TCP_RACK */
   LWIP_DEBUGF(TCP_OUTPUT_DEBUG, ("tcp_output_segment: %"U32_F":%"U32_F"\n",
           htonl(seg->tcphdr->seqno), htonl(seg->tcphdr->seqno) +
           seg->len));
@@ -1293,6 +1533,51 @@ tcp_rst_impl(u32_t seqno, u32_t ackno,
   LWIP_DEBUGF(TCP_RST_DEBUG, ("tcp_rst: seqno %"U32_F" ackno %"U32_F".\n", seqno, ackno));
 }
 
+#if LWIP_TCP_SACK
+/**
+ * Take the SACKed segments off the unacked queue so that a retransmission
+ * timeout resends only the holes.
+ *
+ * SACK information is advisory (the receiver may still discard the data),
+ * so this is only done on the first timeout: after that, the scoreboard is
+ * cleared and everything outstanding is resent.
+ *
+ * @param pcb the tcp_pcb that timed out
+ * @return the SACKed segments, in order (the rest stay on pcb->unacked)
+ */
+static struct tcp_seg *
+tcp_sack_rto_split(struct tcp_pcb *pcb)
+{
+  struct tcp_seg *seg, **pseg;
+  struct tcp_seg *sacked = NULL, **sacked_tail = &sacked;
+  u8_t keep = 0;
+
+  if ((pcb->flags & TF_SACK) && pcb->nrtx == 0) {
+    for (seg = pcb->unacked; seg != NULL; seg = seg->next) {
+      if (!(seg->flags & TF_SEG_SACKED)) {
+        /* at least one hole to fill */
+        keep = 1;
+        break;
+      }
+    }
+  }
+
+  for (pseg = &pcb->unacked; (seg = *pseg) != NULL; ) {
+    seg->flags &= ~TF_SEG_SACK_REXMIT;
+    if (keep && (seg->flags & TF_SEG_SACKED)) {
+      *pseg = seg->next;
+      *sacked_tail = seg;
+      sacked_tail = &seg->next;
+    } else {
+      seg->flags &= ~TF_SEG_SACKED;
+      pseg = &seg->next;
+    }
+  }
+  *sacked_tail = NULL;
+  return sacked;
+}
+#endif /* LWIP_TCP_SACK */
+
 /**
  * Requeue all unacked segments for retransmission
  *
@@ -1303,26 +1588,55 @@ tcp_rst_impl(u32_t seqno, u32_t ackno,
 void
 tcp_rexmit_rto(struct tcp_pcb *pcb)
 {
-  struct tcp_seg *seg;
+  struct tcp_seg *seg, **pseg;
+#if LWIP_TCP_SACK
+  struct tcp_seg *sacked = NULL;
+#endif /* LWIP_TCP_SACK */
 
   if (pcb->unacked == NULL) {
     return;
   }
 
-  /* Move all unacked segments to the head of the unsent queue */
-  for (seg = pcb->unacked; seg->next != NULL; seg = seg->next);
-  /* concatenate unsent queue after unacked queue */
-  seg->next = pcb->unsent;
-#if TCP_OVERSIZE && TCP_OVERSIZE_DBGCHECK
-  /* if last unsent changed, we need to update unsent_oversize */
-  if (pcb->unsent == NULL) {
-    pcb->unsent_oversize = seg->oversize_left;
+#if LWIP_TCP_RACK
+  /* everything is sent again */
+  while (pcb->rack_xmit != NULL) {
+    tcp_rack_unlink(pcb, pcb->rack_xmit);
   }
+#endif /* LWIP_TCP_RACK */
+#if LWIP_TCP_SACK
+  /* A timeout ends fast recovery; the cwnd has been reset to one segment */
+  pcb->flags &= ~TF_INFR;
+  sacked = tcp_sack_rto_split(pcb);
+#endif /* LWIP_TCP_SACK */
+
+  /* Move all unacked segments to the unsent queue. That is not always a
+     matter of putting them in front: segments that RACK or a tail loss
+     probe requeued may still be waiting there for pacing credit, so merge
+     the two sorted queues. */
+  pseg = &pcb->unsent;
+  while ((seg = pcb->unacked) != NULL) {
+    while (*pseg != NULL &&
+           TCP_SEQ_LT(ntohl((*pseg)->tcphdr->seqno), ntohl(seg->tcphdr->seqno))) {
+      pseg = &(*pseg)->next;
+    }
+    pcb->unacked = seg->next;
+    seg->next = *pseg;
+    *pseg = seg;
+    pseg = &seg->next;
+#if TCP_OVERSIZE && TCP_OVERSIZE_DBGCHECK
+    /* if last unsent changed, we need to update unsent_oversize */
+    if (seg->next == NULL) {
+      pcb->unsent_oversize = seg->oversize_left;
+    }
 #endif /* TCP_OVERSIZE && TCP_OVERSIZE_DBGCHECK*/
-  /* unsent queue is the concatenated queue (of unacked, unsent) */
-  pcb->unsent = pcb->unacked;
+  }
+#if LWIP_TCP_SACK
+  /* only the segments the peer has SACKed stay on the unacked queue */
+  pcb->unacked = sacked;
+#else /* LWIP_TCP_SACK */
   /* unacked queue is now empty */
   pcb->unacked = NULL;
+#endif /* LWIP_TCP_SACK */
 
   /* increment number of retransmissions */
   ++pcb->nrtx;
@@ -1344,17 +1658,34 @@ tcp_rexmit_rto(struct tcp_pcb *pcb)
 void
 tcp_rexmit(struct tcp_pcb *pcb)
 {
-  struct tcp_seg *seg;
-  struct tcp_seg **cur_seg;
-
   if (pcb->unacked == NULL) {
     return;
   }
 
   /* Move the first unacked segment to the unsent queue */
+  tcp_rexmit_requeue(pcb, &pcb->unacked);
+
+  ++pcb->nrtx;
+}
+
+/**
+ * Move an unacked segment to the unsent queue for retransmission
+ *
+ * @param pcb the tcp_pcb owning the segment
+ * @param pseg pointer to the unacked queue link to the segment
+ */
+static void
+tcp_rexmit_requeue(struct tcp_pcb *pcb, struct tcp_seg **pseg)
+{
+  struct tcp_seg *seg;
+  struct tcp_seg **cur_seg;
+
   /* Keep the unsent queue sorted. */
-  seg = pcb->unacked;
-  pcb->unacked = seg->next;
+  seg = *pseg;
+  *pseg = seg->next;
+#if LWIP_TCP_RACK
+  tcp_rack_unlink(pcb, seg);
+#endif /* LWIP_TCP_RACK */
 
   cur_seg = &(pcb->unsent);
   while (*cur_seg &&
@@ -1369,8 +1700,9 @@ tcp_rexmit(struct tcp_pcb *pcb)
     pcb->unsent_oversize = 0;
   }
 #endif /* TCP_OVERSIZE */
-
-  ++pcb->nrtx;
+#if LWIP_TCP_SACK
+  seg->flags |= TF_SEG_SACK_REXMIT;
+#endif /* LWIP_TCP_SACK */
 
   /* Don't take any rtt measurements after retransmitting. */
   pcb->rttest = 0;
@@ -1381,6 +1713,94 @@ tcp_rexmit(struct tcp_pcb *pcb)
      and thus tcp_output directly returns. */
 }
 
+#if LWIP_TCP_SACK
+/**
+ * Requeue the first segment the peer is missing according to its SACK
+ * blocks
+ *
+ * Called by tcp_receive() for each ACK during fast recovery. As in RFC 6675,
+ * a segment is presumed lost once three segments above it have been SACKed.
+ * Segments are retransmitted this way only once per recovery episode;
+ * anything lost again is left to the retransmission timer.
+ *
+ * @param pcb the tcp_pcb in fast recovery
+ * @param first_lost treat the first unacked segment as lost (partial ACK)
+ * @return 1 if a segment was requeued, 0 if there was no hole to fill
+ */
+u8_t
+tcp_rexmit_sack(struct tcp_pcb *pcb, u8_t first_lost)
+{
+  struct tcp_seg *seg, **pseg;
+  u16_t sacked = 0;
+
+  for (seg = pcb->unacked; seg != NULL; seg = seg->next) {
+    if (seg->flags & TF_SEG_SACKED) {
+      sacked++;
+    }
+  }
+
+  for (pseg = &pcb->unacked; (seg = *pseg) != NULL; pseg = &seg->next) {
+    if (seg->flags & TF_SEG_SACKED) {
+      sacked--;
+    } else if (!(seg->flags & TF_SEG_SACK_REXMIT) &&
+               (sacked >= 3 || (first_lost && pseg == &pcb->unacked))) {
+      LWIP_DEBUGF(TCP_FR_DEBUG, ("tcp_rexmit_sack: retransmit %"U32_F"\n",
+                                 ntohl(seg->tcphdr->seqno)));
+      tcp_rexmit_requeue(pcb, pseg);
+      return 1;
+    } else if (sacked < 3) {
+      break;
+    }
+  }
+  return 0;
+}
+#endif /* LWIP_TCP_SACK */
+
+/**
+ * Reduce ssthresh after a loss that is repaired without a timeout
+ *
+ * @param pcb the tcp_pcb that lost a segment
+ */
+static void
+tcp_loss_ssthresh(struct tcp_pcb *pcb)
+{
+#if LWIP_TCP_CC
+  pcb->cc->on_loss(pcb);
+#else /* LWIP_TCP_CC */
+  /* Set ssthresh to half of the minimum of the current
+   * cwnd and the advertised window */
+  if (pcb->cwnd > pcb->snd_wnd) {
+    pcb->ssthresh = pcb->snd_wnd / 2;
+  } else {
+    pcb->ssthresh = pcb->cwnd / 2;
+  }
+  
+  /* The minimum value for ssthresh should be 2 MSS */
+  if (pcb->ssthresh < (2U * pcb->mss)) {
+    LWIP_DEBUGF(TCP_FR_DEBUG, 
+                ("tcp_receive: The minimum value for ssthresh %"U16_F
+                 " should be min 2 mss %"U16_F"...\n",
+                 pcb->ssthresh, 2*pcb->mss));
+    pcb->ssthresh = 2*pcb->mss;
+  }
+#endif /* LWIP_TCP_CC */
+}
+
+/**
+ * Enter fast recovery, once the first lost segment has been requeued
+ *
+ * @param pcb the tcp_pcb that lost a segment
+ */
+static void
+tcp_recovery_enter(struct tcp_pcb *pcb)
+{
+  tcp_loss_ssthresh(pcb);
+  pcb->cwnd = pcb->ssthresh + 3 * pcb->mss;
+  pcb->flags |= TF_INFR;
+#if LWIP_TCP_SACK
+  pcb->recover = pcb->snd_nxt;
+#endif /* LWIP_TCP_SACK */
+}
 
 /**
  * Handle retransmission after three dupacks received
@@ -1398,28 +1818,216 @@ tcp_rexmit_fast(struct tcp_pcb *pcb)
                  (u16_t)pcb->dupacks, pcb->lastack,
                  ntohl(pcb->unacked->tcphdr->seqno)));
     tcp_rexmit(pcb);
+    tcp_recovery_enter(pcb);
+  } 
+}
+
+#if LWIP_TCP_RACK
+/**
+ * Put a segment that has just been sent at the end of pcb->rack_xmit.
+ *
+ * @param pcb the tcp_pcb owning the segment
+ * @param seg the segment, already on the unacked queue
+ */
+static void
+tcp_rack_link(struct tcp_pcb *pcb, struct tcp_seg *seg)
+{
+  tcp_rack_unlink(pcb, seg);
+  if (pcb->rack_xmit == NULL) {
+    pcb->rack_xmit_tail = &pcb->rack_xmit;
+  }
+  seg->rack_next = NULL;
+  seg->rack_pprev = pcb->rack_xmit_tail;
+  *pcb->rack_xmit_tail = seg;
+  pcb->rack_xmit_tail = &seg->rack_next;
+}
+
+/**
+ * Take a segment off pcb->rack_xmit: it has been delivered, SACKed or
+ * requeued for retransmission.
+ *
+ * @param pcb the tcp_pcb owning the segment
+ * @param seg the segment
+ */
+void
+tcp_rack_unlink(struct tcp_pcb *pcb, struct tcp_seg *seg)
+{
+  if (seg->rack_pprev != NULL) {
+    *seg->rack_pprev = seg->rack_next;
+    if (seg->rack_next != NULL) {
+      seg->rack_next->rack_pprev = seg->rack_pprev;
+    } else {
+      pcb->rack_xmit_tail = seg->rack_pprev;
+    }
+    seg->rack_next = NULL;
+    seg->rack_pprev = NULL;
+  }
+}
+
+/**
+ * RACK loss detection (RFC 8985, section 6.2): requeue the segments that
+ * were sent a reordering window or more before the most recently sent
+ * segment that has been delivered, and arm the reordering timer for those
+ * that may still be reordered.
+ *
+ * Segments are visited in the order they were sent, up to the first one
+ * that is not lost yet.
+ *
+ * Called by tcp_receive() after each ACK and when the reordering timer
+ * expires.
+ *
+ * @param pcb the tcp_pcb to check
+ */
+void
+tcp_rack_detect_loss(struct tcp_pcb *pcb)
+{
+  struct tcp_seg *seg, **pseg;
+  u32_t now, end, reo_wnd, timeout = 0;
+  s32_t remaining;
+  u16_t lost = 0, n;
+
+  if (!(pcb->rack_flags & TCP_RACK_VALID)) {
+    return;
+  }
+  now = sys_now();
+  if (!(pcb->rack_flags & TCP_RACK_REORD) && (pcb->flags & TF_INFR)) {
+    /* without reordering, there is no need to wait during recovery */
+    reo_wnd = 0;
+  } else {
+    reo_wnd = LWIP_MIN(pcb->rack_min_rtt / 4, (u32_t)(pcb->sa >> 3));
+  }
+
+  while ((seg = pcb->rack_xmit) != NULL) {
+    end = ntohl(seg->tcphdr->seqno) + TCP_TCPLEN(seg);
+    if (TIME_GT(seg->xmit_time, pcb->rack_xmit_ts) ||
+        (seg->xmit_time == pcb->rack_xmit_ts &&
+         TCP_SEQ_GEQ(end, pcb->rack_end_seq))) {
+      /* neither is anything sent after this one */
+      break;
+    }
+    remaining = (s32_t)(seg->xmit_time + pcb->rack_rtt + reo_wnd - now);
+    if (remaining > 0) {
+      /* the others expire later, and are checked again by then */
+      timeout = (u32_t)remaining;
+      break;
+    }
+    LWIP_DEBUGF(TCP_FR_DEBUG, ("tcp_rack_detect_loss: %"U32_F" lost\n",
+                               ntohl(seg->tcphdr->seqno)));
+    tcp_rack_unlink(pcb, seg);
+    lost++;
+  }
 
-    /* Set ssthresh to half of the minimum of the current
-     * cwnd and the advertised window */
-    if (pcb->cwnd > pcb->snd_wnd) {
-      pcb->ssthresh = pcb->snd_wnd / 2;
+  /* Unacked segments that are neither SACKed nor on pcb->rack_xmit are the
+     lost ones: requeue them, keeping the unsent queue in order. */
+  n = lost;
+  for (pseg = &pcb->unacked; n != 0 && (seg = *pseg) != NULL; ) {
+    if (seg->rack_pprev == NULL && !(seg->flags & TF_SEG_SACKED)) {
+      /* advances *pseg */
+      tcp_rexmit_requeue(pcb, pseg);
+      n--;
     } else {
-      pcb->ssthresh = pcb->cwnd / 2;
+      pseg = &seg->next;
     }
-    
-    /* The minimum value for ssthresh should be 2 MSS */
-    if (pcb->ssthresh < (2U * pcb->mss)) {
-      LWIP_DEBUGF(TCP_FR_DEBUG, 
-                  ("tcp_receive: The minimum value for ssthresh %"U16_F
-                   " should be min 2 mss %"U16_F"...\n",
-                   pcb->ssthresh, 2*pcb->mss));
-      pcb->ssthresh = 2*pcb->mss;
+  }
+  LWIP_ASSERT("tcp_rack_detect_loss: lost segments not on unacked", n == 0);
+
+  if (lost && !(pcb->flags & TF_INFR)) {
+    tcp_recovery_enter(pcb);
+    if (pcb->rto_mode == TCP_RTO_MODE_TLP ||
+        (pcb->rto_mode == TCP_RTO_MODE_REO &&
+         pcb->rack_rto_mode == TCP_RTO_MODE_TLP)) {
+      /* no probes during recovery */
+      tcp_rto_start(pcb);
     }
-    
-    pcb->cwnd = pcb->ssthresh + 3 * pcb->mss;
-    pcb->flags |= TF_INFR;
-  } 
+  }
+  if (timeout != 0) {
+    if (pcb->rto_mode != TCP_RTO_MODE_REO) {
+      /* remember the deadline the reordering timer takes over */
+      if (pcb->rtime < 0) {
+        pcb->rack_rto_mode = TCP_RTO_MODE_RTO;
+        pcb->rack_rto_due = now + (u32_t)pcb->rto;
+      } else {
+        pcb->rack_rto_mode = pcb->rto_mode;
+        pcb->rack_rto_due = pcb->rto_due;
+      }
+    }
+    if (TIME_LT(now + timeout, pcb->rack_rto_due)) {
+      pcb->rto_mode = TCP_RTO_MODE_REO;
+      tcp_rto_arm(pcb, timeout);
+    } else if (pcb->rto_mode == TCP_RTO_MODE_REO) {
+      tcp_rack_reo_done(pcb, now);
+    }
+  }
+}
+
+/**
+ * Give the retransmission timer back the deadline that the reordering
+ * timer took over.
+ *
+ * @param pcb the tcp_pcb whose reordering timer expired or is not needed
+ * @param now sys_now()
+ */
+void
+tcp_rack_reo_done(struct tcp_pcb *pcb, u32_t now)
+{
+  pcb->rto_mode = pcb->rack_rto_mode;
+  tcp_rto_arm(pcb, TIME_GT(pcb->rack_rto_due, now) ?
+              pcb->rack_rto_due - now : 0);
+}
+
+/**
+ * Send a tail loss probe (RFC 8985, section 7.3): retransmit the last
+ * segment the peer hasn't SACKed, so that its ACK reveals any losses
+ * before it. Then the RTO takes over.
+ *
+ * @param pcb the tcp_pcb whose probe time-out expired
+ */
+void
+tcp_tlp_probe(struct tcp_pcb *pcb)
+{
+  struct tcp_seg *seg, **pseg, **plast = NULL;
+
+  pcb->rto_mode = TCP_RTO_MODE_RTO;
+  tcp_rto_arm(pcb, (u32_t)pcb->rto);
+  if (pcb->flags & TF_INFR) {
+    return;
+  }
+
+  for (pseg = &pcb->unacked; (seg = *pseg) != NULL; pseg = &seg->next) {
+    if (!(seg->flags & TF_SEG_SACKED)) {
+      plast = pseg;
+    }
+  }
+  if (plast == NULL) {
+    return;
+  }
+  LWIP_DEBUGF(TCP_FR_DEBUG, ("tcp_tlp_probe: retransmit %"U32_F"\n",
+                             ntohl((*plast)->tcphdr->seqno)));
+  tcp_rexmit_requeue(pcb, plast);
+  pcb->rack_flags |= TCP_RACK_TLP_OUT;
+  pcb->tlp_end_seq = pcb->snd_nxt;
+  tcp_output(pcb);
+}
+
+/**
+ * The tail loss probe episode ended: if the probe repaired a loss, the
+ * congestion window has to be reduced as for any other loss (RFC 8985,
+ * section 7.4).
+ *
+ * @param pcb the tcp_pcb that sent the probe
+ * @param repaired 1 if the probe did not turn out to be a duplicate
+ */
+void
+tcp_tlp_done(struct tcp_pcb *pcb, u8_t repaired)
+{
+  pcb->rack_flags &= ~TCP_RACK_TLP_OUT;
+  if (repaired && !(pcb->flags & TF_INFR)) {
+    LWIP_DEBUGF(TCP_FR_DEBUG, ("tcp_tlp_done: loss repaired by probe\n"));
+    tcp_loss_ssthresh(pcb);
+    pcb->cwnd = pcb->ssthresh;
+  }
 }
+#endif /* LWIP_TCP_RACK */
 
 
 /**
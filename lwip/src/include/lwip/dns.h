@@ -103,12 +103,49 @@ struct local_hostlist_entry {
 */
 typedef void (*dns_found_callback)(const char *name, ip_addr_t *ipaddr, void *callback_arg);
 
+#if DNS_HEDGE
+/** dns_hedge_delay() when no hedged query is waiting */
+#define DNS_HEDGE_IDLE 0xffffffffUL
+
+/** Response times and timeouts of one server, see dns_get_server_stats() */
+struct dns_server_stats {
+  u32_t queries;    /* queries sent, including retries and hedges */
+  u32_t answers;
+  u32_t timeouts;   /* queries given up on */
+  u32_t hedges;     /* queries sent because another server was slow */
+  u32_t hedges_won; /* ... that this server answered first */
+  u32_t srtt;       /* smoothed response time, ms */
+  u32_t p95;        /* 95th percentile of recent response times, ms */
+  u8_t  down;       /* skipped after timing out repeatedly */
+};
+#endif /* DNS_HEDGE */
+
+/** Resolver cache counters, see dns_get_stats() */
+struct dns_cache_stats {
+  u32_t hits;       /* answered from a cached address */
+  u32_t neg_hits;   /* answered from a cached failure */
+  u32_t misses;     /* sent a query */
+  u32_t coalesced;  /* waited for a query already sent for the name */
+  u32_t evictions;  /* entries reused while still valid */
+  u16_t used;       /* entries in use, including pending queries */
+};
+
 void           dns_init(void);
 void           dns_tmr(void);
+u8_t           dns_tmr_needed(void);
+void           dns_tmr_skip(u32_t secs);
 void           dns_setserver(u8_t numdns, ip_addr_t *dnsserver);
 ip_addr_t      dns_getserver(u8_t numdns);
 err_t          dns_gethostbyname(const char *hostname, ip_addr_t *addr,
                                  dns_found_callback found, void *callback_arg);
+void           dns_cancel(dns_found_callback found, void *callback_arg);
+u8_t           dns_getaddrs(const char *hostname, ip_addr_t *addrs, u8_t max);
+const struct dns_cache_stats *dns_get_stats(void);
+#if DNS_HEDGE
+u32_t          dns_hedge_delay(void);
+void           dns_hedge_tmr(void);
+const struct dns_server_stats *dns_get_server_stats(u8_t numdns);
+#endif /* DNS_HEDGE */
 
 #if DNS_LOCAL_HOSTLIST && DNS_LOCAL_HOSTLIST_IS_DYNAMIC
 int            dns_local_removehost(const char *hostname, const ip_addr_t *addr);
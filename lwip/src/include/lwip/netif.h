@@ -98,6 +98,16 @@ extern "C" {
  * Set by the netif driver in its init function. */
 #define NETIF_FLAG_IGMP         0x80U
 
+#if LWIP_CHECKSUM_CTRL_PER_NETIF
+/** Checksums a netif verifies on input (see NETIF_SET_CHECKSUM_CTRL()) */
+#define NETIF_CHECKSUM_CHECK_IP     0x0100U
+#define NETIF_CHECKSUM_CHECK_UDP    0x0200U
+#define NETIF_CHECKSUM_CHECK_TCP    0x0400U
+#define NETIF_CHECKSUM_CHECK_ICMP   0x0800U
+#define NETIF_CHECKSUM_ENABLE_ALL   0xFFFFU
+#define NETIF_CHECKSUM_DISABLE_ALL  0x0000U
+#endif /* LWIP_CHECKSUM_CTRL_PER_NETIF */
+
 /** Function prototype for netif init functions. Set up flags and output/linkoutput
  * callback functions in this function.
  *
@@ -236,6 +246,10 @@ struct netif {
   u8_t hwaddr[NETIF_MAX_HWADDR_LEN];
   /** flags (see NETIF_FLAG_ above) */
   u8_t flags;
+#if LWIP_CHECKSUM_CTRL_PER_NETIF
+  /** checksums to verify on input (see NETIF_CHECKSUM_ above) */
+  u16_t chksum_flags;
+#endif /* LWIP_CHECKSUM_CTRL_PER_NETIF */
   /** descriptive abbreviation */
   char name[2];
   /** number of this interface */
@@ -380,6 +394,18 @@ void netif_create_ip6_linklocal_address(struct netif * netif, u8_t from_mac_48bi
 #define NETIF_SET_HWADDRHINT(netif, hint)
 #endif /* LWIP_NETIF_HWADDRHINT */
 
+#if LWIP_CHECKSUM_CTRL_PER_NETIF
+#define NETIF_SET_CHECKSUM_CTRL(netif, chksumflags) \
+  ((netif)->chksum_flags = (chksumflags))
+/** Guards a checksum check: runs the following statement unless the
+ * receiving netif trusts its packets */
+#define IF__NETIF_CHECKSUM_ENABLED(netif, chksumflag) \
+  if (((netif) == NULL) || (((netif)->chksum_flags & (chksumflag)) != 0))
+#else /* LWIP_CHECKSUM_CTRL_PER_NETIF */
+#define NETIF_SET_CHECKSUM_CTRL(netif, chksumflags)
+#define IF__NETIF_CHECKSUM_ENABLED(netif, chksumflag)
+#endif /* LWIP_CHECKSUM_CTRL_PER_NETIF */
+
 #ifdef __cplusplus
 }
 #endif
@@ -886,6 +886,26 @@
 #define DNS_TABLE_SIZE                  4
 #endif
 
+/** DNS_MAX_ADDRS: Number of A records kept per name. dns_gethostbyname()
+ * returns the first one; dns_getaddrs() returns them all. */
+#ifndef DNS_MAX_ADDRS
+#define DNS_MAX_ADDRS                   1
+#endif
+
+/** DNS_MAX_REQUESTS: Maximum number of dns_gethostbyname() callers waiting
+ * for an answer at the same time. Callers asking for a name that is already
+ * being looked up share its query and its dns_table entry. */
+#ifndef DNS_MAX_REQUESTS
+#define DNS_MAX_REQUESTS                DNS_TABLE_SIZE
+#endif
+
+/** DNS_NEG_TTL: Seconds to remember that a name does not exist (NXDOMAIN
+ * or no A record) or that its lookup timed out, so that asking again fails
+ * right away. 0 disables negative caching. */
+#ifndef DNS_NEG_TTL
+#define DNS_NEG_TTL                     0
+#endif
+
 /** DNS maximum host name length supported in the name table. */
 #ifndef DNS_MAX_NAME_LENGTH
 #define DNS_MAX_NAME_LENGTH             256
@@ -896,6 +916,16 @@
 #define DNS_MAX_SERVERS                 2
 #endif
 
+/** DNS_HEDGE==1: Track the response time and timeouts of each DNS server,
+ * send queries to the fastest server that is answering, and if it hasn't
+ * answered within its 95th percentile response time, ask a second server
+ * as well; the first answer wins. dns_hedge_tmr() has to be called
+ * dns_hedge_delay() milliseconds later, and sys_now() must be available.
+ * DNS_HEDGE==0: ask the servers in order, moving on after a timeout. */
+#ifndef DNS_HEDGE
+#define DNS_HEDGE                       0
+#endif
+
 /** DNS do a name checking between the query and the response. */
 #ifndef DNS_DOES_NAME_CHECK
 #define DNS_DOES_NAME_CHECK             1
@@ -1118,20 +1148,156 @@
 
 /**
  * LWIP_TCP_TIMESTAMPS==1: support the TCP timestamp option.
- * The timestamp option is currently only used to help remote hosts, it is not
- * really used locally. Therefore, it is only enabled when a TS option is
- * received in the initial SYN packet from a remote host.
+ * The option is offered on active opens and answered on passive ones. Unless
+ * LWIP_TCP_RTT_MS is enabled it is only used to help remote hosts; it is not
+ * really used locally.
  */
 #ifndef LWIP_TCP_TIMESTAMPS
 #define LWIP_TCP_TIMESTAMPS             0
 #endif
 
+/**
+ * LWIP_TCP_SACK==1: support selective acknowledgements (RFC 2018).
+ * SACK-permitted is offered on every SYN; when the peer agrees, ACKs report
+ * the out-of-sequence data held on the ooseq queue, and the SACK blocks
+ * received from the peer are used to retransmit only the missing segments
+ * during fast recovery and after a retransmission timeout.
+ * Requires TCP_QUEUE_OOSEQ.
+ */
+#ifndef LWIP_TCP_SACK
+#define LWIP_TCP_SACK                   0
+#endif
+
+/**
+ * LWIP_TCP_MAX_SACK_NUM: Maximum number of SACK blocks sent on an ACK and
+ * taken from a received segment (1 to 4). Only 3 blocks fit next to the
+ * timestamp option.
+ */
+#ifndef LWIP_TCP_MAX_SACK_NUM
+#define LWIP_TCP_MAX_SACK_NUM           4
+#endif
+
+/**
+ * LWIP_TCP_CC==1: Pluggable congestion control. Each PCB points to a
+ * struct tcp_cc_ops that owns cwnd and ssthresh outside of fast recovery
+ * and may ask for transmissions to be paced. Reno, CUBIC and a BBR-style
+ * delay-based module are provided. Paced PCBs that ran out of credit are
+ * resumed by tcp_pace_tmr(), which has to be called tcp_pace_delay()
+ * milliseconds later.
+ */
+#ifndef LWIP_TCP_CC
+#define LWIP_TCP_CC                     0
+#endif
+
+/**
+ * TCP_CC_DEFAULT: Congestion control module given to new PCBs (until
+ * tcp_cc_set_default() is called).
+ */
+#ifndef TCP_CC_DEFAULT
+#define TCP_CC_DEFAULT                  tcp_cc_reno
+#endif
+
+/**
+ * LWIP_TCP_RTT_MS==1: Measure round-trip times with sys_now() instead of
+ * counting slow timer ticks: from the echoed timestamp of every ACK for new
+ * data when both sides use LWIP_TCP_TIMESTAMPS, otherwise by timing one
+ * segment per round trip. The RTO is then kept in milliseconds and expires
+ * at a per-PCB deadline instead of on a slow tick: tcp_rto_tmr() has to be
+ * called tcp_rto_delay() milliseconds later.
+ */
+#ifndef LWIP_TCP_RTT_MS
+#define LWIP_TCP_RTT_MS                 0
+#endif
+
+/**
+ * TCP_RTO_WHEEL_SIZE: Number of slots in the timing wheel that holds the
+ * running retransmission timers with LWIP_TCP_RTT_MS, one per millisecond.
+ * Must be a power of 2.
+ */
+#ifndef TCP_RTO_WHEEL_SIZE
+#define TCP_RTO_WHEEL_SIZE              1024
+#endif
+
+/**
+ * TCP_RTO_MIN: Lower bound of the retransmission time-out in milliseconds
+ * with LWIP_TCP_RTT_MS (RFC 6298 recommends one second).
+ */
+#ifndef TCP_RTO_MIN
+#define TCP_RTO_MIN                     1000
+#endif
+
+/**
+ * TCP_RTO_MAX: Upper bound of the retransmission time-out in milliseconds
+ * with LWIP_TCP_RTT_MS, including the exponential backoff.
+ */
+#ifndef TCP_RTO_MAX
+#define TCP_RTO_MAX                     60000
+#endif
+
+/**
+ * LWIP_TCP_RACK==1: RACK-TLP loss detection (RFC 8985) on connections that
+ * use SACK. A segment counts as lost once a segment sent after it has been
+ * delivered and a reordering window has passed, which also catches lost
+ * retransmissions. If the tail of a flight stays unacknowledged for about
+ * two RTTs, a tail loss probe resends the last segment, so that the ACK for
+ * it starts recovery well before the RTO would. Requires LWIP_TCP_SACK and
+ * LWIP_TCP_RTT_MS.
+ */
+#ifndef LWIP_TCP_RACK
+#define LWIP_TCP_RACK                   0
+#endif
+
+/**
+ * TCP_TLP_MAX_ACK_DELAY: How long (in milliseconds) the peer may delay its
+ * ACK for a single segment. A tail loss probe waits this much longer when
+ * only one segment is in flight.
+ */
+#ifndef TCP_TLP_MAX_ACK_DELAY
+#define TCP_TLP_MAX_ACK_DELAY           200
+#endif
+
+/**
+ * LWIP_TCP_PCB_HASH==1: Keep active and TIME-WAIT PCBs in a hash table
+ * indexed by their address/port 4-tuple, so tcp_input() can find the PCB
+ * for an incoming segment without walking the PCB lists.
+ */
+#ifndef LWIP_TCP_PCB_HASH
+#define LWIP_TCP_PCB_HASH               0
+#endif
+
+/**
+ * TCP_PCB_HASH_SIZE: Number of buckets in the PCB hash table. Must be a
+ * power of 2.
+ */
+#ifndef TCP_PCB_HASH_SIZE
+#define TCP_PCB_HASH_SIZE               256
+#endif
+
+/**
+ * LWIP_TCP_TIMER_WHEEL==1: Only visit PCBs that have timer work on each TCP
+ * timer tick. PCBs with retransmit, persist, delayed-ACK or other pending
+ * state are processed on every tick; idle PCBs that are only waiting for a
+ * keepalive, FIN-WAIT-2, SYN-RCVD, LAST-ACK or TIME-WAIT timeout are parked
+ * on a hashed timing wheel until that deadline.
+ */
+#ifndef LWIP_TCP_TIMER_WHEEL
+#define LWIP_TCP_TIMER_WHEEL            0
+#endif
+
+/**
+ * TCP_TIMER_WHEEL_SIZE: Number of slots in the timing wheel, one per slow
+ * timer tick. Must be a power of 2.
+ */
+#ifndef TCP_TIMER_WHEEL_SIZE
+#define TCP_TIMER_WHEEL_SIZE            256
+#endif
+
 /**
  * TCP_WND_UPDATE_THRESHOLD: difference in window to trigger an
  * explicit window update
  */
 #ifndef TCP_WND_UPDATE_THRESHOLD
-#define TCP_WND_UPDATE_THRESHOLD   (TCP_WND / 4)
+#define TCP_WND_UPDATE_THRESHOLD   LWIP_MIN((TCP_WND / 4), (TCP_MSS * 4))
 #endif
 
 /**
@@ -2129,6 +2295,16 @@
 #define CHECKSUM_CHECK_ICMP6            1
 #endif
 
+/**
+ * LWIP_CHECKSUM_CTRL_PER_NETIF==1: Checksum verification of incoming
+ * packets can be turned off at runtime for each netif (see
+ * NETIF_SET_CHECKSUM_CTRL()), e.g. for a link that already protects its
+ * packets with a MAC. Only applies where CHECKSUM_CHECK_* is enabled.
+ */
+#ifndef LWIP_CHECKSUM_CTRL_PER_NETIF
+#define LWIP_CHECKSUM_CTRL_PER_NETIF    0
+#endif
+
 /**
  * LWIP_CHECKSUM_ON_COPY==1: Calculate checksum when copying data from
  * application buffers to pbufs.
@@ -2396,6 +2572,17 @@
  * not part of lwIP but can e.g. be hidden in the netif's state argument.
 */
 
+/**
+ * LWIP_HOOK_TCP_SEG_BUSY(pcb, seg):
+ * - called from tcp_output_segment() when the netif still holds a reference
+ *   to the pbuf of a segment that is about to be (re)transmitted, e.g.
+ *   because its last transmission is queued for a batched send
+ * - pcb: struct tcp_pcb the segment belongs to
+ * - seg: struct tcp_seg about to be sent
+ * The hook must make the netif send or drop what it holds, releasing its
+ * reference, since the segment's headers are rewritten in place.
+ */
+
 /**
  * LWIP_HOOK_VLAN_CHECK(netif, eth_hdr, vlan_hdr):
  * - called from ethernet_input() if VLAN support is enabled
@@ -128,12 +128,28 @@ typedef err_t (*tcp_connected_fn)(void *arg, struct tcp_pcb *tpcb, err_t err);
 #if LWIP_WND_SCALE
 #define RCV_WND_SCALE(pcb, wnd) (((wnd) >> (pcb)->rcv_scale))
 #define SND_WND_SCALE(pcb, wnd) (((wnd) << (pcb)->snd_scale))
+#define TCPWND16(x)             ((u16_t)LWIP_MIN((x), 0xFFFF))
+/* Until (unless) both sides agree on window scaling, the receive window
+   has to fit into the 16-bit header field. */
+#define TCP_WND_MAX(pcb)        ((tcpwnd_size_t)(((pcb)->flags & TF_WND_SCALE) ? TCP_WND : TCPWND16(TCP_WND)))
 typedef u32_t tcpwnd_size_t;
-typedef u16_t tcpflags_t;
 #else
 #define RCV_WND_SCALE(pcb, wnd) (wnd)
 #define SND_WND_SCALE(pcb, wnd) (wnd)
+#define TCPWND16(x)             (x)
+#define TCP_WND_MAX(pcb)        TCP_WND
 typedef u16_t tcpwnd_size_t;
+#endif
+
+#if LWIP_TCP_RTT_MS
+typedef s32_t tcprtt_t;  /* RTT estimator and RTO in milliseconds */
+#else
+typedef s16_t tcprtt_t;  /* RTT estimator and RTO in slow timer ticks */
+#endif
+
+#if LWIP_WND_SCALE || LWIP_TCP_SACK
+typedef u16_t tcpflags_t;
+#else
 typedef u8_t tcpflags_t;
 #endif
 
@@ -164,6 +180,34 @@ enum tcp_state {
 #define DEF_ACCEPT_CALLBACK
 #endif /* LWIP_CALLBACK_API */
 
+#if LWIP_TCP_CC
+/** A congestion control module. The hooks own pcb->cwnd and pcb->ssthresh
+ * except during fast recovery, where the core inflates and deflates cwnd
+ * itself. Listeners pass their module on to the connections they accept. */
+struct tcp_cc_ops {
+  /** name for tcp_cc_find() */
+  const char *name;
+  /** the connection was established, cwnd holds the initial window */
+  void (*init)(struct tcp_pcb *pcb);
+  /** 'acked' bytes of new data were acknowledged outside fast recovery */
+  void (*on_ack)(struct tcp_pcb *pcb, tcpwnd_size_t acked);
+  /** entering fast recovery: set ssthresh, cwnd becomes ssthresh + 3 MSS */
+  void (*on_loss)(struct tcp_pcb *pcb);
+  /** retransmission timeout: set ssthresh and cwnd */
+  void (*on_rto)(struct tcp_pcb *pcb);
+  /** pacing rate in bytes per second, 0 to send as fast as cwnd allows;
+   * may be NULL */
+  u32_t (*pacing_rate)(struct tcp_pcb *pcb);
+};
+
+/** per-PCB private state of the congestion control module */
+#define TCP_CC_PRIV_WORDS 20
+
+#define DEF_TCP_CC  const struct tcp_cc_ops *cc;
+#else /* LWIP_TCP_CC */
+#define DEF_TCP_CC
+#endif /* LWIP_TCP_CC */
+
 /**
  * members common to struct tcp_pcb and struct tcp_listen_pcb
  */
@@ -172,6 +216,8 @@ enum tcp_state {
   void *callback_arg; \
   /* the accept callback for listen- and normal pcbs, if LWIP_CALLBACK_API */ \
   DEF_ACCEPT_CALLBACK \
+  /* congestion control module, if LWIP_TCP_CC */ \
+  DEF_TCP_CC \
   enum tcp_state state; /* TCP state */ \
   u8_t prio; \
   /* ports are in host byte order */ \
@@ -187,6 +233,22 @@ struct tcp_pcb {
 
   /* ports are in host byte order */
   u16_t remote_port;
+
+#if LWIP_TCP_PCB_HASH
+  /* next PCB in the same hash bucket */
+  struct tcp_pcb *hash_next;
+#endif /* LWIP_TCP_PCB_HASH */
+
+#if LWIP_TCP_TIMER_WHEEL
+  /* the 'next' pointer (or list head) that points to this PCB on
+     tcp_active_pcbs or tcp_tw_pcbs */
+  struct tcp_pcb **pprev;
+  /* linkage on the per-tick list or a timing wheel slot */
+  struct tcp_pcb *tmr_next;
+  struct tcp_pcb **tmr_pprev;
+  u32_t tmr_due;   /* tcp_ticks value of the wheel deadline */
+  u8_t tmr_hot;    /* on the per-tick list */
+#endif /* LWIP_TCP_TIMER_WHEEL */
   
   tcpflags_t flags;
 #define TF_ACK_DELAY   ((tcpflags_t)0x0001U)   /* Delayed ACK. */
@@ -199,6 +261,9 @@ struct tcp_pcb {
 #define TF_NAGLEMEMERR ((tcpflags_t)0x0080U)   /* nagle enabled, memerr, try to output to prevent delayed ACK to happen */
 #if LWIP_WND_SCALE
 #define TF_WND_SCALE   ((tcpflags_t)0x0100U)   /* Window Scale option enabled */
+#endif
+#if LWIP_TCP_SACK
+#define TF_SACK        ((tcpflags_t)0x0200U)   /* SACK-permitted negotiated */
 #endif
 
   /* the rest of the fields are in host byte order
@@ -214,27 +279,68 @@ struct tcp_pcb {
   tcpwnd_size_t rcv_wnd;   /* receiver window available */
   tcpwnd_size_t rcv_ann_wnd; /* receiver window to announce */
   u32_t rcv_ann_right_edge; /* announced right edge of window */
+#if LWIP_TCP_SACK
+  u32_t rcv_sack_last; /* seqno of the latest out-of-sequence arrival */
+#endif
 
   /* Retransmission timer. */
-  s16_t rtime;
+  s16_t rtime; /* -1 if stopped (with LWIP_TCP_RTT_MS, rto_due applies) */
 
   u16_t mss;   /* maximum segment size */
 
   /* RTT (round trip time) estimation variables */
-  u32_t rttest; /* RTT estimate in 500ms ticks */
+  u32_t rttest; /* start of the RTT measurement (tcp_ticks or sys_now()) */
   u32_t rtseq;  /* sequence number being timed */
-  s16_t sa, sv; /* @todo document this */
-
-  s16_t rto;    /* retransmission time-out */
+  tcprtt_t sa, sv; /* smoothed RTT << 3, RTT variance << 2 */
+
+  tcprtt_t rto; /* retransmission time-out */
+#if LWIP_TCP_RTT_MS
+  u32_t rto_due; /* sys_now() when the running retransmission timer expires */
+  /* linkage on a retransmission timer wheel slot */
+  struct tcp_pcb *rto_next;
+  struct tcp_pcb **rto_pprev;
+#endif
   u8_t nrtx;    /* number of retransmissions */
+#if LWIP_TCP_RACK
+  u8_t rto_mode; /* what rto_due is for: TCP_RTO_MODE_* */
+  u8_t rack_flags;
+#define TCP_RACK_VALID    0x01U /* a delivered segment has been seen */
+#define TCP_RACK_REORD    0x02U /* the peer has seen reordering */
+#define TCP_RACK_TLP_OUT  0x04U /* a tail loss probe is outstanding */
+  /* the most recently sent segment known to be delivered */
+  u32_t rack_xmit_ts; /* when it was sent */
+  u32_t rack_end_seq;
+  u32_t rack_rtt;     /* ms */
+  u32_t rack_min_rtt; /* ms, 0 if unknown */
+  u32_t rack_fack;    /* highest sequence number delivered */
+  u32_t tlp_end_seq;  /* snd_nxt when the tail loss probe was sent */
+  /* segments in flight, least recently sent first */
+  struct tcp_seg *rack_xmit;
+  struct tcp_seg **rack_xmit_tail;
+  /* the deadline a reordering timer took over */
+  u32_t rack_rto_due;
+  u8_t rack_rto_mode;
+#endif /* LWIP_TCP_RACK */
 
   /* fast retransmit/recovery */
   u8_t dupacks;
   u32_t lastack; /* Highest acknowledged seqno. */
+#if LWIP_TCP_SACK
+  u32_t recover; /* snd_nxt when fast recovery was entered */
+#endif
 
   /* congestion avoidance/control variables */
   tcpwnd_size_t cwnd;
   tcpwnd_size_t ssthresh;
+#if LWIP_TCP_CC
+  u32_t cc_priv[TCP_CC_PRIV_WORDS];
+  /* pacing */
+  u32_t pace_stamp;  /* sys_now() of the last credit refill */
+  u32_t pace_credit; /* bytes that may be sent right away */
+  u32_t pace_due;    /* sys_now() when output resumes, if pace_pprev */
+  struct tcp_pcb *pace_next; /* waiting for pacing credit */
+  struct tcp_pcb **pace_pprev;
+#endif /* LWIP_TCP_CC */
 
   /* sender variables */
   u32_t snd_nxt;   /* next new seqno to be sent */
@@ -385,6 +491,16 @@ err_t            tcp_write   (struct tcp_pcb *pcb, const void *dataptr, u16_t le
 
 void             tcp_setprio (struct tcp_pcb *pcb, u8_t prio);
 
+#if LWIP_TCP_CC
+extern const struct tcp_cc_ops tcp_cc_reno;
+extern const struct tcp_cc_ops tcp_cc_cubic;
+extern const struct tcp_cc_ops tcp_cc_bbr;
+
+const struct tcp_cc_ops *tcp_cc_find(const char *name);
+void             tcp_cc_set_default(const struct tcp_cc_ops *cc);
+void             tcp_set_cc  (struct tcp_pcb *pcb, const struct tcp_cc_ops *cc);
+#endif /* LWIP_TCP_CC */
+
 #define TCP_PRIO_MIN    1
 #define TCP_PRIO_NORMAL 64
 #define TCP_PRIO_MAX    127
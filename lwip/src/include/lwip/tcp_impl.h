@@ -60,6 +60,28 @@ void             tcp_tmr     (void);  /* Must be called every
    intervals (instead of calling tcp_tmr()). */
 void             tcp_slowtmr (void);
 void             tcp_fasttmr (void);
+#if LWIP_TCP_TIMER_WHEEL
+/* Instead of calling tcp_tmr() unconditionally, the timers may be left
+   idle for tcp_timer_idle_ticks() slow ticks; tcp_timer_skip() then
+   accounts for the ticks that were not run. */
+#define TCP_TIMER_IDLE_FOREVER 0xffffffffUL
+u32_t            tcp_timer_idle_ticks(void);
+void             tcp_timer_skip(u32_t ticks);
+#endif /* LWIP_TCP_TIMER_WHEEL */
+#if LWIP_TCP_CC
+/* Paced PCBs that ran out of credit continue sending when tcp_pace_tmr()
+   is called, tcp_pace_delay() ms from now (or never, if TCP_PACE_IDLE). */
+#define TCP_PACE_IDLE 0xffffffffUL
+u32_t            tcp_pace_delay(void);
+void             tcp_pace_tmr(void);
+#endif /* LWIP_TCP_CC */
+#if LWIP_TCP_RTT_MS
+/* Retransmission time-outs are handled by tcp_rto_tmr(), which has to be
+   called tcp_rto_delay() ms from now (or never, if TCP_RTO_IDLE). */
+#define TCP_RTO_IDLE 0xffffffffUL
+u32_t            tcp_rto_delay(void);
+void             tcp_rto_tmr(void);
+#endif /* LWIP_TCP_RTT_MS */
 
 
 /* Only used by IP to pass a TCP segment to TCP: */
@@ -69,6 +91,28 @@ struct tcp_pcb * tcp_alloc   (u8_t prio);
 void             tcp_abandon (struct tcp_pcb *pcb, int reset);
 err_t            tcp_send_empty_ack(struct tcp_pcb *pcb);
 void             tcp_rexmit  (struct tcp_pcb *pcb);
+#if LWIP_TCP_SACK
+u8_t             tcp_rexmit_sack(struct tcp_pcb *pcb, u8_t first_lost);
+#endif /* LWIP_TCP_SACK */
+#if LWIP_TCP_CC
+void             tcp_pace_wait(struct tcp_pcb *pcb, u32_t due);
+void             tcp_pace_cancel(struct tcp_pcb *pcb);
+#endif /* LWIP_TCP_CC */
+#if LWIP_TCP_RACK
+void             tcp_rack_detect_loss(struct tcp_pcb *pcb);
+void             tcp_rack_unlink(struct tcp_pcb *pcb, struct tcp_seg *seg);
+void             tcp_rack_reo_done(struct tcp_pcb *pcb, u32_t now);
+void             tcp_tlp_probe(struct tcp_pcb *pcb);
+void             tcp_tlp_done(struct tcp_pcb *pcb, u8_t repaired);
+#endif /* LWIP_TCP_RACK */
+#if LWIP_TCP_RTT_MS
+void             tcp_rto_arm(struct tcp_pcb *pcb, u32_t delay);
+void             tcp_rto_start(struct tcp_pcb *pcb);
+void             tcp_rto_cancel(struct tcp_pcb *pcb);
+#define TCP_RTO_START(pcb) tcp_rto_start(pcb)
+#else /* LWIP_TCP_RTT_MS */
+#define TCP_RTO_START(pcb) ((pcb)->rtime = 0)
+#endif /* LWIP_TCP_RTT_MS */
 void             tcp_rexmit_rto  (struct tcp_pcb *pcb);
 void             tcp_rexmit_fast (struct tcp_pcb *pcb);
 u32_t            tcp_update_rcv_ann_wnd(struct tcp_pcb *pcb);
@@ -101,6 +145,11 @@ err_t            tcp_process_refused_data(struct tcp_pcb *pcb);
 #define TCP_SEQ_BETWEEN(a,b,c) ((c)-(b) >= (a)-(b))
 #endif
 #define TCP_SEQ_BETWEEN(a,b,c) (TCP_SEQ_GEQ(a,b) && TCP_SEQ_LEQ(a,c))
+/* sys_now() values wrap around, so they are compared the same way */
+#define TIME_LT(a,b)        ((s32_t)((u32_t)(a) - (u32_t)(b)) < 0)
+#define TIME_LEQ(a,b)       ((s32_t)((u32_t)(a) - (u32_t)(b)) <= 0)
+#define TIME_GT(a,b)        ((s32_t)((u32_t)(a) - (u32_t)(b)) > 0)
+#define TIME_GEQ(a,b)       ((s32_t)((u32_t)(a) - (u32_t)(b)) >= 0)
 #define TCP_FIN 0x01U
 #define TCP_SYN 0x02U
 #define TCP_RST 0x04U
@@ -289,12 +338,22 @@ struct tcp_seg {
   u16_t chksum;
   u8_t  chksum_swapped;
 #endif /* TCP_CHECKSUM_ON_COPY */
+#if LWIP_TCP_RACK
+  u32_t xmit_time;         /* sys_now() of the last transmission, 0 if unsent */
+  /* linkage on pcb->rack_xmit, if on the unacked queue and not SACKed */
+  struct tcp_seg *rack_next;
+  struct tcp_seg **rack_pprev;
+#endif /* LWIP_TCP_RACK */
   u8_t  flags;
 #define TF_SEG_OPTS_MSS         (u8_t)0x01U /* Include MSS option. */
 #define TF_SEG_OPTS_TS          (u8_t)0x02U /* Include timestamp option. */
 #define TF_SEG_DATA_CHECKSUMMED (u8_t)0x04U /* ALL data (not the header) is
                                                checksummed into 'chksum' */
 #define TF_SEG_OPTS_WND_SCALE   (u8_t)0x08U /* Include WND SCALE option */
+#define TF_SEG_OPTS_SACK_PERM   (u8_t)0x10U /* Include SACK-permitted option */
+#define TF_SEG_SACKED           (u8_t)0x20U /* Peer has SACKed this segment */
+#define TF_SEG_SACK_REXMIT      (u8_t)0x40U /* Retransmitted as a SACK hole */
+#define TF_SEG_REXMITTED        (u8_t)0x80U /* Sent more than once (RACK) */
   struct tcp_hdr *tcphdr;  /* the TCP header */
 };
 
@@ -302,6 +361,8 @@ struct tcp_seg {
 #define LWIP_TCP_OPT_NOP        1
 #define LWIP_TCP_OPT_MSS        2
 #define LWIP_TCP_OPT_WS         3
+#define LWIP_TCP_OPT_SACK_PERM  4
+#define LWIP_TCP_OPT_SACK       5
 #define LWIP_TCP_OPT_TS         8
 
 #define LWIP_TCP_OPT_LEN_MSS    4
@@ -317,11 +378,20 @@ struct tcp_seg {
 #else
 #define LWIP_TCP_OPT_LEN_WS_OUT 0
 #endif
+#if LWIP_TCP_SACK
+#define LWIP_TCP_OPT_LEN_SACK_PERM     2
+#define LWIP_TCP_OPT_LEN_SACK_PERM_OUT 4 /* aligned for output (includes NOP padding) */
+/* two NOPs, kind and length, then a left and right edge per block */
+#define LWIP_TCP_OPT_LEN_SACK_OUT(n)   (4 + 8 * (n))
+#else
+#define LWIP_TCP_OPT_LEN_SACK_PERM_OUT 0
+#endif
 
 #define LWIP_TCP_OPT_LENGTH(flags) \
   (flags & TF_SEG_OPTS_MSS       ? LWIP_TCP_OPT_LEN_MSS    : 0) + \
   (flags & TF_SEG_OPTS_TS        ? LWIP_TCP_OPT_LEN_TS_OUT : 0) + \
-  (flags & TF_SEG_OPTS_WND_SCALE ? LWIP_TCP_OPT_LEN_WS_OUT : 0)
+  (flags & TF_SEG_OPTS_WND_SCALE ? LWIP_TCP_OPT_LEN_WS_OUT : 0) + \
+  (flags & TF_SEG_OPTS_SACK_PERM ? LWIP_TCP_OPT_LEN_SACK_PERM_OUT : 0)
 
 /** This returns a TCP header option for MSS in an u32_t */
 #define TCP_BUILD_MSS_OPTION(mss) htonl(0x02040000 | ((mss) & 0xFFFF))
@@ -334,6 +404,27 @@ struct tcp_seg {
 #define TCPWND_MAX    0xFFFFU
 #endif /* LWIP_WND_SCALE */
 
+#if LWIP_TCP_RTT_MS
+#define TCPRTT_F        S32_F
+#define TCP_RTO_INITIAL 3000
+/* RTO from the current estimate, before backoff */
+#define TCP_RTO_CALC(pcb) \
+  LWIP_MIN(LWIP_MAX(((pcb)->sa >> 3) + (pcb)->sv, TCP_RTO_MIN), TCP_RTO_MAX)
+#else /* LWIP_TCP_RTT_MS */
+#define TCPRTT_F        S16_F
+#define TCP_RTO_INITIAL (3000 / TCP_SLOW_INTERVAL)
+#define TCP_RTO_CALC(pcb) (((pcb)->sa >> 3) + (pcb)->sv)
+#endif /* LWIP_TCP_RTT_MS */
+
+#if LWIP_TCP_RACK
+/* What the deadline in pcb->rto_due is for */
+#define TCP_RTO_MODE_RTO  0 /* retransmission time-out */
+#define TCP_RTO_MODE_TLP  1 /* tail loss probe */
+#define TCP_RTO_MODE_REO  2 /* RACK reordering window */
+/* Lower bound of the probe time-out, against sys_now() granularity */
+#define TCP_TLP_PTO_MIN   10
+#endif /* LWIP_TCP_RACK */
+
 /* Global variables: */
 extern struct tcp_pcb *tcp_input_pcb;
 extern u32_t tcp_ticks;
@@ -352,6 +443,9 @@ extern struct tcp_pcb *tcp_active_pcbs;  /* List of all TCP PCBs that are in a
 extern struct tcp_pcb *tcp_tw_pcbs;      /* List of all TCP PCBs in TIME-WAIT. */
 
 extern struct tcp_pcb *tcp_tmp_pcb;      /* Only used for temporary storage. */
+#if LWIP_TCP_CC
+extern const struct tcp_cc_ops *tcp_cc_default; /* module for new PCBs */
+#endif /* LWIP_TCP_CC */
 
 /* Axioms about the above lists:   
    1) Every TCP PCB that is not CLOSED is in one of the lists.
@@ -359,6 +453,111 @@ extern struct tcp_pcb *tcp_tmp_pcb;      /* Only used for temporary storage. */
    3) All PCBs in the tcp_listen_pcbs list is in LISTEN state.
    4) All PCBs in the tcp_tw_pcbs list is in TIME-WAIT state.
 */
+#if LWIP_TCP_PCB_HASH
+void tcp_pcb_hash_add(struct tcp_pcb *pcb);
+void tcp_pcb_hash_del(struct tcp_pcb *pcb);
+struct tcp_pcb *tcp_pcb_hash_lookup(ipX_addr_t *local_ip, u16_t local_port,
+                                    ipX_addr_t *remote_ip, u16_t remote_port);
+#define TCP_HASH_ADD(npcb) tcp_pcb_hash_add(npcb)
+#define TCP_HASH_DEL(npcb) tcp_pcb_hash_del(npcb)
+#else /* LWIP_TCP_PCB_HASH */
+#define TCP_HASH_ADD(npcb)
+#define TCP_HASH_DEL(npcb)
+#endif /* LWIP_TCP_PCB_HASH */
+
+#if LWIP_TCP_TIMER_WHEEL
+void tcp_timer_kick(struct tcp_pcb *pcb);
+void tcp_timer_unlink(struct tcp_pcb *pcb);
+#define TCP_TIMER_KICK(npcb) tcp_timer_kick(npcb)
+#define TCP_TIMER_DEL(npcb) tcp_timer_unlink(npcb)
+#else /* LWIP_TCP_TIMER_WHEEL */
+#define TCP_TIMER_KICK(npcb)
+#define TCP_TIMER_DEL(npcb)
+#endif /* LWIP_TCP_TIMER_WHEEL */
+
+#if LWIP_TCP_CC
+#define TCP_PACE_DEL(npcb) tcp_pace_cancel(npcb)
+#else /* LWIP_TCP_CC */
+#define TCP_PACE_DEL(npcb)
+#endif /* LWIP_TCP_CC */
+
+#if LWIP_TCP_RTT_MS
+#define TCP_RTO_DEL(npcb) tcp_rto_cancel(npcb)
+#else /* LWIP_TCP_RTT_MS */
+#define TCP_RTO_DEL(npcb)
+#endif /* LWIP_TCP_RTT_MS */
+
+/* Active and TIME-WAIT PCBs are also kept in the 4-tuple hash table and
+   on the timer, pacing and retransmission timer lists */
+#define TCP_PCB_INDEXED(pcbs) (((pcbs) == &tcp_active_pcbs) || ((pcbs) == &tcp_tw_pcbs))
+#define TCP_INDEX_ADD(pcbs, npcb)                  \
+  do {                                             \
+    if (TCP_PCB_INDEXED(pcbs)) {                   \
+      TCP_HASH_ADD(npcb);                          \
+      TCP_TIMER_KICK(npcb);                        \
+    }                                              \
+  } while (0)
+#define TCP_INDEX_DEL(pcbs, npcb)                  \
+  do {                                             \
+    if (TCP_PCB_INDEXED(pcbs)) {                   \
+      TCP_HASH_DEL(npcb);                          \
+      TCP_TIMER_DEL(npcb);                         \
+      TCP_PACE_DEL(npcb);                          \
+      TCP_RTO_DEL(npcb);                           \
+    }                                              \
+  } while (0)
+
+/* Link npcb in front of *pcbs, and unlink it again. The indexed lists keep
+   back pointers so that the timers can drop an expired PCB in O(1). */
+#if LWIP_TCP_TIMER_WHEEL
+#define TCP_LIST_LINK(pcbs, npcb)                  \
+  do {                                             \
+    if (TCP_PCB_INDEXED(pcbs)) {                   \
+      if (*(pcbs) != NULL) {                       \
+        (*(pcbs))->pprev = &(npcb)->next;          \
+      }                                            \
+      (npcb)->pprev = (pcbs);                      \
+    }                                              \
+    (npcb)->next = *(pcbs);                        \
+    *(pcbs) = (npcb);                              \
+  } while (0)
+#define TCP_LIST_UNLINK(pcbs, npcb)                \
+  do {                                             \
+    if (TCP_PCB_INDEXED(pcbs)) {                   \
+      *(npcb)->pprev = (npcb)->next;               \
+      if ((npcb)->next != NULL) {                  \
+        (npcb)->next->pprev = (npcb)->pprev;       \
+      }                                            \
+      (npcb)->pprev = NULL;                        \
+    } else {                                       \
+      TCP_LIST_UNLINK_WALK(pcbs, npcb);            \
+    }                                              \
+  } while (0)
+#else /* LWIP_TCP_TIMER_WHEEL */
+#define TCP_LIST_LINK(pcbs, npcb)                  \
+  do {                                             \
+    (npcb)->next = *(pcbs);                        \
+    *(pcbs) = (npcb);                              \
+  } while (0)
+#define TCP_LIST_UNLINK(pcbs, npcb) TCP_LIST_UNLINK_WALK(pcbs, npcb)
+#endif /* LWIP_TCP_TIMER_WHEEL */
+#define TCP_LIST_UNLINK_WALK(pcbs, npcb)           \
+  do {                                             \
+    if(*(pcbs) == (npcb)) {                        \
+      (*(pcbs)) = (*pcbs)->next;                   \
+    }                                              \
+    else {                                         \
+      for(tcp_tmp_pcb = *pcbs;                     \
+          tcp_tmp_pcb != NULL;                     \
+          tcp_tmp_pcb = tcp_tmp_pcb->next) {       \
+        if(tcp_tmp_pcb->next == (npcb)) {          \
+          tcp_tmp_pcb->next = (npcb)->next;        \
+          break;                                   \
+        }                                          \
+      }                                            \
+    }                                              \
+  } while (0)
+
 /* Define two macros, TCP_REG and TCP_RMV that registers a TCP PCB
    with a PCB list or removes a PCB from a list, respectively. */
 #ifndef TCP_DEBUG_PCB_LISTS
@@ -373,24 +572,18 @@ extern struct tcp_pcb *tcp_tmp_pcb;      /* Only used for temporary storage. */
                                 LWIP_ASSERT("TCP_REG: already registered\n", tcp_tmp_pcb != (npcb)); \
                             } \
                             LWIP_ASSERT("TCP_REG: pcb->state != CLOSED", ((pcbs) == &tcp_bound_pcbs) || ((npcb)->state != CLOSED)); \
-                            (npcb)->next = *(pcbs); \
+                            TCP_LIST_LINK(pcbs, npcb); \
                             LWIP_ASSERT("TCP_REG: npcb->next != npcb", (npcb)->next != (npcb)); \
-                            *(pcbs) = (npcb); \
+                            TCP_INDEX_ADD(pcbs, npcb); \
                             LWIP_ASSERT("TCP_RMV: tcp_pcbs sane", tcp_pcbs_sane()); \
               tcp_timer_needed(); \
                             } while(0)
 #define TCP_RMV(pcbs, npcb) do { \
                             LWIP_ASSERT("TCP_RMV: pcbs != NULL", *(pcbs) != NULL); \
                             LWIP_DEBUGF(TCP_DEBUG, ("TCP_RMV: removing %p from %p\n", (npcb), *(pcbs))); \
-                            if(*(pcbs) == (npcb)) { \
-                               *(pcbs) = (*pcbs)->next; \
-                            } else for(tcp_tmp_pcb = *(pcbs); tcp_tmp_pcb != NULL; tcp_tmp_pcb = tcp_tmp_pcb->next) { \
-                               if(tcp_tmp_pcb->next == (npcb)) { \
-                                  tcp_tmp_pcb->next = (npcb)->next; \
-                                  break; \
-                               } \
-                            } \
+                            TCP_LIST_UNLINK(pcbs, npcb); \
                             (npcb)->next = NULL; \
+                            TCP_INDEX_DEL(pcbs, npcb); \
                             LWIP_ASSERT("TCP_RMV: tcp_pcbs sane", tcp_pcbs_sane()); \
                             LWIP_DEBUGF(TCP_DEBUG, ("TCP_RMV: removed %p from %p\n", (npcb), *(pcbs))); \
                             } while(0)
@@ -399,27 +592,16 @@ extern struct tcp_pcb *tcp_tmp_pcb;      /* Only used for temporary storage. */
 
 #define TCP_REG(pcbs, npcb)                        \
   do {                                             \
-    (npcb)->next = *pcbs;                          \
-    *(pcbs) = (npcb);                              \
+    TCP_LIST_LINK(pcbs, npcb);                     \
+    TCP_INDEX_ADD(pcbs, npcb);                     \
     tcp_timer_needed();                            \
   } while (0)
 
 #define TCP_RMV(pcbs, npcb)                        \
   do {                                             \
-    if(*(pcbs) == (npcb)) {                        \
-      (*(pcbs)) = (*pcbs)->next;                   \
-    }                                              \
-    else {                                         \
-      for(tcp_tmp_pcb = *pcbs;                     \
-          tcp_tmp_pcb != NULL;                     \
-          tcp_tmp_pcb = tcp_tmp_pcb->next) {       \
-        if(tcp_tmp_pcb->next == (npcb)) {          \
-          tcp_tmp_pcb->next = (npcb)->next;        \
-          break;                                   \
-        }                                          \
-      }                                            \
-    }                                              \
+    TCP_LIST_UNLINK(pcbs, npcb);                   \
     (npcb)->next = NULL;                           \
+    TCP_INDEX_DEL(pcbs, npcb);                     \
   } while(0)
 
 #endif /* LWIP_DEBUG */
@@ -35,7 +35,7 @@
 /*
  * Use the libc memory allocator.
  */
-#define MEM_LIBC_MALLOC         0
+#define MEM_LIBC_MALLOC         1
 #define MEMP_MEM_MALLOC         1
 
 /* <sys/time.h> is included in cc.h! */
@@ -106,11 +106,14 @@ extern unsigned char debug_flags;
    per active RAW "connection". */
 #define MEMP_NUM_RAW_PCB        30
 /* MEMP_NUM_UDP_PCB: the number of UDP protocol control blocks. One
-   per active UDP "connection". */
-#define MEMP_NUM_UDP_PCB        40
+   per active UDP "connection": DNS, one per SOCKS UDP association, and
+   one per -U flow (up to 1024). */
+#define MEMP_NUM_UDP_PCB        1280
 /* MEMP_NUM_TCP_PCB: the number of simulatenously active TCP
-   connections. */
+   connections.  tests/pcbhash sizes it for its own PCB count. */
+#ifndef MEMP_NUM_TCP_PCB
 #define MEMP_NUM_TCP_PCB        1000
+#endif
 /* MEMP_NUM_TCP_PCB_LISTEN: the number of listening TCP
    connections. */
 #define MEMP_NUM_TCP_PCB_LISTEN 80
@@ -159,23 +162,67 @@ extern unsigned char debug_flags;
    order. Define to 0 if your device is low on memory. */
 #define TCP_QUEUE_OOSEQ         1
 
-/* TCP Maximum segment size. */
-#define TCP_MSS                 1024
+/* TCP Maximum segment size.  This is only an upper bound: the MSS that is
+   advertised and used is derived from the VPN interface MTU (-M). */
+#define TCP_MSS                 1460
+
+/* Window scaling lets the windows below exceed 64k.  A shift of 7 allows
+   windows of up to 8MB. */
+#define LWIP_WND_SCALE          1
+#define TCP_RCV_SCALE           7
+
+/* Selective acknowledgements: with large windows, a single loss should
+   not cost a window's worth of retransmissions. */
+#define LWIP_TCP_SACK           1
+
+/* Pluggable congestion control, so that long fat VPN paths can use CUBIC
+   or the BBR-style module instead of Reno (see -c). */
+#define LWIP_TCP_CC             1
+
+/* Timestamps give an RTT sample on every ACK, and the RTO is kept in
+   milliseconds with its own deadline instead of in 500ms slow ticks, so
+   a loss on a short VPN path doesn't stall the connection for seconds.
+   The lower bound is the one Linux uses rather than RFC 6298's 1s. */
+#define LWIP_TCP_TIMESTAMPS     1
+#define LWIP_TCP_RTT_MS         1
+#define TCP_RTO_MIN             200
+
+/* RACK-TLP: losses are detected by the time since a segment was sent
+   rather than by counting duplicate ACKs, and a probe is sent after about
+   two RTTs of silence, so losses at the tail of a request are repaired
+   without waiting for the RTO. The probe allows for the peer's delayed
+   ACK timer; Linux starts it at 40ms rather than the RFC's worst case of
+   200ms, which would put the probe after the RTO on a short path. */
+#define LWIP_TCP_RACK           1
+#define TCP_TLP_MAX_ACK_DELAY   40
 
 /* TCP sender buffer space (bytes). */
-#define TCP_SND_BUF             65534 /* Match TCP_WND. */
+#define TCP_SND_BUF             (4 * 1024 * 1024)
 
 /* TCP sender buffer space (pbufs). This must be at least = 2 *
-   TCP_SND_BUF/TCP_MSS for things to work. */
-#define TCP_SND_QUEUELEN        (4 * TCP_SND_BUF/TCP_MSS)
+   TCP_SND_BUF/TCP_MSS for things to work.  Size it for the smallest MSS
+   we may end up with, not for TCP_MSS. */
+#define TCP_SND_QUEUELEN        (4 * TCP_SND_BUF/536)
 
 /* TCP writable space (bytes). This must be less than or equal
    to TCP_SND_BUF. It is the amount of space which must be
    available in the tcp snd_buf for select to return writable */
 #define TCP_SNDLOWAT            (TCP_SND_BUF/8)
 
-/* TCP receive window. */
-#define TCP_WND                 65534 /* Avoid wrap. */
+/* TCP receive window.  Peers that don't do window scaling get 64k-1. */
+#define TCP_WND                 (4 * 1024 * 1024)
+
+/* Demultiplex incoming segments through a hash table instead of walking
+   every active and TIME-WAIT PCB. */
+#define LWIP_TCP_PCB_HASH       1
+#ifndef TCP_PCB_HASH_SIZE
+#define TCP_PCB_HASH_SIZE       1024
+#endif
+
+/* Only visit PCBs with pending timer work on each TCP tick; idle
+   keepalive and TIME-WAIT connections wait on a timing wheel. */
+#define LWIP_TCP_TIMER_WHEEL    1
+#define TCP_TIMER_WHEEL_SIZE    512
 
 /* Maximum number of retransmissions of data segments. */
 #define TCP_MAXRTX              12
@@ -183,8 +230,22 @@ extern unsigned char debug_flags;
 /* Maximum number of retransmissions of SYN segments. */
 #define TCP_SYNMAXRTX           4
 
+/* Checksum TCP payload when tcp_write() queues it, while the bytes just
+   read from the local socket are still in cache, rather than on every
+   (re)transmission.  tcp_output_segment() then only sums the header. */
+#define LWIP_CHECKSUM_ON_COPY   1
+
+/* Allow --trust-tunnel-checksums to skip verifying inbound checksums on
+   the VPN netif. */
+#define LWIP_CHECKSUM_CTRL_PER_NETIF 1
+
 #define LWIP_TCPIP_CORE_LOCKING 1
 
+/* Packets queued for a batched send to the VPN hold a reference to their
+   pbufs; send them before lwIP rewrites a segment for retransmission. */
+void ocp_vpn_tx_flush(void);
+#define LWIP_HOOK_TCP_SEG_BUSY(pcb, seg) ocp_vpn_tx_flush()
+
 /* ---------- ARP options ---------- */
 #define LWIP_ARP                0
 #undef ARP_QUEUEING
@@ -236,7 +297,23 @@ extern unsigned char debug_flags;
 
 /* Include DNS support. */
 #define LWIP_DNS                1
-#define DNS_TABLE_SIZE          128
+/* Cache capacity; pending queries use entries too.  The least recently
+   used entry is evicted when a new name needs one. */
+#define DNS_TABLE_SIZE          512
+/* Callers waiting for an answer: one per connection or UDP flow being set
+   up.  Lookups of a name already being asked for share its query. */
+#define DNS_MAX_REQUESTS        2048
+/* Remember names that don't resolve, so that retries from applications
+   (and the <name>.<domain> fallback) don't each cross the VPN. */
+#define DNS_NEG_TTL             30
+/* Use every server the VPN advertises: the fastest one that is answering
+   gets each query, and a second one is asked too if the first is slower
+   than its 95th percentile. */
+#define DNS_MAX_SERVERS         4
+#define DNS_HEDGE               1
+/* Keep this many A records per name, so that a connection can fall back
+   to the next address when the first one doesn't answer. */
+#define DNS_MAX_ADDRS           4
 
 /* ---------- PPP options ---------- */
 #define PPP_SUPPORT             0
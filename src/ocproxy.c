@@ -26,7 +26,7 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-#define _GNU_SOURCE
+#include "config.h"
 
 #include <errno.h>
 #include <fcntl.h>
@@ -34,6 +34,8 @@
 #include <signal.h>
 #include <stdarg.h>
 #include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
@@ -55,6 +57,7 @@
 #include "lwip/stats.h"
 #include "lwip/sys.h"
 #include "lwip/tcp_impl.h"
+#include "lwip/udp.h"
 #include "netif/tcpdump.h"
 
 enum {
@@ -64,20 +67,88 @@ enum {
 	STATE_DNS,
 	STATE_CONNECTING,
 	STATE_DATA,
-	STATE_DEAD,
+	STATE_UDP,		/* SOCKS UDP ASSOCIATE control connection */
 	STATE_MAX
 };
 
 #define CONN_TYPE_REDIR		0
 #define CONN_TYPE_SOCKS		1
+#define CONN_TYPE_UDP		2	/* -U listener */
+
+/* names tried by start_resolution(), as bits in ocp_sock.dns_pending */
+#define DNS_CAND_HOST		0	/* the name as given */
+#define DNS_CAND_DOMAIN		1	/* <name>.<dns_domain> */
+#define DNS_CANDS		2
+
+/* --dns-order: which answer start_resolution() uses */
+#define DNS_ORDER_HOST		0	/* the name as given, if it resolves */
+#define DNS_ORDER_DOMAIN	1	/* <name>.<dns_domain>, if it resolves */
+#define DNS_ORDER_FIRST		2	/* whichever resolves first */
+
+/* connect to a name's addresses in turn, this far apart, until one answers */
+#define CONNECT_RACE_MS		250
 
 #define SOCKBUF_LEN		2048
 
+/* a connection's send buffer starts small and doubles up to TCP_SND_BUF */
+#define TXBUF_MIN_LEN		(64 * 1024)
+#define TXBUF_MAX_LEN		TCP_SND_BUF
+
+/*
+ * A connection's receive window starts at RX_WND_INITIAL and grows up to
+ * TCP_WND while the local reader keeps up, so that stalled readers can't
+ * each pin a full TCP_WND of pbufs.  All windows together may grow by at
+ * most RX_HELD_MAX full segments.
+ *
+ * RX_HELD_MAX is how many pool pbufs received data may hold in all while
+ * it waits for local readers.  Past this, a connection holding more than
+ * its share shrinks its window back to RX_WND_INITIAL, and stops
+ * reopening it until it has drained.
+ */
+#define RX_WND_INITIAL		(256 * 1024)
+#define RX_WND_GROWTH_MAX	(RX_HELD_MAX * TCP_MSS)
+#define RX_HELD_MAX		(PBUF_POOL_SIZE / 2)
+
 #define FL_ACTIVATE		1
-#define FL_DIE_ON_ERROR		2
+#define FL_PERSISTENT		2	/* listener/VPN; not in the conn table */
 
 #define MAX_IOVEC		128
-#define MAX_CONN		1024
+
+/* connections are allocated SOCK_SLAB_LEN at a time, up to --max-conns */
+#define DEF_MAX_CONNS		1024
+#define SOCK_SLAB_LEN		64
+
+/*
+ * How often to check that the VPN is alive.  A datagram socket doesn't
+ * become readable when its peer goes away, so this is the only way to
+ * notice that OpenConnect has exited.
+ */
+#define HOUSEKEEPING_MS		1000
+
+#define DEF_BATCH		32
+#define MAX_BATCH		1024
+#define BATCH_HIST_LEN		11	/* log2(MAX_BATCH) + 1 */
+#define BATCH_IOV_PER_PKT	4
+
+/* VPN packets are received directly into a single PBUF_POOL pbuf */
+#define VPN_RX_LEN		PBUF_POOL_BUFSIZE
+
+/* local datagrams too, leaving room in front for the UDP/IP headers */
+#define UDP_RX_LEN		(PBUF_POOL_BUFSIZE - PBUF_LINK_HLEN - \
+				 PBUF_IP_HLEN - PBUF_TRANSPORT_HLEN)
+
+/* UDP associations and flows with no traffic in either direction expire */
+#define UDP_IDLE_MS		120000
+
+/* -U flows, hashed on the forwarder and the client's address:port */
+#define UDP_MAX_FLOWS		1024
+#define UDP_FLOW_HASH_BITS	10
+#define UDP_FLOW_PENDING	4	/* datagrams held during a DNS lookup */
+#define UDP_SOCKBUF		(1 << 20)
+
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+#define USE_MMSG		1
+#endif
 
 #define SOCKS_VER		0x05
 
@@ -99,22 +170,39 @@ enum {
 #define SOCKS_ATYP_DOMAIN	0x03
 #define SOCKS_ATYP_IPV6		0x04
 
+/* RSV, FRAG, ATYP, DST.ADDR, DST.PORT in front of each relayed datagram */
+#define SOCKS_UDP_HLEN_IPV4	10
+
+/* One of the connections racing in start_connection() */
+struct ocp_attempt {
+	struct ocp_sock *s;
+	struct tcp_pcb *tpcb;	/* NULL once it failed or lost */
+};
+
 struct ocp_sock {
 	/* general */
 	int fd;
 	struct evconnlistener *listener;
 	struct event *ev;
+	struct event *wev;
 	struct tcp_pcb *tpcb;
 	int state;
 	int conn_type;
 	struct ocp_sock *next;
+	struct ocp_sock_slab *slab;	/* NULL if FL_PERSISTENT */
 
 	/* for TCP send/receive */
-	int done_len;
+	struct pbuf *pending;	/* VPN data not yet written to fd */
+	int done_len;		/* bytes of pending->payload already written */
+	int rx_held;		/* pbufs on pending */
+	int rx_withheld;	/* bytes written to fd but not tcp_recved() */
+	int rx_wnd;		/* receive window we currently allow */
+	int vpn_eof;
 	int lwip_blocked;
 	int sock_pos;
 	int sock_total;
-	char sockbuf[SOCKBUF_LEN];
+	char *sockbuf;		/* SOCKS request; freed once connecting */
+	struct ocp_txbuf *txbuf;
 
 	/* for all listeners */
 	int lport;
@@ -123,11 +211,121 @@ struct ocp_sock {
 
 	/* for port forwarding */
 	char *rhost_name;
-	ip_addr_t rhost;
 	int rport;
+	const struct tcp_cc_ops *cc;	/* NULL for the -c default */
 
 	/* for lwip_data_cb() */
 	struct netif *netif;
+	struct vpn_batch *batch;
+
+	/* for start_resolution() */
+	int dns_pending;		/* bitmask of DNS_CAND_* being looked up */
+	int dns_ok;			/* ... and of those that resolved */
+	ip_addr_t dns_addr[DNS_CANDS][DNS_MAX_ADDRS];
+	int dns_naddrs[DNS_CANDS];
+	u32_t dns_start;		/* sys_now() when resolution started */
+
+	/* for start_connection() */
+	ip_addr_t race_addr[DNS_MAX_ADDRS];
+	struct ocp_attempt race[DNS_MAX_ADDRS];
+	int race_n;			/* addresses */
+	int race_next;			/* next one to try */
+	int race_live;			/* attempts in progress */
+	struct event *race_ev;		/* starts the next attempt */
+
+	/* for SOCKS UDP ASSOCIATE */
+	struct udp_relay *relay;
+
+	/* for -U listeners */
+	struct udp_txq *txq;
+};
+
+/*
+ * Data read from a local socket is passed to tcp_write() by reference, so
+ * it has to stay put until the VPN peer ACKs it.  If the local socket goes
+ * away first, ownership passes to the tcp_pcb (see ocp_tcp_close()).
+ * When the ring is outgrown, the old one is kept until its data is ACKed.
+ */
+struct ocp_txbuf {
+	int size;
+	int head;		/* next byte to fill from the local socket */
+	int unacked;		/* bytes given to tcp_write() but not ACKed */
+	char *data;
+	char *old;		/* previous, smaller ring */
+	int old_unacked;	/* bytes in old, which are ACKed first */
+};
+
+/*
+ * A block of connection objects.  Slabs are searched oldest first, so that
+ * new connections pack into the early ones and the later ones can drain
+ * and be freed once the load drops.
+ */
+struct ocp_sock_slab {
+	struct ocp_sock_slab *next;
+	struct ocp_sock *free_list;
+	int used;
+	int len;
+	struct ocp_sock socks[];
+};
+
+/* recvmmsg()/sendmmsg() state for the VPN socket */
+struct vpn_batch {
+	struct mmsghdr *rx_msgs;
+	struct iovec *rx_iov;
+	struct pbuf **rx_pbufs;
+
+	/* queued output packets; flushed once per event loop iteration */
+	struct mmsghdr *tx_msgs;
+	struct iovec *tx_iov;
+	struct pbuf **tx_pbufs;
+	int tx_count;
+	int tx_iov_used;
+	int tx_iov_max;
+};
+
+/* Datagrams queued for a local UDP socket; flushed with sendmmsg() */
+struct udp_txq {
+	int fd;
+	struct mmsghdr *msgs;
+	struct iovec *iov;
+	struct pbuf **pbufs;
+	int count;
+	int iov_used;
+	int iov_max;
+	int on_dirty;			/* linked on udp_txq_dirty */
+	struct udp_txq *next_dirty;
+};
+
+/* The local UDP socket and lwIP udp_pcb behind one UDP ASSOCIATE */
+struct udp_relay {
+	int fd;
+	struct event *ev;
+	struct event *idle_ev;
+	struct udp_pcb *upcb;
+	struct ocp_sock *ctl;		/* the SOCKS control connection */
+	struct sockaddr_in bnd;		/* our end of the relay */
+	struct sockaddr_in client;	/* sin_port is 0 until the first datagram */
+	u32_t last_active;
+	struct udp_txq txq;
+};
+
+/*
+ * Each client address:port sending to a -U listener gets its own udp_pcb
+ * (and so its own port on the VPN), so replies can be sent back to it.
+ */
+struct udp_flow {
+	struct udp_flow *hnext;		/* hash chain */
+	struct udp_flow *lru_prev;	/* toward the most recently used */
+	struct udp_flow *lru_next;
+	struct ocp_sock *fwd;		/* the -U listener */
+	struct sockaddr_in client;
+	struct udp_pcb *upcb;
+	ip_addr_t rhost;
+	u32_t last_active;
+	int resolving;			/* waiting on DNS; freed by the callback */
+	int dead;
+	int n_pending;
+	struct pbuf *pending[UDP_FLOW_PENDING];
 };
 
 struct socks_auth {
@@ -166,11 +364,21 @@ struct socks_reply {
 
 static struct event_base *event_base;
 
-static struct ocp_sock ocp_sock_pool[MAX_CONN];
-static struct ocp_sock *ocp_sock_free_list;
+static struct ocp_sock_slab *ocp_slab_list;
+static int ocp_slab_empty;
 static struct ocp_sock *ocp_sock_bind_list;
 static int ocp_sock_used;
 static int ocp_sock_max;
+static int ocp_sock_slots;		/* sum of slab->len */
+static int max_conns = DEF_MAX_CONNS;
+
+/* received data waiting for local readers (see RX_HELD_MAX) */
+static int rx_held;			/* pbufs, over all connections */
+static int rx_held_max;
+static int rx_holders;			/* connections with rx_held != 0 */
+static int rx_wnd_grown;		/* sum of rx_wnd - RX_WND_INITIAL */
+static unsigned long rx_throttled;	/* window updates held back */
+static unsigned long txbuf_grown;
 
 /* nonstatic debug cmd option, exported in lwipopts.h */
 unsigned char debug_flags = 0;
@@ -178,12 +386,75 @@ unsigned char debug_flags = 0;
 static int allow_remote;
 static int tcpdump_enabled;
 static int keep_intvl;
-static int got_sighup;
-static int got_sigusr1;
+static int vpn_batch = DEF_BATCH;
+static int trust_checksums;
+static unsigned long trusted_pkts;	/* delivered without checksum checks */
+static unsigned long trusted_bytes;
 static char *dns_domain;
-
-static void start_connection(struct ocp_sock *s, ip_addr_t *ipaddr);
+static int dns_order = DNS_ORDER_HOST;
+
+static struct event *tcp_tmr_ev;
+static int tcp_tmr_armed;
+static u32_t tcp_tmr_due;		/* sys_now() when tcp_tmr_ev fires */
+static u32_t tcp_tmr_last;		/* sys_now() of the last slow tick */
+static struct event *dns_tmr_ev;
+static int dns_tmr_armed;
+static u32_t dns_tmr_last;		/* sys_now() of the last dns_tmr() */
+static struct event *ms_tmr_ev;		/* pacing and retransmissions */
+static int ms_tmr_armed;
+static u32_t ms_tmr_due;		/* sys_now() when ms_tmr_ev fires */
+static struct event *housekeeping_ev;
+static u32_t housekeeping_last;
+static unsigned long tcp_tmr_wakeups;
+static unsigned long dns_tmr_wakeups;
+static unsigned long ms_tmr_wakeups;
+static unsigned long housekeeping_wakeups;
+
+/* histograms of packets per VPN syscall, bucketed by log2 */
+static unsigned long rx_batch_hist[BATCH_HIST_LEN];
+static unsigned long tx_batch_hist[BATCH_HIST_LEN];
+
+/* start_resolution() outcomes, and its latency in ms bucketed by log2 */
+static unsigned long dns_res_won[DNS_CANDS];
+static unsigned long dns_res_failed;
+static unsigned long dns_res_hist[BATCH_HIST_LEN];
+static u32_t dns_res_max;
+
+/* start_connection() with more than one address, and how often a later
+   address won */
+static unsigned long connect_races;
+static unsigned long connect_race_fallbacks;
+
+/* recvmmsg() state shared by all local UDP sockets */
+static struct mmsghdr *udp_rx_msgs;
+static struct iovec *udp_rx_iov;
+static struct sockaddr_in *udp_rx_from;
+static struct pbuf **udp_rx_pbufs;
+
+static struct udp_txq *udp_txq_dirty;
+static int udp_relays;
+static unsigned long udp_pkts_out;	/* local socket -> VPN */
+static unsigned long udp_pkts_in;	/* VPN -> local socket */
+static unsigned long udp_pkts_dropped;
+static unsigned long udp_pkts_unresolved;	/* dropped, name being looked up */
+
+static struct udp_flow *udp_flow_hash[1 << UDP_FLOW_HASH_BITS];
+static struct udp_flow *udp_flow_lru;		/* most recently used */
+static struct udp_flow *udp_flow_lru_tail;
+static struct event *udp_flow_ev;		/* expires idle flows */
+static int udp_flows;
+static unsigned long udp_flows_evicted;
+
+static void start_connection(struct ocp_sock *s, ip_addr_t *addrs, int n);
+static void race_end(struct ocp_sock *s);
+static void ocp_tcp_close(struct tcp_pcb *tpcb, struct ocp_txbuf *t,
+			  int undelivered);
+static void ocp_txbuf_free(struct ocp_txbuf *t);
+static void vpn_tx_flush(struct ocp_sock *s);
 static void start_resolution(struct ocp_sock *s, const char *hostname);
+static void batch_hist_add(unsigned long *hist, int n);
+static void timers_catchup(void);
+static void dns_tmr_arm(void);
 
 /**********************************************************************
  * Utility functions / libevent wrappers
@@ -219,6 +490,14 @@ static char *xstrdup(const char *s)
 	return ret;
 }
 
+static void *xcalloc(size_t nmemb, size_t size)
+{
+	void *ret = calloc(nmemb, size);
+	if (!ret)
+		die("out of memory\n");
+	return ret;
+}
+
 static int ocp_atoi(const char *s)
 {
 	char *p;
@@ -228,25 +507,101 @@ static int ocp_atoi(const char *s)
 	return val;
 }
 
-static struct ocp_sock *ocp_sock_new(int fd, event_callback_fn cb, int flags)
+static struct ocp_sock_slab *ocp_slab_new(void)
 {
-	struct ocp_sock *s;
+	struct ocp_sock_slab *slab, **pp;
+	int i, len;
 
-	s = ocp_sock_free_list;
-	if (!s) {
-		if (flags & FL_DIE_ON_ERROR)
-			die("%s: ran out of ocp_socks\n", __func__);
+	len = max_conns - ocp_sock_slots;
+	if (len <= 0)
 		return NULL;
+	if (len > SOCK_SLAB_LEN)
+		len = SOCK_SLAB_LEN;
+
+	slab = calloc(1, sizeof(*slab) + len * sizeof(struct ocp_sock));
+	if (!slab)
+		return NULL;
+	slab->len = len;
+	for (i = len - 1; i >= 0; i--) {
+		slab->socks[i].next = slab->free_list;
+		slab->free_list = &slab->socks[i];
 	}
-	ocp_sock_free_list = s->next;
-	memset(s, 0, sizeof(*s));
+
+	for (pp = &ocp_slab_list; *pp; pp = &(*pp)->next)
+		;
+	*pp = slab;
+	ocp_slab_empty++;
+	ocp_sock_slots += len;
+	return slab;
+}
+
+static void ocp_slab_free(struct ocp_sock_slab *slab)
+{
+	struct ocp_sock_slab **pp;
+
+	for (pp = &ocp_slab_list; *pp != slab; pp = &(*pp)->next)
+		;
+	*pp = slab->next;
+	ocp_slab_empty--;
+	ocp_sock_slots -= slab->len;
+	free(slab);
+}
+
+static struct ocp_sock *ocp_sock_alloc(void)
+{
+	struct ocp_sock_slab *slab;
+	struct ocp_sock *s;
+
+	for (slab = ocp_slab_list; slab; slab = slab->next)
+		if (slab->free_list)
+			break;
+	if (!slab) {
+		slab = ocp_slab_new();
+		if (!slab)
+			return NULL;
+	}
+
+	s = slab->free_list;
+	slab->free_list = s->next;
+	if (slab->used++ == 0)
+		ocp_slab_empty--;
 
 	ocp_sock_used++;
 	if (ocp_sock_used > ocp_sock_max)
 		ocp_sock_max = ocp_sock_used;
 
-	s->next = ocp_sock_bind_list;
-	ocp_sock_bind_list = s;
+	memset(s, 0, sizeof(*s));
+	s->slab = slab;
+	return s;
+}
+
+static void ocp_sock_free(struct ocp_sock *s)
+{
+	struct ocp_sock_slab *slab = s->slab;
+
+	memset(s, 0xdd, sizeof(*s));
+	s->next = slab->free_list;
+	slab->free_list = s;
+	ocp_sock_used--;
+
+	/* keep one empty slab around so we don't thrash at a boundary */
+	if (--slab->used == 0 && ++ocp_slab_empty > 1)
+		ocp_slab_free(slab);
+}
+
+static struct ocp_sock *ocp_sock_new(int fd, event_callback_fn cb, int flags)
+{
+	struct ocp_sock *s;
+
+	if (flags & FL_PERSISTENT) {
+		s = xcalloc(1, sizeof(*s));
+		s->next = ocp_sock_bind_list;
+		ocp_sock_bind_list = s;
+	} else {
+		s = ocp_sock_alloc();
+		if (!s)
+			return NULL;
+	}
 
 	if (fd < 0)
 		return s;
@@ -258,60 +613,264 @@ static struct ocp_sock *ocp_sock_new(int fd, event_callback_fn cb, int flags)
 	return s;
 }
 
+/* Account for n more (or fewer) pbufs on s->pending */
+static void ocp_rx_hold(struct ocp_sock *s, int n)
+{
+	if (!s->rx_held)
+		rx_holders++;
+	s->rx_held += n;
+	rx_held += n;
+	if (!s->rx_held)
+		rx_holders--;
+	if (rx_held > rx_held_max)
+		rx_held_max = rx_held;
+}
+
+static void ocp_pending_free(struct ocp_sock *s)
+{
+	struct pbuf *p;
+
+	/* pending is a list of chains, so free it one pbuf at a time */
+	while ((p = s->pending) != NULL) {
+		s->pending = p->next;
+		p->next = NULL;
+		pbuf_free(p);
+		ocp_rx_hold(s, -1);
+	}
+}
+
+static void udp_relay_free(struct udp_relay *r);
+
+static void dns_host_found(const char *name, ip_addr_t *ipaddr, void *arg);
+static void dns_domain_found(const char *name, ip_addr_t *ipaddr, void *arg);
+
 static void ocp_sock_del(struct ocp_sock *s)
 {
-	if (s->state == STATE_DNS) {
-		s->state = STATE_DEAD;
-		return;
+	if (s->dns_pending) {
+		dns_cancel(dns_host_found, s);
+		dns_cancel(dns_domain_found, s);
 	}
+	race_end(s);
 	close(s->fd);
-	if (s->tpcb) {
-		tcp_arg(s->tpcb, NULL);
-		tcp_close(s->tpcb);
-	}
+	if (s->rx_wnd > RX_WND_INITIAL)
+		rx_wnd_grown -= s->rx_wnd - RX_WND_INITIAL;
+	if (s->tpcb)
+		ocp_tcp_close(s->tpcb, s->txbuf, s->pending != NULL);
+	else if (s->txbuf)
+		ocp_txbuf_free(s->txbuf);
+	ocp_pending_free(s);
+	if (s->relay)
+		udp_relay_free(s->relay);
+	free(s->sockbuf);
 	event_free(s->ev);
-	memset(s, 0xdd, sizeof(*s));
-	s->next = ocp_sock_free_list;
-	ocp_sock_free_list = s;
-	ocp_sock_used--;
+	if (s->wev)
+		event_free(s->wev);
+	ocp_sock_free(s);
 }
 
 /**********************************************************************
  * lwIP TCP<->socket TCP traffic
  **********************************************************************/
 
+static struct ocp_txbuf *ocp_txbuf_new(void)
+{
+	struct ocp_txbuf *t;
+
+	t = xcalloc(1, sizeof(*t));
+	/* not calloc(): untouched pages don't need to be backed by RAM */
+	t->data = malloc(TXBUF_MIN_LEN);
+	if (!t->data)
+		die("out of memory\n");
+	t->size = TXBUF_MIN_LEN;
+	return t;
+}
+
+static void ocp_txbuf_free(struct ocp_txbuf *t)
+{
+	/* packets queued up for the VPN may still point into t->data */
+	if (netif_default)
+		vpn_tx_flush(netif_default->state);
+	free(t->old);
+	free(t->data);
+	free(t);
+}
+
+/* Is lwIP still holding on to any of t's data? */
+static int ocp_txbuf_busy(struct ocp_txbuf *t)
+{
+	return t->unacked || t->old_unacked;
+}
+
+/*
+ * Double the size of a full ring.  The data in the old ring stays where
+ * it is until it has been ACKed, and new data goes into the new ring.
+ */
+static void ocp_txbuf_grow(struct ocp_txbuf *t)
+{
+	char *data;
+
+	if (t->size >= TXBUF_MAX_LEN || t->old)
+		return;
+	data = malloc(t->size * 2);
+	if (!data)
+		return;
+	t->old = t->data;
+	t->old_unacked = t->unacked;
+	t->data = data;
+	t->size *= 2;
+	t->head = 0;
+	t->unacked = 0;
+	txbuf_grown++;
+}
+
+/* Number of contiguous bytes that can be read in at t->data + t->head */
+static int ocp_txbuf_space(struct ocp_txbuf *t)
+{
+	int tail;
+
+	if (!t->unacked)
+		t->head = 0;
+	else if (t->unacked == t->size)
+		return 0;
+
+	tail = t->head - t->unacked;
+	if (tail < 0)
+		return tail + t->size - t->head;
+	return t->size - t->head;
+}
+
+static void ocp_txbuf_fill(struct ocp_txbuf *t, int len)
+{
+	t->head += len;
+	if (t->head == t->size)
+		t->head = 0;
+	t->unacked += len;
+}
+
+static void ocp_txbuf_acked(struct ocp_txbuf *t, int len)
+{
+	int n;
+
+	if (t->old) {
+		n = LWIP_MIN(len, t->old_unacked);
+		t->old_unacked -= n;
+		len -= n;
+		if (!t->old_unacked) {
+			if (netif_default)
+				vpn_tx_flush(netif_default->state);
+			free(t->old);
+			t->old = NULL;
+		}
+	}
+
+	t->unacked -= len;
+	if (t->unacked < 0)
+		t->unacked = 0;
+}
+
+/* Called when the peer ACKs data from a connection whose socket is gone */
+static err_t orphan_sent_cb(void *ctx, struct tcp_pcb *tpcb, u16_t len)
+{
+	struct ocp_txbuf *t = ctx;
+
+	ocp_txbuf_acked(t, len);
+	if (!ocp_txbuf_busy(t)) {
+		tcp_arg(tpcb, NULL);
+		tcp_sent(tpcb, NULL);
+		tcp_err(tpcb, NULL);
+		ocp_txbuf_free(t);
+	}
+	return ERR_OK;
+}
+
+static void orphan_err_cb(void *ctx, err_t err)
+{
+	struct ocp_txbuf *t = ctx;
+
+	if (t)
+		ocp_txbuf_free(t);
+}
+
+/*
+ * Close the lwIP side of a connection.  lwIP still references any unACKed
+ * data in t, so t is freed once the last of it is ACKed or the pcb dies.
+ * 'undelivered' is set if received data is thrown away.
+ */
+static void ocp_tcp_close(struct tcp_pcb *tpcb, struct ocp_txbuf *t,
+			  int undelivered)
+{
+	int rst;
+
+	tcp_arg(tpcb, NULL);
+
+	/*
+	 * tcp_close() sends a RST if the receive window isn't fully open,
+	 * taking that to mean that received data was lost.  ocp_rx_window()
+	 * may keep the window small, so open it up unless data was lost.
+	 */
+	if (!undelivered)
+		tpcb->rcv_wnd = TCP_WND_MAX(tpcb);
+
+	/* tcp_close() will send a RST and purge the queues in this case */
+	rst = (tpcb->state == ESTABLISHED || tpcb->state == CLOSE_WAIT) &&
+	      (tpcb->refused_data != NULL || tpcb->rcv_wnd != TCP_WND_MAX(tpcb));
+
+	if (!t || !ocp_txbuf_busy(t) || rst) {
+		tcp_close(tpcb);
+		if (t)
+			ocp_txbuf_free(t);
+		return;
+	}
+
+	tcp_arg(tpcb, t);
+	tcp_recv(tpcb, NULL);
+	tcp_sent(tpcb, orphan_sent_cb);
+	tcp_err(tpcb, orphan_err_cb);
+	tcp_close(tpcb);
+}
+
 /* Called when the local TCP socket has data available (or hung up) */
 static void local_data_cb(evutil_socket_t fd, short what, void *ctx)
 {
 	struct ocp_sock *s = ctx;
+	struct ocp_txbuf *t = s->txbuf;
 	ssize_t len;
 	int try_len;
 	err_t err;
 
+	timers_catchup();
+
 	try_len = tcp_sndbuf(s->tpcb);
-	if (try_len > SOCKBUF_LEN)
-		try_len = SOCKBUF_LEN;
+	if (try_len && !ocp_txbuf_space(t))
+		ocp_txbuf_grow(t);
+	if (try_len > ocp_txbuf_space(t))
+		try_len = ocp_txbuf_space(t);
+	/* tcp_write() takes a u16_t length */
+	if (try_len > 0xffff)
+		try_len = 0xffff;
 	if (!try_len || tcp_sndqueuelen(s->tpcb) > (TCP_SND_QUEUELEN/2)) {
 		s->lwip_blocked = 1;
 		return;
 	}
 
-	len = read(s->fd, s->sockbuf, try_len);
+	len = read(s->fd, t->data + t->head, try_len);
 	if (len <= 0) {
 		ocp_sock_del(s);
 		return;
 	}
-	err = tcp_write(s->tpcb, s->sockbuf, len, TCP_WRITE_FLAG_COPY);
+	err = tcp_write(s->tpcb, t->data + t->head, len, 0);
 	if (err == ERR_MEM)
 		die("%s: out of memory\n", __func__);
 	else if (err != ERR_OK)
 		warn("tcp_write returned %d\n", (int)err);
+	else
+		ocp_txbuf_fill(t, len);
 
 	tcp_output(s->tpcb);
 	event_add(s->ev, NULL);
 }
 
-/* Called when lwIP has sent data to the VPN */
+/* Called when the VPN peer has ACKed data that lwIP sent */
 static err_t sent_cb(void *ctx, struct tcp_pcb *tpcb, u16_t len)
 {
 	struct ocp_sock *s = ctx;
@@ -319,6 +878,8 @@ static err_t sent_cb(void *ctx, struct tcp_pcb *tpcb, u16_t len)
 	if (!s)
 		return ERR_OK;
 
+	ocp_txbuf_acked(s->txbuf, len);
+
 	if (s->lwip_blocked) {
 		s->lwip_blocked = 0;
 		event_add(s->ev, NULL);
@@ -327,95 +888,950 @@ static err_t sent_cb(void *ctx, struct tcp_pcb *tpcb, u16_t len)
 	return ERR_OK;
 }
 
+/* tcp_recved() takes a u16_t length */
+static void ocp_tcp_recved(struct tcp_pcb *tpcb, int len)
+{
+	while (len > 0) {
+		int n = len > 0xffff ? 0xffff : len;
+
+		tcp_recved(tpcb, n);
+		len -= n;
+	}
+}
+
+/*
+ * Open up the receive window for the data written to the local socket,
+ * unless received data is piling up and this connection holds more than
+ * its share of it.  Then the window stays shut until the reader catches up.
+ */
+static void ocp_rx_window(struct ocp_sock *s)
+{
+	int n;
+
+	if (!s->rx_withheld)
+		return;
+	if (rx_held > RX_HELD_MAX && s->rx_held > RX_HELD_MAX / rx_holders) {
+		/* give back what the window grew by, and sit on the rest */
+		n = LWIP_MIN(s->rx_withheld, s->rx_wnd - RX_WND_INITIAL);
+		if (n > 0) {
+			s->rx_wnd -= n;
+			s->rx_withheld -= n;
+			rx_wnd_grown -= n;
+		}
+		rx_throttled++;
+		return;
+	}
+
+	/* the reader has caught up: let in as much again next time */
+	if (!s->pending && rx_held <= RX_HELD_MAX / 2) {
+		n = LWIP_MIN(s->rx_withheld,
+			     (int)TCP_WND_MAX(s->tpcb) - s->rx_wnd);
+		n = LWIP_MIN(n, RX_WND_GROWTH_MAX - rx_wnd_grown);
+		if (n > 0 && s->rx_wnd >= RX_WND_INITIAL) {
+			s->rx_wnd += n;
+			s->rx_withheld += n;
+			rx_wnd_grown += n;
+		}
+	}
+	ocp_tcp_recved(s->tpcb, s->rx_withheld);
+	s->rx_withheld = 0;
+}
+
+/*
+ * Write as much pending VPN data as possible to the local socket, and
+ * open up the TCP receive window by the same amount.  If the socket fills
+ * up, wait for EV_WRITE and try again.  Returns -1 if s was deleted.
+ */
+static int local_flush(struct ocp_sock *s)
+{
+	struct iovec iov[MAX_IOVEC];
+	struct pbuf *p;
+	int i, offset, total;
+	ssize_t wlen;
+
+	while (s->pending) {
+		offset = s->done_len;
+		for (i = 0, total = 0, p = s->pending; p && i < MAX_IOVEC;
+		     p = p->next, i++) {
+			iov[i].iov_base = (char *)p->payload + offset;
+			iov[i].iov_len = p->len - offset;
+			total += p->len - offset;
+			offset = 0;
+		}
+
+		wlen = writev(s->fd, iov, i);
+		if (wlen < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				ocp_sock_del(s);
+				return -1;
+			}
+			wlen = 0;
+		}
+
+		/* release the pbufs that made it out */
+		s->done_len += wlen;
+		while ((p = s->pending) != NULL && s->done_len >= p->len) {
+			s->done_len -= p->len;
+			s->pending = p->next;
+			p->next = NULL;
+			pbuf_free(p);
+			ocp_rx_hold(s, -1);
+		}
+		s->rx_withheld += wlen;
+		ocp_rx_window(s);
+
+		if (wlen < total) {
+			event_add(s->wev, NULL);
+			return 0;
+		}
+	}
+
+	if (s->vpn_eof) {
+		ocp_sock_del(s);
+		return -1;
+	}
+	return 0;
+}
+
+/* Called when the local TCP socket has room for more data from the VPN */
+static void local_write_cb(evutil_socket_t fd, short what, void *ctx)
+{
+	timers_catchup();
+	local_flush(ctx);
+}
+
 /* Called when lwIP has new TCP data from the VPN */
 static err_t recv_cb(void *ctx, struct tcp_pcb *tpcb, struct pbuf *p, err_t err)
 {
 	struct ocp_sock *s = ctx;
-	struct pbuf *first = p;
-	int offset;
-	ssize_t wlen;
+	struct pbuf *q;
+	int n;
 
 	if (!s)
 		return ERR_ABRT;
 
 	if (!p) {
-		ocp_sock_del(s);
+		/* close the local socket once all pending data is written */
+		if (s->pending)
+			s->vpn_eof = 1;
+		else
+			ocp_sock_del(s);
 		return ERR_OK;
 	}
 
 	/*
-	 * tcp_tmr() will call this function every 250ms with the same pbuf,
-	 * if we refused data during the previous attempt.  s->done_len
-	 * will reflect the number of bytes we were able to send to the socket
-	 * so far (if any).
+	 * Always take ownership of p.  Anything that doesn't fit in the
+	 * socket buffer is queued on s->pending (in order) and written from
+	 * local_write_cb(); the receive window stays closed for those bytes
+	 * until then.  pbuf_cat() can't be used because tot_len is a u16_t.
 	 */
-
-	for (offset = s->done_len; p && offset >= p->len; offset -= p->len)
-		p = p->next;
-
-	for (; p; p = p->next) {
-		int try_len = p->len - offset;
-
-		wlen = write(s->fd, (char *)p->payload + offset, try_len);
-		offset = 0;
-
-		if (wlen < 0) {
-			ocp_sock_del(s);
-			return ERR_ABRT;
-		}
-		s->done_len += wlen;
-		tcp_recved(tpcb, wlen);
-		if (wlen < try_len)
-			return ERR_WOULDBLOCK;
+	for (n = 0, q = p; q; q = q->next)
+		n++;
+	ocp_rx_hold(s, n);
+
+	if (s->pending) {
+		for (q = s->pending; q->next; q = q->next)
+			;
+		q->next = p;
+		return ERR_OK;
 	}
 
-	/* if we got here, then the whole pbuf is done */
+	s->pending = p;
 	s->done_len = 0;
-	pbuf_free(first);
-
-	return ERR_OK;
+	return local_flush(s) < 0 ? ERR_ABRT : ERR_OK;
 }
 
 /**********************************************************************
- * SOCKS protocol
+ * lwIP UDP<->socket UDP traffic
  **********************************************************************/
 
-static void socks_reply(struct ocp_sock *s, int rep)
+/* Allocate a pbuf that a local datagram can be read into */
+static struct pbuf *udp_rx_pbuf(void)
 {
-	struct socks_reply rsp;
+	struct pbuf *p;
 
-	memset(&rsp, 0, sizeof(rsp));
-	rsp.ver = SOCKS_VER;
-	rsp.rep = rep;
-	rsp.atyp = SOCKS_ATYP_IPV4;
+	p = pbuf_alloc(PBUF_TRANSPORT, UDP_RX_LEN, PBUF_POOL);
+	if (!p)
+		warn("%s: could not allocate pbuf\n", __func__);
+	return p;
+}
 
-	if (rep == 0 && s->tpcb) {
-		rsp.bnd_addr = htonl(s->tpcb->local_ip.addr);
-		rsp.bnd_port = htons(s->tpcb->local_port);
+static void udp_rx_init(void)
+{
+#ifdef USE_MMSG
+	int i;
+
+	udp_rx_msgs = xcalloc(vpn_batch, sizeof(*udp_rx_msgs));
+	udp_rx_iov = xcalloc(vpn_batch, sizeof(*udp_rx_iov));
+	udp_rx_from = xcalloc(vpn_batch, sizeof(*udp_rx_from));
+	udp_rx_pbufs = xcalloc(vpn_batch, sizeof(*udp_rx_pbufs));
+
+	for (i = 0; i < vpn_batch; i++) {
+		udp_rx_msgs[i].msg_hdr.msg_iov = &udp_rx_iov[i];
+		udp_rx_msgs[i].msg_hdr.msg_iovlen = 1;
+		udp_rx_msgs[i].msg_hdr.msg_name = &udp_rx_from[i];
 	}
-	if (write(s->fd, &rsp, sizeof(rsp)) != sizeof(rsp))
-		rep = -1;
-
-	if (rep != 0)
-		ocp_sock_del(s);
+#endif
 }
 
-static void socks_cmd_cb(evutil_socket_t fd, short what, void *ctx)
+/*
+ * Read up to vpn_batch datagrams from a local UDP socket, and pass each
+ * one to input(), which takes ownership of the pbuf.  Datagrams that don't
+ * fit in a single pbuf are dropped.
+ */
+static void udp_sock_read(int fd, void (*input)(void *ctx, struct pbuf *p,
+				struct sockaddr_in *from), void *ctx)
 {
-	struct ocp_sock *s = ctx;
-	ssize_t ret;
-	struct socks_auth *auth = (void *)s->sockbuf;
-	struct socks_req *req = (void *)s->sockbuf;
-	ip_addr_t ip;
+#ifdef USE_MMSG
+	struct pbuf *p;
+	int i, n;
+
+	for (n = 0; n < vpn_batch; n++) {
+		if (!udp_rx_pbufs[n]) {
+			p = udp_rx_pbuf();
+			if (!p)
+				break;
+			udp_rx_pbufs[n] = p;
+			udp_rx_iov[n].iov_base = p->payload;
+			udp_rx_iov[n].iov_len = p->len;
+		}
+		udp_rx_msgs[n].msg_hdr.msg_namelen = sizeof(*udp_rx_from);
+	}
+	if (!n)
+		return;
 
-	if (s->state == STATE_DATA) {
-		/* we're done with the SOCKS negotiation so just pass data */
-		local_data_cb(fd, what, ctx);
+	n = recvmmsg(fd, udp_rx_msgs, n, MSG_DONTWAIT, NULL);
+	if (n <= 0)
 		return;
-	}
 
-	ret = read(s->fd, s->sockbuf + s->sock_pos, SOCKBUF_LEN - s->sock_pos);
-	if (ret <= 0)
+	for (i = 0; i < n; i++) {
+		if (udp_rx_msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+			udp_pkts_dropped++;
+			continue;
+		}
+		p = udp_rx_pbufs[i];
+		udp_rx_pbufs[i] = NULL;
+		pbuf_realloc(p, udp_rx_msgs[i].msg_len);
+		input(ctx, p, &udp_rx_from[i]);
+	}
+#else
+	struct sockaddr_in from;
+	socklen_t fromlen = sizeof(from);
+	struct pbuf *p;
+	ssize_t len;
+
+	p = udp_rx_pbuf();
+	if (!p)
+		return;
+	len = recvfrom(fd, p->payload, p->len, MSG_DONTWAIT | MSG_TRUNC,
+		       (struct sockaddr *)&from, &fromlen);
+	if (len < 0 || len > p->len) {
+		if (len > p->len)
+			udp_pkts_dropped++;
+		pbuf_free(p);
+		return;
+	}
+	pbuf_realloc(p, len);
+	input(ctx, p, &from);
+#endif
+}
+
+/* Send all queued datagrams out of q->fd */
+static void udp_txq_flush(struct udp_txq *q)
+{
+#ifdef USE_MMSG
+	int i = 0, n;
+
+	while (i < q->count) {
+		n = sendmmsg(q->fd, &q->msgs[i], q->count - i, MSG_DONTWAIT);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			/* the socket buffer is full, or the client is gone */
+			udp_pkts_dropped++;
+			i++;
+			continue;
+		}
+		udp_pkts_in += n;
+		i += n;
+	}
+
+	for (i = 0; i < q->count; i++)
+		pbuf_free(q->pbufs[i]);
+	q->count = 0;
+	q->iov_used = 0;
+#endif
+}
+
+/* Flush every local UDP socket that has datagrams queued */
+static void udp_tx_flush_all(void)
+{
+	struct udp_txq *q;
+
+	while ((q = udp_txq_dirty) != NULL) {
+		udp_txq_dirty = q->next_dirty;
+		q->on_dirty = 0;
+		udp_txq_flush(q);
+	}
+}
+
+/*
+ * Queue datagram p (whose ownership passes to q) for the local address to.
+ * Without sendmmsg() it goes out right away.
+ */
+static void udp_txq_add(struct udp_txq *q, struct pbuf *p,
+			struct sockaddr_in *to)
+{
+	struct msghdr *msg;
+	struct iovec *iov;
+	struct pbuf *r;
+	int n_iov = 0;
+
+	for (r = p; r; r = r->next)
+		n_iov++;
+	if (n_iov > MAX_IOVEC) {
+		udp_pkts_dropped++;
+		pbuf_free(p);
+		return;
+	}
+
+#ifdef USE_MMSG
+	if (!q->msgs) {
+		q->iov_max = vpn_batch * BATCH_IOV_PER_PKT;
+		if (q->iov_max < MAX_IOVEC)
+			q->iov_max = MAX_IOVEC;
+		q->msgs = xcalloc(vpn_batch, sizeof(*q->msgs));
+		q->iov = xcalloc(q->iov_max, sizeof(*q->iov));
+		q->pbufs = xcalloc(vpn_batch, sizeof(*q->pbufs));
+	}
+	if (q->count == vpn_batch || q->iov_used + n_iov > q->iov_max)
+		udp_txq_flush(q);
+	/* a full queue is flushed above but stays linked */
+	if (!q->on_dirty) {
+		q->next_dirty = udp_txq_dirty;
+		udp_txq_dirty = q;
+		q->on_dirty = 1;
+	}
+
+	iov = &q->iov[q->iov_used];
+	msg = &q->msgs[q->count].msg_hdr;
+	q->pbufs[q->count++] = p;
+	q->iov_used += n_iov;
+#else
+	struct msghdr m;
+	struct iovec iov_buf[MAX_IOVEC];
+
+	iov = iov_buf;
+	msg = &m;
+#endif
+
+	memset(msg, 0, sizeof(*msg));
+	msg->msg_name = to;
+	msg->msg_namelen = sizeof(*to);
+	msg->msg_iov = iov;
+	msg->msg_iovlen = n_iov;
+	for (r = p; r; r = r->next) {
+		iov->iov_base = r->payload;
+		iov++->iov_len = r->len;
+	}
+
+#ifndef USE_MMSG
+	if (sendmsg(q->fd, msg, MSG_DONTWAIT) < 0)
+		udp_pkts_dropped++;
+	else
+		udp_pkts_in++;
+	pbuf_free(p);
+#endif
+}
+
+static void udp_txq_free(struct udp_txq *q)
+{
+	struct udp_txq **pp;
+	int i;
+
+	if (q->on_dirty) {
+		for (pp = &udp_txq_dirty; *pp != q; pp = &(*pp)->next_dirty)
+			;
+		*pp = q->next_dirty;
+	}
+	for (i = 0; i < q->count; i++)
+		pbuf_free(q->pbufs[i]);
+	free(q->msgs);
+	free(q->iov);
+	free(q->pbufs);
+}
+
+/* Open a non-blocking UDP socket on addr, and fill in the port it got */
+static int udp_sock_open(struct sockaddr_in *addr)
+{
+	socklen_t len = sizeof(*addr);
+	int fd;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0)
+		return -1;
+	if (evutil_make_socket_nonblocking(fd) < 0 ||
+	    bind(fd, (struct sockaddr *)addr, sizeof(*addr)) < 0 ||
+	    getsockname(fd, (struct sockaddr *)addr, &len) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void udp_relay_free(struct udp_relay *r)
+{
+	udp_remove(r->upcb);
+	event_free(r->ev);
+	event_free(r->idle_ev);
+	close(r->fd);
+	udp_txq_free(&r->txq);
+	free(r);
+	udp_relays--;
+}
+
+/* Called with each datagram the SOCKS client sends to the relay */
+static void udp_relay_input(void *ctx, struct pbuf *p, struct sockaddr_in *from)
+{
+	struct udp_relay *r = ctx;
+	u8_t *hdr = p->payload;
+	char name[256];
+	ip_addr_t ip;
+	int hlen, namelen;
+	u16_t port;
+	err_t err;
+
+	/* only accept datagrams from the host that set up the association */
+	if (from->sin_addr.s_addr != r->client.sin_addr.s_addr ||
+	    (r->client.sin_port && from->sin_port != r->client.sin_port))
+		goto drop;
+	r->client.sin_port = from->sin_port;
+
+	/* fragmented datagrams are not supported, so drop them (RFC 1928);
+	   every address type has at least the byte at hdr[4] */
+	if (p->len < 5 || hdr[2] != 0)
+		goto drop;
+
+	if (hdr[3] == SOCKS_ATYP_IPV4) {
+		hlen = SOCKS_UDP_HLEN_IPV4;
+		if (p->len < hlen)
+			goto drop;
+		memcpy(&ip.addr, &hdr[4], 4);
+		port = (hdr[8] << 8) | hdr[9];
+	} else if (hdr[3] == SOCKS_ATYP_DOMAIN) {
+		namelen = hdr[4];
+		hlen = 5 + namelen + 2;
+		if (p->len < hlen)
+			goto drop;
+		memcpy(name, &hdr[5], namelen);
+		name[namelen] = 0;
+		port = (hdr[5 + namelen] << 8) | hdr[6 + namelen];
+
+		/* drop datagrams for names that aren't in the cache yet;
+		   the next datagram will find the answer there */
+		err = dns_gethostbyname(name, &ip, NULL, NULL);
+		if (err == ERR_INPROGRESS) {
+			dns_tmr_arm();
+			udp_pkts_unresolved++;
+			pbuf_free(p);
+			return;
+		}
+		if (err != ERR_OK)
+			goto drop;
+	} else
+		goto drop;
+
+	r->last_active = sys_now();
+	pbuf_header(p, -hlen);
+	if (udp_sendto(r->upcb, p, &ip, port) != ERR_OK)
+		goto drop;
+	udp_pkts_out++;
+	pbuf_free(p);
+	return;
+
+drop:
+	udp_pkts_dropped++;
+	pbuf_free(p);
+}
+
+/* Called when the SOCKS client has sent datagrams to the relay */
+static void udp_relay_read_cb(evutil_socket_t fd, short what, void *ctx)
+{
+	struct udp_relay *r = ctx;
+
+	timers_catchup();
+	udp_sock_read(r->fd, udp_relay_input, r);
+	event_add(r->ev, NULL);
+}
+
+/* Called when lwIP has a datagram from the VPN for a UDP association */
+static void udp_relay_recv_cb(void *arg, struct udp_pcb *upcb, struct pbuf *p,
+			      ip_addr_t *addr, u16_t port)
+{
+	struct udp_relay *r = arg;
+	struct pbuf *h;
+	u8_t *hdr;
+
+	if (!r->client.sin_port) {
+		/* nowhere to send it yet */
+		udp_pkts_dropped++;
+		pbuf_free(p);
+		return;
+	}
+
+	/* prepend the SOCKS header in the space the IP/UDP headers used */
+	if (pbuf_header(p, SOCKS_UDP_HLEN_IPV4) != 0) {
+		h = pbuf_alloc(PBUF_RAW, SOCKS_UDP_HLEN_IPV4, PBUF_RAM);
+		if (!h) {
+			udp_pkts_dropped++;
+			pbuf_free(p);
+			return;
+		}
+		pbuf_cat(h, p);
+		p = h;
+	}
+	hdr = p->payload;
+	hdr[0] = hdr[1] = hdr[2] = 0;
+	hdr[3] = SOCKS_ATYP_IPV4;
+	memcpy(&hdr[4], &addr->addr, 4);
+	hdr[8] = port >> 8;
+	hdr[9] = port & 0xff;
+
+	r->last_active = sys_now();
+	udp_txq_add(&r->txq, p, &r->client);
+}
+
+/* Close associations that have been idle for UDP_IDLE_MS */
+static void udp_relay_idle_cb(evutil_socket_t fd, short what, void *ctx)
+{
+	struct udp_relay *r = ctx;
+	u32_t idle = sys_now() - r->last_active;
+	struct timeval tv;
+
+	if (idle >= UDP_IDLE_MS) {
+		ocp_sock_del(r->ctl);
+		return;
+	}
+	idle = UDP_IDLE_MS - idle;
+	tv.tv_sec = idle / 1000;
+	tv.tv_usec = 1000 * (idle % 1000);
+	evtimer_add(r->idle_ev, &tv);
+}
+
+/*
+ * Set up the relay for a UDP ASSOCIATE request on s.  Datagrams are
+ * accepted from the client's address, and from port (if nonzero).
+ */
+static struct udp_relay *udp_relay_new(struct ocp_sock *s, u16_t port)
+{
+	struct udp_relay *r;
+	struct sockaddr_in peer;
+	socklen_t len = sizeof(peer);
+	struct timeval tv;
+
+	r = xcalloc(1, sizeof(*r));
+	r->ctl = s;
+
+	/* bind to the address the client reached us on */
+	len = sizeof(r->bnd);
+	if (getsockname(s->fd, (struct sockaddr *)&r->bnd, &len) < 0 ||
+	    r->bnd.sin_family != AF_INET)
+		goto err;
+	len = sizeof(peer);
+	if (getpeername(s->fd, (struct sockaddr *)&peer, &len) < 0)
+		goto err;
+	r->client.sin_family = AF_INET;
+	r->client.sin_addr = peer.sin_addr;
+	r->client.sin_port = htons(port);
+
+	r->bnd.sin_port = 0;
+	r->fd = udp_sock_open(&r->bnd);
+	if (r->fd < 0)
+		goto err;
+	r->txq.fd = r->fd;
+
+	r->upcb = udp_new();
+	if (!r->upcb) {
+		warn("%s: out of UDP PCBs\n", __func__);
+		close(r->fd);
+		goto err;
+	}
+	udp_bind(r->upcb, IP_ADDR_ANY, 0);
+	udp_recv(r->upcb, udp_relay_recv_cb, r);
+
+	r->ev = event_new(event_base, r->fd, EV_READ, udp_relay_read_cb, r);
+	r->idle_ev = evtimer_new(event_base, udp_relay_idle_cb, r);
+	event_add(r->ev, NULL);
+	r->last_active = sys_now();
+	tv.tv_sec = UDP_IDLE_MS / 1000;
+	tv.tv_usec = 1000 * (UDP_IDLE_MS % 1000);
+	evtimer_add(r->idle_ev, &tv);
+
+	udp_relays++;
+	return r;
+
+err:
+	free(r);
+	return NULL;
+}
+
+/* Bucket for the datagrams that fwd receives from client */
+static struct udp_flow **udp_flow_bucket(struct ocp_sock *fwd,
+					 struct sockaddr_in *client)
+{
+	u32_t h = client->sin_addr.s_addr ^
+		  ((u32_t)client->sin_port << 16) ^ fwd->lport;
+
+	return &udp_flow_hash[(u32_t)(h * 0x9e3779b1U) >>
+			      (32 - UDP_FLOW_HASH_BITS)];
+}
+
+static struct udp_flow *udp_flow_find(struct ocp_sock *fwd,
+				      struct sockaddr_in *client)
+{
+	struct udp_flow *f;
+
+	for (f = *udp_flow_bucket(fwd, client); f; f = f->hnext)
+		if (f->fwd == fwd &&
+		    f->client.sin_addr.s_addr == client->sin_addr.s_addr &&
+		    f->client.sin_port == client->sin_port)
+			return f;
+	return NULL;
+}
+
+static void udp_flow_lru_unlink(struct udp_flow *f)
+{
+	if (f->lru_prev)
+		f->lru_prev->lru_next = f->lru_next;
+	else
+		udp_flow_lru = f->lru_next;
+	if (f->lru_next)
+		f->lru_next->lru_prev = f->lru_prev;
+	else
+		udp_flow_lru_tail = f->lru_prev;
+}
+
+static void udp_flow_lru_push(struct udp_flow *f)
+{
+	f->lru_prev = NULL;
+	f->lru_next = udp_flow_lru;
+	if (udp_flow_lru)
+		udp_flow_lru->lru_prev = f;
+	else
+		udp_flow_lru_tail = f;
+	udp_flow_lru = f;
+}
+
+/* Mark f as just used; the LRU list stays sorted by last_active */
+static void udp_flow_touch(struct udp_flow *f)
+{
+	f->last_active = sys_now();
+	if (f != udp_flow_lru) {
+		udp_flow_lru_unlink(f);
+		udp_flow_lru_push(f);
+	}
+}
+
+static void udp_flow_drop_pending(struct udp_flow *f)
+{
+	while (f->n_pending) {
+		pbuf_free(f->pending[--f->n_pending]);
+		udp_pkts_dropped++;
+	}
+}
+
+/*
+ * Take f out of the table.  If a DNS lookup is still using f, it is freed
+ * once the lookup returns.
+ */
+static void udp_flow_del(struct udp_flow *f)
+{
+	struct udp_flow **pp;
+
+	for (pp = udp_flow_bucket(f->fwd, &f->client); *pp != f;
+	     pp = &(*pp)->hnext)
+		;
+	*pp = f->hnext;
+	udp_flow_lru_unlink(f);
+	udp_flows--;
+
+	udp_remove(f->upcb);
+	udp_flow_drop_pending(f);
+	if (f->resolving)
+		f->dead = 1;
+	else
+		free(f);
+}
+
+static void udp_flow_tmr_arm(void)
+{
+	struct timeval tv;
+	u32_t ms;
+
+	if (!udp_flow_lru_tail || evtimer_pending(udp_flow_ev, NULL))
+		return;
+	ms = udp_flow_lru_tail->last_active + UDP_IDLE_MS - sys_now();
+	if ((s32_t)ms < 0)
+		ms = 0;
+	tv.tv_sec = ms / 1000;
+	tv.tv_usec = 1000 * (ms % 1000);
+	evtimer_add(udp_flow_ev, &tv);
+}
+
+/* Expire idle flows, oldest first */
+static void udp_flow_tmr_cb(evutil_socket_t fd, short what, void *ctx)
+{
+	u32_t now = sys_now();
+
+	while (udp_flow_lru_tail &&
+	       now - udp_flow_lru_tail->last_active >= UDP_IDLE_MS)
+		udp_flow_del(udp_flow_lru_tail);
+	udp_flow_tmr_arm();
+}
+
+/* Send f's queued datagrams, now that its udp_pcb is connected */
+static void udp_flow_send_pending(struct udp_flow *f)
+{
+	int i;
+
+	for (i = 0; i < f->n_pending; i++) {
+		if (udp_send(f->upcb, f->pending[i]) == ERR_OK)
+			udp_pkts_out++;
+		else
+			udp_pkts_dropped++;
+		pbuf_free(f->pending[i]);
+	}
+	f->n_pending = 0;
+}
+
+static void udp_flow_dns_cb(const char *name, ip_addr_t *ipaddr, void *arg)
+{
+	struct udp_flow *f = arg;
+
+	f->resolving = 0;
+	if (f->dead) {
+		free(f);
+		return;
+	}
+	if (!ipaddr) {
+		udp_flow_del(f);
+		return;
+	}
+	f->rhost = *ipaddr;
+	udp_connect(f->upcb, &f->rhost, f->fwd->rport);
+	udp_flow_send_pending(f);
+}
+
+/* Called when lwIP has a reply from the VPN for a -U flow */
+static void udp_flow_recv_cb(void *arg, struct udp_pcb *upcb, struct pbuf *p,
+			     ip_addr_t *addr, u16_t port)
+{
+	struct udp_flow *f = arg;
+
+	/* not connected to the remote host yet */
+	if (f->resolving) {
+		udp_pkts_dropped++;
+		pbuf_free(p);
+		return;
+	}
+	udp_flow_touch(f);
+	udp_txq_add(f->fwd->txq, p, &f->client);
+}
+
+/*
+ * Set up a flow for a new client, evicting the least recently used one if
+ * the table is full
+ */
+static struct udp_flow *udp_flow_new(struct ocp_sock *fwd,
+				     struct sockaddr_in *client)
+{
+	struct udp_flow *f, **pp;
+	struct udp_pcb *upcb;
+	char fqdn[DNS_MAX_NAME_LENGTH + 1];
+	const char *name = fwd->rhost_name;
+	err_t err;
+
+	if (udp_flows >= UDP_MAX_FLOWS) {
+		udp_flow_del(udp_flow_lru_tail);
+		udp_flows_evicted++;
+	}
+	upcb = udp_new();
+	if (!upcb && udp_flow_lru_tail) {
+		/* the SOCKS relays took the rest of the pcbs */
+		udp_flow_del(udp_flow_lru_tail);
+		udp_flows_evicted++;
+		upcb = udp_new();
+	}
+	if (!upcb) {
+		warn("%s: out of UDP PCBs\n", __func__);
+		return NULL;
+	}
+	udp_bind(upcb, IP_ADDR_ANY, 0);
+
+	f = xcalloc(1, sizeof(*f));
+	f->fwd = fwd;
+	f->client = *client;
+	f->upcb = upcb;
+	udp_recv(upcb, udp_flow_recv_cb, f);
+
+	pp = udp_flow_bucket(fwd, client);
+	f->hnext = *pp;
+	*pp = f;
+	f->last_active = sys_now();
+	udp_flow_lru_push(f);
+	udp_flows++;
+	udp_flow_tmr_arm();
+
+	if (!strchr(name, '.') && dns_domain &&
+	    snprintf(fqdn, sizeof(fqdn), "%s.%s", name, dns_domain) <
+	    (int)sizeof(fqdn))
+		name = fqdn;
+
+	f->resolving = 1;
+	err = dns_gethostbyname(name, &f->rhost, udp_flow_dns_cb, f);
+	if (err == ERR_INPROGRESS) {
+		dns_tmr_arm();
+		return f;
+	}
+	f->resolving = 0;
+	if (err != ERR_OK) {
+		if (err != ERR_VAL)
+			warn("%s: can't look up '%s'\n", __func__, name);
+		udp_flow_del(f);
+		return NULL;
+	}
+	udp_connect(upcb, &f->rhost, fwd->rport);
+	return f;
+}
+
+/* Called with each datagram a client sends to a -U listener */
+static void udp_fwd_input(void *ctx, struct pbuf *p, struct sockaddr_in *from)
+{
+	struct ocp_sock *fwd = ctx;
+	struct udp_flow *f;
+
+	f = udp_flow_find(fwd, from);
+	if (f)
+		udp_flow_touch(f);
+	else {
+		f = udp_flow_new(fwd, from);
+		if (!f)
+			goto drop;
+	}
+
+	if (f->resolving) {
+		if (f->n_pending == UDP_FLOW_PENDING)
+			goto drop;
+		f->pending[f->n_pending++] = p;
+		return;
+	}
+
+	if (udp_send(f->upcb, p) != ERR_OK)
+		goto drop;
+	udp_pkts_out++;
+	pbuf_free(p);
+	return;
+
+drop:
+	udp_pkts_dropped++;
+	pbuf_free(p);
+}
+
+/* Called when datagrams have arrived on a -U listener */
+static void udp_fwd_read_cb(evutil_socket_t fd, short what, void *ctx)
+{
+	struct ocp_sock *s = ctx;
+
+	timers_catchup();
+	udp_sock_read(s->fd, udp_fwd_input, s);
+	event_add(s->ev, NULL);
+}
+
+/**********************************************************************
+ * SOCKS protocol
+ **********************************************************************/
+
+/* Returns 1 if s was deleted: on errors, or if the client has gone */
+static int socks_reply(struct ocp_sock *s, int rep)
+{
+	struct socks_reply rsp;
+
+	memset(&rsp, 0, sizeof(rsp));
+	rsp.ver = SOCKS_VER;
+	rsp.rep = rep;
+	rsp.atyp = SOCKS_ATYP_IPV4;
+
+	if (rep == 0 && s->relay) {
+		rsp.bnd_addr = s->relay->bnd.sin_addr.s_addr;
+		rsp.bnd_port = s->relay->bnd.sin_port;
+	} else if (rep == 0 && s->tpcb) {
+		rsp.bnd_addr = htonl(s->tpcb->local_ip.addr);
+		rsp.bnd_port = htons(s->tpcb->local_port);
+	}
+	if (write(s->fd, &rsp, sizeof(rsp)) != sizeof(rsp)) {
+		rep = -1;
+		/* nobody to relay the connection to: reset it */
+		if (s->tpcb) {
+			tcp_arg(s->tpcb, NULL);
+			tcp_err(s->tpcb, NULL);
+			tcp_abort(s->tpcb);
+			s->tpcb = NULL;
+		}
+	}
+
+	if (rep == 0)
+		return 0;
+	ocp_sock_del(s);
+	return 1;
+}
+
+/* Answer a UDP ASSOCIATE request; the client will send from port */
+static void socks_udp_associate(struct ocp_sock *s, u16_t port)
+{
+	free(s->sockbuf);
+	s->sockbuf = NULL;
+
+	s->relay = udp_relay_new(s, port);
+	if (!s->relay) {
+		socks_reply(s, SOCKS_GEN_FAILURE);
+		return;
+	}
+	s->state = STATE_UDP;
+	event_add(s->ev, NULL);
+	socks_reply(s, SOCKS_OK);
+}
+
+/* The association lasts until the control connection is closed */
+static void socks_udp_ctl(struct ocp_sock *s)
+{
+	char buf[64];
+
+	if (read(s->fd, buf, sizeof(buf)) <= 0) {
+		ocp_sock_del(s);
+		return;
+	}
+	event_add(s->ev, NULL);
+}
+
+static void socks_cmd_cb(evutil_socket_t fd, short what, void *ctx)
+{
+	struct ocp_sock *s = ctx;
+	ssize_t ret;
+	struct socks_auth *auth = (void *)s->sockbuf;
+	struct socks_req *req = (void *)s->sockbuf;
+	ip_addr_t ip;
+
+	if (s->state == STATE_DATA) {
+		/* we're done with the SOCKS negotiation so just pass data */
+		local_data_cb(fd, what, ctx);
+		return;
+	} else if (s->state == STATE_UDP) {
+		socks_udp_ctl(s);
+		return;
+	}
+
+	ret = read(s->fd, s->sockbuf + s->sock_pos, SOCKBUF_LEN - s->sock_pos);
+	if (ret <= 0)
 		goto disconnect;
 	s->sock_pos += ret;
 
@@ -440,7 +1856,8 @@ static void socks_cmd_cb(evutil_socket_t fd, short what, void *ctx)
 		/* read cmd, atyp */
 		if (s->sock_pos <= offsetof(struct socks_req, atyp))
 			goto req_more;
-		if (req->cmd != SOCKS_CMD_CONNECT) {
+		if (req->cmd != SOCKS_CMD_CONNECT &&
+		    req->cmd != SOCKS_CMD_UDP_ASSOCIATE) {
 			socks_reply(s, SOCKS_CMDNOTSUPP);
 			return;
 		}
@@ -449,7 +1866,10 @@ static void socks_cmd_cb(evutil_socket_t fd, short what, void *ctx)
 				goto req_more;
 			ip.addr = req->u.ipv4.dst_addr;
 			s->rport = ntohs(req->u.ipv4.dst_port);
-			start_connection(s, &ip);
+			if (req->cmd == SOCKS_CMD_UDP_ASSOCIATE)
+				socks_udp_associate(s, s->rport);
+			else
+				start_connection(s, &ip, 1);
 			return;
 		} else if (req->atyp == SOCKS_ATYP_DOMAIN) {
 			u8_t *name = req->u.fqdn.fqdn_name;
@@ -463,7 +1883,10 @@ static void socks_cmd_cb(evutil_socket_t fd, short what, void *ctx)
 				goto req_more;
 			s->rport = (name[namelen] << 8) | name[namelen + 1];
 			name[namelen] = 0;
-			start_resolution(s, (char *)name);
+			if (req->cmd == SOCKS_CMD_UDP_ASSOCIATE)
+				socks_udp_associate(s, s->rport);
+			else
+				start_resolution(s, (char *)name);
 			return;
 		} else {
 			socks_reply(s, SOCKS_ADDRNOTSUPP);
@@ -503,10 +1926,18 @@ static err_t connect_cb(void *arg, struct tcp_pcb *tpcb, err_t err)
 {
 	struct ocp_sock *s = arg;
 
-	if (s->conn_type == CONN_TYPE_SOCKS)
-		socks_reply(s, SOCKS_OK);
+	/* if the client has gone, tpcb was aborted along with s */
+	if (s->conn_type == CONN_TYPE_SOCKS && socks_reply(s, SOCKS_OK))
+		return ERR_ABRT;
+
+	/* the SYN-ACK was just processed, and this comes before our ACK */
+	if (tpcb->rcv_wnd > RX_WND_INITIAL)
+		tpcb->rcv_wnd = tpcb->rcv_ann_wnd = RX_WND_INITIAL;
+	s->rx_wnd = tpcb->rcv_wnd;
 
 	s->state = STATE_DATA;
+	s->txbuf = ocp_txbuf_new();
+	s->wev = event_new(event_base, s->fd, EV_WRITE, local_write_cb, s);
 	event_add(s->ev, NULL);
 	tcp_recv(tpcb, recv_cb);
 	tcp_sent(tpcb, sent_cb);
@@ -514,21 +1945,102 @@ static err_t connect_cb(void *arg, struct tcp_pcb *tpcb, err_t err)
 	return ERR_OK;
 }
 
-static void start_connection(struct ocp_sock *s, ip_addr_t *ipaddr)
+/* Abort the attempts that are still connecting */
+static void race_end(struct ocp_sock *s)
 {
 	struct tcp_pcb *tpcb;
+	int i;
+
+	for (i = 0; i < s->race_next; i++) {
+		tpcb = s->race[i].tpcb;
+		if (tpcb) {
+			tcp_arg(tpcb, NULL);
+			tcp_err(tpcb, NULL);
+			tcp_abort(tpcb);
+			s->race[i].tpcb = NULL;
+		}
+	}
+	s->race_live = 0;
+	if (s->race_ev) {
+		event_free(s->race_ev);
+		s->race_ev = NULL;
+	}
+}
+
+/* Called when an attempt's SYN is answered: it wins the race */
+static err_t race_connect_cb(void *arg, struct tcp_pcb *tpcb, err_t err)
+{
+	struct ocp_attempt *a = arg;
+	struct ocp_sock *s = a->s;
+
+	a->tpcb = NULL;
+	race_end(s);
+	if (a != &s->race[0])
+		connect_race_fallbacks++;
+
+	tcp_arg(tpcb, s);
+	tcp_err(tpcb, tcp_err_cb);
+	s->tpcb = tpcb;
+	return connect_cb(s, tpcb, err);
+}
+
+static void race_start(struct ocp_sock *s);
+
+/* Called when an attempt is refused or times out */
+static void race_err_cb(void *arg, err_t err)
+{
+	struct ocp_attempt *a = arg;
+	struct ocp_sock *s = a->s;
+
+	a->tpcb = NULL;
+	s->race_live--;
+
+	/* don't wait for the timer to try the next address */
+	if (s->race_next < s->race_n) {
+		race_start(s);
+		return;
+	}
+	if (s->race_live)
+		return;
+
+	if (s->conn_type == CONN_TYPE_SOCKS)
+		socks_reply(s, SOCKS_CONNREFUSED);
+	else
+		ocp_sock_del(s);
+}
+
+static void cb_race(evutil_socket_t fd, short what, void *ctx)
+{
+	struct ocp_sock *s = ctx;
+
+	timers_catchup();
+	if (s->race_next < s->race_n)
+		race_start(s);
+}
+
+/* Start connecting to the next address, and arm the timer for the one after */
+static void race_start(struct ocp_sock *s)
+{
+	struct ocp_attempt *a = &s->race[s->race_next];
+	ip_addr_t *ipaddr = &s->race_addr[s->race_next];
+	struct tcp_pcb *tpcb;
+	struct timeval tv;
 	err_t err;
 
-	s->state = STATE_CONNECTING;
+	s->race_next++;
 
 	tpcb = tcp_new();
 	if (!tpcb)
 		die("%s: out of memory\n", __func__);
 	tcp_nagle_disable(tpcb);
-	tcp_arg(tpcb, s);
+	if (s->cc)
+		tcp_set_cc(tpcb, s->cc);
+	a->s = s;
+	a->tpcb = tpcb;
+	tcp_arg(tpcb, a);
 	tcp_recv(tpcb, NULL);
-	tcp_err(tpcb, tcp_err_cb);
-	s->tpcb = tpcb;
+	tcp_err(tpcb, race_err_cb);
+	s->race_live++;
 
 	if (keep_intvl) {
 		tpcb->so_options |= SOF_KEEPALIVE;
@@ -536,161 +2048,484 @@ static void start_connection(struct ocp_sock *s, ip_addr_t *ipaddr)
 		tpcb->keep_idle = tpcb->keep_intvl;
 	}
 
-	err = tcp_connect(tpcb, ipaddr, s->rport, connect_cb);
-	if (err != ERR_OK)
+	err = tcp_connect(tpcb, ipaddr, s->rport, race_connect_cb);
+	if (err != ERR_OK) {
 		warn("%s: tcp_connect() returned %d\n", __func__, (int)err);
+		tcp_arg(tpcb, NULL);
+		tcp_err(tpcb, NULL);
+		tcp_abort(tpcb);
+		race_err_cb(a, err);
+		return;
+	}
+
+	if (s->race_next < s->race_n) {
+		if (!s->race_ev)
+			s->race_ev = evtimer_new(event_base, cb_race, s);
+		tv.tv_sec = 0;
+		tv.tv_usec = CONNECT_RACE_MS * 1000;
+		evtimer_add(s->race_ev, &tv);
+	}
 }
 
-static void finish_resolution(const char *hostname, ip_addr_t *ipaddr, void *arg)
+/*
+ * Connect to the first address that answers, trying them in order,
+ * CONNECT_RACE_MS apart ("happy eyeballs", RFC 8305)
+ */
+static void start_connection(struct ocp_sock *s, ip_addr_t *addrs, int n)
 {
-	struct ocp_sock *s = arg;
+	timers_catchup();
 
-	/*
-	 * We can't abort the DNS lookup, but we can kill the connection when
-	 * it returns (if needed)
-	 */
-	if (s->state == STATE_DEAD) {
-		ocp_sock_del(s);
-		return;
-	}
+	/* the SOCKS request has been fully parsed by now */
+	free(s->sockbuf);
+	s->sockbuf = NULL;
+
+	s->state = STATE_CONNECTING;
 
+	memcpy(s->race_addr, addrs, n * sizeof(*addrs));
+	s->race_n = n;
+	s->race_next = 0;
+	s->race_live = 0;
+	if (n > 1)
+		connect_races++;
+	race_start(s);
+}
+
+/*
+ * Called as each candidate name resolves or fails.  Returns 1 once the
+ * connection has been started or given up on (s may be gone by then),
+ * or 0 while it is still waiting for an answer.
+ */
+static int resolution_done(struct ocp_sock *s, int cand, const char *name,
+			   ip_addr_t *ipaddr)
+{
+	int order[DNS_CANDS], i, c, n;
+	u32_t ms;
+
+	s->dns_pending &= ~(1 << cand);
 	if (ipaddr) {
-		/* success */
-		start_connection(s, ipaddr);
-		return;
+		s->dns_ok |= 1 << cand;
+		/* all of the name's A records, if it came from the cache */
+		n = dns_getaddrs(name, s->dns_addr[cand], DNS_MAX_ADDRS);
+		if (!n) {
+			s->dns_addr[cand][0] = *ipaddr;
+			n = 1;
+		}
+		s->dns_naddrs[cand] = n;
+	}
+
+	order[0] = dns_order == DNS_ORDER_DOMAIN ? DNS_CAND_DOMAIN : DNS_CAND_HOST;
+	order[1] = !order[0];
+
+	for (i = 0; i < DNS_CANDS; i++) {
+		c = order[i];
+		if (s->dns_ok & (1 << c))
+			break;
+		/* a preferred name that's still pending may yet win */
+		if ((s->dns_pending & (1 << c)) && dns_order != DNS_ORDER_FIRST)
+			return 0;
+	}
+	if (i == DNS_CANDS && s->dns_pending)
+		return 0;
+
+	/* the other lookup goes on, and will still fill the cache */
+	if (s->dns_pending) {
+		dns_cancel(dns_host_found, s);
+		dns_cancel(dns_domain_found, s);
+		s->dns_pending = 0;
+	}
+
+	ms = sys_now() - s->dns_start;
+	batch_hist_add(dns_res_hist, ms);
+	if (ms > dns_res_max)
+		dns_res_max = ms;
+
+	if (i < DNS_CANDS) {
+		dns_res_won[c]++;
+		start_connection(s, s->dns_addr[c], s->dns_naddrs[c]);
+		return 1;
 	}
 
 	/* DNS resolution failed */
+	dns_res_failed++;
 	if (s->conn_type == CONN_TYPE_SOCKS)
 		socks_reply(s, SOCKS_HOST_UNREACHABLE);
 	else
 		ocp_sock_del(s);
+	return 1;
+}
+
+static void dns_host_found(const char *name, ip_addr_t *ipaddr, void *arg)
+{
+	resolution_done(arg, DNS_CAND_HOST, name, ipaddr);
+}
+
+static void dns_domain_found(const char *name, ip_addr_t *ipaddr, void *arg)
+{
+	resolution_done(arg, DNS_CAND_DOMAIN, name, ipaddr);
+}
+
+/* Look up one candidate name; returns like resolution_done() */
+static int enqueue_dns_req(struct ocp_sock *s, const char *hostname, int cand)
+{
+	char fqdn[DNS_MAX_NAME_LENGTH + 1];
+	const char *name = hostname;
+	err_t err;
+
+	if (cand == DNS_CAND_HOST)
+		err = dns_gethostbyname(hostname, &s->dns_addr[cand][0],
+					dns_host_found, s);
+	else if (snprintf(fqdn, sizeof(fqdn), "%s.%s", hostname,
+			  dns_domain) >= (int)sizeof(fqdn))
+		err = ERR_ARG;
+	else {
+		/* lwIP copies the name into its own table */
+		name = fqdn;
+		err = dns_gethostbyname(fqdn, &s->dns_addr[cand][0],
+					dns_domain_found, s);
+	}
+
+	if (err == ERR_INPROGRESS) {
+		dns_tmr_arm();
+		return 0;
+	} else if (err == ERR_OK)
+		return resolution_done(s, cand, name, &s->dns_addr[cand][0]);
+	else if (err == ERR_VAL) {
+		/* failed recently; don't ask again yet */
+	} else if (err == ERR_MEM)
+		warn("%s: too many pending DNS lookups, aborting\n", __func__);
+	else
+		warn("%s: invalid hostname '%s'\n", __func__, hostname);
+	return resolution_done(s, cand, name, NULL);
+}
+
+static void start_resolution(struct ocp_sock *s, const char *hostname)
+{
+	int order[DNS_CANDS], i;
+
+	s->state = STATE_DNS;
+	s->dns_ok = 0;
+	s->dns_start = sys_now();
+
+	/*
+	 * Looking up an unqualified hostname can take a few seconds
+	 * to time out, so only look up the FQDN if it's obvious.
+	 * Otherwise ask for both names at once, rather than waiting
+	 * for one to fail before trying the other.
+	 */
+	if (!dns_domain)
+		s->dns_pending = 1 << DNS_CAND_HOST;
+	else if (!strchr(hostname, '.'))
+		s->dns_pending = 1 << DNS_CAND_DOMAIN;
+	else
+		s->dns_pending = (1 << DNS_CAND_HOST) | (1 << DNS_CAND_DOMAIN);
+
+	/* expire stale cache entries first */
+	timers_catchup();
+
+	/* a cached answer for the preferred name saves the other query */
+	order[0] = dns_order == DNS_ORDER_DOMAIN ? DNS_CAND_DOMAIN : DNS_CAND_HOST;
+	order[1] = !order[0];
+	for (i = 0; i < DNS_CANDS; i++)
+		if ((s->dns_pending & (1 << order[i])) &&
+		    enqueue_dns_req(s, hostname, order[i]))
+			return;
+}
+
+/* Called upon connection to a local TCP socket */
+static void new_conn_cb(struct evconnlistener *listener, evutil_socket_t fd,
+			struct sockaddr *address, int socklen, void *ctx)
+{
+	struct ocp_sock *lsock = ctx, *s;
+
+	s = ocp_sock_new(fd, lsock->conn_type == CONN_TYPE_REDIR ?
+			 local_data_cb : socks_cmd_cb, 0);
+	if (!s) {
+		warn("too many connections\n");
+		close(fd);
+		return;
+	}
+
+	s->conn_type = lsock->conn_type;
+	s->rport = lsock->rport;
+	s->cc = lsock->cc;
+
+	if (s->conn_type == CONN_TYPE_REDIR) {
+		s->rport = lsock->rport;
+		start_resolution(s, lsock->rhost_name);
+	} else {
+		s->sockbuf = malloc(SOCKBUF_LEN);
+		if (!s->sockbuf) {
+			warn("%s: out of memory\n", __func__);
+			ocp_sock_del(s);
+			return;
+		}
+		s->state = STATE_SOCKS_AUTH;
+		event_add(s->ev, NULL);
+	}
 }
 
-static void enqueue_dns_req(struct ocp_sock *s, const char *hostname,
-			    const char *domain, dns_found_callback found)
+/**********************************************************************
+ * lwIP<->VPN traffic
+ **********************************************************************/
+
+static void vpn_conn_down(void)
+{
+	printf("ocproxy: VPN connection has terminated\n");
+	event_base_loopbreak(event_base);
+}
+
+static void batch_hist_add(unsigned long *hist, int n)
+{
+	int bucket = 0;
+
+	while (n > 1 && bucket < BATCH_HIST_LEN - 1) {
+		n >>= 1;
+		bucket++;
+	}
+	hist[bucket]++;
+}
+
+static void batch_hist_display(const char *name, const unsigned long *hist)
+{
+	int i;
+
+	printf("%s batch sizes:", name);
+	for (i = 0; i < BATCH_HIST_LEN; i++)
+		if (hist[i])
+			printf(" %d-%d:%lu", 1 << i, (2 << i) - 1, hist[i]);
+	printf("\n");
+}
+
+/* Allocate a pbuf that the VPN socket can be read into */
+static struct pbuf *lwip_rx_pbuf(void)
+{
+	struct pbuf *p;
+
+	p = pbuf_alloc(PBUF_RAW, VPN_RX_LEN, PBUF_POOL);
+	if (!p)
+		warn("%s: could not allocate pbuf\n", __func__);
+	return p;
+}
+
+/* Discard a packet from the VPN that we have no pbuf for */
+static void lwip_rx_drop(struct ocp_sock *s)
+{
+	char buf[SOCKBUF_LEN];
+
+	if (read(s->fd, buf, sizeof(buf)) <= 0)
+		vpn_conn_down();
+	LINK_STATS_INC(link.memerr);
+}
+
+/* Hand one raw IP packet (received into p) from the VPN to lwIP */
+static void lwip_input_pkt(struct netif *netif, struct pbuf *p, int len)
+{
+	pbuf_realloc(p, len);
+	LINK_STATS_INC(link.recv);
+	if (tcpdump_enabled)
+		tcpdump(p);
+	if (trust_checksums) {
+		trusted_pkts++;
+		trusted_bytes += len;
+	}
+	netif->input(p, netif);
+}
+
+#ifdef USE_MMSG
+static void vpn_batch_init(struct ocp_sock *s)
+{
+	struct vpn_batch *b;
+	int i;
+
+	b = xcalloc(1, sizeof(*b));
+	b->rx_msgs = xcalloc(vpn_batch, sizeof(*b->rx_msgs));
+	b->rx_iov = xcalloc(vpn_batch, sizeof(*b->rx_iov));
+	b->rx_pbufs = xcalloc(vpn_batch, sizeof(*b->rx_pbufs));
+
+	for (i = 0; i < vpn_batch; i++) {
+		b->rx_msgs[i].msg_hdr.msg_iov = &b->rx_iov[i];
+		b->rx_msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	b->tx_iov_max = vpn_batch * BATCH_IOV_PER_PKT;
+	if (b->tx_iov_max < MAX_IOVEC)
+		b->tx_iov_max = MAX_IOVEC;
+	b->tx_msgs = xcalloc(vpn_batch, sizeof(*b->tx_msgs));
+	b->tx_iov = xcalloc(b->tx_iov_max, sizeof(*b->tx_iov));
+	b->tx_pbufs = xcalloc(vpn_batch, sizeof(*b->tx_pbufs));
+
+	s->batch = b;
+}
+
+/* Drain up to vpn_batch datagrams from the VPN in a single syscall */
+static void lwip_data_batch(struct ocp_sock *s)
+{
+	struct vpn_batch *b = s->batch;
+	struct pbuf *p;
+	int i, n;
+
+	/* replace the pbufs that were handed to lwIP on the last pass */
+	for (n = 0; n < vpn_batch; n++) {
+		if (!b->rx_pbufs[n]) {
+			p = lwip_rx_pbuf();
+			if (!p)
+				break;
+			b->rx_pbufs[n] = p;
+			b->rx_iov[n].iov_base = p->payload;
+			b->rx_iov[n].iov_len = p->len;
+		}
+	}
+	if (!n) {
+		lwip_rx_drop(s);
+		return;
+	}
+
+	n = recvmmsg(s->fd, b->rx_msgs, n, MSG_DONTWAIT, NULL);
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+		      errno == EINTR))
+		return;
+	if (n <= 0) {
+		vpn_conn_down();
+		return;
+	}
+
+	batch_hist_add(rx_batch_hist, n);
+	for (i = 0; i < n; i++) {
+		if (!b->rx_msgs[i].msg_len)
+			continue;
+		lwip_input_pkt(s->netif, b->rx_pbufs[i], b->rx_msgs[i].msg_len);
+		b->rx_pbufs[i] = NULL;
+	}
+}
+#endif
+
+/* Called when the VPN sends us a raw IP packet destined for lwIP */
+static void lwip_data_cb(evutil_socket_t fd, short what, void *ctx)
 {
-	err_t err;
+	struct ocp_sock *s = ctx;
+	ssize_t len;
+	struct pbuf *p;
 
-	if (!domain)
-		err = dns_gethostbyname(hostname, &s->rhost, found, s);
-	else {
-		/* sockbuf is just scratch space */
-		snprintf(s->sockbuf, SOCKBUF_LEN, "%s.%s", hostname, dns_domain);
-		err = dns_gethostbyname(s->sockbuf, &s->rhost, found, s);
-	}
+	timers_catchup();
 
-	if (err == ERR_INPROGRESS)
+#ifdef USE_MMSG
+	if (s->batch) {
+		lwip_data_batch(s);
+		event_add(s->ev, NULL);
 		return;
-	else if (err == ERR_OK)
-		start_connection(s, &s->rhost);
-	else if (err == ERR_MEM) {
-		warn("%s: DNS table full, aborting lookup\n", __func__);
-		found(hostname, NULL, s);
-	} else {
-		warn("%s: invalid hostname '%s'\n", __func__, hostname);
-		found(hostname, NULL, s);
 	}
-}
-
-static void retry_resolution(const char *hostname, ip_addr_t *ipaddr, void *arg)
-{
-	struct ocp_sock *s = arg;
+#endif
 
-	/* first attempt at DNS resolution succeeded */
-	if (ipaddr != NULL || !dns_domain) {
-		finish_resolution(hostname, ipaddr, arg);
+	p = lwip_rx_pbuf();
+	if (!p) {
+		lwip_rx_drop(s);
+		event_add(s->ev, NULL);
 		return;
 	}
 
-	/* no dice; try again with <hostname>.<dns_domain> */
-	enqueue_dns_req(s, hostname, dns_domain, finish_resolution);
+	len = read(s->fd, p->payload, p->len);
+	if (len <= 0) {
+		/* This might never happen, because s->fd is a DGRAM socket */
+		pbuf_free(p);
+		vpn_conn_down();
+	} else {
+		batch_hist_add(rx_batch_hist, 1);
+		lwip_input_pkt(s->netif, p, len);
+	}
+	event_add(s->ev, NULL);
 }
 
-static void start_resolution(struct ocp_sock *s, const char *hostname)
+/* Update the link stats after trying to send one packet to the VPN */
+static void lwip_data_out_done(ssize_t ret, int total, int err)
 {
-	s->state = STATE_DNS;
-
-	/*
-	 * Looking up an unqualified hostname can take a few seconds
-	 * to time out, so just look up the FQDN right away if it's
-	 * obvious.
-	 */
-	if (strchr(hostname, '.'))
-		enqueue_dns_req(s, hostname, NULL, retry_resolution);
+	if (ret < 0) {
+		if (err == ECONNREFUSED || err == ENOTCONN)
+			vpn_conn_down();
+		else
+			LINK_STATS_INC(link.drop);
+	} else if (ret != total)
+		LINK_STATS_INC(link.lenerr);
 	else
-		enqueue_dns_req(s, hostname, dns_domain, finish_resolution);
+		LINK_STATS_INC(link.xmit);
 }
 
-/* Called upon connection to a local TCP socket */
-static void new_conn_cb(struct evconnlistener *listener, evutil_socket_t fd,
-			struct sockaddr *address, int socklen, void *ctx)
+/* Send all queued packets to the VPN */
+static void vpn_tx_flush(struct ocp_sock *s)
 {
-	struct ocp_sock *lsock = ctx, *s;
+#ifdef USE_MMSG
+	struct vpn_batch *b = s->batch;
+	int i = 0, j, n;
 
-	s = ocp_sock_new(fd, lsock->conn_type == CONN_TYPE_REDIR ?
-			 local_data_cb : socks_cmd_cb, 0);
-	if (!s) {
-		warn("too many connections\n");
+	if (!b || !b->tx_count)
 		return;
-	}
 
-	s->conn_type = lsock->conn_type;
-	s->rport = lsock->rport;
+	batch_hist_add(tx_batch_hist, b->tx_count);
+	while (i < b->tx_count) {
+		n = sendmmsg(s->fd, &b->tx_msgs[i], b->tx_count - i, 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			/* sendmmsg() only reports the error for tx_msgs[i] */
+			lwip_data_out_done(-1, 0, errno);
+			i++;
+			continue;
+		}
+		for (j = i; j < i + n; j++) {
+			struct msghdr *msg = &b->tx_msgs[j].msg_hdr;
+			int k, total = 0;
 
-	if (s->conn_type == CONN_TYPE_REDIR) {
-		s->rport = lsock->rport;
-		start_resolution(s, lsock->rhost_name);
-	} else {
-		s->state = STATE_SOCKS_AUTH;
-		event_add(s->ev, NULL);
+			for (k = 0; k < msg->msg_iovlen; k++)
+				total += msg->msg_iov[k].iov_len;
+			lwip_data_out_done(b->tx_msgs[j].msg_len, total, 0);
+		}
+		i += n;
 	}
-}
 
-/**********************************************************************
- * lwIP<->VPN traffic
- **********************************************************************/
+	for (i = 0; i < b->tx_count; i++)
+		pbuf_free(b->tx_pbufs[i]);
+	b->tx_count = 0;
+	b->tx_iov_used = 0;
+#endif
+}
 
-static void vpn_conn_down(void)
+/* LWIP_HOOK_TCP_SEG_BUSY: release the queue's references to lwIP's pbufs */
+void ocp_vpn_tx_flush(void)
 {
-	printf("ocproxy: VPN connection has terminated\n");
-	event_base_loopbreak(event_base);
+	if (netif_default)
+		vpn_tx_flush(netif_default->state);
 }
 
-/* Called when the VPN sends us a raw IP packet destined for lwIP */
-static void lwip_data_cb(evutil_socket_t fd, short what, void *ctx)
+#ifdef USE_MMSG
+/* Queue one packet for the next vpn_tx_flush() */
+static void lwip_data_queue(struct ocp_sock *s, struct pbuf *p, int n_iov)
 {
-	struct ocp_sock *s = ctx;
-	ssize_t len;
-	struct pbuf *p;
+	struct vpn_batch *b = s->batch;
+	struct msghdr *msg;
+	struct iovec *iov;
 
-	len = read(s->fd, s->sockbuf, SOCKBUF_LEN);
-	if (len <= 0) {
-		/* This might never happen, because s->fd is a DGRAM socket */
-		vpn_conn_down();
-	}
-	if ((p = pbuf_alloc(PBUF_RAW, len, PBUF_POOL)) != NULL) {
-		char *bufptr;
-		struct pbuf *q;
+	if (b->tx_iov_used + n_iov > b->tx_iov_max)
+		vpn_tx_flush(s);
 
-		bufptr = s->sockbuf;
-		q = p;
-		while (len > 0) {
-			int copy = (len > q->len) ? q->len : len;
+	iov = &b->tx_iov[b->tx_iov_used];
+	msg = &b->tx_msgs[b->tx_count].msg_hdr;
+	memset(msg, 0, sizeof(*msg));
+	msg->msg_iov = iov;
+	msg->msg_iovlen = n_iov;
 
-			memcpy(q->payload, bufptr, copy);
-			len -= copy;
-			bufptr += copy;
-			q = q->next;
-		}
-		LINK_STATS_INC(link.recv);
-		if (tcpdump_enabled)
-			tcpdump(p);
-		s->netif->input(p, s->netif);
-	} else
-		warn("%s: could not allocate pbuf\n", __func__);
-	event_add(s->ev, NULL);
+	/* the caller may free or reuse p after we return */
+	pbuf_ref(p);
+	b->tx_pbufs[b->tx_count++] = p;
+	b->tx_iov_used += n_iov;
+
+	for (; p; p = p->next) {
+		iov->iov_base = p->payload;
+		iov++->iov_len = p->len;
+	}
+
+	if (b->tx_count == vpn_batch)
+		vpn_tx_flush(s);
 }
+#endif
 
 /* Called when lwIP has data to send up to the VPN */
 static err_t lwip_data_out(struct netif *netif, struct pbuf *p, ip_addr_t *ipaddr)
@@ -699,30 +2534,34 @@ static err_t lwip_data_out(struct netif *netif, struct pbuf *p, ip_addr_t *ipadd
 	int i = 0, total = 0;
 	ssize_t ret;
 	struct iovec iov[MAX_IOVEC];
+	struct pbuf *q;
 
 	if (tcpdump_enabled)
 		tcpdump(p);
 
-	for (; p; p = p->next) {
-		if (i >= MAX_IOVEC) {
-			warn("%s: too many chunks, dropping packet\n", __func__);
-			return ERR_OK;
-		}
+	for (q = p; q; q = q->next)
+		i++;
+	if (i > MAX_IOVEC) {
+		warn("%s: too many chunks, dropping packet\n", __func__);
+		return ERR_OK;
+	}
+
+#ifdef USE_MMSG
+	if (s->batch) {
+		lwip_data_queue(s, p, i);
+		return ERR_OK;
+	}
+#endif
+
+	for (i = 0; p; p = p->next) {
 		iov[i].iov_base = p->payload;
 		iov[i++].iov_len = p->len;
 		total += p->len;
 	}
 
 	ret = writev(s->fd, iov, i);
-	if (ret < 0) {
-		if (errno == ECONNREFUSED || errno == ENOTCONN)
-			vpn_conn_down();
-		else
-			LINK_STATS_INC(link.drop);
-	} else if (ret != total)
-		LINK_STATS_INC(link.lenerr);
-	else
-		LINK_STATS_INC(link.xmit);
+	batch_hist_add(tx_batch_hist, 1);
+	lwip_data_out_done(ret, total, errno);
 
 	return ERR_OK;
 }
@@ -731,60 +2570,333 @@ static err_t lwip_data_out(struct netif *netif, struct pbuf *p, ip_addr_t *ipadd
  * Periodic tasks
  **********************************************************************/
 
-static void handle_sig(int sig)
-{
-	if (sig == SIGHUP)
-		got_sighup = 1;
-	else if (sig == SIGUSR1)
-		got_sigusr1 = 1;
-}
+/*
+ * The lwIP timers are only armed while they have work to do, so an idle
+ * ocproxy doesn't wake up at all.  While a timer is idle its clock
+ * (tcp_ticks and the DNS cache TTLs) stands still, so timers_catchup()
+ * has to be called before lwIP is handed new input or output.
+ */
+
+static void timers_catchup(void);
 
-static void new_periodic_event(event_callback_fn cb, void *arg, int timeout_ms)
+static void arm_timer(struct event *ev, u32_t now, u32_t due)
 {
 	struct timeval tv;
-	struct event *ev;
+	u32_t ms = (s32_t)(due - now) > 0 ? due - now : 0;
 
-	tv.tv_sec = timeout_ms / 1000;
-	tv.tv_usec = 1000 * (timeout_ms % 1000);
-	ev = event_new(event_base, -1, EV_PERSIST, cb, arg);
-	if (!ev)
-		die("can't create new periodic event\n");
+	tv.tv_sec = ms / 1000;
+	tv.tv_usec = 1000 * (ms % 1000);
 	evtimer_add(ev, &tv);
 }
 
+/* Run or skip all of the TCP slow ticks that have come due by now */
+static void tcp_tmr_advance(u32_t now)
+{
+	u32_t ticks, idle;
+
+	if ((s32_t)(now - tcp_tmr_last) < 0) {
+		/* the clock went backwards */
+		tcp_tmr_last = now;
+		return;
+	}
+	ticks = (now - tcp_tmr_last) / TCP_SLOW_INTERVAL;
+	tcp_tmr_last += ticks * TCP_SLOW_INTERVAL;
+
+	while (ticks) {
+		idle = tcp_timer_idle_ticks();
+		if (idle == 0) {
+			/*
+			 * Like a periodic event, don't replay ticks that were
+			 * missed while the event loop was stalled.
+			 */
+			tcp_slowtmr();
+			break;
+		}
+		if (ticks < idle) {
+			tcp_timer_skip(ticks);
+			break;
+		}
+		tcp_timer_skip(idle - 1);
+		tcp_slowtmr();
+		ticks -= idle;
+	}
+}
+
+/* Run the DNS retry timer, or just age the cache if nothing is pending */
+static void dns_tmr_advance(u32_t now)
+{
+	u32_t secs;
+
+	if ((s32_t)(now - dns_tmr_last) < 0) {
+		dns_tmr_last = now;
+		return;
+	}
+	secs = (now - dns_tmr_last) / DNS_TMR_INTERVAL;
+	if (!secs)
+		return;
+	dns_tmr_last += secs * DNS_TMR_INTERVAL;
+
+	/* one retry step per second, for as long as lookups are pending */
+	while (secs && dns_tmr_needed()) {
+		dns_tmr();
+		secs--;
+	}
+	if (secs)
+		dns_tmr_skip(secs);
+}
+
+static void dns_tmr_arm(void)
+{
+	if (!dns_tmr_armed) {
+		arm_timer(dns_tmr_ev, sys_now(),
+			  dns_tmr_last + DNS_TMR_INTERVAL);
+		dns_tmr_armed = 1;
+	}
+}
+
 static void cb_tcp_tmr(evutil_socket_t fd, short what, void *ctx)
 {
-	tcp_tmr();
+	tcp_tmr_armed = 0;
+	tcp_tmr_wakeups++;
+	tcp_tmr_advance(sys_now());
+	tcp_fasttmr();
 }
 
 static void cb_dns_tmr(evutil_socket_t fd, short what, void *ctx)
 {
-	dns_tmr();
+	dns_tmr_armed = 0;
+	dns_tmr_wakeups++;
+	dns_tmr_advance(sys_now());
+	if (dns_tmr_needed())
+		dns_tmr_arm();
 }
 
-static void cb_housekeeping(evutil_socket_t fd, short what, void *ctx)
+/*
+ * Retransmit on connections whose RTO expired, resume paced connections
+ * once they have earned enough credit, and hedge slow DNS queries
+ */
+static void cb_ms_tmr(evutil_socket_t fd, short what, void *ctx)
+{
+	ms_tmr_armed = 0;
+	ms_tmr_wakeups++;
+	timers_catchup();
+	tcp_rto_tmr();
+	tcp_pace_tmr();
+	dns_hedge_tmr();
+}
+
+static void housekeeping(u32_t now)
 {
-	int *vpnfd = ctx;
+	struct ocp_sock *s = netif_default->state;
+	struct timeval tv;
+
+	housekeeping_last = now;
 
 	/*
 	 * OpenConnect will ignore 0-byte datagrams if it's alive, but
 	 * we'll get ECONNREFUSED if the peer has died.
 	 */
-	if (write(*vpnfd, vpnfd, 0) < 0 &&
+	if (write(s->fd, s, 0) < 0 &&
 	    (errno == ECONNREFUSED || errno == ENOTCONN))
 		vpn_conn_down();
-	else if (got_sighup)
-		vpn_conn_down();
 
-	if (got_sigusr1) {
+	/* push back the check for when we're idle */
+	tv.tv_sec = HOUSEKEEPING_MS / 1000;
+	tv.tv_usec = 1000 * (HOUSEKEEPING_MS % 1000);
+	evtimer_add(housekeeping_ev, &tv);
+}
+
+static void cb_housekeeping(evutil_socket_t fd, short what, void *ctx)
+{
+	housekeeping_wakeups++;
+	housekeeping(sys_now());
+}
+
+static void timers_catchup(void)
+{
+	u32_t now = sys_now();
+
+	tcp_tmr_advance(now);
+	dns_tmr_advance(now);
+}
+
+/* Called after each pass through the event loop to re-arm the timers */
+static void timers_update(void)
+{
+	u32_t now = sys_now(), idle, due, wait;
+
+	idle = tcp_timer_idle_ticks();
+	if (idle == TCP_TIMER_IDLE_FOREVER) {
+		if (tcp_tmr_armed) {
+			evtimer_del(tcp_tmr_ev);
+			tcp_tmr_armed = 0;
+		}
+	} else {
+		if (idle == 0) {
+			/* some PCB needs every tick */
+			due = now + TCP_FAST_INTERVAL;
+			if (tcp_tmr_armed && (s32_t)(tcp_tmr_due - due) <= 0)
+				due = tcp_tmr_due;
+		} else
+			due = tcp_tmr_last + idle * TCP_SLOW_INTERVAL;
+
+		if (!tcp_tmr_armed || due != tcp_tmr_due) {
+			arm_timer(tcp_tmr_ev, now, due);
+			tcp_tmr_armed = 1;
+			tcp_tmr_due = due;
+		}
+	}
+
+	/* TCP_PACE_IDLE == DNS_HEDGE_IDLE == TCP_RTO_IDLE */
+	wait = LWIP_MIN(tcp_rto_delay(), tcp_pace_delay());
+	wait = LWIP_MIN(wait, dns_hedge_delay());
+	if (wait == TCP_RTO_IDLE) {
+		if (ms_tmr_armed) {
+			evtimer_del(ms_tmr_ev);
+			ms_tmr_armed = 0;
+		}
+	} else if (!ms_tmr_armed || now + wait != ms_tmr_due) {
+		ms_tmr_due = now + wait;
+		arm_timer(ms_tmr_ev, now, ms_tmr_due);
+		ms_tmr_armed = 1;
+	}
+
+	/* piggyback on wakeups we're getting anyway */
+	if (now - housekeeping_last >= HOUSEKEEPING_MS)
+		housekeeping(now);
+}
+
+/* Per-connection RTT estimate and retransmission timeout */
+static void tcp_rtt_display(void)
+{
+	struct tcp_pcb *pcb;
+
+	for (pcb = tcp_active_pcbs; pcb; pcb = pcb->next)
+		printf("tcp %u -> %s:%u: srtt %ld ms, rttvar %ld ms, rto %ld ms%s\n",
+		       pcb->local_port, ipaddr_ntoa(ipX_2_ip(&pcb->remote_ip)),
+		       pcb->remote_port, (long)(pcb->sa >> 3),
+		       (long)(pcb->sv >> 2), (long)pcb->rto,
+		       (pcb->flags & TF_TIMESTAMP) ? ", timestamps" : "");
+}
+
+/* Resolver cache occupancy and hit rates */
+static void dns_stats_display(void)
+{
+	const struct dns_cache_stats *st = dns_get_stats();
+	unsigned long total = st->hits + st->neg_hits + st->misses +
+			      st->coalesced;
+
+	printf("dns cache: %u / %d entries, %lu lookups: %lu hits, "
+	       "%lu negative hits, %lu misses, %lu coalesced, %lu evictions\n",
+	       (unsigned)st->used, DNS_TABLE_SIZE, total,
+	       (unsigned long)st->hits, (unsigned long)st->neg_hits,
+	       (unsigned long)st->misses, (unsigned long)st->coalesced,
+	       (unsigned long)st->evictions);
+}
+
+/* Response times and reliability of each DNS server */
+static void dns_server_display(void)
+{
+	const struct dns_server_stats *st;
+	ip_addr_t addr;
+	int i;
+
+	for (i = 0; i < DNS_MAX_SERVERS; i++) {
+		st = dns_get_server_stats(i);
+		if (!st)
+			continue;
+		addr = dns_getserver(i);
+		printf("dns server %s: srtt %lu ms, p95 %lu ms, %lu queries, "
+		       "%lu answers, %lu timeouts, %lu hedges (%lu won)%s\n",
+		       ipaddr_ntoa(&addr), (unsigned long)st->srtt,
+		       (unsigned long)st->p95, (unsigned long)st->queries,
+		       (unsigned long)st->answers, (unsigned long)st->timeouts,
+		       (unsigned long)st->hedges,
+		       (unsigned long)st->hedges_won,
+		       st->down ? ", down" : "");
+	}
+}
+
+/* How start_resolution() fared, and how long connections waited for it */
+static void dns_res_display(void)
+{
+	int i;
+
+	printf("dns resolution: %lu as given, %lu with domain, %lu failed, "
+	       "max %lu ms; ms:", dns_res_won[DNS_CAND_HOST],
+	       dns_res_won[DNS_CAND_DOMAIN], dns_res_failed,
+	       (unsigned long)dns_res_max);
+	for (i = 0; i < BATCH_HIST_LEN - 1; i++)
+		if (dns_res_hist[i])
+			printf(" %d-%d:%lu", i ? 1 << i : 0, (2 << i) - 1,
+			       dns_res_hist[i]);
+	if (dns_res_hist[i])
+		printf(" %d+:%lu", 1 << i, dns_res_hist[i]);
+	printf("\n");
+}
+
+static void cb_signal(evutil_socket_t sig, short what, void *ctx)
+{
+	if (sig == SIGHUP) {
+		vpn_conn_down();
+	} else if (sig == SIGUSR1) {
 		LINK_STATS_DISPLAY();
 		MEM_STATS_DISPLAY();
-		printf("open connections: %d / %d, max %d\n",
-		       ocp_sock_used, MAX_CONN, ocp_sock_max);
-		got_sigusr1 = 0;
+		batch_hist_display("VPN rx", rx_batch_hist);
+		batch_hist_display("VPN tx", tx_batch_hist);
+		printf("timer wakeups: tcp %lu, dns %lu, rto/pacing %lu, housekeeping %lu\n",
+		       tcp_tmr_wakeups, dns_tmr_wakeups, ms_tmr_wakeups,
+		       housekeeping_wakeups);
+		tcp_rtt_display();
+		dns_stats_display();
+		dns_server_display();
+		dns_res_display();
+		printf("connect races: %lu, won by a later address %lu\n",
+		       connect_races, connect_race_fallbacks);
+		if (trust_checksums)
+			printf("checksums trusted: %lu packets, %lu bytes\n",
+			       trusted_pkts, trusted_bytes);
+		printf("open connections: %d / %d, max %d, %d allocated\n",
+		       ocp_sock_used, max_conns, ocp_sock_max, ocp_sock_slots);
+		printf("rx data held for local readers: %d pbufs, max %d, "
+		       "windows grown by %d, held back %lu times; "
+		       "tx buffers grown %lu times\n",
+		       rx_held, rx_held_max, rx_wnd_grown, rx_throttled,
+		       txbuf_grown);
+		printf("udp associations: %d, flows: %d / %d, evicted %lu\n",
+		       udp_relays, udp_flows, UDP_MAX_FLOWS,
+		       udp_flows_evicted);
+		printf("udp datagrams: to VPN %lu, from VPN %lu, dropped %lu, "
+		       "dropped while resolving the name %lu\n",
+		       udp_pkts_out, udp_pkts_in, udp_pkts_dropped,
+		       udp_pkts_unresolved);
 	}
 }
 
+static void new_signal_event(int sig)
+{
+	struct event *ev;
+
+	ev = evsignal_new(event_base, sig, cb_signal, NULL);
+	if (!ev || evsignal_add(ev, NULL) < 0)
+		die("can't create signal event\n");
+}
+
+static void init_timers(void)
+{
+	tcp_tmr_ev = evtimer_new(event_base, cb_tcp_tmr, NULL);
+	dns_tmr_ev = evtimer_new(event_base, cb_dns_tmr, NULL);
+	ms_tmr_ev = evtimer_new(event_base, cb_ms_tmr, NULL);
+	housekeeping_ev = evtimer_new(event_base, cb_housekeeping, NULL);
+	udp_flow_ev = evtimer_new(event_base, udp_flow_tmr_cb, NULL);
+	if (!tcp_tmr_ev || !dns_tmr_ev || !ms_tmr_ev || !housekeeping_ev ||
+	    !udp_flow_ev)
+		die("can't create timer events\n");
+
+	tcp_tmr_last = dns_tmr_last = sys_now();
+	housekeeping(tcp_tmr_last);
+}
+
 /**********************************************************************
  * Program initialization
  **********************************************************************/
@@ -797,13 +2909,30 @@ static err_t init_oc_netif(struct netif *netif)
 	return ERR_OK;
 }
 
+static void bind_udp_listener(struct ocp_sock *s, struct sockaddr_in *sock)
+{
+	int bufsize = UDP_SOCKBUF;
+
+	s->fd = udp_sock_open(sock);
+	if (s->fd < 0)
+		die("can't set up listener on port %d/udp\n", s->lport);
+
+	/* absorb bursts while lwIP is busy */
+	setsockopt(s->fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+	setsockopt(s->fd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+
+	s->txq->fd = s->fd;
+	s->ev = event_new(event_base, s->fd, EV_READ, udp_fwd_read_cb, s);
+	event_add(s->ev, NULL);
+}
+
 static void bind_all_listeners(void)
 {
 	struct ocp_sock *s;
 	struct sockaddr_in sock;
 
 	for (s = ocp_sock_bind_list; s; s = s->next) {
-		if (!s->listen_cb)
+		if (!s->listen_cb && s->conn_type != CONN_TYPE_UDP)
 			continue;
 		if (s->lport < 1 || s->lport > 65535)
 			die("invalid port number: %d\n", s->lport);
@@ -825,6 +2954,11 @@ static void bind_all_listeners(void)
 				INADDR_ANY : INADDR_LOOPBACK);
 		}
 
+		if (s->conn_type == CONN_TYPE_UDP) {
+			bind_udp_listener(s, &sock);
+			continue;
+		}
+
 		s->listener = evconnlistener_new_bind(event_base, s->listen_cb,
 			s, LEV_OPT_CLOSE_ON_FREE|LEV_OPT_REUSEABLE, -1,
 			(struct sockaddr *)&sock, sizeof(sock));
@@ -837,16 +2971,37 @@ static struct ocp_sock *new_listener(int port, evconnlistener_cb cb)
 {
 	struct ocp_sock *s;
 
-	s = ocp_sock_new(-1, NULL, FL_DIE_ON_ERROR);
+	s = ocp_sock_new(-1, NULL, FL_PERSISTENT);
 	s->lport = port;
 	s->listen_cb = cb;
 
 	return s;
 }
 
+static const struct tcp_cc_ops *cc_lookup(const char *name)
+{
+	const struct tcp_cc_ops *cc = tcp_cc_find(name);
+
+	if (!cc)
+		die("Unknown congestion control algorithm: '%s'\n", name);
+	return cc;
+}
+
+/* Strip an optional "/<algorithm>" suffix off a forwarding specifier */
+static const struct tcp_cc_ops *cc_suffix(char *spec)
+{
+	char *p = strrchr(spec, '/');
+
+	if (!p)
+		return NULL;
+	*p = 0;
+	return cc_lookup(p + 1);
+}
+
 static void fwd_add(const char *opt)
 {
 	char *str = xstrdup(opt), *tmp = str, *p;
+	const struct tcp_cc_ops *cc = cc_suffix(str);
 	int lport;
 	struct ocp_sock *s;
 
@@ -863,6 +3018,7 @@ static void fwd_add(const char *opt)
 	s->rhost_name = xstrdup(p);
 	s->rport = ocp_atoi(str);
 	s->conn_type = CONN_TYPE_REDIR;
+	s->cc = cc;
 
 	if (s->rport <= 0)
 		die("Remote port must be a positive integer\n");
@@ -874,9 +3030,42 @@ bad:
 	die("Invalid port forward specifier: '%s'\n", opt);
 }
 
-static struct ocp_sock *dyn_fwd(const char *arg)
+static void udp_fwd_add(const char *opt)
+{
+	char *str = xstrdup(opt), *tmp = str, *p;
+	int lport;
+	struct ocp_sock *s;
+
+	p = strsep(&str, ":");
+	if (!str)
+		goto bad;
+	lport = ocp_atoi(p);
+
+	p = strsep(&str, ":");
+	if (!str)
+		goto bad;
+
+	s = new_listener(lport, NULL);
+	s->rhost_name = xstrdup(p);
+	s->rport = ocp_atoi(str);
+	s->conn_type = CONN_TYPE_UDP;
+	s->txq = xcalloc(1, sizeof(*s->txq));
+
+	if (s->rport <= 0)
+		die("Remote port must be a positive integer\n");
+
+	free(tmp);
+
+	return;
+bad:
+	die("Invalid UDP port forward specifier: '%s'\n", opt);
+}
+
+static struct ocp_sock *dyn_fwd(const char *opt)
 {
 	struct ocp_sock *s;
+	char *arg = xstrdup(opt);
+	const struct tcp_cc_ops *cc = cc_suffix(arg);
 	const char *sep = strrchr(arg, ':');
 
 	if (sep) {
@@ -890,38 +3079,70 @@ static struct ocp_sock *dyn_fwd(const char *arg)
 	}
 
 	s->conn_type = CONN_TYPE_SOCKS;
+	s->cc = cc;
+	free(arg);
 	return s;
 }
 
+/* Configure the servers in a space or comma separated list of addresses */
+static void dns_add_servers(const char *list)
+{
+	char *str = xstrdup(list), *tmp = str, *p;
+	ip_addr_t dns;
+	int n = 0;
+
+	while ((p = strsep(&str, " ,")) != NULL) {
+		if (!*p)
+			continue;
+		if (!ipaddr_aton(p, &dns))
+			die("Invalid DNS IP: '%s'\n", p);
+		if (n == DNS_MAX_SERVERS) {
+			warn("too many DNS servers, ignoring '%s'\n", p);
+			continue;
+		}
+		/* the first one replaces the default opendns server */
+		dns_setserver(n++, &dns);
+	}
+	free(tmp);
+}
+
+/* long options with no short equivalent */
+enum {
+	OPT_TRUST_CHECKSUMS = 256,
+	OPT_DNS_ORDER,
+};
+
 static struct option longopts[] = {
 	{ "ip",			1,	NULL,	'I' },
 	{ "mtu",		1,	NULL,	'M' },
 	{ "dns",		1,	NULL,	'd' },
 	{ "domain",		1,	NULL,	'o' },
 	{ "localfw",		1,	NULL,	'L' },
+	{ "udpfw",		1,	NULL,	'U' },
 	{ "dynfw",		1,	NULL,	'D' },
 	{ "keepalive",		1,	NULL,	'k' },
 	{ "allow-remote",	0,	NULL,	'g' },
 	{ "verbose",		0,	NULL,	'v' },
 	{ "tcpdump",		0,	NULL,	'T' },
+	{ "batch",		1,	NULL,	'B' },
+	{ "max-conns",		1,	NULL,	'C' },
+	{ "congestion",		1,	NULL,	'c' },
+	{ "trust-tunnel-checksums", 0,	NULL,	OPT_TRUST_CHECKSUMS },
+	{ "dns-order",		1,	NULL,	OPT_DNS_ORDER },
 	{ NULL }
 };
 
 int main(int argc, char **argv)
 {
-	int opt, i, vpnfd;
+	int opt, vpnfd;
 	char *str;
 	char *ip_str, *mtu_str, *dns_str;
-	ip_addr_t ip, netmask, gw, dns;
+	ip_addr_t ip, netmask, gw;
 	struct ocp_sock *s;
 	struct netif netif;
 
 	ip_str = mtu_str = dns_str = NULL;
 
-	ocp_sock_free_list = &ocp_sock_pool[0];
-	for (i = 1; i < MAX_CONN; i++)
-		ocp_sock_pool[i - 1].next = &ocp_sock_pool[i];
-
 	event_base = event_base_new();
 	if (!event_base)
 		die("can't initialize libevent\n");
@@ -936,20 +3157,12 @@ int main(int argc, char **argv)
 	mtu_str = getenv("INTERNAL_IP4_MTU");
 
 	dns_domain = getenv("CISCO_DEF_DOMAIN");
-	str = getenv("INTERNAL_IP4_DNS");
-	if (str) {
-		char *p;
-
-		/* this could contain many addresses; just use the first one */
-		dns_str = xstrdup(str);
-		p = strchr(dns_str, ' ');
-		if (p)
-			*p = 0;
-	}
+	/* this could contain many addresses, separated by spaces */
+	dns_str = getenv("INTERNAL_IP4_DNS");
 
 	/* override with command line options */
 	while ((opt = getopt_long(argc, argv,
-				  "I:M:d:o:D:k:gL:vT", longopts, NULL)) != -1) {
+				  "I:M:d:o:D:k:gL:U:vTB:C:c:", longopts, NULL)) != -1) {
 		switch (opt) {
 		case 'I':
 			ip_str = optarg;
@@ -975,6 +3188,9 @@ int main(int argc, char **argv)
 		case 'L':
 			fwd_add(optarg);
 			break;
+		case 'U':
+			udp_fwd_add(optarg);
+			break;
 		case 'v':
 			debug_flags = LWIP_DBG_ON | LWIP_DBG_TRACE |
 				      LWIP_DBG_STATE | LWIP_DBG_FRESH |
@@ -983,6 +3199,33 @@ int main(int argc, char **argv)
 		case 'T':
 			tcpdump_enabled = 1;
 			break;
+		case 'B':
+			vpn_batch = ocp_atoi(optarg);
+			if (vpn_batch < 1 || vpn_batch > MAX_BATCH)
+				die("batch size must be between 1 and %d\n",
+				    MAX_BATCH);
+			break;
+		case 'C':
+			max_conns = ocp_atoi(optarg);
+			if (max_conns < 1)
+				die("max-conns must be a positive integer\n");
+			break;
+		case 'c':
+			tcp_cc_set_default(cc_lookup(optarg));
+			break;
+		case OPT_TRUST_CHECKSUMS:
+			trust_checksums = 1;
+			break;
+		case OPT_DNS_ORDER:
+			if (!strcmp(optarg, "host"))
+				dns_order = DNS_ORDER_HOST;
+			else if (!strcmp(optarg, "domain"))
+				dns_order = DNS_ORDER_DOMAIN;
+			else if (!strcmp(optarg, "first"))
+				dns_order = DNS_ORDER_FIRST;
+			else
+				die("dns-order must be host, domain or first\n");
+			break;
 		default:
 			die("unknown option: %c\n", opt);
 		}
@@ -994,32 +3237,41 @@ int main(int argc, char **argv)
 	if (!ipaddr_aton(ip_str, &ip))
 		die("Invalid IP address: '%s'\n", ip_str);
 
-	/* Debugging help. */
-	signal(SIGHUP, handle_sig);
-	signal(SIGUSR1, handle_sig);
+	/* SIGHUP shuts down, SIGUSR1 prints debugging stats */
+	new_signal_event(SIGHUP);
+	new_signal_event(SIGUSR1);
 	signal(SIGPIPE, SIG_IGN);
 	setlinebuf(stdout);
 	setlinebuf(stderr);
 
 	/* Set up lwIP interface */
-	s = ocp_sock_new(vpnfd, lwip_data_cb, FL_ACTIVATE | FL_DIE_ON_ERROR);
+	s = ocp_sock_new(vpnfd, lwip_data_cb, FL_ACTIVATE | FL_PERSISTENT);
 	memset(&netif, 0, sizeof(netif));
 	s->netif = &netif;
+#ifdef USE_MMSG
+	if (vpn_batch > 1)
+		vpn_batch_init(s);
+#endif
+	udp_rx_init();
 
 	lwip_init();
 	dns_init();
 
-	if (dns_str) {
-		if (!ipaddr_aton(dns_str, &dns))
-			die("Invalid DNS IP: '%s'\n", dns_str);
-		/* this replaces the default opendns server */
-		dns_setserver(0, &dns);
-	}
+	if (dns_str)
+		dns_add_servers(dns_str);
 
 	ip_addr_set_zero(&netmask);
 	ip_addr_set_zero(&gw);
 	netif_add(&netif, &ip, &netmask, &gw, s, init_oc_netif, ip_input);
 	netif.mtu = ocp_atoi(mtu_str);
+	if (trust_checksums) {
+		/* the VPN has already authenticated every packet */
+		NETIF_SET_CHECKSUM_CTRL(&netif, NETIF_CHECKSUM_ENABLE_ALL &
+					~(NETIF_CHECKSUM_CHECK_IP |
+					  NETIF_CHECKSUM_CHECK_UDP |
+					  NETIF_CHECKSUM_CHECK_TCP |
+					  NETIF_CHECKSUM_CHECK_ICMP));
+	}
 
 	netif_set_default(&netif);
 	netif_set_up(&netif);
@@ -1030,11 +3282,21 @@ int main(int argc, char **argv)
 	if (tcpdump_enabled)
 		tcpdump_init();
 
-	new_periodic_event(cb_tcp_tmr, NULL, 250);
-	new_periodic_event(cb_dns_tmr, NULL, 1000);
-	new_periodic_event(cb_housekeeping, &vpnfd, 1000);
+	init_timers();
+	timers_update();
 
-	event_base_dispatch(event_base);
+	/*
+	 * Run the event loop one iteration at a time, so that all of the
+	 * packets that lwIP generated in response to this batch of events
+	 * can be passed to the VPN in a single syscall.
+	 */
+	while (!event_base_got_break(event_base)) {
+		if (event_base_loop(event_base, EVLOOP_ONCE) != 0)
+			break;
+		vpn_tx_flush(s);
+		udp_tx_flush_all();
+		timers_update();
+	}
 
 	return 0;
 }
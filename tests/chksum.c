@@ -0,0 +1,197 @@
+/*
+ * Checks the scalar, SSE2 and AVX2 variants of lwip_chksum() against a
+ * plain RFC 1071 sum, for every length and alignment up to MAX_LEN and for
+ * some lengths around the vector block size.  With --bench, times them
+ * instead.
+ *
+ * "make check" runs the test, "make bench" the benchmark.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* the variants are static */
+#include "../contrib/ports/unix/lwip_chksum.c"
+
+#define MAX_LEN			1600
+#define MAX_ALIGN		64
+/* how much the vector variants sum up in 32 bit lanes at once */
+#define CHKSUM_BLOCK		0x10000
+#define BUF_LEN			(3 * CHKSUM_BLOCK + 2 * MAX_ALIGN)
+
+struct variant {
+	const char *name;
+	u16_t (*fn)(void *dataptr, int len);
+	int usable;
+};
+
+static struct variant variants[] = {
+	{ "scalar", lwip_chksum_scalar, 1 },
+#if LWIP_CHKSUM_X86
+	{ "sse2", lwip_chksum_sse2, 0 },
+	{ "avx2", lwip_chksum_avx2, 0 },
+#endif
+};
+
+#define N_VARIANTS	(sizeof(variants) / sizeof(variants[0]))
+
+/* big endian 16 bit words, stored back in memory order */
+static u16_t ref_chksum(const u8_t *p, int len)
+{
+	uint64_t acc = 0;
+	u8_t out[2];
+	u16_t ret;
+
+	for (; len > 1; len -= 2, p += 2)
+		acc += (u32_t)p[0] << 8 | p[1];
+	if (len > 0)
+		acc += (u32_t)p[0] << 8;
+	while (acc >> 16)
+		acc = (acc >> 16) + (acc & 0xffff);
+	out[0] = acc >> 8;
+	out[1] = acc & 0xff;
+	memcpy(&ret, out, 2);
+	return ret;
+}
+
+static void pick_variants(void)
+{
+#if LWIP_CHKSUM_X86
+	__builtin_cpu_init();
+	variants[1].usable = __builtin_cpu_supports("sse2");
+	variants[2].usable = __builtin_cpu_supports("avx2");
+#endif
+}
+
+static int check_one(u8_t *buf, int align, int len, const char *what)
+{
+	u16_t want = ref_chksum(buf + align, len), got;
+	unsigned int i;
+	int fails = 0;
+
+	for (i = 0; i < N_VARIANTS; i++) {
+		if (!variants[i].usable)
+			continue;
+		got = variants[i].fn(buf + align, len);
+		if (got != want) {
+			fprintf(stderr, "%s: %s data, len %d, align %d: "
+				"got %04x, want %04x\n", variants[i].name,
+				what, len, align, got, want);
+			fails++;
+		}
+	}
+	return fails;
+}
+
+static int run_checks(u8_t *buf)
+{
+	static const int big[] = {
+		CHKSUM_BLOCK - 1, CHKSUM_BLOCK, CHKSUM_BLOCK + 1,
+		CHKSUM_BLOCK + 127, 2 * CHKSUM_BLOCK + 63, 3 * CHKSUM_BLOCK,
+	};
+	int align, len, fails = 0, fill;
+	unsigned int i;
+
+	/* random data, then all ones to get the most carries */
+	for (fill = 0; fill < 2; fill++) {
+		const char *what = fill ? "0xff" : "random";
+
+		for (i = 0; i < BUF_LEN; i++)
+			buf[i] = fill ? 0xff : rand();
+		for (align = 0; align < MAX_ALIGN; align++)
+			for (len = 0; len <= MAX_LEN; len++)
+				fails += check_one(buf, align, len, what);
+		for (i = 0; i < sizeof(big) / sizeof(big[0]); i++)
+			for (align = 0; align < MAX_ALIGN; align++)
+				fails += check_one(buf, align, big[i], what);
+	}
+	return fails;
+}
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* GB/s, best of 5 runs of about 8MB each */
+static double bench_one(u16_t (*fn)(void *, int), u8_t *p, int len)
+{
+	volatile u16_t sink = 0;
+	double best = 0, t;
+	int run, i, iters = 8000000 / len + 1;
+
+	for (run = 0; run < 5; run++) {
+		t = now_sec();
+		for (i = 0; i < iters; i++)
+			sink += fn(p, len);
+		t = now_sec() - t;
+		if (t > 0 && (double)len * iters / t / 1e9 > best)
+			best = (double)len * iters / t / 1e9;
+	}
+	(void)sink;
+	return best;
+}
+
+static u16_t ref_chksum_fn(void *dataptr, int len)
+{
+	return ref_chksum(dataptr, len);
+}
+
+static void run_bench(u8_t *buf)
+{
+	static const int lens[] = { 40, 128, 576, 1460, 4096, 65535 };
+	unsigned int i, j;
+
+	for (i = 0; i < BUF_LEN; i++)
+		buf[i] = rand();
+
+	printf("GB/s, best of 5\n%8s %9s", "bytes", "rfc1071");
+	for (j = 0; j < N_VARIANTS; j++)
+		if (variants[j].usable)
+			printf(" %9s", variants[j].name);
+	printf("\n");
+
+	for (i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+		printf("%8d %9.2f", lens[i],
+		       bench_one(ref_chksum_fn, buf, lens[i]));
+		for (j = 0; j < N_VARIANTS; j++)
+			if (variants[j].usable)
+				printf(" %9.2f",
+				       bench_one(variants[j].fn, buf, lens[i]));
+		printf("\n");
+	}
+}
+
+int main(int argc, char **argv)
+{
+	u8_t *buf = malloc(BUF_LEN);
+	unsigned int i;
+	int fails;
+
+	if (!buf)
+		return 1;
+	srand(1);
+	pick_variants();
+
+	if (argc > 1 && !strcmp(argv[1], "--bench")) {
+		run_bench(buf);
+		return 0;
+	}
+
+	fails = run_checks(buf);
+	for (i = 0; i < N_VARIANTS; i++)
+		printf("%s: %s\n", variants[i].name,
+		       variants[i].usable ? "checked" : "not supported");
+	if (fails) {
+		fprintf(stderr, "%d mismatches\n", fails);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,212 @@
+/*
+ * Checks that tcp_pcb_hash_lookup() finds every active and TIME-WAIT PCB,
+ * and stops finding them once they are removed.  With --bench, times it
+ * against the linear walk of tcp_active_pcbs that tcp_input() used to do,
+ * for 10 to 50,000 established PCBs.  What little the hash lookup slows
+ * down by at the high end is cache misses on the PCBs themselves.
+ *
+ * The pools and the hash table are sized for MAX_PCBS here (see
+ * tests_pcbhash_CPPFLAGS in Makefile.am), not for ocproxy's --max-conns.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lwip/init.h"
+#include "lwip/memp.h"
+#include "lwip/tcp_impl.h"
+
+#define MAX_PCBS		50000
+#define CHECK_PCBS		2000
+#define LOOKUPS			(1 << 20)
+/* the linear walk gets LINEAR_WORK / n lookups */
+#define LINEAR_WORK		(1 << 26)
+
+struct tuple {
+	ip_addr_t local_ip, remote_ip;
+	u16_t local_port, remote_port;
+};
+
+static struct tuple tuples[MAX_PCBS];
+static struct tcp_pcb *pcbs[MAX_PCBS];
+static int n_pcbs;
+
+/* LWIP_HOOK_TCP_SEG_BUSY: nothing is sent here */
+void ocp_vpn_tx_flush(void)
+{
+}
+
+/* many clients of one VPN address, as in ocproxy */
+static void make_tuple(struct tuple *t, int i)
+{
+	IP4_ADDR(&t->local_ip, 10, 0, 0, 2);
+	IP4_ADDR(&t->remote_ip, 10, 1, (i >> 8) & 0xff, i & 0xff);
+	t->local_port = 1024 + i;
+	t->remote_port = (i & 1) ? 443 : 80;
+}
+
+static void add_pcbs(int n, int time_wait)
+{
+	struct tcp_pcb *pcb;
+
+	for (; n_pcbs < n; n_pcbs++) {
+		struct tuple *t = &tuples[n_pcbs];
+
+		make_tuple(t, n_pcbs);
+		pcb = tcp_new();
+		if (!pcb) {
+			fprintf(stderr, "out of PCBs at %d\n", n_pcbs);
+			exit(1);
+		}
+		pcb->local_ip = t->local_ip;
+		pcb->remote_ip = t->remote_ip;
+		pcb->local_port = t->local_port;
+		pcb->remote_port = t->remote_port;
+		if (time_wait && !(n_pcbs % 10)) {
+			pcb->state = TIME_WAIT;
+			TCP_REG(&tcp_tw_pcbs, pcb);
+		} else {
+			pcb->state = ESTABLISHED;
+			TCP_REG_ACTIVE(pcb);
+		}
+		pcbs[n_pcbs] = pcb;
+	}
+}
+
+static void del_pcb(int i)
+{
+	struct tcp_pcb *pcb = pcbs[i];
+
+	if (pcb->state == TIME_WAIT)
+		TCP_RMV(&tcp_tw_pcbs, pcb);
+	else
+		TCP_RMV_ACTIVE(pcb);
+	memp_free(MEMP_TCP_PCB, pcb);
+	pcbs[i] = NULL;
+}
+
+static struct tcp_pcb *hash_lookup(const struct tuple *t)
+{
+	return tcp_pcb_hash_lookup((ipX_addr_t *)&t->local_ip, t->local_port,
+				   (ipX_addr_t *)&t->remote_ip, t->remote_port);
+}
+
+/* what tcp_input() did before LWIP_TCP_PCB_HASH */
+static struct tcp_pcb *linear_lookup(const struct tuple *t)
+{
+	struct tcp_pcb *pcb;
+
+	for (pcb = tcp_active_pcbs; pcb; pcb = pcb->next)
+		if (pcb->remote_port == t->remote_port &&
+		    pcb->local_port == t->local_port &&
+		    ip_addr_cmp(&pcb->remote_ip, &t->remote_ip) &&
+		    ip_addr_cmp(&pcb->local_ip, &t->local_ip))
+			return pcb;
+	return NULL;
+}
+
+static int run_checks(void)
+{
+	int i, fails = 0;
+
+	add_pcbs(CHECK_PCBS, 1);
+	for (i = 0; i < CHECK_PCBS; i++)
+		if (hash_lookup(&tuples[i]) != pcbs[i]) {
+			fprintf(stderr, "PCB %d not found\n", i);
+			fails++;
+		}
+
+	/* every third one goes away, including some in TIME-WAIT */
+	for (i = 0; i < CHECK_PCBS; i += 3)
+		del_pcb(i);
+	for (i = CHECK_PCBS - 1; i >= 0; i--)
+		if (hash_lookup(&tuples[i]) != pcbs[i]) {
+			fprintf(stderr, "PCB %d: found %s\n", i,
+				pcbs[i] ? "nothing" : "a removed PCB");
+			fails++;
+		}
+	return fails;
+}
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* ns per lookup of a random PCB, best of 3 runs */
+static double bench_one(struct tcp_pcb *(*fn)(const struct tuple *),
+			const int *order, int iters)
+{
+	double best = 0, t;
+	int run, i;
+
+	for (run = 0; run < 3; run++) {
+		t = now_sec();
+		for (i = 0; i < iters; i++)
+			if (fn(&tuples[order[i]]) != pcbs[order[i]]) {
+				fprintf(stderr, "lookup of PCB %d failed\n",
+					order[i]);
+				exit(1);
+			}
+		t = (now_sec() - t) * 1e9 / iters;
+		if (!run || t < best)
+			best = t;
+	}
+	return best;
+}
+
+static void run_bench(void)
+{
+	static const int counts[] = { 10, 100, 1000, 10000, MAX_PCBS };
+	int *order = malloc(LOOKUPS * sizeof(*order));
+	unsigned int i;
+	int j, n;
+
+	if (!order)
+		exit(1);
+	printf("ns per lookup, best of 3\n%8s %9s %9s\n",
+	       "PCBs", "hash", "linear");
+	for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+		n = counts[i];
+		add_pcbs(n, 0);
+		/* never the same PCB twice in a row, to get past the cache */
+		for (j = 0; j < LOOKUPS; j++) {
+			order[j] = rand() % n;
+			if (j && order[j] == order[j - 1])
+				order[j] = (order[j] + 1) % n;
+		}
+		printf("%8d %9.1f %9.1f\n", n,
+		       bench_one(hash_lookup, order, LOOKUPS),
+		       bench_one(linear_lookup, order,
+				 LWIP_MIN(LOOKUPS, LINEAR_WORK / n)));
+	}
+	free(order);
+}
+
+int main(int argc, char **argv)
+{
+	int fails;
+
+	srand(1);
+	lwip_init();
+
+	if (argc > 1 && !strcmp(argv[1], "--bench")) {
+		run_bench();
+		return 0;
+	}
+
+	fails = run_checks();
+	if (fails) {
+		fprintf(stderr, "%d lookups failed\n", fails);
+		return 1;
+	}
+	printf("%d PCBs checked\n", CHECK_PCBS);
+	return 0;
+}
@@ -0,0 +1,654 @@
+/*
+ * Sends data through lwIP TCP over a simulated link with a given round
+ * trip time, bottleneck rate, queue and random loss.  Both ends are lwIP:
+ * a client connects to a listener on the same netif, and the netif hands
+ * every packet back to ip_input() after the link delay, unless the link
+ * drops it.  The clock is simulated too, so a run depends only on its
+ * parameters and the seed.
+ *
+ * The link can also strip SACK-permitted from SYNs, like a middlebox
+ * would, to compare recovery with and without SACK.  The sender can use
+ * any of the congestion control modules in tcp_cc.c.
+ *
+ * By default, checks that transfers under loss arrive intact and in
+ * time; --bench compares throughput; with other options, makes one run.
+ */
+
+#include "config.h"
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lwip/init.h"
+#include "lwip/ip.h"
+#include "lwip/netif.h"
+#include "lwip/tcp_impl.h"
+#include "lwip/tcpip.h"
+
+#define SIM_PORT		5001
+#define SIM_MTU			1500
+/* runs that take longer than this (simulated) have stalled */
+#define SIM_TIMEOUT_US		(600 * 1000000ULL)
+/* the data is i % PATTERN_LEN, so the receiver can check it */
+#define PATTERN_LEN		251
+#define WRITE_MAX		32768
+
+#define ARRAY_SIZE(x)		(sizeof(x) / sizeof((x)[0]))
+
+struct sim_cfg {
+	unsigned int rtt_ms;
+	double loss;			/* fraction of packets dropped, each way */
+	unsigned int rate_mbit;
+	unsigned int queue_kb;		/* 0: one bandwidth-delay product */
+	unsigned int size;		/* bytes to send */
+	int no_sack;
+	const struct tcp_cc_ops *cc;	/* the sender's */
+	uint64_t seed;
+};
+
+struct sim_result {
+	double secs;
+	unsigned long rexmits;		/* data segments sent more than once */
+	unsigned long lost;		/* randomly dropped packets */
+	unsigned long overflows;	/* packets dropped by the full queue */
+	int ok;
+};
+
+struct sim_pkt {
+	struct sim_pkt *next;
+	uint64_t due;
+	struct pbuf *p;
+};
+
+/* one direction of the link */
+struct sim_link {
+	struct sim_pkt *head, *tail;
+	uint64_t busy_until;		/* the bottleneck is sending until then */
+};
+
+static uint64_t now_us;
+static uint64_t rng;
+static struct netif sim_netif;
+/* 0: client to server (the data), 1: back (the ACKs) */
+static struct sim_link links[2];
+static const struct sim_cfg *cfg;
+static struct sim_result *res;
+static u8_t pattern[WRITE_MAX + PATTERN_LEN];
+
+static struct tcp_pcb *client, *server, *listener;
+static u32_t sent, rcvd;
+static u32_t data_max;			/* highest data sequence number sent */
+static int data_max_valid;
+static int failed;
+
+/* sys_arch.c replacements: one thread, simulated time */
+u32_t sys_now(void)
+{
+	return (u32_t)(now_us / 1000);
+}
+
+void sys_init(void)
+{
+}
+
+sys_prot_t sys_arch_protect(void)
+{
+	return 0;
+}
+
+void sys_arch_unprotect(sys_prot_t pval)
+{
+}
+
+u32_t sys_arch_sem_wait(sys_sem_t *sem, u32_t timeout)
+{
+	abort();
+}
+
+void sys_sem_signal(sys_sem_t *sem)
+{
+}
+
+u32_t sys_arch_mbox_fetch(sys_mbox_t *mbox, void **msg, u32_t timeout)
+{
+	abort();
+}
+
+sys_mutex_t lock_tcpip_core;
+
+err_t tcpip_callback_with_block(tcpip_callback_fn function, void *ctx,
+				u8_t block)
+{
+	return ERR_MEM;
+}
+
+/* LWIP_HOOK_TCP_SEG_BUSY: the link copies every packet */
+void ocp_vpn_tx_flush(void)
+{
+}
+
+/* xorshift64*, so that runs are the same everywhere */
+static u32_t sim_rand(void)
+{
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return (u32_t)((rng * 2685821657736338717ULL) >> 32);
+}
+
+static void strip_sack_perm(struct tcp_hdr *tcphdr)
+{
+	u8_t *opt = (u8_t *)(tcphdr + 1);
+	int len = TCPH_HDRLEN(tcphdr) * 4 - TCP_HLEN, i = 0;
+
+	while (i < len && opt[i] != LWIP_TCP_OPT_EOL) {
+		if (opt[i] == LWIP_TCP_OPT_NOP) {
+			i++;
+			continue;
+		}
+		if (i + 1 >= len || opt[i + 1] < 2)
+			break;
+		if (opt[i] == LWIP_TCP_OPT_SACK_PERM)
+			memset(&opt[i], LWIP_TCP_OPT_NOP, opt[i + 1]);
+		i += opt[i + 1];
+	}
+}
+
+/* look at a TCP segment on its way through: which way, and is it resent */
+static int sim_inspect(struct pbuf *p)
+{
+	struct ip_hdr *iphdr = p->payload;
+	struct tcp_hdr *tcphdr;
+	u32_t seq, end;
+	int dir, len;
+
+	if (IPH_PROTO(iphdr) != IP_PROTO_TCP)
+		return 0;
+	tcphdr = (struct tcp_hdr *)((u8_t *)iphdr + IPH_HL(iphdr) * 4);
+	dir = ntohs(tcphdr->src) == SIM_PORT;
+	if (cfg->no_sack && (TCPH_FLAGS(tcphdr) & TCP_SYN))
+		strip_sack_perm(tcphdr);
+
+	if (dir == 0) {
+		len = ntohs(IPH_LEN(iphdr)) - IPH_HL(iphdr) * 4 -
+		      TCPH_HDRLEN(tcphdr) * 4;
+		seq = ntohl(tcphdr->seqno);
+		end = seq + len;
+		if (!data_max_valid) {
+			data_max = end;
+			data_max_valid = 1;
+		} else if (len > 0 && TCP_SEQ_LEQ(end, data_max)) {
+			res->rexmits++;
+		} else if (TCP_SEQ_GT(end, data_max)) {
+			data_max = end;
+		}
+	}
+	return dir;
+}
+
+static err_t sim_output(struct netif *netif, struct pbuf *p,
+			ip_addr_t *ipaddr)
+{
+	struct sim_link *link;
+	struct sim_pkt *pkt;
+	struct pbuf *q;
+	uint64_t start, queue_bytes;
+
+	/* copy it, as a real link would, so lwIP may reuse the segment */
+	q = pbuf_alloc(PBUF_RAW, p->tot_len, PBUF_RAM);
+	if (!q || pbuf_copy(q, p) != ERR_OK) {
+		if (q)
+			pbuf_free(q);
+		return ERR_MEM;
+	}
+	link = &links[sim_inspect(q)];
+
+	if (sim_rand() < cfg->loss * 4294967296.0) {
+		res->lost++;
+		pbuf_free(q);
+		return ERR_OK;
+	}
+
+	queue_bytes = cfg->queue_kb ? cfg->queue_kb * 1024ULL :
+		      (uint64_t)cfg->rate_mbit * cfg->rtt_ms * 1000 / 8;
+	start = link->busy_until > now_us ? link->busy_until : now_us;
+	if ((start - now_us) * cfg->rate_mbit / 8 + q->tot_len > queue_bytes) {
+		res->overflows++;
+		pbuf_free(q);
+		return ERR_OK;
+	}
+
+	pkt = malloc(sizeof(*pkt));
+	if (!pkt) {
+		pbuf_free(q);
+		return ERR_MEM;
+	}
+	link->busy_until = start + (q->tot_len * 8ULL + cfg->rate_mbit - 1) /
+				   cfg->rate_mbit;
+	pkt->due = link->busy_until + cfg->rtt_ms * 500ULL;
+	pkt->p = q;
+	pkt->next = NULL;
+	if (link->tail)
+		link->tail->next = pkt;
+	else
+		link->head = pkt;
+	link->tail = pkt;
+	return ERR_OK;
+}
+
+static err_t sim_netif_init(struct netif *netif)
+{
+	netif->name[0] = 's';
+	netif->name[1] = 'm';
+	netif->output = sim_output;
+	netif->mtu = SIM_MTU;
+	/* the link may rewrite TCP options */
+	NETIF_SET_CHECKSUM_CTRL(netif, NETIF_CHECKSUM_ENABLE_ALL &
+				~(NETIF_CHECKSUM_CHECK_IP |
+				  NETIF_CHECKSUM_CHECK_TCP));
+	return ERR_OK;
+}
+
+static void sim_deliver(uint64_t until)
+{
+	struct sim_pkt *pkt;
+	int i;
+
+	for (i = 0; i < 2; i++)
+		while ((pkt = links[i].head) != NULL && pkt->due <= until) {
+			links[i].head = pkt->next;
+			if (!pkt->next)
+				links[i].tail = NULL;
+			ip_input(pkt->p, &sim_netif);
+			free(pkt);
+		}
+}
+
+static void sim_send(void)
+{
+	u16_t len;
+
+	if (!client || client->state != ESTABLISHED)
+		return;
+	while (sent < cfg->size) {
+		len = LWIP_MIN(LWIP_MIN(cfg->size - sent, WRITE_MAX),
+			       tcp_sndbuf(client));
+		if (!len || tcp_write(client, &pattern[sent % PATTERN_LEN],
+				      len, TCP_WRITE_FLAG_COPY) != ERR_OK)
+			break;
+		sent += len;
+	}
+	tcp_output(client);
+}
+
+static err_t client_connected(void *arg, struct tcp_pcb *pcb, err_t err)
+{
+	sim_send();
+	return ERR_OK;
+}
+
+static err_t client_sent(void *arg, struct tcp_pcb *pcb, u16_t len)
+{
+	sim_send();
+	return ERR_OK;
+}
+
+static void client_err(void *arg, err_t err)
+{
+	fprintf(stderr, "client: error %d\n", err);
+	client = NULL;
+	failed = 1;
+}
+
+static err_t server_recv(void *arg, struct tcp_pcb *pcb, struct pbuf *p,
+			 err_t err)
+{
+	struct pbuf *q;
+	u16_t i;
+
+	if (!p)
+		return ERR_OK;
+	for (q = p; q; q = q->next)
+		for (i = 0; i < q->len; i++, rcvd++)
+			if (((u8_t *)q->payload)[i] != rcvd % PATTERN_LEN &&
+			    !failed) {
+				fprintf(stderr, "bad data at byte %u\n", rcvd);
+				failed = 1;
+			}
+	tcp_recved(pcb, p->tot_len);
+	pbuf_free(p);
+	return ERR_OK;
+}
+
+static void server_err(void *arg, err_t err)
+{
+	fprintf(stderr, "server: error %d\n", err);
+	server = NULL;
+	failed = 1;
+}
+
+static err_t server_accept(void *arg, struct tcp_pcb *pcb, err_t err)
+{
+	server = pcb;
+	tcp_recv(pcb, server_recv);
+	tcp_err(pcb, server_err);
+	return ERR_OK;
+}
+
+static void sim_reset(void)
+{
+	struct sim_pkt *pkt;
+	int i;
+
+	if (client) {
+		tcp_err(client, NULL);
+		tcp_abort(client);
+	}
+	if (server) {
+		tcp_err(server, NULL);
+		tcp_abort(server);
+	}
+	if (listener)
+		tcp_close(listener);
+	client = server = listener = NULL;
+	for (i = 0; i < 2; i++) {
+		while ((pkt = links[i].head) != NULL) {
+			links[i].head = pkt->next;
+			pbuf_free(pkt->p);
+			free(pkt);
+		}
+		links[i].tail = NULL;
+	}
+}
+
+static void sim_run(const struct sim_cfg *c, struct sim_result *r)
+{
+	uint64_t start, next;
+	u32_t ms, last_ms, tmr_ms;
+	ip_addr_t addr;
+
+	cfg = c;
+	res = r;
+	memset(r, 0, sizeof(*r));
+	rng = c->seed * 0x9e3779b97f4a7c15ULL + 1;
+	sent = rcvd = 0;
+	data_max_valid = 0;
+	failed = 0;
+
+	listener = tcp_new();
+	tcp_bind(listener, IP_ADDR_ANY, SIM_PORT);
+	listener = tcp_listen(listener);
+	tcp_accept(listener, server_accept);
+
+	client = tcp_new();
+	tcp_set_cc(client, c->cc);
+	tcp_sent(client, client_sent);
+	tcp_err(client, client_err);
+	IP4_ADDR(&addr, 10, 0, 0, 2);
+	start = now_us;
+	tcp_connect(client, &addr, SIM_PORT, client_connected);
+
+	last_ms = tmr_ms = sys_now();
+	while (rcvd < c->size && !failed) {
+		if (now_us - start > SIM_TIMEOUT_US) {
+			fprintf(stderr, "stalled at %u of %u bytes\n",
+				rcvd, c->size);
+			failed = 1;
+			break;
+		}
+		sim_deliver(now_us);
+
+		ms = sys_now();
+		if (ms != last_ms) {
+			last_ms = ms;
+			tcp_rto_tmr();
+			tcp_pace_tmr();
+			while (ms - tmr_ms >= TCP_TMR_INTERVAL) {
+				tmr_ms += TCP_TMR_INTERVAL;
+				tcp_tmr();
+			}
+		}
+		sim_send();
+
+		/* on to the next packet, or the next ms tick */
+		next = (now_us / 1000 + 1) * 1000;
+		if (links[0].head && links[0].head->due < next)
+			next = links[0].head->due;
+		if (links[1].head && links[1].head->due < next)
+			next = links[1].head->due;
+		now_us = next;
+	}
+
+	r->secs = (now_us - start) / 1e6;
+	r->ok = !failed;
+	sim_reset();
+	/* let the next run start on a fresh tick */
+	now_us = (now_us / 1000 + 1) * 1000;
+}
+
+static void print_result(const struct sim_result *r, unsigned int size)
+{
+	printf("%.1f MB in %.2f s: %.2f MB/s, %lu segments resent, "
+	       "%lu packets lost, %lu dropped by the queue\n",
+	       size / 1e6, r->secs, size / 1e6 / r->secs, r->rexmits,
+	       r->lost, r->overflows);
+}
+
+static const struct sim_cfg default_cfg = {
+	.rtt_ms = 50,
+	.loss = 0.01,
+	.rate_mbit = 100,
+	.size = 20000000,
+	.cc = &tcp_cc_reno,
+	.seed = 1,
+};
+
+static const struct tcp_cc_ops *const ccs[] = {
+	&tcp_cc_reno, &tcp_cc_cubic, &tcp_cc_bbr,
+};
+
+/* short transfers under heavy loss, with and without SACK, for each CC */
+static int run_checks(void)
+{
+	static const double losses[] = { 0, 0.02, 0.05 };
+	struct sim_cfg c = default_cfg;
+	struct sim_result r;
+	unsigned int i, j;
+	int fails = 0;
+
+	c.rtt_ms = 20;
+	c.size = 2000000;
+	for (j = 0; j < ARRAY_SIZE(ccs); j++)
+		for (c.no_sack = 0; c.no_sack < 2; c.no_sack++)
+			for (i = 0; i < ARRAY_SIZE(losses); i++) {
+				c.cc = ccs[j];
+				c.loss = losses[i];
+				sim_run(&c, &r);
+				printf("%s, %s, %.0f%% loss: ", c.cc->name,
+				       c.no_sack ? "no SACK" : "SACK",
+				       c.loss * 100);
+				if (!r.ok) {
+					printf("FAILED\n");
+					fails++;
+				} else
+					print_result(&r, c.size);
+			}
+	return fails;
+}
+
+#define BENCH_SEEDS	3
+
+/* MB/s and resent segments, averaged over BENCH_SEEDS runs */
+static void bench_one(struct sim_cfg *c, double *mbps, double *rexmits)
+{
+	struct sim_result r;
+
+	*mbps = *rexmits = 0;
+	for (c->seed = 1; c->seed <= BENCH_SEEDS; c->seed++) {
+		sim_run(c, &r);
+		*mbps += r.ok ? c->size / 1e6 / r.secs / BENCH_SEEDS : 0;
+		*rexmits += (double)r.rexmits / BENCH_SEEDS;
+	}
+}
+
+/* SACK against no SACK, with Reno */
+static void bench_sack(void)
+{
+	static const unsigned int rtts[] = { 10, 50, 100 };
+	static const double losses[] = { 0.001, 0.01, 0.02 };
+	struct sim_cfg c = default_cfg;
+	double mbps[2], rexmits[2];
+	unsigned int i, j;
+
+	printf("%.0f MB over %u Mbit/s, %s, MB/s (segments resent), "
+	       "mean of %d seeds\n", c.size / 1e6, c.rate_mbit, c.cc->name,
+	       BENCH_SEEDS);
+	printf("%6s %6s %16s %16s\n", "rtt", "loss", "SACK", "no SACK");
+	for (i = 0; i < ARRAY_SIZE(rtts); i++)
+		for (j = 0; j < ARRAY_SIZE(losses); j++) {
+			c.rtt_ms = rtts[i];
+			c.loss = losses[j];
+			for (c.no_sack = 0; c.no_sack < 2; c.no_sack++)
+				bench_one(&c, &mbps[c.no_sack],
+					  &rexmits[c.no_sack]);
+			printf("%4u ms %5.1f%% %8.2f (%5.0f) %8.2f (%5.0f)\n",
+			       c.rtt_ms, c.loss * 100, mbps[0], rexmits[0],
+			       mbps[1], rexmits[1]);
+		}
+}
+
+/* the congestion control modules, at 50 ms with SACK */
+static void bench_cc(void)
+{
+	static const double losses[] = { 0, 0.001, 0.01 };
+	struct sim_cfg c = default_cfg;
+	double mbps, rexmits;
+	unsigned int i, j;
+
+	printf("\n%.0f MB over %u Mbit/s, %u ms, MB/s (segments resent), "
+	       "mean of %d seeds\n", c.size / 1e6, c.rate_mbit, c.rtt_ms,
+	       BENCH_SEEDS);
+	printf("%6s", "");
+	for (j = 0; j < ARRAY_SIZE(losses); j++)
+		printf(" %9.1f%% loss", losses[j] * 100);
+	printf("\n");
+	for (i = 0; i < ARRAY_SIZE(ccs); i++) {
+		c.cc = ccs[i];
+		printf("%6s", c.cc->name);
+		for (j = 0; j < ARRAY_SIZE(losses); j++) {
+			c.loss = losses[j];
+			bench_one(&c, &mbps, &rexmits);
+			printf(" %6.2f (%5.0f)", mbps, rexmits);
+		}
+		printf("\n");
+	}
+}
+
+static void usage(void)
+{
+	printf("usage: tcpsim [--bench]\n"
+	       "       tcpsim [--rtt MS] [--loss PERCENT] [--rate MBIT] "
+	       "[--queue KB]\n"
+	       "              [--size MB] [--no-sack] [--cc reno|cubic|bbr] "
+	       "[--seed N]\n");
+	exit(1);
+}
+
+static struct option longopts[] = {
+	{ "bench",	0,	NULL,	'b' },
+	{ "rtt",	1,	NULL,	'r' },
+	{ "loss",	1,	NULL,	'l' },
+	{ "rate",	1,	NULL,	'R' },
+	{ "queue",	1,	NULL,	'q' },
+	{ "size",	1,	NULL,	's' },
+	{ "no-sack",	0,	NULL,	'n' },
+	{ "seed",	1,	NULL,	'S' },
+	{ "cc",		1,	NULL,	'c' },
+	{ NULL }
+};
+
+int main(int argc, char **argv)
+{
+	struct sim_cfg c = default_cfg;
+	struct sim_result r;
+	ip_addr_t ip, netmask, gw;
+	int opt, bench = 0, single = 0, fails;
+	unsigned int i;
+
+	while ((opt = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+		single = 1;
+		switch (opt) {
+		case 'b':
+			bench = 1;
+			break;
+		case 'r':
+			c.rtt_ms = atoi(optarg);
+			break;
+		case 'l':
+			c.loss = atof(optarg) / 100;
+			break;
+		case 'R':
+			c.rate_mbit = atoi(optarg);
+			break;
+		case 'q':
+			c.queue_kb = atoi(optarg);
+			break;
+		case 's':
+			c.size = atof(optarg) * 1e6;
+			break;
+		case 'n':
+			c.no_sack = 1;
+			break;
+		case 'S':
+			c.seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'c':
+			c.cc = tcp_cc_find(optarg);
+			if (!c.cc) {
+				fprintf(stderr, "unknown congestion control '%s'\n",
+					optarg);
+				usage();
+			}
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc || !c.rate_mbit || !c.size)
+		usage();
+
+	for (i = 0; i < sizeof(pattern); i++)
+		pattern[i] = i % PATTERN_LEN;
+
+	lwip_init();
+	IP4_ADDR(&ip, 10, 0, 0, 2);
+	IP4_ADDR(&netmask, 255, 255, 255, 0);
+	ip_addr_set_zero(&gw);
+	netif_add(&sim_netif, &ip, &netmask, &gw, NULL, sim_netif_init,
+		  ip_input);
+	netif_set_default(&sim_netif);
+	netif_set_up(&sim_netif);
+
+	if (bench) {
+		bench_sack();
+		bench_cc();
+		return 0;
+	}
+	if (single) {
+		sim_run(&c, &r);
+		if (!r.ok)
+			return 1;
+		print_result(&r, c.size);
+		return 0;
+	}
+
+	fails = run_checks();
+	if (fails) {
+		fprintf(stderr, "%d transfers failed\n", fails);
+		return 1;
+	}
+	return 0;
+}